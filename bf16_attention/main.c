@@ -0,0 +1,170 @@
+#include <immintrin.h>
+#include <math.h>
+#include <memory.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../common/amx.h"
+#include "../common/attention_bf16.h"
+#include "../common/bench.h"
+#include "../common/cpu_features.h"
+#include "../common/verify.h"
+
+// -----------------------------------------------
+// Fused bf16 attention (common/attention_bf16.h)
+
+static const char *attention_path_name() {
+    return (cpu_features.amx_bf16 && cpu_features.avx512) ? "AMX-BF16"
+           : cpu_features.avx512_bf16                     ? "AVX512-BF16"
+                                                          : "scalar";
+}
+
+typedef struct attention_inputs_t {
+    uint16_t *q, *k, *v;
+} attention_inputs_t;
+
+static attention_inputs_t alloc_inputs(const attention_desc_t *desc) {
+    attention_inputs_t in;
+    const size_t q_size = (size_t)desc->seq_q * desc->d;
+    const size_t kv_size = (size_t)desc->seq_kv * desc->d;
+    in.q = (uint16_t *)malloc(q_size * sizeof(uint16_t));
+    in.k = (uint16_t *)malloc(kv_size * sizeof(uint16_t));
+    in.v = (uint16_t *)malloc(kv_size * sizeof(uint16_t));
+
+    for (size_t i = 0; i < q_size; ++i) {
+        in.q[i] = bf16_from_fp32(((i * 7) % 19) * 0.125f - 1.125f); // The value you like
+    }
+    for (size_t i = 0; i < kv_size; ++i) {
+        in.k[i] = bf16_from_fp32(((i * 5) % 23) * 0.0625f - 0.6875f); // The value you like
+        in.v[i] = bf16_from_fp32(((i * 3) % 29) * 0.25f - 3.5f);      // The value you like
+    }
+    return in;
+}
+
+static void free_inputs(attention_inputs_t *in) {
+    free(in->q);
+    free(in->k);
+    free(in->v);
+}
+
+// Multiply-adds of Q K^T and P V over the keys each query sees
+static double attention_ops(const attention_desc_t *desc) {
+    double keys = 0;
+    for (int i = 0; i < desc->seq_q; ++i) {
+        keys += attention_last_key(desc, i) + 1;
+    }
+    return 2.0 * 2.0 * keys * desc->d;
+}
+
+// Compare attention_bf16 with attention_ref. P is rounded to bf16 before P V, so an output is off by up to
+// about 2^-9 of the largest |v| (under 1% of the largest |out| with this data).
+#define ATTENTION_REL_TOL 0.01f
+
+void run_attention(int seq_q, int seq_kv, int d, bool causal) {
+    const attention_desc_t desc = {seq_q, seq_kv, d, causal};
+    attention_inputs_t in = alloc_inputs(&desc);
+    float *out_ref = (float *)malloc((size_t)seq_q * d * sizeof(float));
+    float *out = (float *)malloc((size_t)seq_q * d * sizeof(float));
+
+    attention_ref(&desc, out_ref, in.q, in.k, in.v);
+#if defined(AMX_EMULATE)
+    amx_emu_reset_counters();
+#endif
+    const double t0 = now_sec();
+    attention_bf16(&desc, out, in.q, in.k, in.v);
+    const double t1 = now_sec();
+
+    printf("seq %4d x %4d, d %3d%s: %8.3f ms (%7.2f GFLOPS)\n", seq_q, seq_kv, d, causal ? ", causal" : "        ",
+           (t1 - t0) * 1e3, attention_ops(&desc) / (t1 - t0) * 1e-9);
+    char name[64];
+    snprintf(name, sizeof(name), "attention %dx%d d%d%s", seq_q, seq_kv, d, causal ? " causal" : "");
+    verify_f32(name, out, out_ref, verify_dims2(seq_q, d), 0, ATTENTION_REL_TOL);
+#if defined(AMX_EMULATE)
+    amx_emu_print_counters("(tile instructions)");
+#endif
+
+    free_inputs(&in);
+    free(out_ref);
+    free(out);
+}
+
+// -----------------------------------------------
+// Benchmark mode (--bench, see common/bench.h)
+
+typedef struct attention_bench_args_t {
+    const attention_desc_t *desc;
+    float *out;
+    const attention_inputs_t *in;
+} attention_bench_args_t;
+
+static void bench_attention(void *arg) {
+    attention_bench_args_t *args = (attention_bench_args_t *)arg;
+    attention_bf16(args->desc, args->out, args->in->q, args->in->k, args->in->v);
+}
+
+// Self-attention over sequence lengths, with and without the causal mask. The traffic counts Q, K and V in bf16
+// and the output in fp32; a GEMM, softmax, GEMM chain would write and read seq^2 fp32 scores on top of it.
+void run_benchmarks() {
+    static const int seqs[] = {128, 256, 512, 1024, 2048, 4096};
+    static const int dims[] = {64, 128};
+
+    bench_begin();
+
+    for (int x = 0; x < (int)(sizeof(dims) / sizeof(dims[0])); ++x) {
+        for (int y = 0; y < (int)(sizeof(seqs) / sizeof(seqs[0])); ++y) {
+            for (int causal = 0; causal < 2; ++causal) {
+                const attention_desc_t desc = {seqs[y], seqs[y], dims[x], causal != 0};
+                attention_inputs_t in = alloc_inputs(&desc);
+                float *out = (float *)malloc((size_t)desc.seq_q * desc.d * sizeof(float));
+
+                char shape[64];
+                snprintf(shape, sizeof(shape), "seq%d-d%d%s", desc.seq_q, desc.d, desc.causal ? "-causal" : "");
+                const double bytes = (double)desc.seq_q * desc.d * (3 * sizeof(uint16_t) + sizeof(float));
+
+                attention_bench_args_t args = {&desc, out, &in};
+                bench_report("bf16_attention", attention_path_name(), shape, attention_ops(&desc), bytes,
+                             bench_measure(bench_attention, &args));
+
+                free_inputs(&in);
+                free(out);
+            }
+        }
+    }
+
+    bench_end();
+}
+
+// -----------------------------------------------
+
+int main(int argc, char **argv) {
+    detect_cpu_features();
+
+    if (bench_parse_args(argc, argv)) {
+        run_benchmarks();
+        if (cpu_features.amx_tile)
+            amx_release();
+        return 0;
+    }
+
+    print_cpu_features();
+
+    printf("----------------------------------------------- Fused attention (%s)\n", attention_path_name());
+    run_attention(16, 16, 32, false);
+    run_attention(100, 100, 64, false);
+    run_attention(100, 100, 64, true);
+    run_attention(37, 200, 96, true); // queries at the end of the keys (KV cache)
+    run_attention(1, 333, 128, false);
+
+    printf("----------------------------------------------- Sequence lengths (d = 64)\n");
+    for (int seq = 128; seq <= 2048; seq *= 2) {
+        run_attention(seq, seq, 64, false);
+        run_attention(seq, seq, 64, true);
+    }
+
+    if (cpu_features.amx_tile)
+        amx_release(); // Release the AMX state
+
+    return 0;
+}
@@ -0,0 +1,182 @@
+#include <immintrin.h>
+#include <math.h>
+#include <memory.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../common/amx.h"
+#include "../common/bench.h"
+#include "../common/conv.h"
+#include "../common/conv_bf16.h"
+#include "../common/cpu_features.h"
+#include "../common/verify.h"
+
+// -----------------------------------------------
+// BF16 convolution (common/conv_bf16.h) on the layers of a small CNN
+
+static const conv_desc_t bf16_layers[] = {
+    // h, w, c_in, c_out, kernel, stride, pad, dilation
+    {160, 160, 3, 6, 3, 1, 0, 1},
+    {112, 112, 3, 32, 3, 2, 1, 1},
+    {56, 56, 32, 32, 3, 1, 1, 1},
+    {56, 56, 32, 64, 1, 1, 0, 1},
+    {56, 56, 64, 64, 5, 1, 2, 1},
+    {28, 28, 64, 128, 3, 2, 1, 1},
+    {14, 14, 128, 256, 1, 1, 0, 1},
+    {14, 14, 256, 10, 7, 1, 0, 1},
+    {9, 13, 5, 7, 3, 1, 1, 1}, // edges of under one block
+};
+static const int num_bf16_layers = sizeof(bf16_layers) / sizeof(bf16_layers[0]);
+
+static size_t layer_input_size(const conv_desc_t *d) { return (size_t)d->h * d->w * d->c_in; }
+
+static size_t layer_filter_size(const conv_desc_t *d) { return (size_t)d->kernel * d->kernel * d->c_in * d->c_out; }
+
+static void init_layer(int x, float *input, float *filter) {
+    const conv_desc_t *d = &bf16_layers[x];
+    for (size_t i = 0; i < layer_input_size(d); ++i) {
+        input[i] = ((i + x) % 17) * 0.25f - 2.0f; // The value you like
+    }
+    for (size_t i = 0; i < layer_filter_size(d); ++i) {
+        filter[i] = ((i * 7 + x) % 13) * 0.0625f - 0.375f; // The value you like
+    }
+}
+
+// Run every layer with fp32 input and output, and with bf16 input and output, and compare it with conv_bf16_ref.
+// The sums are fp32 in both cases (exact with this data, whatever their order); the bf16 output is off by its
+// rounding (2^-8 relative) at most.
+#define CONV_FP32_MAX_ULPS 4
+#define CONV_BF16_REL_TOL (1.0f / 128)
+
+void run_layers() {
+    for (int x = 0; x < num_bf16_layers; ++x) {
+        const conv_desc_t *d = &bf16_layers[x];
+        float *input = (float *)malloc(layer_input_size(d) * sizeof(float));
+        float *filter = (float *)malloc(layer_filter_size(d) * sizeof(float));
+        init_layer(x, input, filter);
+
+        conv_bf16_layer_t *layer = conv_bf16_create(d, filter);
+        const size_t output_size = (size_t)layer->out_h * layer->out_w * d->c_out;
+        float *output_ref = (float *)malloc(output_size * sizeof(float));
+        float *output = (float *)malloc(output_size * sizeof(float));
+        uint16_t *input16 = (uint16_t *)malloc(layer_input_size(d) * sizeof(uint16_t));
+        uint16_t *output16 = (uint16_t *)malloc(output_size * sizeof(uint16_t));
+        float *output_of16 = (float *)malloc(output_size * sizeof(float));
+        bf16_convert(input16, input, (int)layer_input_size(d));
+
+        conv_bf16_ref(d, output_ref, input, filter);
+
+#if defined(AMX_EMULATE)
+        amx_emu_reset_counters();
+#endif
+        const double t0 = now_sec();
+        conv_bf16_run(layer, output, input);
+        const double t1 = now_sec();
+#if defined(AMX_EMULATE)
+        const amx_emu_counters_t counters = amx_emu_counters;
+#endif
+        const double t2 = now_sec();
+        conv_bf16_run_bf16(layer, output16, input16);
+        const double t3 = now_sec();
+        for (size_t i = 0; i < output_size; ++i) {
+            output_of16[i] = bf16_to_fp32(output16[i]);
+        }
+
+        const double ops = 2.0 * output_size * d->kernel * d->kernel * d->c_in;
+        printf("%3dx%-3d %3d -> %3d, %dx%d s%d p%d: fp32 %9.3f ms (%7.2f GFLOPS), bf16 %9.3f ms\n", d->h, d->w,
+               d->c_in, d->c_out, d->kernel, d->kernel, d->stride, d->pad, (t1 - t0) * 1e3, ops / (t1 - t0) * 1e-9,
+               (t3 - t2) * 1e3);
+        const verify_dims_t dims = verify_dims3(layer->out_h, layer->out_w, d->c_out);
+        char name[64];
+        snprintf(name, sizeof(name), "bf16 layer %d", x);
+        verify_f32(name, output, output_ref, dims, CONV_FP32_MAX_ULPS, 0.0f);
+        snprintf(name, sizeof(name), "bf16 layer %d bf16 output", x);
+        verify_f32(name, output_of16, output_ref, dims, 0, CONV_BF16_REL_TOL);
+#if defined(AMX_EMULATE)
+        amx_emu_counters = counters;
+        if (amx_emu_counters.tmuls > 0)
+            amx_emu_print_counters("(tile instructions, fp32)");
+#endif
+
+        conv_bf16_destroy(layer);
+        free(input);
+        free(filter);
+        free(input16);
+        free(output16);
+        free(output_of16);
+        free(output);
+        free(output_ref);
+    }
+}
+
+// -----------------------------------------------
+// Benchmark mode (--bench, see common/bench.h)
+
+typedef struct conv_bf16_bench_args_t {
+    conv_bf16_layer_t *layer;
+    float *output;
+    const float *input;
+} conv_bf16_bench_args_t;
+
+static void bench_conv_bf16(void *arg) {
+    conv_bf16_bench_args_t *args = (conv_bf16_bench_args_t *)arg;
+    conv_bf16_run(args->layer, args->output, args->input);
+}
+
+// conv_bf16_run (fp32 input and output) on every layer. The traffic counts the input, filter and output in FP32.
+void run_benchmarks() {
+    bench_begin();
+
+    for (int x = 0; x < num_bf16_layers; ++x) {
+        const conv_desc_t *d = &bf16_layers[x];
+        float *input = (float *)malloc(layer_input_size(d) * sizeof(float));
+        float *filter = (float *)malloc(layer_filter_size(d) * sizeof(float));
+        init_layer(x, input, filter);
+
+        conv_bf16_layer_t *layer = conv_bf16_create(d, filter);
+        const size_t output_size = (size_t)layer->out_h * layer->out_w * d->c_out;
+        float *output = (float *)malloc(output_size * sizeof(float));
+
+        char shape[96];
+        snprintf(shape, sizeof(shape), "%dx%dx%d-%dx%dx%d-s%dp%d", d->h, d->w, d->c_in, d->kernel, d->kernel,
+                 d->c_out, d->stride, d->pad);
+        const double ops = 2.0 * output_size * d->kernel * d->kernel * d->c_in;
+        const double bytes = ((double)layer_input_size(d) + layer_filter_size(d) + output_size) * sizeof(float);
+
+        conv_bf16_bench_args_t args = {layer, output, input};
+        bench_report("bf16_conv", conv_bf16_kernel_name(), shape, ops, bytes,
+                     bench_measure(bench_conv_bf16, &args));
+
+        conv_bf16_destroy(layer);
+        free(input);
+        free(filter);
+        free(output);
+    }
+
+    bench_end();
+}
+
+// -----------------------------------------------
+
+int main(int argc, char **argv) {
+    detect_cpu_features();
+
+    if (bench_parse_args(argc, argv)) {
+        run_benchmarks();
+        if (cpu_features.amx_tile)
+            amx_release();
+        return 0;
+    }
+
+    print_cpu_features();
+
+    printf("----------------------------------------------- BF16 convolution (%s)\n", conv_bf16_kernel_name());
+    run_layers();
+
+    if (cpu_features.amx_tile)
+        amx_release(); // Release the AMX state
+
+    return 0;
+}
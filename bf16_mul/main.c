@@ -1,19 +1,21 @@
+#define _GNU_SOURCE // CPU affinity of the thread pool
+
 #include <immintrin.h>
+#include <math.h>
 #include <memory.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
-#if defined(__linux__)
-#include <sys/syscall.h>
-#include <unistd.h>
-
-#define ARCH_GET_XCOMP_PERM 0x1022
-#define ARCH_REQ_XCOMP_PERM 0x1023
-#define XFEATURE_XTILECFG 17
-#define XFEATURE_XTILEDATA 18
-#endif
+#include "../common/amx.h"
+#include "../common/bf16.h"
+#include "../common/bench.h"
+#include "../common/cpu_features.h"
+#include "../common/thread_pool.h"
+#include "../common/verify.h"
+#include "../common/vnni_pack.h"
 
 // -----------------------------------------------
 
@@ -23,22 +25,13 @@ typedef float fp32_t;
 // To represent BF16, we use uint16_t
 typedef uint16_t bf16_t;
 
-// BF16 can be converted as follows (no rounding)
-static bf16_t fp32_to_bf16(fp32_t value) {
-    const uint16_t v = (*((uint32_t *)&value)) >> 16;
-    return v;
-}
-
-static fp32_t bf16_to_fp32(bf16_t value) {
-    const uint32_t v = ((uint32_t)value) << 16;
-    return (*((fp32_t *)&v));
-}
+// fp32 <-> bf16 conversion: common/bf16.h (round to nearest even, the bits of vcvtneps2bf16 on every path)
 
 // -----------------------------------------------
 
 void init_mat_a(fp32_t a[16][32]) {
-    for (int r = 0; r < 32; ++r) {
-        for (int c = 0; c < 16; ++c) {
+    for (int r = 0; r < 16; ++r) {
+        for (int c = 0; c < 32; ++c) {
             a[r][c] = r * 0.5 + c * 0.5; // The value you like
         }
     }
@@ -52,15 +45,6 @@ void init_mat_b(fp32_t b[32][16]) {
     }
 }
 
-void print_float16x16(fp32_t m[16][16]) {
-    for (int r = 0; r < 16; ++r) {
-        for (int c = 0; c < 16; ++c) {
-            printf("%f ", m[r][c]);
-        }
-        printf("\n");
-    }
-}
-
 // -----------------------------------------------
 
 // Multiply A and B using naive method
@@ -77,28 +61,9 @@ void mul_naive(fp32_t c[16][16], fp32_t a[16][32], fp32_t b[32][16]) {
 
 // -----------------------------------------------
 // See: https://www.intel.com/content/www/us/en/docs/intrinsics-guide/index.html#!=undefined&techs=AMX
+// The tile config (tile_config_t) and the tile numbers (TILE_0 - TILE_7) are in common/amx.h.
 
-typedef struct tile_config_t {
-    uint8_t palette_id;         // 0
-    uint8_t start_row;          // 1
-    uint8_t reserved_2_15[14];  // 2-15: must be zero
-    uint16_t colsb[8];          // 16-31
-    uint8_t reserved_32_47[16]; // 32-47: must be zero
-    uint8_t rows[8];            // 48-55
-    uint8_t reserved_56_63[16]; // 56-63: must be zero
-} tile_config_t;
-
-// AMX has 8 tiles
-#define TILE_0 0
-#define TILE_1 1
-#define TILE_2 2
-#define TILE_3 3
-#define TILE_4 4
-#define TILE_5 5
-#define TILE_6 6
-#define TILE_7 7
-
-void init_tile_config() {
+TARGET_AMX_BF16 void init_tile_config() {
     tile_config_t tile = {0};
 
     tile.palette_id = 1; // This value is always 0 when using AMX
@@ -125,45 +90,18 @@ void init_tile_config() {
 }
 
 // Multiply A and B using AMX
-void mul_amx(fp32_t c[16][16], fp32_t a[16][32], fp32_t b[32][16]) {
+TARGET_AMX_BF16 void mul_amx(fp32_t c[16][16], fp32_t a[16][32], fp32_t b[32][16]) {
     bf16_t a16[16][32];
     bf16_t b16[32][16];
 
-#if defined(__AVX512F__)
-    // Convert FP32 to BF16 with AVX-512
-    for (int r = 0; r < 16; r += 1) {
-        // Load the first 16 elements
-        __m512 zmm0 = _mm512_loadu_ps(&a[r][0]); // 16 elements of float
-
-        // Load the latter 16 elements
-        __m512 zmm1 = _mm512_loadu_ps(&a[r][16]); // 16 elements of float
-
-        // Total 32 elements compressed and converted to bfloat16
-        __m512bh bf16_32 = _mm512_cvtne2ps_pbh(zmm1, zmm0);
-
-        // Store the result
-        _mm512_storeu_si512(a16[r], bf16_32);
-    }
-
-    for (int r = 0; r < 32; r += 2) {
-        __m512 zmm0 = _mm512_loadu_ps(b[r]);     // 16 elements of float
-        __m512 zmm1 = _mm512_loadu_ps(b[r + 1]); // 16 elements of float
-        __m512bh bf16_32 = _mm512_cvtne2ps_pbh(zmm1, zmm0);
-        _mm512_storeu_si512(b16[r], bf16_32);
-    }
-#else
+    // Convert FP32 to BF16 (with AVX-512 when the CPU has it)
     for (int r = 0; r < 16; r += 1) {
-        for (int c = 0; c < 32; c += 1) {
-            a16[r][c] = fp32_to_bf16(a[r][c]);
-        }
+        bf16_convert(a16[r], a[r], 32);
     }
 
     for (int r = 0; r < 32; r += 1) {
-        for (int c = 0; c < 16; c += 1) {
-            b16[r][c] = fp32_to_bf16(b[r][c]);
-        }
+        bf16_convert(b16[r], b[r], 16);
     }
-#endif
 
     bf16_t b16_transformed[16][32];
     for (int r = 0; r < 32; ++r) {
@@ -188,15 +126,1073 @@ void mul_amx(fp32_t c[16][16], fp32_t a[16][32], fp32_t b[32][16]) {
 }
 
 // -----------------------------------------------
+// General BF16 GEMM: C[M][N] = A[M][K] * B[K][N] (all row-major, FP32 in and out)
+
+// Multiply A and B using naive method (any shape)
+void gemm_naive(fp32_t *c, const fp32_t *a, const fp32_t *b, int m, int n, int k) {
+    for (int i = 0; i < m; ++i) {
+        for (int j = 0; j < n; ++j) {
+            fp32_t sum = 0;
+            for (int p = 0; p < k; ++p) {
+                sum += a[i * k + p] * b[p * n + j];
+            }
+            c[i * n + j] = sum;
+        }
+    }
+}
+
+// One tile holds 16 rows of 64 bytes.
+// For BF16 that is A[16][32] and B[32][16] (B is stored as [32 / 2][16 * 2]).
+#define GEMM_TILE_M 16
+#define GEMM_TILE_N 16
+#define GEMM_TILE_K 32
+
+// 2x2 register blocking: one block computes C[32][32] with 4 C tiles, 2 A tiles and 2 B tiles
+#define GEMM_BLOCK_M (GEMM_TILE_M * 2)
+#define GEMM_BLOCK_N (GEMM_TILE_N * 2)
+
+#define ROUND_UP(x, y) (((x) + (y) - 1) / (y) * (y))
+
+// Tile config for blocks of rows x cols of C (up to 32 x 32).
+// Blocks at the bottom and right edges of C use a reduced config, so their tile loads and stores touch only
+// the rows and columns that exist. Tiles of a half the block doesn't have (rows or cols <= 16) stay unconfigured.
+TARGET_AMX_BF16 void init_gemm_tile_config_block(int rows, int cols) {
+    tile_config_t tile = {0};
+
+    tile.palette_id = 1;
+    tile.start_row = 0;
+
+    const int rows0 = (rows < GEMM_TILE_M) ? rows : GEMM_TILE_M;
+    const int cols0 = (cols < GEMM_TILE_N) ? cols : GEMM_TILE_N;
+    const int rows1 = rows - rows0;
+    const int cols1 = cols - cols0;
+
+    // config for C tiles: c[16][16] of fp32 (TILE_0 | TILE_1 over TILE_2 | TILE_3)
+    tile.rows[TILE_0] = rows0;
+    tile.colsb[TILE_0] = cols0 * sizeof(fp32_t);
+    tile.rows[TILE_1] = cols1 > 0 ? rows0 : 0;
+    tile.colsb[TILE_1] = cols1 > 0 ? cols1 * sizeof(fp32_t) : 0;
+    tile.rows[TILE_2] = rows1;
+    tile.colsb[TILE_2] = rows1 > 0 ? cols0 * sizeof(fp32_t) : 0;
+    tile.rows[TILE_3] = cols1 > 0 ? rows1 : 0;
+    tile.colsb[TILE_3] = (rows1 > 0 && cols1 > 0) ? cols1 * sizeof(fp32_t) : 0;
+
+    // config for A tiles: a[16][32] of bf16
+    tile.rows[TILE_4] = rows0;
+    tile.colsb[TILE_4] = GEMM_TILE_K * sizeof(bf16_t); // 64
+    tile.rows[TILE_5] = rows1;
+    tile.colsb[TILE_5] = rows1 > 0 ? GEMM_TILE_K * sizeof(bf16_t) : 0;
+
+    // config for B tiles: b[32][16] of bf16, stored as [16][32]
+    tile.rows[TILE_6] = GEMM_TILE_K / 2; // 16
+    tile.colsb[TILE_6] = (cols0 * 2) * sizeof(bf16_t);
+    tile.rows[TILE_7] = cols1 > 0 ? GEMM_TILE_K / 2 : 0;
+    tile.colsb[TILE_7] = (cols1 * 2) * sizeof(bf16_t);
+
+    _tile_loadconfig(&tile);
+}
+
+// -----------------------------------------------
+// Pre-packed B
+// B (e.g. weights) usually doesn't change between multiplications,
+// so the BF16 conversion and the 2-element interleave are done once and the result is kept in a handle.
+
+typedef struct packed_b16_t {
+    int n, k;         // shape of the original B[K][N]
+    int n_pad, k_pad; // padded to GEMM_BLOCK_N and GEMM_TILE_K
+    bf16_t *panels;   // 64-byte aligned
+} packed_b16_t;
+
+// Offset of panel (j, kb) in packed_b16_t::panels.
+// Panel (j, kb) holds B[kb * 32 .. +32][j * 16 .. +16] as a [16][32] tile,
+// and the panels of a column j are contiguous so that the K loop streams them.
+static inline size_t packed_b16_panel(const packed_b16_t *pb, int j, int kb) {
+    return ((size_t)j * (pb->k_pad / GEMM_TILE_K) + kb) * (GEMM_TILE_K * GEMM_TILE_N);
+}
+
+// Pack B[K][N] into tile panels.
+// Out-of-range elements are zero, so ragged K and N contribute nothing to C.
+packed_b16_t *pack_b16(const fp32_t *b, int n, int k) {
+    packed_b16_t *pb = (packed_b16_t *)malloc(sizeof(packed_b16_t));
+    pb->n = n;
+    pb->k = k;
+    pb->n_pad = ROUND_UP(n, GEMM_BLOCK_N);
+    pb->k_pad = ROUND_UP(k, GEMM_TILE_K);
+    pb->panels = (bf16_t *)aligned_alloc(64, (size_t)pb->n_pad * pb->k_pad * sizeof(bf16_t));
+    memset(pb->panels, 0, (size_t)pb->n_pad * pb->k_pad * sizeof(bf16_t));
+
+    // The rows of B must be divided by 2 elements.
+    // Every 16 columns of an interleaved row go to the next panel column (j + 1).
+    const size_t chunk_stride = packed_b16_panel(pb, 1, 0) * sizeof(bf16_t);
+    bf16_t *rows16 = (bf16_t *)calloc((size_t)n * 2, sizeof(bf16_t)); // 2 converted rows, zero past K
+
+    for (int r = 0; r < k; r += 2) {
+        bf16_convert(&rows16[0], &b[(size_t)r * n], n);
+        if (r + 1 < k) {
+            bf16_convert(&rows16[n], &b[(size_t)(r + 1) * n], n);
+        } else {
+            memset(&rows16[n], 0, n * sizeof(bf16_t));
+        }
+
+        bf16_t *dst = &pb->panels[packed_b16_panel(pb, 0, r / GEMM_TILE_K) + (r % GEMM_TILE_K) / 2 * (GEMM_TILE_N * 2)];
+        vnni_interleave2_bf16(dst, chunk_stride, &rows16[0], &rows16[n], n);
+    }
+
+    free(rows16);
+    return pb;
+}
+
+void free_packed_b16(packed_b16_t *pb) {
+    free(pb->panels);
+    free(pb);
+}
+
+// A is converted to BF16 a strip at a time: rows i .. i + 31 in a [32][k_pad] buffer (64 KiB for K = 1024),
+// one panel (32 x 32) right before the first block of the strip loads it, so there is no full-size copy of A
+// and the panel is still in L1 when the tiles read it. The rows are zero-padded to k_pad, so a ragged K loads
+// whole tiles. Ragged M and N are left to the reduced tile configs of the edge blocks.
+static bf16_t *alloc_a16_strip(int k_pad) {
+    return (bf16_t *)aligned_alloc(64, (size_t)GEMM_BLOCK_M * k_pad * sizeof(bf16_t));
+}
+
+// Convert panel kb of `rows` rows of A (FP32, k apart) into a16 (k_pad apart)
+static inline void convert_a16_panel(bf16_t *a16, const fp32_t *a, int rows, int k, int k_pad, int kb) {
+    const int p = kb * GEMM_TILE_K;
+    const int cols = (k - p < GEMM_TILE_K) ? k - p : GEMM_TILE_K;
+    for (int r = 0; r < rows; ++r) {
+        bf16_convert(&a16[(size_t)r * k_pad + p], &a[(size_t)r * k + p], cols);
+        if (cols < GEMM_TILE_K)
+            memset(&a16[(size_t)r * k_pad + p + cols], 0, (GEMM_TILE_K - cols) * sizeof(bf16_t));
+    }
+}
+
+// Compute the block of C at (i, j) with AMX: min(M - i, 32) x min(N - j, 32), every element exactly once
+// (the tile config of init_gemm_tile_config_block for this shape must be loaded).
+// The block stays in 4 tiles during the whole K loop, and every loaded A or B tile is used by two _tile_dpbf16ps.
+// a16 is the strip of rows i .. i + 31; a is the same rows in FP32 when the strip is to be converted panel by panel
+// during the K loop (the first block of the strip), or NULL.
+// C is FP32, or BF16 (rounded to nearest even) with c_bf16.
+TARGET_AMX_BF16 void gemm_amx_block(void *c, bool c_bf16, bf16_t *a16, const fp32_t *a, const packed_b16_t *pb,
+                                    int m, int i, int j) {
+    const int n = pb->n;
+    const int k_pad = pb->k_pad;
+    const int k_blocks = k_pad / GEMM_TILE_K;
+    const int a_stride = k_pad * sizeof(bf16_t);
+    const int rows = (m - i < GEMM_BLOCK_M) ? m - i : GEMM_BLOCK_M;
+    const int cols = (n - j < GEMM_BLOCK_N) ? n - j : GEMM_BLOCK_N;
+    const bool has_m1 = rows > GEMM_TILE_M; // TILE_2, TILE_3 and TILE_5 are configured
+    const bool has_n1 = cols > GEMM_TILE_N; // TILE_1, TILE_3 and TILE_7 are configured
+
+    const bf16_t *a0 = a16;
+    const bf16_t *a1 = &a16[(size_t)GEMM_TILE_M * k_pad];
+    const bf16_t *b0 = &pb->panels[packed_b16_panel(pb, j / GEMM_TILE_N, 0)];
+    const bf16_t *b1 = &pb->panels[packed_b16_panel(pb, j / GEMM_TILE_N + 1, 0)];
+
+    if (has_m1 && has_n1) {
+        _tile_zero(TILE_0);
+        _tile_zero(TILE_1);
+        _tile_zero(TILE_2);
+        _tile_zero(TILE_3);
+
+        for (int kb = 0; kb < k_blocks; ++kb) {
+            if (a != NULL)
+                convert_a16_panel(a16, a, rows, pb->k, k_pad, kb);
+
+            _tile_loadd(TILE_4, &a0[kb * GEMM_TILE_K], a_stride);
+            _tile_loadd(TILE_5, &a1[kb * GEMM_TILE_K], a_stride);
+            _tile_loadd(TILE_6, &b0[kb * GEMM_TILE_K * GEMM_TILE_N], (GEMM_TILE_N * 2) * sizeof(bf16_t));
+            _tile_loadd(TILE_7, &b1[kb * GEMM_TILE_K * GEMM_TILE_N], (GEMM_TILE_N * 2) * sizeof(bf16_t));
+
+            _tile_dpbf16ps(TILE_0, TILE_4, TILE_6);
+            _tile_dpbf16ps(TILE_1, TILE_4, TILE_7);
+            _tile_dpbf16ps(TILE_2, TILE_5, TILE_6);
+            _tile_dpbf16ps(TILE_3, TILE_5, TILE_7);
+        }
+    } else {
+        // Edge block: only the configured tiles
+        _tile_zero(TILE_0);
+        if (has_n1)
+            _tile_zero(TILE_1);
+        if (has_m1)
+            _tile_zero(TILE_2);
+
+        for (int kb = 0; kb < k_blocks; ++kb) {
+            if (a != NULL)
+                convert_a16_panel(a16, a, rows, pb->k, k_pad, kb);
+
+            _tile_loadd(TILE_4, &a0[kb * GEMM_TILE_K], a_stride);
+            _tile_loadd(TILE_6, &b0[kb * GEMM_TILE_K * GEMM_TILE_N], (GEMM_TILE_N * 2) * sizeof(bf16_t));
+            _tile_dpbf16ps(TILE_0, TILE_4, TILE_6);
+            if (has_n1) {
+                _tile_loadd(TILE_7, &b1[kb * GEMM_TILE_K * GEMM_TILE_N], (GEMM_TILE_N * 2) * sizeof(bf16_t));
+                _tile_dpbf16ps(TILE_1, TILE_4, TILE_7);
+            }
+            if (has_m1) {
+                _tile_loadd(TILE_5, &a1[kb * GEMM_TILE_K], a_stride);
+                _tile_dpbf16ps(TILE_2, TILE_5, TILE_6);
+            }
+        }
+    }
+
+    // The tile config covers only the valid part of the block, so the tiles go to C (or c_block) as they are
+    fp32_t c_block[GEMM_BLOCK_M][GEMM_BLOCK_N];
+    fp32_t *c0 = c_bf16 ? &c_block[0][0] : &((fp32_t *)c)[(size_t)i * n + j];
+    const int c_ld = c_bf16 ? GEMM_BLOCK_N : n;
+    fp32_t *c1 = c0 + (size_t)GEMM_TILE_M * c_ld;
+    _tile_stored(TILE_0, c0, c_ld * sizeof(fp32_t));
+    if (has_n1)
+        _tile_stored(TILE_1, c0 + GEMM_TILE_N, c_ld * sizeof(fp32_t));
+    if (has_m1)
+        _tile_stored(TILE_2, c1, c_ld * sizeof(fp32_t));
+    if (has_m1 && has_n1)
+        _tile_stored(TILE_3, c1 + GEMM_TILE_N, c_ld * sizeof(fp32_t));
+
+    if (c_bf16) {
+        for (int r = 0; r < rows; ++r) {
+            bf16_convert(&((bf16_t *)c)[(size_t)(i + r) * n + j], c_block[r], cols);
+        }
+    }
+}
+
+// Rows i .. i + 31 of C, every block of them. The first block converts the strip of A into a16.
+// Loads the tile config of the full blocks of the strip, and of the block at the right edge.
+TARGET_AMX_BF16 static void gemm_amx_strip(void *c, bool c_bf16, bf16_t *a16, const fp32_t *a, const packed_b16_t *pb,
+                                           int m, int i) {
+    const int n = pb->n;
+    const int rows = (m - i < GEMM_BLOCK_M) ? m - i : GEMM_BLOCK_M;
+    const int n_full = n / GEMM_BLOCK_N * GEMM_BLOCK_N;
+    const fp32_t *a_strip = &a[(size_t)i * pb->k];
+
+    if (n_full > 0)
+        init_gemm_tile_config_block(rows, GEMM_BLOCK_N);
+    for (int j = 0; j < n_full; j += GEMM_BLOCK_N) {
+        gemm_amx_block(c, c_bf16, a16, j == 0 ? a_strip : NULL, pb, m, i, j);
+    }
+    if (n_full < n) {
+        init_gemm_tile_config_block(rows, n - n_full);
+        gemm_amx_block(c, c_bf16, a16, n_full == 0 ? a_strip : NULL, pb, m, i, n_full);
+    }
+}
+
+// Multiply A and pre-packed B using AMX (any shape), strip by strip of 32 rows of C
+// C is FP32, or BF16 with c_bf16.
+TARGET_AMX_BF16 void gemm_amx_packed_io(void *c, bool c_bf16, const fp32_t *a, const packed_b16_t *pb, int m) {
+    bf16_t *a16 = alloc_a16_strip(pb->k_pad);
+    for (int i = 0; i < m; i += GEMM_BLOCK_M) {
+        gemm_amx_strip(c, c_bf16, a16, a, pb, m, i);
+    }
+    free(a16);
+}
+
+TARGET_AMX_BF16 void gemm_amx_packed(fp32_t *c, const fp32_t *a, const packed_b16_t *pb, int m) {
+    gemm_amx_packed_io(c, false, a, pb, m);
+}
+
+// Same with C in BF16
+TARGET_AMX_BF16 void gemm_amx_packed_bf16(bf16_t *c, const fp32_t *a, const packed_b16_t *pb, int m) {
+    gemm_amx_packed_io(c, true, a, pb, m);
+}
+
+// Multiply A and B using AMX (any shape)
+// B is packed on every call; use pack_b16 and gemm_amx_packed when B is reused.
+void gemm_amx(fp32_t *c, const fp32_t *a, const fp32_t *b, int m, int n, int k) {
+    packed_b16_t *pb = pack_b16(b, n, k);
+    gemm_amx_packed(c, a, pb, m);
+    free_packed_b16(pb);
+}
+
+// Multiply A[16][32] and pre-packed B[32][16] using AMX (same as mul_amx without the B conversion and re-layout)
+// Panel (0, 0) is exactly b16_transformed of mul_amx.
+TARGET_AMX_BF16 void mul_amx_packed(fp32_t c[16][16], fp32_t a[16][32], const packed_b16_t *pb) {
+    bf16_t a16[16][32];
+    for (int r = 0; r < 16; ++r) {
+        bf16_convert(a16[r], a[r], 32);
+    }
+
+    _tile_loadd(TILE_1, a16, 32 * sizeof(bf16_t));
+    _tile_loadd(TILE_2, pb->panels, 32 * sizeof(bf16_t));
+
+    _tile_zero(TILE_0);
+    _tile_dpbf16ps(TILE_0, TILE_1, TILE_2);
+    _tile_stored(TILE_0, c, 16 * sizeof(fp32_t));
+}
+
+// -----------------------------------------------
+// Kernels for CPUs without AMX
+// They read the same packed B. The panels of a column j are contiguous,
+// so row p (a pair of K) of the 16 columns starting at j is at packed_b16_panel(pb, j / 16, 0) + p * 32.
+
+// Multiply A and pre-packed B without SIMD (A stays FP32)
+void gemm_scalar_packed(fp32_t *c, const fp32_t *a, const packed_b16_t *pb, int m) {
+    const int n = pb->n;
+    const int k = pb->k;
+
+    for (int i = 0; i < m; ++i) {
+        for (int j = 0; j < n; ++j) {
+            const bf16_t *col = &pb->panels[packed_b16_panel(pb, j / GEMM_TILE_N, 0) + (j % GEMM_TILE_N) * 2];
+            fp32_t sum = 0;
+            for (int p = 0; p < k; ++p) {
+                sum += a[i * k + p] * bf16_to_fp32(col[(p / 2) * (GEMM_TILE_N * 2) + p % 2]);
+            }
+            c[i * n + j] = sum;
+        }
+    }
+}
+
+static inline __mmask16 store_mask16(int cols) {
+    return cols >= 16 ? 0xffff : cols <= 0 ? 0 : (__mmask16)((1u << cols) - 1);
+}
+
+// Multiply A and pre-packed B using AVX-512 BF16
+// A panel row is 16 columns of (k, k + 1) pairs, which is exactly the operand of vdpbf16ps
+// with the matching pair of A broadcast. One step computes C[4][32] with 8 accumulators.
+TARGET_AVX512_BF16 void gemm_avx512_bf16_packed(fp32_t *c, const fp32_t *a, const packed_b16_t *pb, int m) {
+    const int n = pb->n;
+    const int k = pb->k;
+    const int k_pad = pb->k_pad;
+    const int k_pairs = (k + 1) / 2;
+
+    // A in BF16; the element after an odd K is zero
+    bf16_t *a16 = (bf16_t *)aligned_alloc(64, (size_t)m * k_pad * sizeof(bf16_t));
+    for (int i = 0; i < m; ++i) {
+        bf16_convert(&a16[(size_t)i * k_pad], &a[(size_t)i * k], k);
+        memset(&a16[(size_t)i * k_pad + k], 0, (k_pad - k) * sizeof(bf16_t));
+    }
+
+    for (int j = 0; j < pb->n_pad; j += GEMM_BLOCK_N) {
+        const bf16_t *b0 = &pb->panels[packed_b16_panel(pb, j / GEMM_TILE_N, 0)];
+        const bf16_t *b1 = &pb->panels[packed_b16_panel(pb, j / GEMM_TILE_N + 1, 0)];
+
+        for (int i = 0; i < m; i += 4) {
+            // Rows past M repeat the last row and are not stored
+            const uint32_t *ar[4];
+            for (int r = 0; r < 4; ++r) {
+                ar[r] = (const uint32_t *)&a16[(size_t)(i + r < m ? i + r : m - 1) * k_pad];
+            }
+
+            __m512 acc[4][2];
+            for (int r = 0; r < 4; ++r) {
+                acc[r][0] = _mm512_setzero_ps();
+                acc[r][1] = _mm512_setzero_ps();
+            }
+
+            for (int p = 0; p < k_pairs; ++p) {
+                const __m512bh vb0 = (__m512bh)_mm512_load_si512(&b0[p * 32]);
+                const __m512bh vb1 = (__m512bh)_mm512_load_si512(&b1[p * 32]);
+
+                for (int r = 0; r < 4; ++r) {
+                    const __m512bh va = (__m512bh)_mm512_set1_epi32(ar[r][p]);
+                    acc[r][0] = _mm512_dpbf16_ps(acc[r][0], va, vb0);
+                    acc[r][1] = _mm512_dpbf16_ps(acc[r][1], va, vb1);
+                }
+            }
+
+            for (int r = 0; r < 4 && i + r < m; ++r) {
+                fp32_t *cr = &c[(size_t)(i + r) * n + j];
+                _mm512_mask_storeu_ps(cr, store_mask16(n - j), acc[r][0]);
+                _mm512_mask_storeu_ps(cr + GEMM_TILE_N, store_mask16(n - j - GEMM_TILE_N), acc[r][1]);
+            }
+        }
+    }
+
+    free(a16);
+}
+
+// Multiply A and pre-packed B using AVX2 and FMA (A stays FP32)
+// A (k, k + 1) pair of B is one dword: BF16 is the upper half of FP32,
+// so B[k + 1] is (dword & 0xffff0000) and B[k] is (dword << 16).
+TARGET_AVX2 void gemm_avx2_packed(fp32_t *c, const fp32_t *a, const packed_b16_t *pb, int m) {
+    const int n = pb->n;
+    const int k = pb->k;
+    const __m256i upper = _mm256_set1_epi32((int)0xffff0000);
+
+    for (int j = 0; j < n; j += GEMM_TILE_N) {
+        const bf16_t *bj = &pb->panels[packed_b16_panel(pb, j / GEMM_TILE_N, 0)];
+
+        for (int i = 0; i < m; i += 2) {
+            const fp32_t *ar[2];
+            for (int r = 0; r < 2; ++r) {
+                ar[r] = &a[(size_t)(i + r < m ? i + r : m - 1) * k];
+            }
+
+            __m256 acc[2][2];
+            for (int r = 0; r < 2; ++r) {
+                acc[r][0] = _mm256_setzero_ps();
+                acc[r][1] = _mm256_setzero_ps();
+            }
+
+            for (int p = 0; p < k; p += 2) {
+                __m256 b_even[2], b_odd[2];
+                for (int x = 0; x < 2; ++x) {
+                    const __m256i pairs = _mm256_load_si256((const __m256i *)&bj[(p / 2) * 32 + x * 16]);
+                    b_even[x] = _mm256_castsi256_ps(_mm256_slli_epi32(pairs, 16));
+                    b_odd[x] = _mm256_castsi256_ps(_mm256_and_si256(pairs, upper));
+                }
+
+                for (int r = 0; r < 2; ++r) {
+                    const __m256 a0 = _mm256_broadcast_ss(&ar[r][p]);
+                    const __m256 a1 = (p + 1 < k) ? _mm256_broadcast_ss(&ar[r][p + 1]) : _mm256_setzero_ps();
+                    for (int x = 0; x < 2; ++x) {
+                        acc[r][x] = _mm256_fmadd_ps(a0, b_even[x], acc[r][x]);
+                        acc[r][x] = _mm256_fmadd_ps(a1, b_odd[x], acc[r][x]);
+                    }
+                }
+            }
+
+            for (int r = 0; r < 2 && i + r < m; ++r) {
+                fp32_t row[GEMM_TILE_N];
+                _mm256_storeu_ps(&row[0], acc[r][0]);
+                _mm256_storeu_ps(&row[8], acc[r][1]);
+
+                const int cols = (n - j < GEMM_TILE_N) ? n - j : GEMM_TILE_N;
+                memcpy(&c[(size_t)(i + r) * n + j], row, cols * sizeof(fp32_t));
+            }
+        }
+    }
+}
+
+// -----------------------------------------------
+// Runtime dispatch
+// gemm_packed, gemm and mul use the fastest kernel the CPU supports (see detect_cpu_features).
+
+typedef void (*gemm_packed_fn_t)(fp32_t *c, const fp32_t *a, const packed_b16_t *pb, int m);
+
+typedef struct gemm_kernel_t {
+    const char *name;
+    gemm_packed_fn_t fn;
+} gemm_kernel_t;
+
+// Supported kernels, the fastest first
+static gemm_kernel_t gemm_kernels[4];
+static int num_gemm_kernels;
+
+void init_dispatch() {
+    num_gemm_kernels = 0;
+    if (cpu_features.amx_bf16)
+        gemm_kernels[num_gemm_kernels++] = (gemm_kernel_t){"AMX-BF16", gemm_amx_packed};
+    if (cpu_features.avx512_bf16)
+        gemm_kernels[num_gemm_kernels++] = (gemm_kernel_t){"AVX512-BF16", gemm_avx512_bf16_packed};
+    if (cpu_features.avx2)
+        gemm_kernels[num_gemm_kernels++] = (gemm_kernel_t){"AVX2", gemm_avx2_packed};
+    gemm_kernels[num_gemm_kernels++] = (gemm_kernel_t){"scalar", gemm_scalar_packed};
+}
+
+void gemm_packed(fp32_t *c, const fp32_t *a, const packed_b16_t *pb, int m) { gemm_kernels[0].fn(c, a, pb, m); }
+
+// Same with C in BF16 (rounded to nearest even). Without AMX, GEMM_BLOCK_M rows at a time go through an FP32 strip.
+void gemm_packed_bf16(bf16_t *c, const fp32_t *a, const packed_b16_t *pb, int m) {
+    if (cpu_features.amx_bf16) {
+        gemm_amx_packed_bf16(c, a, pb, m);
+        return;
+    }
+
+    const int n = pb->n;
+    fp32_t *strip = (fp32_t *)malloc((size_t)GEMM_BLOCK_M * n * sizeof(fp32_t));
+    for (int i = 0; i < m; i += GEMM_BLOCK_M) {
+        const int rows = (m - i < GEMM_BLOCK_M) ? m - i : GEMM_BLOCK_M;
+        gemm_kernels[0].fn(strip, &a[(size_t)i * pb->k], pb, rows);
+        bf16_convert(&c[(size_t)i * n], strip, rows * n);
+    }
+    free(strip);
+}
+
+void gemm(fp32_t *c, const fp32_t *a, const fp32_t *b, int m, int n, int k) {
+    packed_b16_t *pb = pack_b16(b, n, k);
+    gemm_packed(c, a, pb, m);
+    free_packed_b16(pb);
+}
+
+void mul(fp32_t c[16][16], fp32_t a[16][32], fp32_t b[32][16]) {
+    if (cpu_features.amx_bf16) {
+        init_tile_config();
+        mul_amx(c, a, b);
+    } else {
+        gemm(&c[0][0], &a[0][0], &b[0][0], 16, 16, 32);
+    }
+}
+
+// -----------------------------------------------
+// Batched mul
+// Many independent 16x32 * 32x16 problems (e.g. per-head attention blocks, small MLPs) in one call.
+// The tile config is loaded once for the batch, and two sets of tiles alternate:
+// problem x uses (TILE_0, TILE_1, TILE_2) or (TILE_3, TILE_4, TILE_5) by its parity, so the BF16 conversion,
+// the B re-layout and the tile loads of problem x + 1 are issued before the _tile_dpbf16ps of problem x.
+
+// Problem x is c[x], a[x] and b[x] (arrays of pointers), or, when they are NULL,
+// c_base + x * c_stride, a_base + x * a_stride and b_base + x * b_stride (strides in elements)
+typedef struct mul_batch_t {
+    fp32_t *const *c;
+    const fp32_t *const *a;
+    const fp32_t *const *b;
+    fp32_t *c_base;
+    const fp32_t *a_base;
+    const fp32_t *b_base;
+    size_t c_stride, a_stride, b_stride;
+    int count;
+} mul_batch_t;
+
+static inline fp32_t *mul_batch_c(const mul_batch_t *batch, int x) {
+    return batch->c != NULL ? batch->c[x] : batch->c_base + x * batch->c_stride;
+}
+
+static inline const fp32_t *mul_batch_a(const mul_batch_t *batch, int x) {
+    return batch->a != NULL ? batch->a[x] : batch->a_base + x * batch->a_stride;
+}
+
+static inline const fp32_t *mul_batch_b(const mul_batch_t *batch, int x) {
+    return batch->b != NULL ? batch->b[x] : batch->b_base + x * batch->b_stride;
+}
+
+// a16 and b16_transformed of mul_amx. The pair interleave of B is SSE2
+// (16 columns are below the chunks of the wider kernels of common/vnni_pack.h).
+static inline void transform_ab16(bf16_t a16[16][32], bf16_t b16_transformed[16][32], const fp32_t *a,
+                                  const fp32_t *b) {
+    bf16_t b16[32][16];
+    bf16_convert(&a16[0][0], a, 16 * 32);
+    bf16_convert(&b16[0][0], b, 32 * 16);
+
+    for (int r = 0; r < 32; r += 2) {
+        for (int half = 0; half < 2; ++half) {
+            const __m128i r0 = _mm_loadu_si128((const __m128i *)&b16[r][half * 8]);
+            const __m128i r1 = _mm_loadu_si128((const __m128i *)&b16[r + 1][half * 8]);
+            _mm_storeu_si128((__m128i *)&b16_transformed[r / 2][half * 16], _mm_unpacklo_epi16(r0, r1));
+            _mm_storeu_si128((__m128i *)&b16_transformed[r / 2][half * 16 + 8], _mm_unpackhi_epi16(r0, r1));
+        }
+    }
+}
+
+// Tile config of the batch: mul_amx's C, A and B tiles twice
+TARGET_AMX_BF16 void init_batch_tile_config() {
+    tile_config_t tile = {0};
+    tile.palette_id = 1;
+
+    for (int set = 0; set < 2; ++set) {
+        tile.colsb[TILE_0 + set * 3] = 16 * sizeof(fp32_t); // c[16][16]
+        tile.rows[TILE_0 + set * 3] = 16;
+        tile.colsb[TILE_1 + set * 3] = 32 * sizeof(bf16_t); // a[16][32]
+        tile.rows[TILE_1 + set * 3] = 16;
+        tile.colsb[TILE_2 + set * 3] = (16 * 2) * sizeof(bf16_t); // b[32][16] as [16][32]
+        tile.rows[TILE_2 + set * 3] = 32 / 2;
+    }
 
-int main() {
-#if defined(__linux__)
-    if (syscall(SYS_arch_prctl, ARCH_REQ_XCOMP_PERM, XFEATURE_XTILEDATA)) {
-        printf("\n Fail to do XFEATURE_XTILEDATA \n\n");
-        fflush(stdout);
-        return 1;
+    _tile_loadconfig(&tile);
+}
+
+TARGET_AMX_BF16 void mul_amx_batch_run(const mul_batch_t *batch) {
+    const int count = batch->count;
+    bf16_t a16[2][16][32] __attribute__((aligned(64)));
+    bf16_t b16_transformed[2][16][32] __attribute__((aligned(64)));
+    if (count <= 0)
+        return;
+
+    init_batch_tile_config();
+
+    transform_ab16(a16[0], b16_transformed[0], mul_batch_a(batch, 0), mul_batch_b(batch, 0));
+    _tile_loadd(TILE_1, a16[0], 32 * sizeof(bf16_t));
+    _tile_loadd(TILE_2, b16_transformed[0], 32 * sizeof(bf16_t));
+    _tile_zero(TILE_0);
+
+    for (int x = 0; x < count; x += 2) {
+        // Problem x is in the first set; load x + 1 into the second one
+        if (x + 1 < count) {
+            transform_ab16(a16[1], b16_transformed[1], mul_batch_a(batch, x + 1), mul_batch_b(batch, x + 1));
+            _tile_loadd(TILE_4, a16[1], 32 * sizeof(bf16_t));
+            _tile_loadd(TILE_5, b16_transformed[1], 32 * sizeof(bf16_t));
+            _tile_zero(TILE_3);
+        }
+        _tile_dpbf16ps(TILE_0, TILE_1, TILE_2);
+        _tile_stored(TILE_0, mul_batch_c(batch, x), 16 * sizeof(fp32_t));
+
+        if (x + 1 >= count)
+            break;
+
+        // Problem x + 1 is in the second set; load x + 2 into the first one
+        if (x + 2 < count) {
+            transform_ab16(a16[0], b16_transformed[0], mul_batch_a(batch, x + 2), mul_batch_b(batch, x + 2));
+            _tile_loadd(TILE_1, a16[0], 32 * sizeof(bf16_t));
+            _tile_loadd(TILE_2, b16_transformed[0], 32 * sizeof(bf16_t));
+            _tile_zero(TILE_0);
+        }
+        _tile_dpbf16ps(TILE_3, TILE_4, TILE_5);
+        _tile_stored(TILE_3, mul_batch_c(batch, x + 1), 16 * sizeof(fp32_t));
     }
+}
+
+// Without AMX, mul one by one
+static void mul_batch_run(const mul_batch_t *batch) {
+    if (cpu_features.amx_bf16) {
+        mul_amx_batch_run(batch);
+        return;
+    }
+    for (int x = 0; x < batch->count; ++x) {
+        gemm(mul_batch_c(batch, x), mul_batch_a(batch, x), mul_batch_b(batch, x), 16, 16, 32);
+    }
+}
+
+// count problems c[x][16][16] = a[x][16][32] * b[x][32][16], given as arrays of pointers
+void mul_batch(fp32_t *const c[], const fp32_t *const a[], const fp32_t *const b[], int count) {
+    const mul_batch_t batch = {c, a, b, NULL, NULL, NULL, 0, 0, 0, count};
+    mul_batch_run(&batch);
+}
+
+// Same, problem x at c + x * c_stride, a + x * a_stride and b + x * b_stride (in elements)
+void mul_batch_strided(fp32_t *c, size_t c_stride, const fp32_t *a, size_t a_stride, const fp32_t *b,
+                       size_t b_stride, int count) {
+    const mul_batch_t batch = {NULL, NULL, NULL, c, a, b, c_stride, a_stride, b_stride, count};
+    mul_batch_run(&batch);
+}
+
+// -----------------------------------------------
+// Multi-threaded GEMM
+// AMX: every 32x32 block of C is a task. The tile config is per thread, so every thread loads it
+// before its first block (parallel_job_t::begin), and the pool releases the tiles when a worker ends.
+// A block at the edge of C loads its reduced tile config and restores the full one afterwards.
+// Every thread converts the strip of A of its block into its own strip buffer (one per thread for the job),
+// and skips the conversion while its next blocks are in the same strip.
+// Other kernels: every GEMM_BLOCK_M rows of C are a task for the single-threaded kernel.
+
+typedef struct gemm_job_args_t {
+    fp32_t *c;
+    const fp32_t *a;
+    const packed_b16_t *pb;
+    int m;
+    int n_blocks;          // blocks of C in a row (AMX)
+    bf16_t *a16;           // [num_threads][GEMM_BLOCK_M][k_pad] strip buffers (AMX)
+    atomic_int next_strip; // next unused strip buffer
+} gemm_job_args_t;
+
+// Strip buffer of the thread and the first row of A it holds (-1: none), set in gemm_amx_begin
+static __thread bf16_t *gemm_thread_a16;
+static __thread int gemm_thread_a16_row;
+
+static void gemm_amx_begin(void *arg) {
+    gemm_job_args_t *args = (gemm_job_args_t *)arg;
+    const int strip = atomic_fetch_add(&args->next_strip, 1);
+    gemm_thread_a16 = &args->a16[(size_t)strip * GEMM_BLOCK_M * args->pb->k_pad];
+    gemm_thread_a16_row = -1;
+    init_gemm_tile_config_block(GEMM_BLOCK_M, GEMM_BLOCK_N);
+}
+
+static void gemm_amx_task(void *arg, int task) {
+    const gemm_job_args_t *args = (const gemm_job_args_t *)arg;
+    const packed_b16_t *pb = args->pb;
+    const int i = task / args->n_blocks * GEMM_BLOCK_M;
+    const int j = task % args->n_blocks * GEMM_BLOCK_N;
+    const int rows = (args->m - i < GEMM_BLOCK_M) ? args->m - i : GEMM_BLOCK_M;
+    const int cols = (pb->n - j < GEMM_BLOCK_N) ? pb->n - j : GEMM_BLOCK_N;
+    const bool edge = rows < GEMM_BLOCK_M || cols < GEMM_BLOCK_N;
+    const fp32_t *a_strip = NULL;
+
+    if (gemm_thread_a16_row != i) {
+        a_strip = &args->a[(size_t)i * pb->k];
+        gemm_thread_a16_row = i;
+    }
+    if (edge)
+        init_gemm_tile_config_block(rows, cols);
+    gemm_amx_block(args->c, false, gemm_thread_a16, a_strip, pb, args->m, i, j);
+    if (edge)
+        init_gemm_tile_config_block(GEMM_BLOCK_M, GEMM_BLOCK_N);
+}
+
+static void gemm_strip_task(void *arg, int task) {
+    const gemm_job_args_t *args = (const gemm_job_args_t *)arg;
+    const int i = task * GEMM_BLOCK_M;
+    const int rows = (args->m - i < GEMM_BLOCK_M) ? args->m - i : GEMM_BLOCK_M;
+    gemm_kernels[0].fn(&args->c[(size_t)i * args->pb->n], &args->a[(size_t)i * args->pb->k], args->pb, rows);
+}
+
+// Same as gemm_packed on all threads of the pool
+// The tasks are split statically when every thread gets the same number of full blocks;
+// ragged shapes take the tasks one by one from a shared counter.
+void gemm_packed_mt(thread_pool_t *pool, fp32_t *c, const fp32_t *a, const packed_b16_t *pb, int m) {
+    const int m_pad = ROUND_UP(m, GEMM_BLOCK_M);
+    const bool ragged = m != m_pad || pb->n != pb->n_pad;
+
+    gemm_job_args_t args = {c, a, pb, m, pb->n_pad / GEMM_BLOCK_N, NULL, 0};
+    parallel_job_t job = {NULL, gemm_strip_task, &args, m_pad / GEMM_BLOCK_M, SCHEDULE_STATIC};
+
+    if (cpu_features.amx_bf16) {
+        args.a16 = (bf16_t *)aligned_alloc(64, (size_t)pool->num_threads * GEMM_BLOCK_M * pb->k_pad * sizeof(bf16_t));
+        job.begin = gemm_amx_begin;
+        job.task = gemm_amx_task;
+        job.num_tasks = (m_pad / GEMM_BLOCK_M) * args.n_blocks;
+    }
+
+    if (ragged || job.num_tasks % pool->num_threads != 0)
+        job.schedule = SCHEDULE_DYNAMIC;
+
+    thread_pool_run(pool, &job);
+    free(args.a16);
+}
+
+// -----------------------------------------------
+
+// got against ref bit for bit (widened to int32 for verify_i32)
+static void verify_convert(const char *name, const bf16_t *got, const bf16_t *ref, int n) {
+    int32_t *got32 = (int32_t *)malloc(n * sizeof(int32_t));
+    int32_t *ref32 = (int32_t *)malloc(n * sizeof(int32_t));
+    for (int i = 0; i < n; ++i) {
+        got32[i] = got[i];
+        ref32[i] = ref[i];
+    }
+    verify_i32(name, got32, ref32, (verify_dims_t){1, {n}});
+    free(got32);
+    free(ref32);
+}
+
+// Compare the conversions of common/bf16.h with vcvtneps2bf16 bit for bit: ties, NaN, infinities, denormals and
+// overflow, then 1M bit patterns spread over every exponent (every other one a tie)
+void run_convert_check() {
+    static const uint32_t special[] = {
+        0x3f808000, 0x3f818000, 0xbf808000, 0x3f807fff, 0x3f808001, // ties and next to them
+        0x7f800001, 0xff800001, 0x7fc00000, 0x7fbfffff, 0xffffffff, // NaN (signaling, quiet, negative)
+        0x7f800000, 0xff800000, 0x7f7fffff, 0xff7fffff,             // infinities, rounding up to them
+        0x00000001, 0x807fffff, 0x007fffff, 0x00408000, 0x80000000, // denormals, -0
+        0x00800000, 0x0080ffff, 0x80808000,                         // smallest normals
+    };
+    const int n = 1 << 20;
+    const int n_special = sizeof(special) / sizeof(special[0]);
+
+    if (!cpu_features.avx512_bf16) {
+        printf("bf16_from_fp32: no AVX-512 BF16 to compare with\n");
+        return;
+    }
+
+    uint32_t *bits = (uint32_t *)malloc(n * sizeof(uint32_t));
+    fp32_t *values = (fp32_t *)malloc(n * sizeof(fp32_t));
+    bf16_t *ref = (bf16_t *)malloc(n * sizeof(bf16_t));
+    bf16_t *got = (bf16_t *)malloc(n * sizeof(bf16_t));
+
+    for (int i = 0; i < n; ++i) {
+        bits[i] = (i < n_special) ? special[i] : (uint32_t)i * 2654435761u; // The value you like
+        if (i >= n_special && i % 2 == 0)
+            bits[i] = (bits[i] & 0xffff0000) | 0x8000;
+    }
+    memcpy(values, bits, n * sizeof(fp32_t));
+    bf16_convert_avx512_bf16(ref, values, n);
+
+    for (int i = 0; i < n; ++i) {
+        got[i] = bf16_from_fp32(values[i]);
+    }
+    verify_convert("bf16_from_fp32", got, ref, n);
+
+    bf16_convert_avx512(got, values, n);
+    verify_convert("bf16_from_fp32_avx512", got, ref, n);
+
+    free(bits);
+    free(values);
+    free(ref);
+    free(got);
+}
+
+// Compare every supported kernel with gemm_naive on a shape and print the speed
+// BF16 keeps 8 bits of mantissa, so C passes within GEMM_BF16_REL_TOL of the largest |C|.
+#define GEMM_BF16_REL_TOL (1.0f / 64)
+
+void run_gemm(int m, int n, int k) {
+    fp32_t *a = (fp32_t *)malloc((size_t)m * k * sizeof(fp32_t));
+    fp32_t *b = (fp32_t *)malloc((size_t)k * n * sizeof(fp32_t));
+    fp32_t *c_naive = (fp32_t *)malloc((size_t)m * n * sizeof(fp32_t));
+    fp32_t *c_kernel = (fp32_t *)malloc((size_t)m * n * sizeof(fp32_t));
+
+    // Not exact in BF16, so the error includes the rounding of A and B
+    for (int i = 0; i < m * k; ++i) {
+        a[i] = (i % 17) * 0.23f - 1.9f; // The value you like
+    }
+    for (int i = 0; i < k * n; ++i) {
+        b[i] = (i % 13) * 0.47f - 2.9f; // The value you like
+    }
+
+    const double ops = 2.0 * m * n * k;
+
+    double t0 = now_sec();
+    gemm_naive(c_naive, a, b, m, n, k);
+    double t1 = now_sec();
+
+    // B packed once, e.g. inference weights
+    packed_b16_t *pb = pack_b16(b, n, k);
+    double t2 = now_sec();
+
+    printf("M=%d N=%d K=%d: naive %.3f ms (%.2f GFLOPS), pack_b16 %.3f ms\n", m, n, k, (t1 - t0) * 1e3,
+           ops / (t1 - t0) * 1e-9, (t2 - t1) * 1e3);
+
+    for (int x = 0; x < num_gemm_kernels; ++x) {
+        memset(c_kernel, 0, (size_t)m * n * sizeof(fp32_t));
+#if defined(AMX_EMULATE)
+        amx_emu_reset_counters();
 #endif
+        double t3 = now_sec();
+        gemm_kernels[x].fn(c_kernel, a, pb, m);
+        double t4 = now_sec();
+
+        printf("    %-12s %9.3f ms (%7.2f GFLOPS)\n", gemm_kernels[x].name, (t4 - t3) * 1e3, ops / (t4 - t3) * 1e-9);
+        char name[64];
+        snprintf(name, sizeof(name), "%s %dx%dx%d", gemm_kernels[x].name, m, n, k);
+        verify_f32(name, c_kernel, c_naive, verify_dims2(m, n), 4, GEMM_BF16_REL_TOL);
+#if defined(AMX_EMULATE)
+        if (amx_emu_counters.tmuls > 0)
+            amx_emu_print_counters("(tile instructions)");
+#endif
+    }
+
+    // C in BF16 with the dispatched kernel; the rounding of C adds up to 2^-8 of |C|
+    bf16_t *c16 = (bf16_t *)malloc((size_t)m * n * sizeof(bf16_t));
+    double t5 = now_sec();
+    gemm_packed_bf16(c16, a, pb, m);
+    double t6 = now_sec();
+
+    printf("    %-12s %9.3f ms (%7.2f GFLOPS) (BF16 C)\n", gemm_kernels[0].name, (t6 - t5) * 1e3,
+           ops / (t6 - t5) * 1e-9);
+    for (int i = 0; i < m * n; ++i) {
+        c_kernel[i] = bf16_to_fp32(c16[i]);
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "%s %dx%dx%d BF16 C", gemm_kernels[0].name, m, n, k);
+    verify_f32(name, c_kernel, c_naive, verify_dims2(m, n), 4, GEMM_BF16_REL_TOL);
+    free(c16);
+
+    free_packed_b16(pb);
+    free(a);
+    free(b);
+    free(c_naive);
+    free(c_kernel);
+}
+
+// Compare mul_batch_strided and mul_batch with mul (same conversions and TMULs, so the results are identical)
+// on count problems, and their throughput with mul one by one (a tile config and a B re-layout per problem)
+void run_mul_batch(int count) {
+    fp32_t(*a)[16][32] = malloc(count * sizeof(*a));
+    fp32_t(*b)[32][16] = malloc(count * sizeof(*b));
+    fp32_t(*c_ref)[16][16] = malloc(count * sizeof(*c_ref));
+    fp32_t(*c)[16][16] = malloc(count * sizeof(*c));
+    const fp32_t **a_ptrs = (const fp32_t **)malloc(count * sizeof(fp32_t *));
+    const fp32_t **b_ptrs = (const fp32_t **)malloc(count * sizeof(fp32_t *));
+    fp32_t **c_ptrs = (fp32_t **)malloc(count * sizeof(fp32_t *));
+
+    for (int x = 0; x < count; ++x) {
+        for (int r = 0; r < 16; ++r) {
+            for (int k = 0; k < 32; ++k) {
+                a[x][r][k] = (x % 5) * 0.25f + r * 0.5f - k * 0.125f; // The value you like
+                b[x][k][r] = (x % 3) * 0.5f - r * 0.25f + k * 0.0625f; // The value you like
+            }
+        }
+
+        // In reverse order, as the problems of a batch need not be contiguous
+        a_ptrs[x] = &a[count - 1 - x][0][0];
+        b_ptrs[x] = &b[count - 1 - x][0][0];
+        c_ptrs[x] = &c[count - 1 - x][0][0];
+    }
+
+    // The fastest of 3 runs each; mul one by one is the reference
+    double one_by_one = 1e30;
+    double strided = 1e30;
+    double pointers = 1e30;
+    for (int run = 0; run < 3; ++run) {
+        double t0 = now_sec();
+        for (int x = 0; x < count; ++x) {
+            mul(c_ref[x], a[x], b[x]);
+        }
+        double t1 = now_sec();
+        mul_batch_strided(&c[0][0][0], 16 * 16, &a[0][0][0], 16 * 32, &b[0][0][0], 32 * 16, count);
+        double t2 = now_sec();
+        if (run == 0)
+            verify_f32("mul_batch_strided", &c[0][0][0], &c_ref[0][0][0], verify_dims3(count, 16, 16), 0, 0.0f);
+        memset(c, 0, count * sizeof(*c));
+        double t3 = now_sec();
+        mul_batch(c_ptrs, a_ptrs, b_ptrs, count);
+        double t4 = now_sec();
+        if (run == 0)
+            verify_f32("mul_batch", &c[0][0][0], &c_ref[0][0][0], verify_dims3(count, 16, 16), 0, 0.0f);
+
+        one_by_one = (t1 - t0 < one_by_one) ? t1 - t0 : one_by_one;
+        strided = (t2 - t1 < strided) ? t2 - t1 : strided;
+        pointers = (t4 - t3 < pointers) ? t4 - t3 : pointers;
+    }
+
+    printf("%d problems of 16x16x32 (%s): mul %.2f M problems/s, mul_batch_strided %.2f M problems/s, "
+           "mul_batch %.2f M problems/s\n",
+           count, cpu_features.amx_bf16 ? "AMX-BF16" : gemm_kernels[0].name, count / one_by_one * 1e-6,
+           count / strided * 1e-6, count / pointers * 1e-6);
+
+    free(a);
+    free(b);
+    free(c_ref);
+    free(c);
+    free(a_ptrs);
+    free(b_ptrs);
+    free(c_ptrs);
+}
+
+// Run gemm_packed_mt from 1 thread to all cores of a socket and print the speedup
+// Every thread computes its part of C exactly as the single-threaded kernel, so the results must be identical.
+void run_gemm_scaling(int m, int n, int k) {
+    fp32_t *a = (fp32_t *)malloc((size_t)m * k * sizeof(fp32_t));
+    fp32_t *b = (fp32_t *)malloc((size_t)k * n * sizeof(fp32_t));
+    fp32_t *c_ref = (fp32_t *)malloc((size_t)m * n * sizeof(fp32_t));
+    fp32_t *c_mt = (fp32_t *)malloc((size_t)m * n * sizeof(fp32_t));
+
+    for (int i = 0; i < m * k; ++i) {
+        a[i] = (i % 17) * 0.25f - 2.0f; // The value you like
+    }
+    for (int i = 0; i < k * n; ++i) {
+        b[i] = (i % 13) * 0.5f - 3.0f; // The value you like
+    }
+
+    packed_b16_t *pb = pack_b16(b, n, k);
+    gemm_packed(c_ref, a, pb, m);
+
+    int cpus[CPU_SETSIZE];
+    const int num_cores = socket_core_cpus(cpus, CPU_SETSIZE);
+    const double ops = 2.0 * m * n * k;
+    double time_1 = 0;
+
+    printf("M=%d N=%d K=%d (%s, %d cores in the socket)\n", m, n, k, gemm_kernels[0].name, num_cores);
+
+    for (int threads = 1;; threads = (threads * 2 < num_cores) ? threads * 2 : num_cores) {
+        thread_pool_t *pool = thread_pool_create(threads, cpu_features.amx_tile ? amx_release : NULL);
+
+        // The first run warms up the threads and the caches, then the fastest of 3 runs is kept
+        memset(c_mt, 0, (size_t)m * n * sizeof(fp32_t));
+        gemm_packed_mt(pool, c_mt, a, pb, m);
+        double best = 1e30;
+        for (int x = 0; x < 3; ++x) {
+            const double t0 = now_sec();
+            gemm_packed_mt(pool, c_mt, a, pb, m);
+            const double t1 = now_sec();
+            best = (t1 - t0 < best) ? t1 - t0 : best;
+        }
+        thread_pool_destroy(pool);
+
+        if (threads == 1)
+            time_1 = best;
+        printf("    threads %3d %9.3f ms (%7.2f GFLOPS), speedup %5.2fx\n", threads, best * 1e3, ops / best * 1e-9,
+               time_1 / best);
+        char name[64];
+        snprintf(name, sizeof(name), "gemm_packed_mt %d threads", threads);
+        verify_f32(name, c_mt, c_ref, verify_dims2(m, n), 0, 0.0f);
+
+        if (threads == num_cores)
+            break;
+    }
+
+    free_packed_b16(pb);
+    free(a);
+    free(b);
+    free(c_ref);
+    free(c_mt);
+}
+
+// -----------------------------------------------
+// Benchmark mode (--bench, see common/bench.h)
+
+typedef struct mul_bench_args_t {
+    fp32_t c[16][16];
+    fp32_t a[16][32];
+    fp32_t b[32][16];
+} mul_bench_args_t;
+
+static void bench_mul_naive(void *arg) {
+    mul_bench_args_t *args = (mul_bench_args_t *)arg;
+    mul_naive(args->c, args->a, args->b);
+}
+
+static void bench_mul_amx(void *arg) {
+    mul_bench_args_t *args = (mul_bench_args_t *)arg;
+    mul_amx(args->c, args->a, args->b);
+}
+
+typedef struct gemm_bench_args_t {
+    gemm_packed_fn_t fn;
+    fp32_t *c;
+    const fp32_t *a;
+    const fp32_t *b;
+    const packed_b16_t *pb;
+    int m, n, k;
+} gemm_bench_args_t;
+
+static void bench_gemm_naive(void *arg) {
+    gemm_bench_args_t *args = (gemm_bench_args_t *)arg;
+    gemm_naive(args->c, args->a, args->b, args->m, args->n, args->k);
+}
+
+static void bench_gemm_packed(void *arg) {
+    gemm_bench_args_t *args = (gemm_bench_args_t *)arg;
+    args->fn(args->c, args->a, args->pb, args->m);
+}
+
+// mul_naive and mul_amx on their 16x32x16 shape, then gemm_naive and every supported kernel
+// (with B packed once) over a sweep of shapes. The traffic counts A, B and C in FP32.
+void run_benchmarks() {
+    bench_begin();
+
+    mul_bench_args_t *mul_args = (mul_bench_args_t *)malloc(sizeof(mul_bench_args_t));
+    init_mat_a(mul_args->a);
+    init_mat_b(mul_args->b);
+    const double mul_ops = 2.0 * 16 * 16 * 32;
+    const double mul_bytes = sizeof(mul_args->a) + sizeof(mul_args->b) + sizeof(mul_args->c);
+
+    bench_report("bf16_mul", "mul_naive", "16x16x32", mul_ops, mul_bytes, bench_measure(bench_mul_naive, mul_args));
+    if (cpu_features.amx_bf16) {
+        init_tile_config();
+        bench_report("bf16_mul", "mul_amx", "16x16x32", mul_ops, mul_bytes, bench_measure(bench_mul_amx, mul_args));
+    }
+    free(mul_args);
+
+    // {M, N, K}; the last one is ragged
+    const int shapes[][3] = {{64, 64, 64}, {256, 256, 256}, {512, 512, 512}, {1024, 1024, 1024}, {1000, 777, 333}};
+    const int num_shapes = sizeof(shapes) / sizeof(shapes[0]);
+
+    for (int x = 0; x < num_shapes; ++x) {
+        const int m = shapes[x][0];
+        const int n = shapes[x][1];
+        const int k = shapes[x][2];
+
+        fp32_t *a = (fp32_t *)malloc((size_t)m * k * sizeof(fp32_t));
+        fp32_t *b = (fp32_t *)malloc((size_t)k * n * sizeof(fp32_t));
+        fp32_t *c = (fp32_t *)malloc((size_t)m * n * sizeof(fp32_t));
+        for (int i = 0; i < m * k; ++i) {
+            a[i] = (i % 17) * 0.25f - 2.0f; // The value you like
+        }
+        for (int i = 0; i < k * n; ++i) {
+            b[i] = (i % 13) * 0.5f - 3.0f; // The value you like
+        }
+        packed_b16_t *pb = pack_b16(b, n, k);
+
+        char shape[64];
+        snprintf(shape, sizeof(shape), "%dx%dx%d", m, n, k);
+        const double ops = 2.0 * m * n * k;
+        const double bytes = ((double)m * k + (double)k * n + (double)m * n) * sizeof(fp32_t);
+
+        gemm_bench_args_t args = {NULL, c, a, b, pb, m, n, k};
+        bench_report("bf16_mul", "gemm_naive", shape, ops, bytes, bench_measure(bench_gemm_naive, &args));
+        for (int i = 0; i < num_gemm_kernels; ++i) {
+            args.fn = gemm_kernels[i].fn;
+            bench_report("bf16_mul", gemm_kernels[i].name, shape, ops, bytes, bench_measure(bench_gemm_packed, &args));
+        }
+
+        free_packed_b16(pb);
+        free(a);
+        free(b);
+        free(c);
+    }
+
+    bench_end();
+}
+
+// -----------------------------------------------
+
+int main(int argc, char **argv) {
+    detect_cpu_features();
+    init_dispatch();
+
+    if (bench_parse_args(argc, argv)) {
+        run_benchmarks();
+        if (cpu_features.amx_tile)
+            amx_release();
+        return 0;
+    }
+
+    print_cpu_features();
 
     fp32_t a[16][32];
     fp32_t b[32][16];
@@ -205,19 +1201,50 @@ int main() {
     init_mat_b(b);
 
     fp32_t c_naive[16][16];
-    fp32_t c_amx[16][16];
+    fp32_t c_mul[16][16];
 
     mul_naive(c_naive, a, b);
+    mul(c_mul, a, b);
+
+    // A and B are exact in BF16, so only the order of the FP32 additions differs from mul_naive
+    printf("----------------------------------------------- Verification against mul_naive\n");
+    char name[64];
+    snprintf(name, sizeof(name), "mul (%s)", gemm_kernels[0].name);
+    verify_f32(name, &c_mul[0][0], &c_naive[0][0], verify_dims2(16, 16), 4, 1e-6f);
+
+    if (cpu_features.amx_bf16) {
+        fp32_t c_amx[16][16];
+        init_tile_config();
+        mul_amx(c_amx, a, b);
+
+        fp32_t c_amx_packed[16][16];
+        packed_b16_t *pb = pack_b16(&b[0][0], 16, 32);
+        mul_amx_packed(c_amx_packed, a, pb);
+        free_packed_b16(pb);
+
+        verify_f32("mul_amx", &c_amx[0][0], &c_naive[0][0], verify_dims2(16, 16), 4, 1e-6f);
+        verify_f32("mul_amx_packed", &c_amx_packed[0][0], &c_naive[0][0], verify_dims2(16, 16), 4, 1e-6f);
+    }
+
+    printf("----------------------------------------------- BF16 conversion\n");
+    run_convert_check();
+
+    printf("----------------------------------------------- GEMM\n");
+    run_gemm(512, 512, 512);
+    run_gemm(1000, 777, 333); // ragged edges
+    run_gemm(47, 13, 70);     // edges of under one tile
+    run_gemm(5, 40, 3);
 
-    init_tile_config();
-    mul_amx(c_amx, a, b);
+    printf("----------------------------------------------- Batched mul\n");
+    run_mul_batch(1);
+    run_mul_batch(4096);
 
-    printf("----------------------------------------------- Naive result\n");
-    print_float16x16(c_naive);
-    printf("----------------------------------------------- AMX result\n");
-    print_float16x16(c_amx);
+    printf("----------------------------------------------- Multi-threaded GEMM\n");
+    run_gemm_scaling(1024, 1024, 1024);
+    run_gemm_scaling(1000, 777, 333);
 
-    _tile_release(); // Release the AMX state
+    if (cpu_features.amx_tile)
+        amx_release(); // Release the AMX state
 
     return 0;
 }
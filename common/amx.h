@@ -0,0 +1,115 @@
+#pragma once
+
+#include <immintrin.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// -----------------------------------------------
+// Tile config of palette 1 (ldtilecfg)
+// See: https://www.intel.com/content/www/us/en/docs/intrinsics-guide/index.html#!=undefined&techs=AMX
+
+typedef struct tile_config_t {
+    uint8_t palette_id;         // 0
+    uint8_t start_row;          // 1
+    uint8_t reserved_2_15[14];  // 2-15: must be zero
+    uint16_t colsb[8];          // 16-31
+    uint8_t reserved_32_47[16]; // 32-47: must be zero
+    uint8_t rows[8];            // 48-55
+    uint8_t reserved_56_63[16]; // 56-63: must be zero
+} tile_config_t;
+
+// AMX has 8 tiles
+#define TILE_0 0
+#define TILE_1 1
+#define TILE_2 2
+#define TILE_3 3
+#define TILE_4 4
+#define TILE_5 5
+#define TILE_6 6
+#define TILE_7 7
+
+// -----------------------------------------------
+// Signedness of the int8 operands of a tile dot product (A: activations, B: weights).
+// Image pixels and activations after ReLU are uint8, so they don't have to be shifted into int8.
+
+typedef enum int8_signs_t {
+    INT8_SS, // int8 A,  int8 B  (tdpbssd)
+    INT8_SU, // int8 A,  uint8 B (tdpbsud)
+    INT8_US, // uint8 A, int8 B  (tdpbusd)
+    INT8_UU, // uint8 A, uint8 B (tdpbuud)
+} int8_signs_t;
+
+static inline int8_signs_t int8_signs(bool a_unsigned, bool b_unsigned) {
+    return (int8_signs_t)((a_unsigned ? INT8_US : INT8_SS) | (b_unsigned ? INT8_SU : INT8_SS));
+}
+
+static inline bool int8_signs_a_unsigned(int8_signs_t signs) { return signs == INT8_US || signs == INT8_UU; }
+static inline bool int8_signs_b_unsigned(int8_signs_t signs) { return signs == INT8_SU || signs == INT8_UU; }
+
+// -----------------------------------------------
+// GCC 12 declares the operands of the AMX intrinsics too narrowly:
+// ldtilecfg is told to read only 8 bytes, and tileloadd / tilestored don't mention memory at all.
+// The optimizer then drops the stores that fill a tile config or a transformed B before the load,
+// and assumes nothing was written by a tile store. Redefine them with the full memory operands.
+
+#if defined(AMX_EMULATE)
+
+// Software AMX instead of the instructions
+#include "amx_emu.h"
+
+#elif defined(__GNUC__) && !defined(__clang__) && !defined(__INTEL_COMPILER) && !defined(__INTEL_LLVM_COMPILER)
+
+static inline void amx_loadconfig(const void *config) {
+    __asm__ volatile("ldtilecfg\t%0" ::"m"(*(const char(*)[64])config));
+}
+
+#undef _tile_loadconfig
+#define _tile_loadconfig(config) amx_loadconfig(config)
+
+// The tile number is stringified, so expand TILE_N through one more macro level
+#undef _tile_loadd
+#define _tile_loadd(dst, base, stride) amx_loadd_internal(dst, base, stride)
+#define amx_loadd_internal(dst, base, stride)                                                                          \
+    __asm__ volatile("tileloadd\t(%0,%1,1), %%tmm" #dst ::"r"((const void *)(base)), "r"((long)(stride)) : "memory")
+
+#undef _tile_stream_loadd
+#define _tile_stream_loadd(dst, base, stride) amx_stream_loadd_internal(dst, base, stride)
+#define amx_stream_loadd_internal(dst, base, stride)                                                                   \
+    __asm__ volatile("tileloaddt1\t(%0,%1,1), %%tmm" #dst ::"r"((const void *)(base)), "r"((long)(stride)) : "memory")
+
+#undef _tile_stored
+#define _tile_stored(src, base, stride) amx_stored_internal(src, base, stride)
+#define amx_stored_internal(src, base, stride)                                                                         \
+    __asm__ volatile("tilestored\t%%tmm" #src ", (%0,%1,1)" ::"r"((void *)(base)), "r"((long)(stride)) : "memory")
+
+#undef _tile_release
+#define _tile_release() __asm__ volatile("tilerelease" ::)
+
+#endif
+
+// The int8 tile dot product for the signedness of A and B (the tile numbers are constants).
+// signs is usually the same for a whole call, so the branch is predicted.
+#define amx_tile_dpb(signs, dst, src1, src2)                                                                           \
+    do {                                                                                                               \
+        switch (signs) {                                                                                               \
+        case INT8_SS:                                                                                                  \
+            _tile_dpbssd(dst, src1, src2);                                                                             \
+            break;                                                                                                     \
+        case INT8_SU:                                                                                                  \
+            _tile_dpbsud(dst, src1, src2);                                                                             \
+            break;                                                                                                     \
+        case INT8_US:                                                                                                  \
+            _tile_dpbusd(dst, src1, src2);                                                                             \
+            break;                                                                                                     \
+        default:                                                                                                       \
+            _tile_dpbuud(dst, src1, src2);                                                                             \
+            break;                                                                                                     \
+        }                                                                                                              \
+    } while (0)
+
+// _tile_release for callers that are not compiled for AMX (e.g. main)
+#if defined(AMX_EMULATE)
+static inline void amx_release() { _tile_release(); }
+#else
+__attribute__((target("amx-tile"))) static inline void amx_release() { _tile_release(); }
+#endif
@@ -0,0 +1,420 @@
+#pragma once
+
+#include <immintrin.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu_features.h"
+
+// -----------------------------------------------
+// Software AMX (palette 1)
+// 8 tiles of 16 rows x 64 bytes with the semantics of ldtilecfg, tileloadd, tilestored, tilezero,
+// tdpbssd / tdpbsud / tdpbusd / tdpbuud and tdpbf16ps, bit-exact with the hardware. Build with -DAMX_EMULATE and the
+// _tile_* intrinsics are replaced by these functions (see common/amx.h), so the AMX kernels run on
+// any x86-64 CPU. The dot products use AVX2 when the CPU has it.
+//
+// Like the hardware:
+// - a load fills rows x colsb of the tile from memory and zeroes the rest (stride 0 repeats one row)
+// - a store writes rows x colsb
+// - a dot product zeroes the columns of C past colsb
+// - a tile config that doesn't fit palette 1 or a dot product whose shapes don't match faults (abort)
+//
+// The emulator also counts the tile instructions, see amx_emu_counters.
+
+typedef struct amx_emu_counters_t {
+    uint64_t loads;        // tileloadd, tileloaddt1
+    uint64_t stores;       // tilestored
+    uint64_t zeros;        // tilezero
+    uint64_t tmuls;        // tdpb[su][su]d, tdpbf16ps
+    uint64_t bytes_loaded; // rows x colsb of every load
+    uint64_t bytes_stored; // rows x colsb of every store
+    uint64_t macs;         // multiply-adds done by the dot products (int8 or bf16 pairs)
+} amx_emu_counters_t;
+
+// Tile state is per thread like on the hardware; the counters are shared by all threads
+static __thread struct {
+    uint8_t data[8][16][64] __attribute__((aligned(64)));
+    uint16_t colsb[8];
+    uint8_t rows[8];
+    uint8_t palette;
+} amx_emu_state;
+
+static amx_emu_counters_t amx_emu_counters;
+
+#define amx_emu_count(counter, value) __atomic_fetch_add(&amx_emu_counters.counter, (value), __ATOMIC_RELAXED)
+
+static inline void amx_emu_reset_counters() { memset(&amx_emu_counters, 0, sizeof(amx_emu_counters)); }
+
+static inline void amx_emu_print_counters(const char *name) {
+    const amx_emu_counters_t *n = &amx_emu_counters;
+    printf("    %-24s loads %8llu (%10llu B), stores %7llu (%9llu B), zeros %6llu, TMUL %8llu (%11llu MAC)\n", name,
+           (unsigned long long)n->loads, (unsigned long long)n->bytes_loaded, (unsigned long long)n->stores,
+           (unsigned long long)n->bytes_stored, (unsigned long long)n->zeros, (unsigned long long)n->tmuls,
+           (unsigned long long)n->macs);
+}
+
+static void amx_emu_fault(const char *instruction, const char *reason) {
+    fprintf(stderr, "AMX emulator: %s faults, %s\n", instruction, reason);
+    abort();
+}
+
+// -----------------------------------------------
+
+static inline void amx_emu_release() {
+    memset(&amx_emu_state, 0, sizeof(amx_emu_state));
+}
+
+static inline void amx_emu_loadconfig(const void *config) {
+    const uint8_t *cfg = (const uint8_t *)config;
+
+    // Palette 0 is the init state (same as tilerelease)
+    if (cfg[0] == 0) {
+        amx_emu_release();
+        return;
+    }
+    if (cfg[0] != 1)
+        amx_emu_fault("ldtilecfg", "unsupported palette");
+    for (int i = 2; i < 16; ++i) {
+        if (cfg[i] != 0)
+            amx_emu_fault("ldtilecfg", "reserved bytes are not zero");
+    }
+
+    for (int i = 0; i < 16; ++i) {
+        uint16_t colsb;
+        memcpy(&colsb, &cfg[16 + 2 * i], 2);
+        const uint8_t rows = cfg[48 + i];
+
+        // Only tiles 0-7 exist, the rest of the config must be zero
+        if (i >= 8) {
+            if (colsb != 0 || rows != 0)
+                amx_emu_fault("ldtilecfg", "tile 8-15 configured");
+            continue;
+        }
+        if (colsb > 64 || rows > 16 || (colsb == 0) != (rows == 0))
+            amx_emu_fault("ldtilecfg", "tile shape out of palette 1");
+
+        // The hardware takes the config, but then every tile instruction raises #UD
+        if (colsb % 4 != 0)
+            amx_emu_fault("ldtilecfg", "colsb is not a multiple of 4");
+
+        amx_emu_state.colsb[i] = colsb;
+        amx_emu_state.rows[i] = rows;
+    }
+
+    amx_emu_state.palette = 1;
+    memset(amx_emu_state.data, 0, sizeof(amx_emu_state.data));
+}
+
+static inline void amx_emu_check_tile(const char *instruction, int tile) {
+    if (amx_emu_state.palette == 0)
+        amx_emu_fault(instruction, "no tile config");
+    if (tile < 0 || tile >= 8 || amx_emu_state.rows[tile] == 0)
+        amx_emu_fault(instruction, "tile not configured");
+}
+
+static inline void amx_emu_loadd(int tile, const void *base, long stride) {
+    amx_emu_check_tile("tileloadd", tile);
+    const int rows = amx_emu_state.rows[tile];
+    const int colsb = amx_emu_state.colsb[tile];
+
+    memset(amx_emu_state.data[tile], 0, sizeof(amx_emu_state.data[tile]));
+    for (int r = 0; r < rows; ++r) {
+        memcpy(amx_emu_state.data[tile][r], (const int8_t *)base + r * stride, colsb);
+    }
+
+    amx_emu_count(loads, 1);
+    amx_emu_count(bytes_loaded, rows * colsb);
+}
+
+static inline void amx_emu_stored(int tile, void *base, long stride) {
+    amx_emu_check_tile("tilestored", tile);
+    const int rows = amx_emu_state.rows[tile];
+    const int colsb = amx_emu_state.colsb[tile];
+
+    for (int r = 0; r < rows; ++r) {
+        memcpy((int8_t *)base + r * stride, amx_emu_state.data[tile][r], colsb);
+    }
+
+    amx_emu_count(stores, 1);
+    amx_emu_count(bytes_stored, rows * colsb);
+}
+
+static inline void amx_emu_zero(int tile) {
+    amx_emu_check_tile("tilezero", tile);
+    memset(amx_emu_state.data[tile], 0, sizeof(amx_emu_state.data[tile]));
+    amx_emu_count(zeros, 1);
+}
+
+// Check the shapes of C[M][N] += A[M][K] * B[K][N] (K in dwords) and count it
+static inline void amx_emu_check_dp(const char *instruction, int dst, int src1, int src2, int elems_per_dword) {
+    amx_emu_check_tile(instruction, dst);
+    amx_emu_check_tile(instruction, src1);
+    amx_emu_check_tile(instruction, src2);
+    if (dst == src1 || dst == src2 || src1 == src2)
+        amx_emu_fault(instruction, "same tile used twice");
+
+    const int m = amx_emu_state.rows[dst];
+    const int n = amx_emu_state.colsb[dst] / 4;
+    const int k = amx_emu_state.colsb[src1] / 4;
+    if (amx_emu_state.rows[src1] != m || amx_emu_state.rows[src2] != k ||
+        amx_emu_state.colsb[src2] != amx_emu_state.colsb[dst])
+        amx_emu_fault(instruction, "tile shapes don't match");
+
+    amx_emu_count(tmuls, 1);
+    amx_emu_count(macs, (uint64_t)m * n * k * elems_per_dword);
+}
+
+// -----------------------------------------------
+// tdpbssd: C[m][n] += sum of A[m][4k + i] * B[k][4n + i] (i = 0..3), int32 wraps around
+// tdpbsud / tdpbusd / tdpbuud: the same with unsigned bytes in B / A / both
+
+static inline int32_t amx_emu_byte(const int8_t *p, bool is_unsigned) {
+    return is_unsigned ? (int32_t)(uint8_t)*p : (int32_t)*p;
+}
+
+static inline void amx_emu_dpb_int8_scalar(int32_t c[16][16], const int8_t a[16][64], const int8_t b[16][64], int m,
+                                           int n, int k, bool a_unsigned, bool b_unsigned) {
+    for (int r = 0; r < m; ++r) {
+        for (int col = 0; col < n; ++col) {
+            uint32_t sum = c[r][col];
+            for (int q = 0; q < k; ++q) {
+                for (int i = 0; i < 4; ++i) {
+                    sum += (uint32_t)(amx_emu_byte(&a[r][q * 4 + i], a_unsigned) *
+                                      amx_emu_byte(&b[q][col * 4 + i], b_unsigned));
+                }
+            }
+            c[r][col] = (int32_t)sum;
+        }
+    }
+}
+
+// Bytes to int16, zero- or sign-extended
+TARGET_AVX2 static inline __m256i amx_emu_widen_avx2(__m128i x, bool is_unsigned) {
+    return is_unsigned ? _mm256_cvtepu8_epi16(x) : _mm256_cvtepi8_epi16(x);
+}
+
+// Same as gemm_avx2_packed of int8_mul: a B row (16 columns x 4 K) is 4 vectors of int16,
+// _mm256_madd_epi16 leaves 2 partial sums per column, which hadd adds at the end
+// (a pair of uint8 products is at most 2 * 255 * 255, so madd doesn't overflow).
+// Columns past n are 0 in B, so all 16 columns are computed.
+TARGET_AVX2 static inline void amx_emu_dpb_int8_avx2(int32_t c[16][16], const int8_t a[16][64],
+                                                     const int8_t b[16][64], int m, int k, bool a_unsigned,
+                                                     bool b_unsigned) {
+    __m256i vb[16][4];
+    for (int q = 0; q < k; ++q) {
+        for (int x = 0; x < 4; ++x) {
+            vb[q][x] = amx_emu_widen_avx2(_mm_loadu_si128((const __m128i *)&b[q][x * 16]), b_unsigned);
+        }
+    }
+
+    for (int r = 0; r < m; ++r) {
+        __m256i acc[4] = {_mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(),
+                          _mm256_setzero_si256()};
+        for (int q = 0; q < k; ++q) {
+            int32_t quad;
+            memcpy(&quad, &a[r][q * 4], 4);
+            const __m128i a4 = a_unsigned ? _mm_cvtepu8_epi16(_mm_cvtsi32_si128(quad))
+                                          : _mm_cvtepi8_epi16(_mm_cvtsi32_si128(quad));
+            const __m256i va = _mm256_broadcastq_epi64(a4);
+            for (int x = 0; x < 4; ++x) {
+                acc[x] = _mm256_add_epi32(acc[x], _mm256_madd_epi16(va, vb[q][x]));
+            }
+        }
+
+        __m256i *cr = (__m256i *)c[r];
+        const __m256i s0 = _mm256_permute4x64_epi64(_mm256_hadd_epi32(acc[0], acc[1]), 0xd8);
+        const __m256i s1 = _mm256_permute4x64_epi64(_mm256_hadd_epi32(acc[2], acc[3]), 0xd8);
+        _mm256_store_si256(&cr[0], _mm256_add_epi32(_mm256_load_si256(&cr[0]), s0));
+        _mm256_store_si256(&cr[1], _mm256_add_epi32(_mm256_load_si256(&cr[1]), s1));
+    }
+}
+
+static inline void amx_emu_dpb_int8(const char *instruction, int dst, int src1, int src2, bool a_unsigned,
+                                    bool b_unsigned) {
+    amx_emu_check_dp(instruction, dst, src1, src2, 4);
+    const int m = amx_emu_state.rows[dst];
+    const int n = amx_emu_state.colsb[dst] / 4;
+    const int k = amx_emu_state.colsb[src1] / 4;
+
+    int32_t(*c)[16] = (int32_t(*)[16])amx_emu_state.data[dst];
+    const int8_t(*a)[64] = (const int8_t(*)[64])amx_emu_state.data[src1];
+    const int8_t(*b)[64] = (const int8_t(*)[64])amx_emu_state.data[src2];
+
+    if (cpu_features.avx2) {
+        amx_emu_dpb_int8_avx2(c, a, b, m, k, a_unsigned, b_unsigned);
+    } else {
+        amx_emu_dpb_int8_scalar(c, a, b, m, n, k, a_unsigned, b_unsigned);
+    }
+
+    // The columns past N are written as 0
+    for (int r = 0; r < m; ++r) {
+        memset(&c[r][n], 0, (16 - n) * sizeof(int32_t));
+    }
+}
+
+static inline void amx_emu_dpbssd(int dst, int src1, int src2) {
+    amx_emu_dpb_int8("tdpbssd", dst, src1, src2, false, false);
+}
+
+static inline void amx_emu_dpbsud(int dst, int src1, int src2) {
+    amx_emu_dpb_int8("tdpbsud", dst, src1, src2, false, true);
+}
+
+static inline void amx_emu_dpbusd(int dst, int src1, int src2) {
+    amx_emu_dpb_int8("tdpbusd", dst, src1, src2, true, false);
+}
+
+static inline void amx_emu_dpbuud(int dst, int src1, int src2) {
+    amx_emu_dpb_int8("tdpbuud", dst, src1, src2, true, true);
+}
+
+// -----------------------------------------------
+// tdpbf16ps: C[m][n] += sum of A[m][2k + i] * B[k][2n + i] (i = 0, 1)
+// The order of the additions matters. On the hardware the even products (i = 0) and the odd products
+// (i = 1) are summed separately over K, starting from +0, and then C[m][n] += (even + odd).
+// The products are exact, and every sum is rounded to fp32 (nearest even) with denormal results
+// flushed to a zero of the same sign. Denormal inputs count as zero. MXCSR is ignored.
+//
+// The emulator runs the same steps in double: a bf16 product is exact in double,
+// and rounding a double sum of 2 values to fp32 gives the correctly rounded fp32 sum.
+// NaN results are NaN, but their payloads may differ from the hardware.
+
+static inline float amx_emu_ftz(float x) {
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    if ((bits & 0x7f800000) == 0)
+        bits &= 0x80000000;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+static inline float amx_emu_bf16_to_fp32(uint16_t x) {
+    const uint32_t bits = (uint32_t)x << 16;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return amx_emu_ftz(f);
+}
+
+// fp32 sum of a (an fp32 value) and b (exact)
+static inline double amx_emu_add(double a, double b) { return amx_emu_ftz((float)(a + b)); }
+
+static inline void amx_emu_dpbf16ps_scalar(float c[16][16], const uint16_t a[16][32], const uint16_t b[16][32], int m,
+                                           int n, int k) {
+    for (int r = 0; r < m; ++r) {
+        for (int col = 0; col < n; ++col) {
+            double sum[2] = {0.0, 0.0};
+            for (int i = 0; i < 2; ++i) {
+                for (int q = 0; q < k; ++q) {
+                    const double p =
+                        (double)amx_emu_bf16_to_fp32(a[r][q * 2 + i]) * amx_emu_bf16_to_fp32(b[q][col * 2 + i]);
+                    sum[i] = amx_emu_add(sum[i], p);
+                }
+            }
+            c[r][col] = amx_emu_add(amx_emu_ftz(c[r][col]), amx_emu_add(sum[0], sum[1]));
+        }
+    }
+}
+
+// x, or a zero of the same sign when x is denormal
+TARGET_AVX2 static inline __m128 amx_emu_ftz_avx2(__m128 x) {
+    const __m128i exp_mask = _mm_set1_epi32(0x7f800000);
+    const __m128i abs_mask = _mm_set1_epi32(0x7fffffff);
+    const __m128i denormal = _mm_cmpeq_epi32(_mm_and_si128(_mm_castps_si128(x), exp_mask), _mm_setzero_si128());
+    return _mm_castsi128_ps(_mm_andnot_si128(_mm_and_si128(denormal, abs_mask), _mm_castps_si128(x)));
+}
+
+TARGET_AVX2 static inline __m256d amx_emu_add_avx2(__m256d a, __m256d b) {
+    return _mm256_cvtps_pd(amx_emu_ftz_avx2(_mm256_cvtpd_ps(_mm256_add_pd(a, b))));
+}
+
+// 4 columns per vector of doubles. A B row (16 columns x 2 K) is 4 vectors of dwords:
+// the even K is the low half (<< 16), the odd K is the high half (& 0xffff0000).
+TARGET_AVX2 static inline void amx_emu_dpbf16ps_avx2(float c[16][16], const uint16_t a[16][32],
+                                                     const uint16_t b[16][32], int m, int k) {
+    const __m128i hi_mask = _mm_set1_epi32((int)0xffff0000);
+
+    __m256d vb[16][2][4]; // [k][even / odd][column / 4]
+    for (int q = 0; q < k; ++q) {
+        for (int x = 0; x < 4; ++x) {
+            const __m128i v = _mm_loadu_si128((const __m128i *)&b[q][x * 8]);
+            vb[q][0][x] = _mm256_cvtps_pd(amx_emu_ftz_avx2(_mm_castsi128_ps(_mm_slli_epi32(v, 16))));
+            vb[q][1][x] = _mm256_cvtps_pd(amx_emu_ftz_avx2(_mm_castsi128_ps(_mm_and_si128(v, hi_mask))));
+        }
+    }
+
+    for (int r = 0; r < m; ++r) {
+        __m256d sum[2][4]; // [even / odd][column / 4]
+        for (int i = 0; i < 2; ++i) {
+            for (int x = 0; x < 4; ++x) {
+                sum[i][x] = _mm256_setzero_pd();
+            }
+            for (int q = 0; q < k; ++q) {
+                const __m256d va = _mm256_set1_pd(amx_emu_bf16_to_fp32(a[r][q * 2 + i]));
+                for (int x = 0; x < 4; ++x) {
+                    sum[i][x] = amx_emu_add_avx2(sum[i][x], _mm256_mul_pd(va, vb[q][i][x]));
+                }
+            }
+        }
+        for (int x = 0; x < 4; ++x) {
+            const __m256d acc = _mm256_cvtps_pd(amx_emu_ftz_avx2(_mm_load_ps(&c[r][x * 4])));
+            const __m256d dot = amx_emu_add_avx2(sum[0][x], sum[1][x]);
+            _mm_store_ps(&c[r][x * 4], _mm256_cvtpd_ps(amx_emu_add_avx2(acc, dot)));
+        }
+    }
+}
+
+static inline void amx_emu_dpbf16ps(int dst, int src1, int src2) {
+    amx_emu_check_dp("tdpbf16ps", dst, src1, src2, 2);
+    const int m = amx_emu_state.rows[dst];
+    const int n = amx_emu_state.colsb[dst] / 4;
+    const int k = amx_emu_state.colsb[src1] / 4;
+
+    float(*c)[16] = (float(*)[16])amx_emu_state.data[dst];
+    const uint16_t(*a)[32] = (const uint16_t(*)[32])amx_emu_state.data[src1];
+    const uint16_t(*b)[32] = (const uint16_t(*)[32])amx_emu_state.data[src2];
+
+    if (cpu_features.avx2) {
+        amx_emu_dpbf16ps_avx2(c, a, b, m, k);
+    } else {
+        amx_emu_dpbf16ps_scalar(c, a, b, m, n, k);
+    }
+
+    // The columns past N are written as 0
+    for (int r = 0; r < m; ++r) {
+        memset(&c[r][n], 0, (16 - n) * sizeof(float));
+    }
+}
+
+// -----------------------------------------------
+// Replace the intrinsics (the tile numbers are constants, as for the hardware instructions)
+
+#if defined(AMX_EMULATE)
+
+#undef _tile_loadconfig
+#undef _tile_loadd
+#undef _tile_stream_loadd
+#undef _tile_stored
+#undef _tile_zero
+#undef _tile_dpbssd
+#undef _tile_dpbsud
+#undef _tile_dpbusd
+#undef _tile_dpbuud
+#undef _tile_dpbf16ps
+#undef _tile_release
+
+#define _tile_loadconfig(config) amx_emu_loadconfig(config)
+#define _tile_loadd(dst, base, stride) amx_emu_loadd(dst, base, stride)
+#define _tile_stream_loadd(dst, base, stride) amx_emu_loadd(dst, base, stride)
+#define _tile_stored(src, base, stride) amx_emu_stored(src, base, stride)
+#define _tile_zero(tile) amx_emu_zero(tile)
+#define _tile_dpbssd(dst, src1, src2) amx_emu_dpbssd(dst, src1, src2)
+#define _tile_dpbsud(dst, src1, src2) amx_emu_dpbsud(dst, src1, src2)
+#define _tile_dpbusd(dst, src1, src2) amx_emu_dpbusd(dst, src1, src2)
+#define _tile_dpbuud(dst, src1, src2) amx_emu_dpbuud(dst, src1, src2)
+#define _tile_dpbf16ps(dst, src1, src2) amx_emu_dpbf16ps(dst, src1, src2)
+#define _tile_release() amx_emu_release()
+
+#endif
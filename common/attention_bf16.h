@@ -0,0 +1,505 @@
+#pragma once
+
+#include <immintrin.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "amx.h"
+#include "bf16.h"
+#include "conv_bf16.h"
+#include "cpu_features.h"
+#include "vnni_pack.h"
+
+// -----------------------------------------------
+// Fused bf16 attention (one head)
+//
+//   out[seq_q][d] = softmax(q[seq_q][d] * k[seq_kv][d]^T / sqrt(d)) * v[seq_kv][d]
+//
+// q, k and v are bf16 (uint16_t), out is fp32. As in flash attention, the score matrix is never stored:
+// 16 queries at a time go over the keys 32 at a time, and keep a running max and sum per query
+// (the online softmax). For each block of keys:
+//
+//   1. S[16][32] = Q K^T with _tile_dpbf16ps (2 C tiles), stored to a buffer on the stack
+//   2. in AVX-512: scale, mask, new max m, P = exp(S - m), the sum of P, and the factor exp(m_old - m)
+//      of what was accumulated so far; P is rounded to bf16
+//   3. O[16][d] = O * exp(m_old - m) + P V, with P V from _tile_dpbf16ps
+//
+// and O is divided by the sum at the end. Memory is the packed K and V (O(seq_kv * d)) plus a few KB per
+// block, instead of the O(seq_q * seq_kv) scores of a GEMM, softmax, GEMM chain.
+//
+// With causal, query i sees keys 0 .. i + seq_kv - seq_q (the queries are the last seq_q positions, as when
+// decoding with a KV cache), and the key blocks past the last query of a block are skipped.
+// d must be a multiple of 32 up to ATTENTION_MAX_D. Without AMX, steps 1 and 3 are vdpbf16ps (AVX-512 BF16)
+// on the same packed K and V, with the same softmax; without that, a scalar kernel runs the same blocks.
+
+#define ATTENTION_BLOCK_Q 16
+#define ATTENTION_BLOCK_KV 32
+#define ATTENTION_MAX_D 256
+
+typedef struct attention_desc_t {
+    int seq_q, seq_kv;
+    int d; // head dimension
+    bool causal;
+} attention_desc_t;
+
+static inline bool attention_supported(const attention_desc_t *desc) {
+    return desc->seq_q >= 1 && desc->seq_kv >= 1 && desc->d >= 32 && desc->d % 32 == 0 &&
+           desc->d <= ATTENTION_MAX_D && (!desc->causal || desc->seq_kv >= desc->seq_q);
+}
+
+// Last key query i sees
+static inline int attention_last_key(const attention_desc_t *desc, int i) {
+    return desc->causal ? i + desc->seq_kv - desc->seq_q : desc->seq_kv - 1;
+}
+
+// Naive attention (the reference): the scores of a query in double, and softmax over all of them
+static void attention_ref(const attention_desc_t *desc, float *out, const uint16_t *q, const uint16_t *k,
+                          const uint16_t *v) {
+    const int d = desc->d;
+    const double scale = 1.0 / sqrt((double)d);
+    double *s = (double *)malloc(desc->seq_kv * sizeof(double));
+    double *o = (double *)malloc(d * sizeof(double));
+
+    for (int i = 0; i < desc->seq_q; ++i) {
+        const int last = attention_last_key(desc, i);
+        double max = -INFINITY;
+        for (int j = 0; j <= last; ++j) {
+            double dot = 0;
+            for (int x = 0; x < d; ++x) {
+                dot += (double)bf16_to_fp32(q[(size_t)i * d + x]) * bf16_to_fp32(k[(size_t)j * d + x]);
+            }
+            s[j] = dot * scale;
+            max = s[j] > max ? s[j] : max;
+        }
+
+        double sum = 0;
+        memset(o, 0, d * sizeof(double));
+        for (int j = 0; j <= last; ++j) {
+            const double p = exp(s[j] - max);
+            sum += p;
+            for (int x = 0; x < d; ++x) {
+                o[x] += p * bf16_to_fp32(v[(size_t)j * d + x]);
+            }
+        }
+        for (int x = 0; x < d; ++x) {
+            out[(size_t)i * d + x] = (float)(o[x] / sum);
+        }
+    }
+
+    free(s);
+    free(o);
+}
+
+// -----------------------------------------------
+// Packed K and V
+// K block jb (keys jb * 32 ..) is the B operand of Q K^T: for dims kb * 32 .. +32 and keys h * 16 .. +16,
+// a [16][32] tile whose row r holds dims 2r, 2r + 1 of each key (a 16x16 transpose of bf16 pairs).
+// V block jb is the B operand of P V: for dims c * 16 .. +16, keys 2r and 2r + 1 interleaved into row r
+// (b16_transformed of bf16_mul). Keys past seq_kv are zero.
+
+static inline size_t attention_k_panel(int d, int jb, int kb, int h) {
+    return (((size_t)jb * (d / 32) + kb) * 2 + h) * (16 * 32);
+}
+
+static inline size_t attention_v_panel(int d, int jb, int c) { return ((size_t)jb * (d / 16) + c) * (16 * 32); }
+
+static inline size_t attention_packed_size(const attention_desc_t *desc) {
+    const int kv_blocks = (desc->seq_kv + ATTENTION_BLOCK_KV - 1) / ATTENTION_BLOCK_KV;
+    return (size_t)kv_blocks * ATTENTION_BLOCK_KV * desc->d;
+}
+
+static void attention_pack_k(const attention_desc_t *desc, uint16_t *kp, const uint16_t *k) {
+    const int d = desc->d;
+    const size_t size = attention_packed_size(desc);
+    memset(kp, 0, size * sizeof(uint16_t));
+
+    for (int j = 0; j < desc->seq_kv; ++j) {
+        const uint32_t *key = (const uint32_t *)&k[(size_t)j * d]; // bf16 pairs
+        for (int kb = 0; kb < d / 32; ++kb) {
+            uint32_t *panel = (uint32_t *)&kp[attention_k_panel(d, j / 32, kb, (j % 32) / 16)];
+            for (int r = 0; r < 16; ++r) {
+                panel[r * 16 + j % 16] = key[kb * 16 + r];
+            }
+        }
+    }
+}
+
+static void attention_pack_v(const attention_desc_t *desc, uint16_t *vp, const uint16_t *v) {
+    const int d = desc->d;
+    const size_t size = attention_packed_size(desc);
+    uint16_t *zeros = (uint16_t *)calloc(d, sizeof(uint16_t));
+    const size_t chunk_stride = 16 * 32 * sizeof(uint16_t);
+
+    for (size_t j = 0; j < size / d; j += 2) {
+        const uint16_t *r0 = (j < (size_t)desc->seq_kv) ? &v[j * d] : zeros;
+        const uint16_t *r1 = (j + 1 < (size_t)desc->seq_kv) ? &v[(j + 1) * d] : zeros;
+        vnni_interleave2_bf16(&vp[attention_v_panel(d, j / 32, 0) + (j % 32) / 2 * 32], chunk_stride, r0, r1, d);
+    }
+    free(zeros);
+}
+
+// -----------------------------------------------
+// Online softmax (AVX-512)
+
+// Running state of 16 queries
+typedef struct attention_state_t {
+    float max[ATTENTION_BLOCK_Q];
+    float sum[ATTENTION_BLOCK_Q];
+    float alpha[ATTENTION_BLOCK_Q]; // exp(m_old - m) of the current block
+    float o[ATTENTION_BLOCK_Q][ATTENTION_MAX_D];
+} attention_state_t;
+
+static void attention_state_init(attention_state_t *st, int d) {
+    for (int r = 0; r < ATTENTION_BLOCK_Q; ++r) {
+        st->max[r] = -INFINITY;
+        st->sum[r] = 0;
+        memset(st->o[r], 0, d * sizeof(float));
+    }
+}
+
+// out = O / sum for the first rows queries of the block
+static void attention_state_store(const attention_state_t *st, float *out, int d, int rows) {
+    for (int r = 0; r < rows; ++r) {
+        const float inv_sum = 1.0f / st->sum[r];
+        for (int x = 0; x < d; ++x) {
+            out[(size_t)r * d + x] = st->o[r][x] * inv_sum;
+        }
+    }
+}
+
+// exp(x) for x <= 0: 2^n * 2^f with n = round(x * log2(e)) and a degree 6 polynomial of f in [-0.5, 0.5]
+// (relative error about 2e-7). Below -100 (and -inf) the result is a denormal or 0.
+TARGET_AVX512 static inline __m512 attention_exp_avx512(__m512 x) {
+    x = _mm512_max_ps(x, _mm512_set1_ps(-100.0f));
+    const __m512 t = _mm512_mul_ps(x, _mm512_set1_ps(1.44269504f));
+    const __m512 n = _mm512_roundscale_ps(t, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    const __m512 f = _mm512_sub_ps(t, n);
+
+    __m512 p = _mm512_set1_ps(1.540353e-4f);
+    p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(1.333355e-3f));
+    p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(9.618129e-3f));
+    p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(5.550411e-2f));
+    p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(2.402265e-1f));
+    p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(6.931472e-1f));
+    p = _mm512_fmadd_ps(p, f, _mm512_set1_ps(1.0f));
+    return _mm512_scalef_ps(p, n);
+}
+
+TARGET_AVX512 static inline __m512 attention_from_bf16_avx512(__m256i x) {
+    return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(x), 16));
+}
+
+// Step 2 on the scores s of queries i .. i + 15 and keys j .. j + 31: P (bf16) for the P V tile, and the new
+// max, sum and alpha of each query. Keys a query doesn't see score -inf.
+TARGET_AVX512 static void attention_softmax_avx512(const attention_desc_t *desc, attention_state_t *st,
+                                                   uint16_t p[ATTENTION_BLOCK_Q][ATTENTION_BLOCK_KV],
+                                                   const float s[ATTENTION_BLOCK_Q][ATTENTION_BLOCK_KV], int i, int j) {
+    const __m512 scale = _mm512_set1_ps(1.0f / sqrtf((float)desc->d));
+    const __m512 neg_inf = _mm512_set1_ps(-INFINITY);
+    const __m512i keys0 = _mm512_add_epi32(_mm512_set1_epi32(j), _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10,
+                                                                                     11, 12, 13, 14, 15));
+    const __m512i keys1 = _mm512_add_epi32(keys0, _mm512_set1_epi32(16));
+
+    for (int r = 0; r < ATTENTION_BLOCK_Q; ++r) {
+        const __m512i last = _mm512_set1_epi32(attention_last_key(desc, i + r));
+        const __m512 s0 = _mm512_mask_mul_ps(neg_inf, _mm512_cmple_epi32_mask(keys0, last), _mm512_loadu_ps(&s[r][0]),
+                                             scale);
+        const __m512 s1 = _mm512_mask_mul_ps(neg_inf, _mm512_cmple_epi32_mask(keys1, last), _mm512_loadu_ps(&s[r][16]),
+                                             scale);
+
+        const float max = fmaxf(st->max[r], _mm512_reduce_max_ps(_mm512_max_ps(s0, s1)));
+        if (max == -INFINITY) {
+            // No key yet: a causal query whose first key is in a later block (not with seq_kv >= seq_q)
+            memset(p[r], 0, sizeof(p[r]));
+            st->alpha[r] = 1.0f;
+            continue;
+        }
+
+        const __m512 m = _mm512_set1_ps(max);
+        const __m256i p0 = bf16_from_fp32_avx512(attention_exp_avx512(_mm512_sub_ps(s0, m)));
+        const __m256i p1 = bf16_from_fp32_avx512(attention_exp_avx512(_mm512_sub_ps(s1, m)));
+        _mm256_storeu_si256((__m256i *)&p[r][0], p0);
+        _mm256_storeu_si256((__m256i *)&p[r][16], p1);
+
+        // The sum is of the rounded P, which is what P V multiplies
+        const __m512 sum = _mm512_add_ps(attention_from_bf16_avx512(p0), attention_from_bf16_avx512(p1));
+        st->alpha[r] = _mm512_cvtss_f32(attention_exp_avx512(_mm512_set1_ps(st->max[r] - max)));
+        st->sum[r] = st->sum[r] * st->alpha[r] + _mm512_reduce_add_ps(sum);
+        st->max[r] = max;
+    }
+}
+
+// Step 3: O = O * alpha + P V (pv[16][d], from the tiles)
+TARGET_AVX512 static void attention_accumulate_avx512(attention_state_t *st, const float *pv, int d) {
+    for (int r = 0; r < ATTENTION_BLOCK_Q; ++r) {
+        const __m512 alpha = _mm512_set1_ps(st->alpha[r]);
+        for (int x = 0; x < d; x += 16) {
+            const __m512 o = _mm512_fmadd_ps(_mm512_loadu_ps(&st->o[r][x]), alpha, _mm512_loadu_ps(&pv[r * d + x]));
+            _mm512_storeu_ps(&st->o[r][x], o);
+        }
+    }
+}
+
+// -----------------------------------------------
+// AMX
+
+// Every tile is 16 rows x 64 bytes: Q (16 queries x 32 dims), K^T and V panels (32 x 16 as [16][32]),
+// P (16 queries x 32 keys) and the fp32 C tiles (16 x 16)
+TARGET_AMX_BF16 static void attention_init_tile_config() {
+    tile_config_t tile = {0};
+    tile.palette_id = 1;
+    for (int t = TILE_0; t <= TILE_7; ++t) {
+        tile.colsb[t] = 64;
+        tile.rows[t] = 16;
+    }
+    _tile_loadconfig(&tile);
+}
+
+// S = Q K^T of the queries in q16 ([16][d]) and key block jb: TILE_0 and TILE_1 (keys 0 .. 15, 16 .. 31)
+// from Q in TILE_2 and K^T in TILE_3 / TILE_4
+TARGET_AMX_BF16 static inline void attention_amx_scores(float s[ATTENTION_BLOCK_Q][ATTENTION_BLOCK_KV],
+                                                        const uint16_t *q16, const uint16_t *kp, int d, int jb) {
+    _tile_zero(TILE_0);
+    _tile_zero(TILE_1);
+    for (int kb = 0; kb < d / 32; ++kb) {
+        _tile_loadd(TILE_2, &q16[kb * 32], d * sizeof(uint16_t));
+        _tile_loadd(TILE_3, &kp[attention_k_panel(d, jb, kb, 0)], 64);
+        _tile_loadd(TILE_4, &kp[attention_k_panel(d, jb, kb, 1)], 64);
+        _tile_dpbf16ps(TILE_0, TILE_2, TILE_3);
+        _tile_dpbf16ps(TILE_1, TILE_2, TILE_4);
+    }
+    _tile_stored(TILE_0, &s[0][0], ATTENTION_BLOCK_KV * sizeof(float));
+    _tile_stored(TILE_1, &s[0][16], ATTENTION_BLOCK_KV * sizeof(float));
+}
+
+// pv[16][d] = P V of key block jb: P in TILE_2, V in TILE_3 / TILE_4, 32 dims at a time in TILE_0 / TILE_1
+TARGET_AMX_BF16 static inline void attention_amx_pv(float *pv, const uint16_t p[ATTENTION_BLOCK_Q][ATTENTION_BLOCK_KV],
+                                                    const uint16_t *vp, int d, int jb) {
+    _tile_loadd(TILE_2, &p[0][0], ATTENTION_BLOCK_KV * sizeof(uint16_t));
+    for (int c = 0; c < d / 16; c += 2) {
+        _tile_zero(TILE_0);
+        _tile_zero(TILE_1);
+        _tile_loadd(TILE_3, &vp[attention_v_panel(d, jb, c)], 64);
+        _tile_loadd(TILE_4, &vp[attention_v_panel(d, jb, c + 1)], 64);
+        _tile_dpbf16ps(TILE_0, TILE_2, TILE_3);
+        _tile_dpbf16ps(TILE_1, TILE_2, TILE_4);
+        _tile_stored(TILE_0, &pv[c * 16], d * sizeof(float));
+        _tile_stored(TILE_1, &pv[c * 16 + 16], d * sizeof(float));
+    }
+}
+
+TARGET_AMX_BF16 static void attention_amx(const attention_desc_t *desc, float *out, const uint16_t *q,
+                                          const uint16_t *kp, const uint16_t *vp) {
+    const int d = desc->d;
+    uint16_t q16[ATTENTION_BLOCK_Q * ATTENTION_MAX_D] __attribute__((aligned(64)));
+    float s[ATTENTION_BLOCK_Q][ATTENTION_BLOCK_KV] __attribute__((aligned(64)));
+    uint16_t p[ATTENTION_BLOCK_Q][ATTENTION_BLOCK_KV] __attribute__((aligned(64)));
+    float pv[ATTENTION_BLOCK_Q * ATTENTION_MAX_D] __attribute__((aligned(64)));
+    attention_state_t st __attribute__((aligned(64)));
+
+    attention_init_tile_config();
+
+    for (int i = 0; i < desc->seq_q; i += ATTENTION_BLOCK_Q) {
+        const int rows = (desc->seq_q - i < ATTENTION_BLOCK_Q) ? desc->seq_q - i : ATTENTION_BLOCK_Q;
+        // The queries of a block are copied, so the last block is padded with zeros
+        memcpy(q16, &q[(size_t)i * d], (size_t)rows * d * sizeof(uint16_t));
+        memset(&q16[rows * d], 0, (size_t)(ATTENTION_BLOCK_Q - rows) * d * sizeof(uint16_t));
+        attention_state_init(&st, d);
+
+        const int last = attention_last_key(desc, i + rows - 1);
+        for (int j = 0; j <= last; j += ATTENTION_BLOCK_KV) {
+            attention_amx_scores(s, q16, kp, d, j / ATTENTION_BLOCK_KV);
+            attention_softmax_avx512(desc, &st, p, s, i, j);
+            attention_amx_pv(pv, p, vp, d, j / ATTENTION_BLOCK_KV);
+            attention_accumulate_avx512(&st, pv, d);
+        }
+
+        attention_state_store(&st, &out[(size_t)i * d], d, rows);
+    }
+}
+
+// -----------------------------------------------
+// Without AMX: AVX-512 BF16
+// The packed K and V rows are 16 (key or dim) columns of bf16 pairs, the operand of vdpbf16ps with the matching
+// pair of Q or P broadcast. Both steps go 4 queries x 32 columns at a time (8 accumulators).
+
+// Step 1: s[16][32] = Q K^T of the queries in q16 ([16][d]) and key block jb
+TARGET_AVX512_BF16 static void attention_avx512_scores(float s[ATTENTION_BLOCK_Q][ATTENTION_BLOCK_KV],
+                                                       const uint16_t *q16, const uint16_t *kp, int d, int jb) {
+    for (int i = 0; i < ATTENTION_BLOCK_Q; i += 4) {
+        __m512 acc[4][2];
+        for (int r = 0; r < 4; ++r) {
+            acc[r][0] = _mm512_setzero_ps();
+            acc[r][1] = _mm512_setzero_ps();
+        }
+        for (int kb = 0; kb < d / 32; ++kb) {
+            const uint16_t *k0 = &kp[attention_k_panel(d, jb, kb, 0)];
+            const uint16_t *k1 = &kp[attention_k_panel(d, jb, kb, 1)];
+            for (int x = 0; x < 16; ++x) {
+                const __m512bh vk0 = (__m512bh)_mm512_load_si512(&k0[x * 32]);
+                const __m512bh vk1 = (__m512bh)_mm512_load_si512(&k1[x * 32]);
+                for (int r = 0; r < 4; ++r) {
+                    uint32_t pair; // dims kb * 32 + 2x, + 1 of query i + r
+                    memcpy(&pair, &q16[(size_t)(i + r) * d + kb * 32 + 2 * x], sizeof(pair));
+                    const __m512bh vq = (__m512bh)_mm512_set1_epi32((int)pair);
+                    acc[r][0] = _mm512_dpbf16_ps(acc[r][0], vq, vk0);
+                    acc[r][1] = _mm512_dpbf16_ps(acc[r][1], vq, vk1);
+                }
+            }
+        }
+        for (int r = 0; r < 4; ++r) {
+            _mm512_store_ps(&s[i + r][0], acc[r][0]);
+            _mm512_store_ps(&s[i + r][16], acc[r][1]);
+        }
+    }
+}
+
+// Step 3: O = O * alpha + P V of key block jb, with O * alpha as the start of the accumulators
+TARGET_AVX512_BF16 static void attention_avx512_pv(attention_state_t *st,
+                                                   const uint16_t p[ATTENTION_BLOCK_Q][ATTENTION_BLOCK_KV],
+                                                   const uint16_t *vp, int d, int jb) {
+    for (int c = 0; c < d / 16; c += 2) {
+        const uint16_t *v0 = &vp[attention_v_panel(d, jb, c)];
+        const uint16_t *v1 = &vp[attention_v_panel(d, jb, c + 1)];
+        for (int i = 0; i < ATTENTION_BLOCK_Q; i += 4) {
+            __m512 acc[4][2];
+            for (int r = 0; r < 4; ++r) {
+                const __m512 alpha = _mm512_set1_ps(st->alpha[i + r]);
+                acc[r][0] = _mm512_mul_ps(_mm512_loadu_ps(&st->o[i + r][c * 16]), alpha);
+                acc[r][1] = _mm512_mul_ps(_mm512_loadu_ps(&st->o[i + r][c * 16 + 16]), alpha);
+            }
+            for (int x = 0; x < 16; ++x) {
+                const __m512bh vv0 = (__m512bh)_mm512_load_si512(&v0[x * 32]);
+                const __m512bh vv1 = (__m512bh)_mm512_load_si512(&v1[x * 32]);
+                for (int r = 0; r < 4; ++r) {
+                    uint32_t pair; // keys 2x, 2x + 1 of query i + r
+                    memcpy(&pair, &p[i + r][2 * x], sizeof(pair));
+                    const __m512bh vp2 = (__m512bh)_mm512_set1_epi32((int)pair);
+                    acc[r][0] = _mm512_dpbf16_ps(acc[r][0], vp2, vv0);
+                    acc[r][1] = _mm512_dpbf16_ps(acc[r][1], vp2, vv1);
+                }
+            }
+            for (int r = 0; r < 4; ++r) {
+                _mm512_storeu_ps(&st->o[i + r][c * 16], acc[r][0]);
+                _mm512_storeu_ps(&st->o[i + r][c * 16 + 16], acc[r][1]);
+            }
+        }
+    }
+}
+
+// attention_amx with the two products in vdpbf16ps
+TARGET_AVX512_BF16 static void attention_avx512(const attention_desc_t *desc, float *out, const uint16_t *q,
+                                                const uint16_t *kp, const uint16_t *vp) {
+    const int d = desc->d;
+    uint16_t q16[ATTENTION_BLOCK_Q * ATTENTION_MAX_D] __attribute__((aligned(64)));
+    float s[ATTENTION_BLOCK_Q][ATTENTION_BLOCK_KV] __attribute__((aligned(64)));
+    uint16_t p[ATTENTION_BLOCK_Q][ATTENTION_BLOCK_KV] __attribute__((aligned(64)));
+    attention_state_t st __attribute__((aligned(64)));
+
+    for (int i = 0; i < desc->seq_q; i += ATTENTION_BLOCK_Q) {
+        const int rows = (desc->seq_q - i < ATTENTION_BLOCK_Q) ? desc->seq_q - i : ATTENTION_BLOCK_Q;
+        memcpy(q16, &q[(size_t)i * d], (size_t)rows * d * sizeof(uint16_t));
+        memset(&q16[rows * d], 0, (size_t)(ATTENTION_BLOCK_Q - rows) * d * sizeof(uint16_t));
+        attention_state_init(&st, d);
+
+        const int last = attention_last_key(desc, i + rows - 1);
+        for (int j = 0; j <= last; j += ATTENTION_BLOCK_KV) {
+            attention_avx512_scores(s, q16, kp, d, j / ATTENTION_BLOCK_KV);
+            attention_softmax_avx512(desc, &st, p, s, i, j);
+            attention_avx512_pv(&st, p, vp, d, j / ATTENTION_BLOCK_KV);
+        }
+
+        attention_state_store(&st, &out[(size_t)i * d], d, rows);
+    }
+}
+
+// -----------------------------------------------
+// Without AVX-512 BF16
+// The same blocks in scalar code, on the packed K and V
+
+static void attention_scalar(const attention_desc_t *desc, float *out, const uint16_t *q, const uint16_t *kp,
+                             const uint16_t *vp) {
+    const int d = desc->d;
+    const float scale = 1.0f / sqrtf((float)d);
+    attention_state_t *st = (attention_state_t *)malloc(sizeof(attention_state_t));
+
+    for (int i = 0; i < desc->seq_q; i += ATTENTION_BLOCK_Q) {
+        const int rows = (desc->seq_q - i < ATTENTION_BLOCK_Q) ? desc->seq_q - i : ATTENTION_BLOCK_Q;
+        attention_state_init(st, d);
+
+        for (int r = 0; r < rows; ++r) {
+            const uint16_t *qr = &q[(size_t)(i + r) * d];
+            const int last = attention_last_key(desc, i + r);
+            for (int j = 0; j <= last; j += ATTENTION_BLOCK_KV) {
+                const int jb = j / ATTENTION_BLOCK_KV;
+                const int keys = (last - j + 1 < ATTENTION_BLOCK_KV) ? last - j + 1 : ATTENTION_BLOCK_KV;
+
+                float s[ATTENTION_BLOCK_KV];
+                float max = st->max[r];
+                for (int n = 0; n < keys; ++n) {
+                    float dot = 0;
+                    for (int x = 0; x < d; x += 2) {
+                        const uint16_t *k2 = &kp[attention_k_panel(d, jb, x / 32, n / 16) + (x % 32) / 2 * 32 +
+                                                 (n % 16) * 2];
+                        dot += bf16_to_fp32(qr[x]) * bf16_to_fp32(k2[0]) +
+                               bf16_to_fp32(qr[x + 1]) * bf16_to_fp32(k2[1]);
+                    }
+                    s[n] = dot * scale;
+                    max = fmaxf(max, s[n]);
+                }
+
+                const float alpha = expf(st->max[r] - max);
+                st->sum[r] *= alpha;
+                for (int x = 0; x < d; ++x) {
+                    st->o[r][x] *= alpha;
+                }
+                for (int n = 0; n < keys; ++n) {
+                    const float pn = bf16_to_fp32(bf16_from_fp32(expf(s[n] - max)));
+                    st->sum[r] += pn;
+                    for (int x = 0; x < d; ++x) {
+                        const uint16_t *v2 = &vp[attention_v_panel(d, jb, x / 16) + n / 2 * 32 + (x % 16) * 2 + n % 2];
+                        st->o[r][x] += pn * bf16_to_fp32(*v2);
+                    }
+                }
+                st->max[r] = max;
+            }
+        }
+
+        attention_state_store(st, &out[(size_t)i * d], d, rows);
+    }
+    free(st);
+}
+
+// -----------------------------------------------
+
+// out[seq_q][d] = attention of q[seq_q][d], k[seq_kv][d] and v[seq_kv][d] (bf16). Returns false when the shape
+// isn't supported (see attention_supported).
+static bool attention_bf16(const attention_desc_t *desc, float *out, const uint16_t *q, const uint16_t *k,
+                           const uint16_t *v) {
+    if (!attention_supported(desc)) {
+        fprintf(stderr, "attention_bf16: unsupported shape\n");
+        return false;
+    }
+
+    const size_t packed_size = attention_packed_size(desc) * sizeof(uint16_t);
+    uint16_t *kp = (uint16_t *)aligned_alloc(64, packed_size);
+    uint16_t *vp = (uint16_t *)aligned_alloc(64, packed_size);
+    attention_pack_k(desc, kp, k);
+    attention_pack_v(desc, vp, v);
+
+    if (cpu_features.amx_bf16 && cpu_features.avx512) {
+        attention_amx(desc, out, q, kp, vp);
+    } else if (cpu_features.avx512_bf16) {
+        attention_avx512(desc, out, q, kp, vp);
+    } else {
+        attention_scalar(desc, out, q, kp, vp);
+    }
+
+    free(kp);
+    free(vp);
+    return true;
+}
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <cpuid.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "cpu_features.h"
+
+// -----------------------------------------------
+// Tuning cache
+// A kernel with blocking choices (int8_mul's gemm_autotune, conv_create_tuned of common/conv.h) times its
+// candidates once for a shape and keeps the fastest in a text file, one line per CPU model and shape:
+//
+//   <CPU model>|<key>|<params>|<ms>
+//
+// e.g. "Intel(R) Xeon(R) ...|int8_gemm m1024 n1024 k1024|2 2 0 0 0|1.234567". The params are up to
+// AUTOTUNE_MAX_PARAMS ints whose meaning belongs to the kernel. Lines of other CPUs are kept when the file is
+// saved, so one file can serve several machines. The file is AMX_EXAMPLE_TUNE_CACHE, or amx_tune_cache.txt in
+// the working directory.
+
+#define AUTOTUNE_MAX_PARAMS 8
+#define AUTOTUNE_MAX_KEY 128
+#define AUTOTUNE_MAX_CPU 64
+
+typedef struct autotune_entry_t {
+    char cpu[AUTOTUNE_MAX_CPU];
+    char key[AUTOTUNE_MAX_KEY];
+    int params[AUTOTUNE_MAX_PARAMS];
+    int num_params;
+    double ms; // time of the chosen params when they were tuned
+} autotune_entry_t;
+
+typedef struct autotune_cache_t {
+    char path[512];
+    char cpu[AUTOTUNE_MAX_CPU]; // the model of this CPU
+    autotune_entry_t *entries;
+    int count, capacity;
+    bool dirty; // entries were added since the file was read
+} autotune_cache_t;
+
+// The CPU brand string of CPUID (e.g. "Intel(R) Xeon(R) Platinum 8480+"), with " (emulated AMX)" when the
+// AMX kernels run on common/amx_emu.h, whose best blockings have nothing to do with the hardware's
+static inline void autotune_cpu_model(char model[AUTOTUNE_MAX_CPU]) {
+    unsigned int regs[12] = {0};
+    if (__get_cpuid_max(0x80000000, NULL) >= 0x80000004) {
+        for (int i = 0; i < 3; ++i) {
+            __get_cpuid(0x80000002 + i, &regs[i * 4], &regs[i * 4 + 1], &regs[i * 4 + 2], &regs[i * 4 + 3]);
+        }
+    }
+    char brand[49];
+    memcpy(brand, regs, 48);
+    brand[48] = '\0';
+
+    const char *start = brand;
+    while (*start == ' ')
+        start++;
+    snprintf(model, AUTOTUNE_MAX_CPU, "%s", *start ? start : "unknown CPU");
+    for (char *p = model; *p; ++p) {
+        if (*p == '|' || *p == '\n')
+            *p = ' ';
+    }
+#if defined(AMX_EMULATE)
+    const size_t len = strlen(model);
+    snprintf(model + len, AUTOTUNE_MAX_CPU - len, " (emulated AMX)");
+#endif
+}
+
+static inline autotune_entry_t *autotune_find_entry(autotune_cache_t *cache, const char *cpu, const char *key) {
+    for (int i = 0; i < cache->count; ++i) {
+        if (strcmp(cache->entries[i].cpu, cpu) == 0 && strcmp(cache->entries[i].key, key) == 0)
+            return &cache->entries[i];
+    }
+    return NULL;
+}
+
+static inline autotune_entry_t *autotune_add_entry(autotune_cache_t *cache, const char *cpu, const char *key) {
+    autotune_entry_t *e = autotune_find_entry(cache, cpu, key);
+    if (e != NULL)
+        return e;
+    if (cache->count == cache->capacity) {
+        cache->capacity = cache->capacity ? cache->capacity * 2 : 16;
+        cache->entries = (autotune_entry_t *)realloc(cache->entries, cache->capacity * sizeof(autotune_entry_t));
+    }
+    e = &cache->entries[cache->count++];
+    memset(e, 0, sizeof(*e));
+    snprintf(e->cpu, sizeof(e->cpu), "%s", cpu);
+    snprintf(e->key, sizeof(e->key), "%s", key);
+    return e;
+}
+
+// Read the cache file of path (NULL: AMX_EXAMPLE_TUNE_CACHE or amx_tune_cache.txt). A missing file is an empty
+// cache, and malformed lines are skipped.
+static inline autotune_cache_t *autotune_cache_load(const char *path) {
+    autotune_cache_t *cache = (autotune_cache_t *)calloc(1, sizeof(autotune_cache_t));
+    if (path == NULL)
+        path = getenv("AMX_EXAMPLE_TUNE_CACHE");
+    snprintf(cache->path, sizeof(cache->path), "%s", path != NULL ? path : "amx_tune_cache.txt");
+    autotune_cpu_model(cache->cpu);
+
+    FILE *f = fopen(cache->path, "r");
+    if (f == NULL)
+        return cache;
+
+    char line[1024];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char *fields[4];
+        char *p = line;
+        int num_fields = 0;
+        for (; num_fields < 4 && p != NULL; ++num_fields) {
+            fields[num_fields] = p;
+            p = strchr(p, '|');
+            if (p != NULL)
+                *p++ = '\0';
+        }
+        if (num_fields != 4 || p != NULL || strlen(fields[0]) >= AUTOTUNE_MAX_CPU ||
+            strlen(fields[1]) >= AUTOTUNE_MAX_KEY)
+            continue;
+
+        autotune_entry_t e = {0};
+        char *end = fields[2];
+        while (e.num_params < AUTOTUNE_MAX_PARAMS) {
+            char *next;
+            const long v = strtol(end, &next, 10);
+            if (next == end)
+                break;
+            e.params[e.num_params++] = (int)v;
+            end = next;
+        }
+        e.ms = atof(fields[3]);
+        if (e.num_params == 0)
+            continue;
+
+        autotune_entry_t *dst = autotune_add_entry(cache, fields[0], fields[1]);
+        memcpy(dst->params, e.params, sizeof(e.params));
+        dst->num_params = e.num_params;
+        dst->ms = e.ms;
+    }
+    fclose(f);
+    return cache;
+}
+
+// The tuned params of key on this CPU. Returns false when key hasn't been tuned (or has another number of params).
+static inline bool autotune_cache_lookup(autotune_cache_t *cache, const char *key, int *params, int num_params) {
+    const autotune_entry_t *e = autotune_find_entry(cache, cache->cpu, key);
+    if (e == NULL || e->num_params != num_params)
+        return false;
+    memcpy(params, e->params, num_params * sizeof(int));
+    return true;
+}
+
+static inline void autotune_cache_store(autotune_cache_t *cache, const char *key, const int *params, int num_params,
+                                        double ms) {
+    autotune_entry_t *e = autotune_add_entry(cache, cache->cpu, key);
+    memcpy(e->params, params, num_params * sizeof(int));
+    e->num_params = num_params;
+    e->ms = ms;
+    cache->dirty = true;
+}
+
+// Write the cache file when entries were added (to a temporary file, then renamed over it, so a reader never sees
+// half a file). Returns false when the file can't be written.
+static inline bool autotune_cache_save(autotune_cache_t *cache) {
+    if (!cache->dirty)
+        return true;
+
+    char tmp[sizeof(cache->path) + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", cache->path);
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL) {
+        fprintf(stderr, "autotune: can't write %s\n", tmp);
+        return false;
+    }
+    for (int i = 0; i < cache->count; ++i) {
+        const autotune_entry_t *e = &cache->entries[i];
+        fprintf(f, "%s|%s|", e->cpu, e->key);
+        for (int x = 0; x < e->num_params; ++x) {
+            fprintf(f, x ? " %d" : "%d", e->params[x]);
+        }
+        fprintf(f, "|%.6f\n", e->ms);
+    }
+    if (fclose(f) != 0 || rename(tmp, cache->path) != 0) {
+        fprintf(stderr, "autotune: can't write %s\n", cache->path);
+        return false;
+    }
+    cache->dirty = false;
+    return true;
+}
+
+static inline void autotune_cache_destroy(autotune_cache_t *cache) {
+    free(cache->entries);
+    free(cache);
+}
+
+// Median time of fn(arg) in ms, with fewer runs than the benchmark mode (a tuning run times every candidate)
+static inline double autotune_measure(void (*fn)(void *arg), void *arg) {
+    const bench_config_t saved = bench_config;
+    bench_config.warmup = 1;
+    bench_config.repeat = 5;
+    const bench_stats_t stats = bench_measure(fn, arg);
+    bench_config = saved;
+    return stats.median_sec * 1e3;
+}
@@ -0,0 +1,213 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "perf_counters.h"
+
+// -----------------------------------------------
+// Benchmark harness
+// Run the programs with --bench (CSV) or --bench=json instead of printing the results.
+// Every kernel is run --warmup=N times untimed, then timed --repeat=N times; both stop early after BENCH_MAX_SEC
+// so the naive kernels on large shapes stay bearable. A kernel faster than BENCH_MIN_SAMPLE_SEC is run several
+// times per timed sample. One record per kernel and shape is printed:
+//
+//   program, kernel, shape, runs, min_ms, median_ms, gops, gbps
+//
+// gops counts a multiply-add as 2 operations. gbps is the compulsory traffic (every input read once and
+// every output written once) divided by the median time, so it is a lower bound of the real traffic.
+//
+// --counters adds the hardware counters of common/perf_counters.h per run (cycles, instructions, ipc, l1d_misses,
+// l2_misses, llc_misses, amx_busy) and their source, perf or rdtsc. They are averaged over every timed run, and an
+// event that isn't available is left empty (CSV) or null (JSON). Without --counters nothing is counted.
+
+#define BENCH_MAX_SEC 0.5
+#define BENCH_MIN_SAMPLE_SEC 1e-4
+
+typedef enum bench_format_t {
+    BENCH_OFF, // normal run
+    BENCH_CSV,
+    BENCH_JSON,
+} bench_format_t;
+
+typedef struct bench_config_t {
+    bench_format_t format;
+    int warmup; // untimed runs
+    int repeat;    // timed runs at most
+    bool counters; // collect hardware counters
+} bench_config_t;
+
+static bench_config_t bench_config = {BENCH_OFF, 2, 10, false};
+
+typedef struct bench_stats_t {
+    int runs;
+    double min_sec;
+    double median_sec;
+    perf_sample_t counters; // valid with --counters
+} bench_stats_t;
+
+static perf_counters_t bench_counters;
+static bool bench_counters_open; // between bench_begin and bench_end with --counters
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Parse --bench[=csv|json], --warmup=N, --repeat=N and --counters. Returns true in benchmark mode.
+static bool bench_parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--bench") == 0 || strcmp(argv[i], "--bench=csv") == 0) {
+            bench_config.format = BENCH_CSV;
+        } else if (strcmp(argv[i], "--bench=json") == 0) {
+            bench_config.format = BENCH_JSON;
+        } else if (strncmp(argv[i], "--warmup=", 9) == 0) {
+            bench_config.warmup = atoi(argv[i] + 9);
+        } else if (strncmp(argv[i], "--repeat=", 9) == 0) {
+            bench_config.repeat = atoi(argv[i] + 9);
+        } else if (strcmp(argv[i], "--counters") == 0) {
+            bench_config.counters = true;
+        } else {
+            fprintf(stderr, "usage: %s [--bench[=csv|json]] [--warmup=N] [--repeat=N] [--counters]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (bench_config.warmup < 0)
+        bench_config.warmup = 0;
+    if (bench_config.repeat < 1)
+        bench_config.repeat = 1;
+    return bench_config.format != BENCH_OFF;
+}
+
+static int bench_compare_double(const void *a, const void *b) {
+    const double x = *(const double *)a;
+    const double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Time fn(arg) as configured by bench_config
+static bench_stats_t bench_measure(void (*fn)(void *arg), void *arg) {
+    double start = now_sec();
+    for (int i = 0; i < bench_config.warmup && now_sec() - start < BENCH_MAX_SEC; ++i) {
+        fn(arg);
+    }
+
+    double *times = (double *)malloc(bench_config.repeat * sizeof(double));
+    int runs = 0;
+    int iters = 1; // runs per sample, doubled until a sample is long enough for the clock
+    uint64_t calls = 0;
+    if (bench_counters_open)
+        perf_counters_start(&bench_counters);
+    start = now_sec();
+    do {
+        const double t0 = now_sec();
+        for (int i = 0; i < iters; ++i) {
+            fn(arg);
+        }
+        const double t1 = now_sec();
+        calls += iters;
+        if (t1 - t0 < BENCH_MIN_SAMPLE_SEC && iters < (1 << 20)) {
+            iters *= 2;
+            start = t1;
+            continue;
+        }
+        times[runs++] = (t1 - t0) / iters;
+    } while (runs < bench_config.repeat && now_sec() - start < BENCH_MAX_SEC);
+
+    perf_sample_t counters = {0};
+    if (bench_counters_open)
+        counters = perf_counters_stop(&bench_counters, calls);
+
+    qsort(times, runs, sizeof(double), bench_compare_double);
+    const double median = (runs % 2) ? times[runs / 2] : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+    const bench_stats_t stats = {runs, times[0], median, counters};
+    free(times);
+    return stats;
+}
+
+static int bench_records;
+
+static void bench_begin() {
+    bench_records = 0;
+    if (bench_config.counters && !bench_counters_open) {
+        perf_counters_open(&bench_counters);
+        bench_counters_open = true;
+    }
+    if (bench_config.format == BENCH_CSV) {
+        printf("program,kernel,shape,runs,min_ms,median_ms,gops,gbps");
+        if (bench_config.counters) {
+            printf(",counter_source");
+            for (int i = 0; i < PERF_NUM_COUNTERS; ++i) {
+                printf(i == PERF_INSTRUCTIONS + 1 ? ",ipc,%s" : ",%s", perf_counter_names[i]);
+            }
+        }
+        printf("\n");
+    } else {
+        printf("[\n");
+    }
+}
+
+// The counter fields of a record (nothing without --counters)
+static void bench_print_counters(const perf_sample_t *s) {
+    if (!s->valid)
+        return;
+    const bool csv = bench_config.format == BENCH_CSV;
+    const char *na = csv ? "" : "null";
+    const double cycles = s->values[PERF_CYCLES];
+    const double instructions = s->values[PERF_INSTRUCTIONS];
+
+    printf(csv ? ",%s" : ", \"counter_source\": \"%s\"", s->perf ? "perf" : "rdtsc");
+    for (int i = 0; i < PERF_NUM_COUNTERS; ++i) {
+        if (i == PERF_INSTRUCTIONS + 1) {
+            printf(csv ? "," : ", \"ipc\": ");
+            if (cycles > 0 && instructions >= 0)
+                printf("%.3f", instructions / cycles);
+            else
+                printf("%s", na);
+        }
+        if (!csv)
+            printf(", \"%s\": ", perf_counter_names[i]);
+        else
+            printf(",");
+        if (s->values[i] >= 0)
+            printf("%.0f", s->values[i]);
+        else
+            printf("%s", na);
+    }
+}
+
+// ops: operations of one run, bytes: compulsory traffic of one run
+static void bench_report(const char *program, const char *kernel, const char *shape, double ops, double bytes,
+                         bench_stats_t stats) {
+    const double gops = ops / stats.median_sec * 1e-9;
+    const double gbps = bytes / stats.median_sec * 1e-9;
+
+    if (bench_config.format == BENCH_CSV) {
+        printf("%s,%s,%s,%d,%.6f,%.6f,%.3f,%.3f", program, kernel, shape, stats.runs, stats.min_sec * 1e3,
+               stats.median_sec * 1e3, gops, gbps);
+        bench_print_counters(&stats.counters);
+        printf("\n");
+    } else {
+        printf("%s  {\"program\": \"%s\", \"kernel\": \"%s\", \"shape\": \"%s\", \"runs\": %d, \"min_ms\": %.6f, "
+               "\"median_ms\": %.6f, \"gops\": %.3f, \"gbps\": %.3f",
+               bench_records > 0 ? ",\n" : "", program, kernel, shape, stats.runs, stats.min_sec * 1e3,
+               stats.median_sec * 1e3, gops, gbps);
+        bench_print_counters(&stats.counters);
+        printf("}");
+    }
+    bench_records++;
+    fflush(stdout);
+}
+
+static void bench_end() {
+    if (bench_config.format == BENCH_JSON)
+        printf("\n]\n");
+    if (bench_counters_open) {
+        perf_counters_close(&bench_counters);
+        bench_counters_open = false;
+    }
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <immintrin.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cpu_features.h"
+
+// -----------------------------------------------
+// fp32 <-> bf16 conversion
+// Every path gives the bits of vcvtneps2bf16: round to nearest even, NaN stays NaN (quiet),
+// and denormal inputs are read as zero (signed zero out). bf16 is a uint16_t.
+
+// fp32 to bf16 (no type punning through pointers, which breaks strict aliasing)
+static inline uint16_t bf16_from_fp32(float value) {
+    uint32_t v;
+    memcpy(&v, &value, sizeof(v));
+    if ((v & 0x7fffffff) > 0x7f800000)
+        return (uint16_t)((v >> 16) | 0x40);
+    if ((v & 0x7f800000) == 0)
+        return (uint16_t)((v >> 16) & 0x8000);
+    return (uint16_t)((v + 0x7fff + ((v >> 16) & 1)) >> 16);
+}
+
+static inline float bf16_to_fp32(uint16_t value) {
+    const uint32_t v = (uint32_t)value << 16;
+    float f;
+    memcpy(&f, &v, sizeof(f));
+    return f;
+}
+
+// 16 fp32 to bf16 with AVX-512F only (bf16_from_fp32 per lane, for CPUs without AVX-512 BF16)
+TARGET_AVX512 static inline __m256i bf16_from_fp32_avx512(__m512 x) {
+    const __m512i v = _mm512_castps_si512(x);
+    const __m512i high = _mm512_srli_epi32(v, 16);
+    const __m512i odd = _mm512_and_si512(high, _mm512_set1_epi32(1));
+    const __m512i rounded = _mm512_add_epi32(v, _mm512_add_epi32(odd, _mm512_set1_epi32(0x7fff)));
+    const __mmask16 nan =
+        _mm512_cmpgt_epi32_mask(_mm512_and_si512(v, _mm512_set1_epi32(0x7fffffff)), _mm512_set1_epi32(0x7f800000));
+    const __mmask16 denormal = _mm512_testn_epi32_mask(v, _mm512_set1_epi32(0x7f800000));
+
+    __m512i r = _mm512_srli_epi32(rounded, 16);
+    r = _mm512_mask_or_epi32(r, nan, high, _mm512_set1_epi32(0x40));
+    r = _mm512_mask_and_epi32(r, denormal, high, _mm512_set1_epi32(0x8000));
+    return _mm512_cvtepi32_epi16(r);
+}
+
+static inline __mmask16 bf16_tail_mask(int n) { return (n >= 16) ? 0xffff : (__mmask16)((1u << n) - 1); }
+
+// Convert n fp32 values to bf16 with vcvtneps2bf16
+TARGET_AVX512_BF16 static void bf16_convert_avx512_bf16(uint16_t *dst, const float *src, int n) {
+    for (int i = 0; i < n; i += 16) {
+        const __mmask16 mask = bf16_tail_mask(n - i);
+        const __m256bh bf16_16 = _mm512_cvtneps_pbh(_mm512_maskz_loadu_ps(mask, &src[i]));
+        _mm256_mask_storeu_epi16(&dst[i], mask, (__m256i)bf16_16);
+    }
+}
+
+// Same with AVX-512F
+TARGET_AVX512 static void bf16_convert_avx512(uint16_t *dst, const float *src, int n) {
+    for (int i = 0; i < n; i += 16) {
+        const __mmask16 mask = bf16_tail_mask(n - i);
+        _mm256_mask_storeu_epi16(&dst[i], mask, bf16_from_fp32_avx512(_mm512_maskz_loadu_ps(mask, &src[i])));
+    }
+}
+
+// Convert n fp32 values to bf16 (the same bits on every path)
+static void bf16_convert(uint16_t *dst, const float *src, int n) {
+    if (cpu_features.avx512_bf16) {
+        bf16_convert_avx512_bf16(dst, src, n);
+    } else if (cpu_features.avx512) {
+        bf16_convert_avx512(dst, src, n);
+    } else {
+        for (int i = 0; i < n; ++i) {
+            dst[i] = bf16_from_fp32(src[i]);
+        }
+    }
+}
@@ -0,0 +1,905 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "amx.h"
+#include "autotune.h"
+#include "cpu_features.h"
+#include "requant.h"
+#include "tensor.h"
+#include "vnni_pack.h"
+
+// -----------------------------------------------
+// Runtime-shaped int8 convolution
+// The shape of a layer is a conv_desc_t instead of compile-time macros, so one process can run every layer of a CNN.
+//
+// input:  int8_t  [h][w][c_in]            (NHWC, batch 1), or uint8_t with conv_run_u8 / conv_run_requant_u8
+// filter: int8_t  [kernel][kernel][c_in][c_out]
+// output: int32_t [out_h][out_w][c_out], or int8_t / uint8_t with conv_run_requant (common/requant.h)
+//
+// conv_create packs the filter once (as pack_b of int8_mul) and picks a path for the shape:
+// - CONV_PATH_1X1:    1x1, stride 1, no padding. The input is A of a GEMM as it is (one pixel per tile row).
+// - CONV_PATH_3X3S1:  3x3, stride 1, dilation 1. For filter row fr, the K values (fc, ich) of a pixel are
+//                     3 * c_in contiguous bytes of input row r + fr, and the next pixel starts c_in bytes later,
+//                     so the tiles are loaded from the (zero-padded) input directly, like conv_amx_v4.
+//                     The kernel size and the stride are compile-time constants of this path.
+// - CONV_PATH_ROWSEG: the same for any other kernel size and stride with dilation 1
+//                     (strided layers with short output rows take im2col, see conv_select_path).
+// - CONV_PATH_IM2COL: anything else. 32 output pixels at a time are gathered into a buffer (im2col).
+// Every path computes 32 pixels x 32 output channels per block with 4 C tiles, as gemm_amx_packed
+// (tdpbssd, or tdpbusd for a uint8 input such as image pixels or activations after ReLU).
+// Without AMX, AVX-512 VNNI or AVX2 kernels compute the same blocks from the same packed filter on the same paths,
+// and a scalar kernel covers the rest.
+//
+// conv_run_tensor takes the input and the output as tensors (common/tensor.h). An input with a halo of at least
+// pad (conv_input_tensor) is read in place by the row-segment paths instead of being copied into a padded buffer,
+// and the output may have a halo itself, so it can be the input of the next layer as it is.
+
+typedef struct conv_desc_t {
+    int h, w;       // input
+    int c_in, c_out;
+    int kernel;     // kernel x kernel
+    int stride;
+    int pad;        // zeros on every side
+    int dilation;   // 1: dense kernel
+} conv_desc_t;
+
+typedef enum conv_path_t {
+    CONV_PATH_1X1,
+    CONV_PATH_3X3S1,
+    CONV_PATH_ROWSEG,
+    CONV_PATH_IM2COL,
+} conv_path_t;
+
+// One tile holds 16 pixels x 64 bytes of K (A), 64 K x 16 channels (B) or 16 pixels x 16 channels (C)
+#define CONV_TILE_M 16
+#define CONV_TILE_N 16
+#define CONV_TILE_K 64
+#define CONV_BLOCK_M (CONV_TILE_M * 2)
+#define CONV_BLOCK_N (CONV_TILE_N * 2)
+
+// Largest kernel (the row-segment paths keep one A pointer per filter row)
+#define CONV_MAX_KERNEL 16
+
+#define CONV_ROUND_UP(x, y) (((x) + (y) - 1) / (y) * (y))
+
+// A layer: the shape, the path and the packed filter
+// K is split into k_segs segments of k_seg values, each padded to k_seg_pad (a multiple of CONV_TILE_K):
+// one segment per filter row for the row-segment paths, one segment of kernel * kernel * c_in otherwise.
+typedef struct conv_layer_t {
+    conv_desc_t desc;
+    conv_path_t path;
+    int out_h, out_w;
+    int k_segs, k_seg, k_seg_pad;
+    int k_pad; // k_segs * k_seg_pad
+    int n_pad; // c_out padded to CONV_BLOCK_N
+    int8_t *panels; // 64-byte aligned
+    int32_t *col_sums; // sum of the filter for each (padded) output channel, for conv_avx512_vnni_block
+    int8_t *scratch; // im2col buffer of 32 pixels (or the accumulators of one pixel without AMX), 64-byte aligned;
+                     // a layer is run by one thread at a time
+} conv_layer_t;
+
+static inline int conv_out_size(int size, int kernel, int stride, int pad, int dilation) {
+    return (size + 2 * pad - dilation * (kernel - 1) - 1) / stride + 1;
+}
+
+static inline const char *conv_path_name(conv_path_t path) {
+    switch (path) {
+    case CONV_PATH_1X1:
+        return "1x1";
+    case CONV_PATH_3X3S1:
+        return "3x3 s1";
+    case CONV_PATH_ROWSEG:
+        return "row segments";
+    default:
+        return "im2col";
+    }
+}
+
+// A block of the row-segment paths is 32 pixels of one output row, so strided layers with short output rows
+// waste most of each block and are faster with im2col (which packs the pixels of several rows into a block).
+static conv_path_t conv_select_path(const conv_desc_t *d) {
+    if (d->kernel == 1 && d->stride == 1 && d->pad == 0)
+        return CONV_PATH_1X1;
+    if (d->dilation != 1)
+        return CONV_PATH_IM2COL;
+    if (d->kernel == 3 && d->stride == 1)
+        return CONV_PATH_3X3S1;
+    if (d->stride > 1 && conv_out_size(d->w, d->kernel, d->stride, d->pad, d->dilation) < CONV_BLOCK_M)
+        return CONV_PATH_IM2COL;
+    return CONV_PATH_ROWSEG;
+}
+
+// Offset of panel (j, kb) in conv_layer_t::panels, the same layout as packed_b_panel of int8_mul:
+// panel (j, kb) holds K values kb * 64 .. +64 of output channels j * 16 .. +16 as a [16][64] tile.
+static inline size_t conv_panel(const conv_layer_t *l, int j, int kb) {
+    return ((size_t)j * (l->k_pad / CONV_TILE_K) + kb) * (CONV_TILE_K * CONV_TILE_N);
+}
+
+// Create a layer with the given path (conv_create picks it from the shape).
+// Returns NULL when the shape isn't supported.
+static conv_layer_t *conv_create_path(const conv_desc_t *desc, const int8_t *filter, conv_path_t path) {
+    if (desc->h < 1 || desc->w < 1 || desc->c_in < 1 || desc->c_out < 1 || desc->kernel < 1 ||
+        desc->kernel > CONV_MAX_KERNEL || desc->stride < 1 || desc->pad < 0 || desc->dilation < 1 ||
+        conv_out_size(desc->h, desc->kernel, desc->stride, desc->pad, desc->dilation) < 1 ||
+        conv_out_size(desc->w, desc->kernel, desc->stride, desc->pad, desc->dilation) < 1) {
+        fprintf(stderr, "conv: unsupported shape\n");
+        return NULL;
+    }
+
+    conv_layer_t *l = (conv_layer_t *)malloc(sizeof(conv_layer_t));
+    const conv_desc_t *d = &l->desc;
+    l->desc = *desc;
+    l->path = path;
+    l->out_h = conv_out_size(d->h, d->kernel, d->stride, d->pad, d->dilation);
+    l->out_w = conv_out_size(d->w, d->kernel, d->stride, d->pad, d->dilation);
+
+    const bool rowseg = path == CONV_PATH_3X3S1 || path == CONV_PATH_ROWSEG;
+    l->k_segs = rowseg ? d->kernel : 1;
+    l->k_seg = rowseg ? d->kernel * d->c_in : d->kernel * d->kernel * d->c_in;
+    l->k_seg_pad = CONV_ROUND_UP(l->k_seg, CONV_TILE_K);
+    l->k_pad = l->k_segs * l->k_seg_pad;
+    l->n_pad = CONV_ROUND_UP(d->c_out, CONV_BLOCK_N);
+
+    const size_t size = (size_t)l->k_pad * l->n_pad;
+    l->panels = (int8_t *)aligned_alloc(64, size);
+    memset(l->panels, 0, size);
+
+    // K value kk of segment s is filter row s * k_seg + kk (the filter is [kernel][kernel][c_in][c_out],
+    // so its rows in K order are contiguous); 4 rows are interleaved into one tile row.
+    const size_t chunk_stride = conv_panel(l, 1, 0);
+    int8_t *zeros = (int8_t *)calloc(d->c_out, sizeof(int8_t));
+
+    for (int q = 0; q < l->k_pad; q += 4) {
+        const int8_t *rows[4];
+        for (int i = 0; i < 4; ++i) {
+            const int s = (q + i) / l->k_seg_pad;
+            const int kk = (q + i) % l->k_seg_pad;
+            rows[i] = (kk < l->k_seg) ? &filter[((size_t)s * l->k_seg + kk) * d->c_out] : zeros;
+        }
+
+        int8_t *dst = &l->panels[conv_panel(l, 0, q / CONV_TILE_K) + (q % CONV_TILE_K) / 4 * (CONV_TILE_N * 4)];
+        vnni_interleave4_s8(dst, chunk_stride, rows[0], rows[1], rows[2], rows[3], d->c_out);
+    }
+
+    free(zeros);
+
+    l->col_sums = (int32_t *)aligned_alloc(64, l->n_pad * sizeof(int32_t));
+    memset(l->col_sums, 0, l->n_pad * sizeof(int32_t));
+    for (size_t r = 0; r < (size_t)d->kernel * d->kernel * d->c_in; ++r) {
+        for (int och = 0; och < d->c_out; ++och) {
+            l->col_sums[och] += filter[r * d->c_out + och];
+        }
+    }
+
+    size_t scratch_size = (size_t)CONV_BLOCK_M * l->k_pad;
+    if (scratch_size < d->c_out * sizeof(int32_t))
+        scratch_size = d->c_out * sizeof(int32_t);
+    l->scratch = (int8_t *)aligned_alloc(64, CONV_ROUND_UP(scratch_size, 64));
+    return l;
+}
+
+static inline conv_layer_t *conv_create(const conv_desc_t *desc, const int8_t *filter) {
+    return conv_create_path(desc, filter, conv_select_path(desc));
+}
+
+static inline void conv_destroy(conv_layer_t *l) {
+    free(l->panels);
+    free(l->col_sums);
+    free(l->scratch);
+    free(l);
+}
+
+// Naive convolution (the reference); the input is uint8 with input_unsigned
+static void conv_ref_sign(const conv_desc_t *d, int32_t *output, const int8_t *input, bool input_unsigned,
+                          const int8_t *filter) {
+    const int out_h = conv_out_size(d->h, d->kernel, d->stride, d->pad, d->dilation);
+    const int out_w = conv_out_size(d->w, d->kernel, d->stride, d->pad, d->dilation);
+
+    for (int oy = 0; oy < out_h; ++oy) {
+        for (int ox = 0; ox < out_w; ++ox) {
+            for (int och = 0; och < d->c_out; ++och) {
+                int32_t sum = 0;
+                for (int fr = 0; fr < d->kernel; ++fr) {
+                    for (int fc = 0; fc < d->kernel; ++fc) {
+                        const int y = oy * d->stride - d->pad + fr * d->dilation;
+                        const int x = ox * d->stride - d->pad + fc * d->dilation;
+                        if (y < 0 || y >= d->h || x < 0 || x >= d->w)
+                            continue;
+                        for (int ich = 0; ich < d->c_in; ++ich) {
+                            const int8_t v = input[((size_t)y * d->w + x) * d->c_in + ich];
+                            sum += (input_unsigned ? (uint8_t)v : v) *
+                                   filter[(((size_t)fr * d->kernel + fc) * d->c_in + ich) * d->c_out + och];
+                        }
+                    }
+                }
+                output[((size_t)oy * out_w + ox) * d->c_out + och] = sum;
+            }
+        }
+    }
+}
+
+static inline void conv_ref(const conv_desc_t *d, int32_t *output, const int8_t *input, const int8_t *filter) {
+    conv_ref_sign(d, output, input, false, filter);
+}
+
+static inline void conv_ref_u8(const conv_desc_t *d, int32_t *output, const uint8_t *input, const int8_t *filter) {
+    conv_ref_sign(d, output, (const int8_t *)input, true, filter);
+}
+
+// -----------------------------------------------
+// AMX paths
+
+TARGET_AMX_INT8 static void conv_init_tile_config() {
+    tile_config_t tile = {0};
+    tile.palette_id = 1;
+
+    // C tiles: 16 pixels x 16 output channels of int32
+    for (int t = TILE_0; t <= TILE_3; ++t) {
+        tile.colsb[t] = CONV_TILE_N * sizeof(int32_t);
+        tile.rows[t] = CONV_TILE_M;
+    }
+    // A tiles: 16 pixels x 64 K
+    for (int t = TILE_4; t <= TILE_5; ++t) {
+        tile.colsb[t] = CONV_TILE_K;
+        tile.rows[t] = CONV_TILE_M;
+    }
+    // B tiles: 64 K x 16 output channels, stored as [16][64]
+    for (int t = TILE_6; t <= TILE_7; ++t) {
+        tile.colsb[t] = CONV_TILE_N * 4;
+        tile.rows[t] = CONV_TILE_K / 4;
+    }
+
+    _tile_loadconfig(&tile);
+}
+
+// Compute output pixels p .. p + 31 (of which the first `pixels` are stored) x channels j .. j + 31.
+// Pixel p + r reads segment s of its K from a0[s] + r * a_stride (r < 16) or a1[s] + (r - 16) * a_stride;
+// signs is INT8_SS, or INT8_US for a uint8 input.
+// Output pixels are numbered [out_h][out_w] flattened; when the 32 pixels are contiguous in the output
+// (one output row, or an output without a halo), one tile store covers 16 of them.
+// With requantization the tiles are stored into c_edge (in L1) and only the int8 result goes to the output.
+TARGET_AMX_INT8 static inline void conv_amx_block(const conv_layer_t *l, const acc_output_t *out, int p, int pixels,
+                                                  const int8_t *const *a0, const int8_t *const *a1, long a_stride,
+                                                  int j, int8_signs_t signs) {
+    const int c_out = l->desc.c_out;
+    const int seg_blocks = l->k_seg_pad / CONV_TILE_K;
+    const int8_t *b0 = &l->panels[conv_panel(l, j / CONV_TILE_N, 0)];
+    const int8_t *b1 = &l->panels[conv_panel(l, j / CONV_TILE_N + 1, 0)];
+
+    _tile_zero(TILE_0);
+    _tile_zero(TILE_1);
+    _tile_zero(TILE_2);
+    _tile_zero(TILE_3);
+
+    for (int s = 0; s < l->k_segs; ++s) {
+        for (int kb = 0; kb < seg_blocks; ++kb) {
+            const size_t panel = (size_t)(s * seg_blocks + kb) * (CONV_TILE_K * CONV_TILE_N);
+            _tile_loadd(TILE_4, a0[s] + kb * CONV_TILE_K, a_stride);
+            _tile_loadd(TILE_5, a1[s] + kb * CONV_TILE_K, a_stride);
+            _tile_loadd(TILE_6, &b0[panel], CONV_TILE_N * 4);
+            _tile_loadd(TILE_7, &b1[panel], CONV_TILE_N * 4);
+
+            amx_tile_dpb(signs, TILE_0, TILE_4, TILE_6);
+            amx_tile_dpb(signs, TILE_1, TILE_4, TILE_7);
+            amx_tile_dpb(signs, TILE_2, TILE_5, TILE_6);
+            amx_tile_dpb(signs, TILE_3, TILE_5, TILE_7);
+        }
+    }
+
+    if (acc_output_is_int32(out) && pixels == CONV_BLOCK_M && j + CONV_BLOCK_N <= c_out &&
+        acc_output_contiguous(out, p, CONV_BLOCK_M)) {
+        const size_t ld = out->ld * sizeof(int32_t);
+        int32_t *c0 = (int32_t *)out->data + acc_output_offset(out, p) + j;
+        int32_t *c1 = c0 + CONV_TILE_M * out->ld;
+        _tile_stored(TILE_0, c0, ld);
+        _tile_stored(TILE_1, c0 + CONV_TILE_N, ld);
+        _tile_stored(TILE_2, c1, ld);
+        _tile_stored(TILE_3, c1 + CONV_TILE_N, ld);
+    } else {
+        // Last pixels or channels, or a converted or non-contiguous output: the whole 32 x 32 block goes to c_edge,
+        // and acc_output_store writes only its first `pixels` rows and `cols` channels (the rest is dropped)
+        int32_t c_edge[CONV_BLOCK_M][CONV_BLOCK_N];
+        _tile_stored(TILE_0, &c_edge[0][0], sizeof(c_edge[0]));
+        _tile_stored(TILE_1, &c_edge[0][CONV_TILE_N], sizeof(c_edge[0]));
+        _tile_stored(TILE_2, &c_edge[CONV_TILE_M][0], sizeof(c_edge[0]));
+        _tile_stored(TILE_3, &c_edge[CONV_TILE_M][CONV_TILE_N], sizeof(c_edge[0]));
+
+        const int cols = (c_out - j < CONV_BLOCK_N) ? c_out - j : CONV_BLOCK_N;
+        acc_output_store(out, p, j, c_edge[0], CONV_BLOCK_N, pixels, cols);
+    }
+}
+
+// Gather the K values of output pixels p .. p + pixels - 1 into buf[32][k_pad] (zero outside the input).
+// Input row y starts at input + y * pitch * c_in.
+static void conv_im2col(const conv_layer_t *l, int8_t *buf, const int8_t *input, int pitch, int p, int pixels) {
+    const conv_desc_t *d = &l->desc;
+    memset(buf, 0, (size_t)CONV_BLOCK_M * l->k_pad);
+
+    for (int r = 0; r < pixels; ++r) {
+        const int oy = (p + r) / l->out_w;
+        const int ox = (p + r) % l->out_w;
+        int8_t *row = &buf[(size_t)r * l->k_pad];
+
+        for (int fr = 0; fr < d->kernel; ++fr) {
+            const int y = oy * d->stride - d->pad + fr * d->dilation;
+            if (y < 0 || y >= d->h)
+                continue;
+            for (int fc = 0; fc < d->kernel; ++fc) {
+                const int x = ox * d->stride - d->pad + fc * d->dilation;
+                if (x < 0 || x >= d->w)
+                    continue;
+                const int kk = (fr * d->kernel + fc) * d->c_in;
+                const int s = kk / l->k_seg;
+                memcpy(&row[s * l->k_seg_pad + kk % l->k_seg], &input[((size_t)y * pitch + x) * d->c_in], d->c_in);
+            }
+        }
+    }
+}
+
+// 32 output pixels from an im2col buffer, for every block of output channels
+TARGET_AMX_INT8 static void conv_amx_im2col_block(const conv_layer_t *l, const acc_output_t *out, const int8_t *input,
+                                                  int pitch, int8_t *buf, int p, int pixels, int8_signs_t signs) {
+    conv_im2col(l, buf, input, pitch, p, pixels);
+
+    const int8_t *a0[CONV_MAX_KERNEL];
+    const int8_t *a1[CONV_MAX_KERNEL];
+    for (int s = 0; s < l->k_segs; ++s) {
+        a0[s] = &buf[s * l->k_seg_pad];
+        a1[s] = &buf[(size_t)CONV_TILE_M * l->k_pad + s * l->k_seg_pad];
+    }
+
+    for (int j = 0; j < l->n_pad; j += CONV_BLOCK_N) {
+        conv_amx_block(l, out, p, pixels, a0, a1, l->k_pad, j, signs);
+    }
+}
+
+TARGET_AMX_INT8 static void conv_amx_im2col(const conv_layer_t *l, const acc_output_t *out, const int8_t *input,
+                                            int pitch, int8_t *buf, int8_signs_t signs) {
+    const int num_pixels = l->out_h * l->out_w;
+    for (int p = 0; p < num_pixels; p += CONV_BLOCK_M) {
+        const int pixels = (num_pixels - p < CONV_BLOCK_M) ? num_pixels - p : CONV_BLOCK_M;
+        conv_amx_im2col_block(l, out, input, pitch, buf, p, pixels, signs);
+    }
+}
+
+// 1x1: the input is [h * w][c_in], exactly A of a GEMM.
+// A tile reads 64 bytes per pixel, past c_in into the next pixels (their weights are zero), so the last pixels,
+// whose loads would run past the end of the input, go through im2col.
+TARGET_AMX_INT8 static void conv_amx_1x1(const conv_layer_t *l, const acc_output_t *out, const int8_t *input,
+                                         int8_t *buf, int8_signs_t signs) {
+    const int c_in = l->desc.c_in;
+    const int num_pixels = l->out_h * l->out_w;
+    const size_t input_size = (size_t)num_pixels * c_in;
+
+    for (int p = 0; p < num_pixels; p += CONV_BLOCK_M) {
+        const int pixels = (num_pixels - p < CONV_BLOCK_M) ? num_pixels - p : CONV_BLOCK_M;
+        if (pixels < CONV_BLOCK_M || (size_t)(p + CONV_BLOCK_M - 1) * c_in + l->k_pad > input_size) {
+            conv_amx_im2col_block(l, out, input, l->desc.w, buf, p, pixels, signs);
+            continue;
+        }
+
+        const int8_t *a0[1] = {&input[(size_t)p * c_in]};
+        const int8_t *a1[1] = {&input[(size_t)(p + CONV_TILE_M) * c_in]};
+        for (int j = 0; j < l->n_pad; j += CONV_BLOCK_N) {
+            conv_amx_block(l, out, p, pixels, a0, a1, c_in, j, signs);
+        }
+    }
+}
+
+// Row segments on the zero-padded input xp[h + 2 * pad][wp][c_in] (with slack after the end), where xp is the
+// padded pixel (-pad, -pad) and wp >= w + 2 * pad pixels per row (a tensor with a halo >= pad can be read in place):
+// pixel (oy, ox) reads segment fr at xp[oy * stride + fr][ox * stride], and the next pixel is stride * c_in later.
+// 32 pixels of one output row are a block; pixels past out_w are computed from whatever follows and not stored.
+__attribute__((always_inline)) TARGET_AMX_INT8 static inline void
+conv_amx_rowseg_body(const conv_layer_t *l, const acc_output_t *out, const int8_t *xp, int wp, const int kernel,
+                     const int stride, int8_signs_t signs) {
+    const int c_in = l->desc.c_in;
+    const long a_stride = (long)stride * c_in;
+
+    for (int oy = 0; oy < l->out_h; ++oy) {
+        for (int ox = 0; ox < l->out_w; ox += CONV_BLOCK_M) {
+            const int pixels = (l->out_w - ox < CONV_BLOCK_M) ? l->out_w - ox : CONV_BLOCK_M;
+
+            const int8_t *a0[CONV_MAX_KERNEL];
+            const int8_t *a1[CONV_MAX_KERNEL];
+            for (int fr = 0; fr < kernel; ++fr) {
+                a0[fr] = &xp[((size_t)(oy * stride + fr) * wp + (size_t)ox * stride) * c_in];
+                a1[fr] = a0[fr] + CONV_TILE_M * a_stride;
+            }
+
+            for (int j = 0; j < l->n_pad; j += CONV_BLOCK_N) {
+                conv_amx_block(l, out, oy * l->out_w + ox, pixels, a0, a1, a_stride, j, signs);
+            }
+        }
+    }
+}
+
+TARGET_AMX_INT8 static void conv_amx_3x3s1(const conv_layer_t *l, const acc_output_t *out, const int8_t *xp, int wp,
+                                           int8_signs_t signs) {
+    conv_amx_rowseg_body(l, out, xp, wp, 3, 1, signs);
+}
+
+TARGET_AMX_INT8 static void conv_amx_rowseg(const conv_layer_t *l, const acc_output_t *out, const int8_t *xp, int wp,
+                                            int8_signs_t signs) {
+    conv_amx_rowseg_body(l, out, xp, wp, l->desc.kernel, l->desc.stride, signs);
+}
+
+// 1x1 on rows with a halo: they aren't one [h * w][c_in] matrix, but they are row segments of one filter row
+TARGET_AMX_INT8 static void conv_amx_1x1_rows(const conv_layer_t *l, const acc_output_t *out, const int8_t *input,
+                                              int pitch, int8_signs_t signs) {
+    conv_amx_rowseg_body(l, out, input, pitch, 1, 1, signs);
+}
+
+// Bytes the row-segment paths may read past the last padded row (the last block of the last row runs past it)
+static inline size_t conv_input_slack(const conv_layer_t *l) {
+    const conv_desc_t *d = &l->desc;
+    return ((size_t)CONV_BLOCK_M * d->stride + d->kernel) * d->c_in + l->k_seg_pad;
+}
+
+// Bytes of the zero-padded input of the row-segment paths, with room for the loads past the last pixel
+static inline size_t conv_padded_input_size(const conv_layer_t *l) {
+    const conv_desc_t *d = &l->desc;
+    return (size_t)(d->h + 2 * d->pad) * (d->w + 2 * d->pad) * d->c_in + conv_input_slack(l);
+}
+
+static void conv_pad_input(const conv_layer_t *l, int8_t *xp, const int8_t *input, int pitch) {
+    const conv_desc_t *d = &l->desc;
+    const int wp = d->w + 2 * d->pad;
+    memset(xp, 0, conv_padded_input_size(l));
+    for (int y = 0; y < d->h; ++y) {
+        memcpy(&xp[((size_t)(y + d->pad) * wp + d->pad) * d->c_in], &input[(size_t)y * pitch * d->c_in],
+               (size_t)d->w * d->c_in);
+    }
+}
+
+// -----------------------------------------------
+// Without AMX
+// The AVX-512 VNNI and AVX2 kernels compute up to 32 pixels at a time from the segment pointers of conv_amx_block,
+// so they run on the paths of the AMX kernels (conv_simd_*), reading the same bytes of the input.
+// The panels of output channels j .. j + 15 are contiguous, so row q (4 values of K) of the 16 channels is at
+// conv_panel(l, j / 16, 0) + q * 64, as in the kernels of int8_mul without AMX.
+
+// Pixels p .. p + pixels - 1 (up to 32) x every output channel with AVX-512 VNNI.
+// Pixel p + r reads segment s of its K from a[s] + r * a_stride (k_seg_pad bytes, as the tile loads).
+// vpdpbusd multiplies unsigned A by signed B, which is a uint8 input as it is (input_unsigned); an int8 input is
+// biased to a + 128 (a ^ 0x80) and 128 * conv_layer_t::col_sums is subtracted.
+// One step computes 4 pixels x 32 channels with 8 accumulators; each filter row is used 4 times.
+TARGET_AVX512_VNNI static void conv_avx512_vnni_block(const conv_layer_t *l, const acc_output_t *out, int p,
+                                                      int pixels, const int8_t *const *a, long a_stride,
+                                                      bool input_unsigned) {
+    const int c_out = l->desc.c_out;
+    const int seg_quads = l->k_seg_pad / 4;
+    const __m512i a_flip = _mm512_set1_epi8(input_unsigned ? 0 : (char)0x80);
+
+    for (int j = 0; j < c_out; j += CONV_BLOCK_N) {
+        const int8_t *b0 = &l->panels[conv_panel(l, j / CONV_TILE_N, 0)];
+        const int8_t *b1 = &l->panels[conv_panel(l, j / CONV_TILE_N + 1, 0)];
+        const int cols = (c_out - j < CONV_BLOCK_N) ? c_out - j : CONV_BLOCK_N;
+        const __m512i sums0 = _mm512_load_si512(&l->col_sums[j]);
+        const __m512i sums1 = _mm512_load_si512(&l->col_sums[j + CONV_TILE_N]);
+        const __m512i zero = _mm512_setzero_si512();
+        const __m512i bias0 = input_unsigned ? zero : _mm512_sub_epi32(zero, _mm512_slli_epi32(sums0, 7));
+        const __m512i bias1 = input_unsigned ? zero : _mm512_sub_epi32(zero, _mm512_slli_epi32(sums1, 7));
+
+        for (int i = 0; i < pixels; i += 4) {
+            __m512i acc[4][2];
+            for (int r = 0; r < 4; ++r) {
+                acc[r][0] = bias0;
+                acc[r][1] = bias1;
+            }
+
+            for (int s = 0; s < l->k_segs; ++s) {
+                // Pixels past `pixels` repeat the last one and are not stored
+                const int8_t *ar[4];
+                for (int r = 0; r < 4; ++r) {
+                    ar[r] = a[s] + (i + r < pixels ? i + r : pixels - 1) * a_stride;
+                }
+                const int8_t *bs0 = &b0[(size_t)s * seg_quads * 64];
+                const int8_t *bs1 = &b1[(size_t)s * seg_quads * 64];
+
+                for (int q = 0; q < seg_quads; ++q) {
+                    const __m512i vb0 = _mm512_load_si512(&bs0[q * 64]);
+                    const __m512i vb1 = _mm512_load_si512(&bs1[q * 64]);
+
+                    for (int r = 0; r < 4; ++r) {
+                        int32_t quad;
+                        memcpy(&quad, &ar[r][q * 4], 4);
+                        const __m512i va = _mm512_xor_si512(_mm512_set1_epi32(quad), a_flip);
+                        acc[r][0] = _mm512_dpbusd_epi32(acc[r][0], va, vb0);
+                        acc[r][1] = _mm512_dpbusd_epi32(acc[r][1], va, vb1);
+                    }
+                }
+            }
+
+            int32_t c_edge[4][CONV_BLOCK_N];
+            for (int r = 0; r < 4; ++r) {
+                _mm512_storeu_si512(&c_edge[r][0], acc[r][0]);
+                _mm512_storeu_si512(&c_edge[r][CONV_TILE_N], acc[r][1]);
+            }
+            const int rows = (pixels - i < 4) ? pixels - i : 4;
+            acc_output_store(out, p + i, j, c_edge[0], CONV_BLOCK_N, rows, cols);
+        }
+    }
+}
+
+// Same with AVX2
+// AVX2 has no byte dot product without saturation, so the filter is widened to int16 and _mm256_madd_epi16 is used
+// (a uint8 input is zero-extended).
+// A filter row (4 values of K for 16 channels) becomes 4 vectors for channels 0-3, 4-7, 8-11 and 12-15,
+// and madd leaves 2 partial sums per channel (K pairs 0-1 and 2-3) that are added by hadd at the end.
+TARGET_AVX2 static void conv_avx2_block(const conv_layer_t *l, const acc_output_t *out, int p, int pixels,
+                                        const int8_t *const *a, long a_stride, bool input_unsigned) {
+    const int c_out = l->desc.c_out;
+    const int seg_quads = l->k_seg_pad / 4;
+
+    for (int j = 0; j < c_out; j += CONV_TILE_N) {
+        const int8_t *bj = &l->panels[conv_panel(l, j / CONV_TILE_N, 0)];
+        const int cols = (c_out - j < CONV_TILE_N) ? c_out - j : CONV_TILE_N;
+
+        for (int i = 0; i < pixels; i += 2) {
+            __m256i acc[2][4];
+            for (int r = 0; r < 2; ++r) {
+                for (int x = 0; x < 4; ++x) {
+                    acc[r][x] = _mm256_setzero_si256();
+                }
+            }
+
+            for (int s = 0; s < l->k_segs; ++s) {
+                const int8_t *ar[2];
+                for (int r = 0; r < 2; ++r) {
+                    ar[r] = a[s] + (i + r < pixels ? i + r : pixels - 1) * a_stride;
+                }
+                const int8_t *bs = &bj[(size_t)s * seg_quads * 64];
+
+                for (int q = 0; q < seg_quads; ++q) {
+                    __m256i vb[4];
+                    for (int x = 0; x < 4; ++x) {
+                        vb[x] = _mm256_cvtepi8_epi16(_mm_load_si128((const __m128i *)&bs[q * 64 + x * 16]));
+                    }
+
+                    for (int r = 0; r < 2; ++r) {
+                        // 4 values of the input as int16, repeated for every channel
+                        int32_t quad;
+                        memcpy(&quad, &ar[r][q * 4], 4);
+                        const __m128i a_quad = _mm_cvtsi32_si128(quad);
+                        const __m128i a4 = input_unsigned ? _mm_cvtepu8_epi16(a_quad) : _mm_cvtepi8_epi16(a_quad);
+                        const __m256i va = _mm256_broadcastq_epi64(a4);
+                        for (int x = 0; x < 4; ++x) {
+                            acc[r][x] = _mm256_add_epi32(acc[r][x], _mm256_madd_epi16(va, vb[x]));
+                        }
+                    }
+                }
+            }
+
+            int32_t c_edge[2][CONV_TILE_N];
+            for (int r = 0; r < 2; ++r) {
+                _mm256_storeu_si256((__m256i *)&c_edge[r][0],
+                                    _mm256_permute4x64_epi64(_mm256_hadd_epi32(acc[r][0], acc[r][1]), 0xd8));
+                _mm256_storeu_si256((__m256i *)&c_edge[r][8],
+                                    _mm256_permute4x64_epi64(_mm256_hadd_epi32(acc[r][2], acc[r][3]), 0xd8));
+            }
+            const int rows = (pixels - i < 2) ? pixels - i : 2;
+            acc_output_store(out, p + i, j, c_edge[0], CONV_TILE_N, rows, cols);
+        }
+    }
+}
+
+// Pixels p .. p + pixels - 1 with the widest kernel of the CPU
+static inline void conv_simd_block(const conv_layer_t *l, const acc_output_t *out, int p, int pixels,
+                                   const int8_t *const *a, long a_stride, bool input_unsigned) {
+    if (cpu_features.avx512_vnni) {
+        conv_avx512_vnni_block(l, out, p, pixels, a, a_stride, input_unsigned);
+    } else {
+        conv_avx2_block(l, out, p, pixels, a, a_stride, input_unsigned);
+    }
+}
+
+// The paths of the AMX kernels (conv_amx_im2col, conv_amx_1x1 and conv_amx_rowseg_body) with conv_simd_block
+
+static void conv_simd_im2col_block(const conv_layer_t *l, const acc_output_t *out, const int8_t *input, int pitch,
+                                   int8_t *buf, int p, int pixels, bool input_unsigned) {
+    conv_im2col(l, buf, input, pitch, p, pixels);
+
+    const int8_t *a[CONV_MAX_KERNEL];
+    for (int s = 0; s < l->k_segs; ++s) {
+        a[s] = &buf[s * l->k_seg_pad];
+    }
+    conv_simd_block(l, out, p, pixels, a, l->k_pad, input_unsigned);
+}
+
+static void conv_simd_im2col(const conv_layer_t *l, const acc_output_t *out, const int8_t *input, int pitch,
+                             int8_t *buf, bool input_unsigned) {
+    const int num_pixels = l->out_h * l->out_w;
+    for (int p = 0; p < num_pixels; p += CONV_BLOCK_M) {
+        const int pixels = (num_pixels - p < CONV_BLOCK_M) ? num_pixels - p : CONV_BLOCK_M;
+        conv_simd_im2col_block(l, out, input, pitch, buf, p, pixels, input_unsigned);
+    }
+}
+
+static void conv_simd_1x1(const conv_layer_t *l, const acc_output_t *out, const int8_t *input, int8_t *buf,
+                          bool input_unsigned) {
+    const int c_in = l->desc.c_in;
+    const int num_pixels = l->out_h * l->out_w;
+    const size_t input_size = (size_t)num_pixels * c_in;
+
+    for (int p = 0; p < num_pixels; p += CONV_BLOCK_M) {
+        const int pixels = (num_pixels - p < CONV_BLOCK_M) ? num_pixels - p : CONV_BLOCK_M;
+        if ((size_t)(p + pixels - 1) * c_in + l->k_pad > input_size) {
+            conv_simd_im2col_block(l, out, input, l->desc.w, buf, p, pixels, input_unsigned);
+            continue;
+        }
+
+        const int8_t *a[1] = {&input[(size_t)p * c_in]};
+        conv_simd_block(l, out, p, pixels, a, c_in, input_unsigned);
+    }
+}
+
+// Also 1x1 on rows with a halo (kernel 1, stride 1), as conv_amx_1x1_rows
+static void conv_simd_rowseg(const conv_layer_t *l, const acc_output_t *out, const int8_t *xp, int wp,
+                             bool input_unsigned) {
+    const int c_in = l->desc.c_in;
+    const int stride = l->desc.stride;
+    const long a_stride = (long)stride * c_in;
+
+    for (int oy = 0; oy < l->out_h; ++oy) {
+        for (int ox = 0; ox < l->out_w; ox += CONV_BLOCK_M) {
+            const int pixels = (l->out_w - ox < CONV_BLOCK_M) ? l->out_w - ox : CONV_BLOCK_M;
+
+            const int8_t *a[CONV_MAX_KERNEL];
+            for (int fr = 0; fr < l->desc.kernel; ++fr) {
+                a[fr] = &xp[((size_t)(oy * stride + fr) * wp + (size_t)ox * stride) * c_in];
+            }
+            conv_simd_block(l, out, oy * l->out_w + ox, pixels, a, a_stride, input_unsigned);
+        }
+    }
+}
+
+// Without AVX2
+static void conv_scalar(const conv_layer_t *l, const acc_output_t *out, const int8_t *input, int pitch,
+                        bool input_unsigned) {
+    const conv_desc_t *d = &l->desc;
+    int32_t *acc = (int32_t *)l->scratch; // one output pixel
+
+    for (int oy = 0; oy < l->out_h; ++oy) {
+        for (int ox = 0; ox < l->out_w; ++ox) {
+            for (int och = 0; och < d->c_out; ++och) {
+                const int8_t *col = &l->panels[conv_panel(l, och / CONV_TILE_N, 0) + (och % CONV_TILE_N) * 4];
+                int32_t sum = 0;
+                for (int fr = 0; fr < d->kernel; ++fr) {
+                    for (int fc = 0; fc < d->kernel; ++fc) {
+                        const int y = oy * d->stride - d->pad + fr * d->dilation;
+                        const int x = ox * d->stride - d->pad + fc * d->dilation;
+                        if (y < 0 || y >= d->h || x < 0 || x >= d->w)
+                            continue;
+                        const int kk0 = (fr * d->kernel + fc) * d->c_in;
+                        for (int ich = 0; ich < d->c_in; ++ich) {
+                            const int kk = kk0 + ich;
+                            const int q = kk / l->k_seg * l->k_seg_pad + kk % l->k_seg;
+                            const int8_t v = input[((size_t)y * pitch + x) * d->c_in + ich];
+                            sum += (input_unsigned ? (uint8_t)v : v) * col[(q / 4) * (CONV_TILE_N * 4) + q % 4];
+                        }
+                    }
+                }
+                acc[och] = sum;
+            }
+            acc_output_store(out, (size_t)oy * l->out_w + ox, 0, acc, d->c_out, 1, d->c_out);
+        }
+    }
+}
+
+// -----------------------------------------------
+
+// Run a layer on input[h][pitch][c_in] (input is pixel (0, 0)), which has `halo` zero pixels on every side and
+// `slack` zero bytes after the last padded row (0 and 0 for a dense array); its bytes are uint8 with input_unsigned
+static void conv_run_input(const conv_layer_t *l, const acc_output_t *out, const int8_t *input, int pitch, int halo,
+                           size_t slack, bool input_unsigned) {
+    const conv_desc_t *d = &l->desc;
+    const int8_signs_t signs = int8_signs(input_unsigned, false);
+    const bool amx = cpu_features.amx_int8;
+    if (!amx && !cpu_features.avx512_vnni && !cpu_features.avx2) {
+        conv_scalar(l, out, input, pitch, input_unsigned);
+        return;
+    }
+
+    if (amx)
+        conv_init_tile_config();
+
+    const bool in_place = halo >= d->pad && slack >= conv_input_slack(l);
+    if (l->path == CONV_PATH_3X3S1 || l->path == CONV_PATH_ROWSEG) {
+        const int8_t *xp = input - ((size_t)d->pad * pitch + d->pad) * d->c_in;
+        int wp = pitch;
+        int8_t *copy = NULL;
+        if (!in_place) {
+            copy = (int8_t *)aligned_alloc(64, CONV_ROUND_UP(conv_padded_input_size(l), 64));
+            conv_pad_input(l, copy, input, pitch);
+            xp = copy;
+            wp = d->w + 2 * d->pad;
+        }
+        if (!amx) {
+            conv_simd_rowseg(l, out, xp, wp, input_unsigned);
+        } else if (l->path == CONV_PATH_3X3S1) {
+            conv_amx_3x3s1(l, out, xp, wp, signs);
+        } else {
+            conv_amx_rowseg(l, out, xp, wp, signs);
+        }
+        free(copy);
+        return;
+    }
+
+    if (l->path == CONV_PATH_1X1 && pitch == d->w) {
+        if (amx) {
+            conv_amx_1x1(l, out, input, l->scratch, signs);
+        } else {
+            conv_simd_1x1(l, out, input, l->scratch, input_unsigned);
+        }
+    } else if (l->path == CONV_PATH_1X1 && in_place) {
+        if (amx) {
+            conv_amx_1x1_rows(l, out, input, pitch, signs);
+        } else {
+            conv_simd_rowseg(l, out, input, pitch, input_unsigned);
+        }
+    } else if (amx) {
+        conv_amx_im2col(l, out, input, pitch, l->scratch, signs);
+    } else {
+        conv_simd_im2col(l, out, input, pitch, l->scratch, input_unsigned);
+    }
+}
+
+static void conv_run_output(const conv_layer_t *l, const acc_output_t *out, const int8_t *input, bool input_unsigned) {
+    conv_run_input(l, out, input, l->desc.w, 0, 0, input_unsigned);
+}
+
+// Run a layer: output[out_h][out_w][c_out] = input[h][w][c_in] (*) filter
+static inline void conv_run(const conv_layer_t *l, int32_t *output, const int8_t *input) {
+    const acc_output_t out = {.data = output, .ld = (size_t)l->desc.c_out};
+    conv_run_output(l, &out, input, false);
+}
+
+// Same as conv_run with a uint8 input (no shift into int8, no zero-point correction)
+static inline void conv_run_u8(const conv_layer_t *l, int32_t *output, const uint8_t *input) {
+    const acc_output_t out = {.data = output, .ld = (size_t)l->desc.c_out};
+    conv_run_output(l, &out, (const int8_t *)input, true);
+}
+
+// Same as conv_run, but every block is requantized as it leaves the tiles:
+// output is int8_t (or uint8_t, see requant_t) [out_h][out_w][c_out], ready to be the input of the next layer.
+static inline void conv_run_requant(const conv_layer_t *l, void *output, const int8_t *input, const requant_t *q) {
+    const acc_output_t out = {.data = output, .ld = (size_t)l->desc.c_out, .requant = q};
+    conv_run_output(l, &out, input, false);
+}
+
+// Same as conv_run_requant with a uint8 input, e.g. the uint8 output of the previous layer (requant_t::is_unsigned)
+static inline void conv_run_requant_u8(const conv_layer_t *l, void *output, const uint8_t *input,
+                                       const requant_t *q) {
+    const acc_output_t out = {.data = output, .ld = (size_t)l->desc.c_out, .requant = q};
+    conv_run_output(l, &out, (const int8_t *)input, true);
+}
+
+// An input tensor of l from the arena, which the row-segment paths read in place (halo = pad, slack for the
+// loads past the last pixel)
+static inline tensor_t conv_input_tensor(tensor_arena_t *a, const conv_layer_t *l, int halo) {
+    if (halo < l->desc.pad)
+        halo = l->desc.pad;
+    return tensor_alloc(a, l->desc.h, l->desc.w, l->desc.c_in, 1, halo, conv_input_slack(l));
+}
+
+// Run a layer on tensors: output is [out_h][out_w][c_out] of int32 (q == NULL, elem_size 4) or requantized
+// (elem_size 1), and only its inside is written, so its halo stays zero. The input may be uint8 (is_unsigned).
+// Returns false when the shapes don't match the layer.
+static inline bool conv_run_tensor(const conv_layer_t *l, const tensor_t *output, const tensor_t *input,
+                                   const requant_t *q) {
+    const conv_desc_t *d = &l->desc;
+    if (input->h != d->h || input->w != d->w || input->c != d->c_in || input->elem_size != 1 ||
+        output->h != l->out_h || output->w != l->out_w || output->c != d->c_out ||
+        output->elem_size != (q == NULL ? (int)sizeof(int32_t) : 1)) {
+        fprintf(stderr, "conv: tensor shapes don't match the layer\n");
+        return false;
+    }
+
+    const acc_output_t out = {.data = output->data,
+                              .ld = (size_t)d->c_out,
+                              .requant = q,
+                              .row_pixels = l->out_w,
+                              .row_stride = (size_t)output->pitch * d->c_out};
+    conv_run_input(l, &out, (const int8_t *)input->data, input->pitch, input->halo, input->slack, input->is_unsigned);
+    return true;
+}
+
+// -----------------------------------------------
+// Autotuned path
+// conv_select_path guesses from the shape; conv_create_tuned times every path that can run the shape instead
+// (on a zero input, AMX doesn't care about the values) and keeps the fastest in the tuning cache
+// (common/autotune.h), keyed by the shape, so the next process creates the layer without timing anything.
+
+typedef struct conv_tune_args_t {
+    const conv_layer_t *l;
+    int32_t *output;
+    const int8_t *input;
+} conv_tune_args_t;
+
+static inline void conv_tune_run(void *arg) {
+    const conv_tune_args_t *args = (const conv_tune_args_t *)arg;
+    conv_run(args->l, args->output, args->input);
+}
+
+static inline bool conv_path_supported(const conv_desc_t *d, conv_path_t path) {
+    switch (path) {
+    case CONV_PATH_1X1:
+        return d->kernel == 1 && d->stride == 1 && d->pad == 0;
+    case CONV_PATH_3X3S1:
+        return d->kernel == 3 && d->stride == 1 && d->dilation == 1;
+    case CONV_PATH_ROWSEG:
+        return d->dilation == 1;
+    default:
+        return true;
+    }
+}
+
+// conv_create with the fastest path for the shape on this CPU. *cached tells whether it came from the cache.
+// Only the path is tuned: the blocking of every kernel is fixed. With the AVX-512 VNNI and AVX2 kernels the paths
+// are 1x1, row segments (3x3 s1 is the same there) and im2col. The ISA that runs is part of the key, so
+// AMX_EXAMPLE_ISA gets entries of its own. Without AVX2 (conv_scalar has no paths) it is conv_create.
+static inline conv_layer_t *conv_create_tuned(const conv_desc_t *d, const int8_t *filter, autotune_cache_t *cache,
+                                              bool *cached) {
+    *cached = false;
+    const char *isa = cpu_features.amx_int8      ? "amx"
+                      : cpu_features.avx512_vnni ? "avx512-vnni"
+                      : cpu_features.avx2        ? "avx2"
+                                                 : NULL;
+    if (isa == NULL)
+        return conv_create(d, filter);
+
+    char key[AUTOTUNE_MAX_KEY];
+    snprintf(key, sizeof(key), "int8_conv %s h%d w%d c%d-%d k%d s%d p%d d%d", isa, d->h, d->w, d->c_in, d->c_out,
+             d->kernel, d->stride, d->pad, d->dilation);
+
+    int path = conv_select_path(d);
+    if (autotune_cache_lookup(cache, key, &path, 1) && path >= CONV_PATH_1X1 && path <= CONV_PATH_IM2COL &&
+        conv_path_supported(d, (conv_path_t)path)) {
+        *cached = true;
+        return conv_create_path(d, filter, (conv_path_t)path);
+    }
+
+    conv_layer_t *best = NULL;
+    double best_ms = 1e30;
+    int8_t *input = NULL;
+    int32_t *output = NULL;
+    for (int p = CONV_PATH_1X1; p <= CONV_PATH_IM2COL; ++p) {
+        if (!conv_path_supported(d, (conv_path_t)p))
+            continue;
+        conv_layer_t *l = conv_create_path(d, filter, (conv_path_t)p);
+        if (l == NULL) {
+            if (best != NULL)
+                conv_destroy(best);
+            free(input);
+            free(output);
+            return NULL;
+        }
+        if (input == NULL) {
+            input = (int8_t *)calloc((size_t)d->h * d->w * d->c_in, 1);
+            output = (int32_t *)malloc((size_t)l->out_h * l->out_w * d->c_out * sizeof(int32_t));
+        }
+
+        conv_tune_args_t args = {l, output, input};
+        const double ms = autotune_measure(conv_tune_run, &args);
+        if (ms < best_ms) {
+            if (best != NULL)
+                conv_destroy(best);
+            best = l;
+            best_ms = ms;
+        } else {
+            conv_destroy(l);
+        }
+    }
+    free(input);
+    free(output);
+
+    path = best->path;
+    autotune_cache_store(cache, key, &path, 1, best_ms);
+    return best;
+}
@@ -0,0 +1,427 @@
+#pragma once
+
+#include <immintrin.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "amx.h"
+#include "bf16.h"
+#include "conv.h"
+#include "cpu_features.h"
+#include "vnni_pack.h"
+
+// -----------------------------------------------
+// Runtime-shaped bf16 convolution
+// The bf16 counterpart of common/conv.h, for models that need more than int8.
+//
+// input:  float or bf16 (uint16_t) [h][w][c_in]   (NHWC, batch 1)
+// filter: float [kernel][kernel][c_in][c_out], converted to bf16 and packed once by conv_bf16_create
+// output: float or bf16 [out_h][out_w][c_out]; the sums are fp32 (_tile_dpbf16ps) and rounded once at the end
+//
+// There is no im2col, as in conv_amx_v4 and the row-segment paths of conv.h: for filter row fr, the K values
+// (fc, ich) of a pixel are kernel * c_in contiguous bf16 of padded input row oy * stride + fr, and the next pixel
+// starts stride * c_in values later, so the A tiles are loaded from the zero-padded bf16 input directly.
+// The filter panels use the pair interleave of b16_transformed in bf16_mul (2 K values per 4 bytes).
+// A block is 32 pixels of one output row x 32 output channels in 4 C tiles. Dilation must be 1.
+// Without AMX, vdpbf16ps (AVX-512 BF16) or a scalar kernel reads the same padded input and packed filter.
+
+// One tile holds 16 pixels x 32 K of bf16 (A), 32 K x 16 channels (B) or 16 pixels x 16 channels of fp32 (C)
+#define CONV_BF16_TILE_K 32
+
+typedef struct conv_bf16_layer_t {
+    conv_desc_t desc;
+    int out_h, out_w;
+    int k_seg, k_seg_pad; // K of a filter row (kernel * c_in), padded to CONV_BF16_TILE_K
+    int k_pad;            // kernel * k_seg_pad
+    int n_pad;            // c_out padded to CONV_BLOCK_N
+    uint16_t *panels;     // 64-byte aligned
+    uint16_t *xp;         // the zero-padded bf16 input [h + 2 * pad][w + 2 * pad][c_in] and the slack, 64-byte
+                          // aligned; every run writes the inside (so the run functions take a non-const layer),
+                          // and a layer is run by one thread at a time
+} conv_bf16_layer_t;
+
+// Offset of panel (j, kb) in conv_bf16_layer_t::panels: K values kb * 32 .. +32 of output channels
+// j * 16 .. +16 as a [16][32] tile
+static inline size_t conv_bf16_panel(const conv_bf16_layer_t *l, int j, int kb) {
+    return ((size_t)j * (l->k_pad / CONV_BF16_TILE_K) + kb) * (CONV_BF16_TILE_K * CONV_TILE_N);
+}
+
+// Values the tile loads may read past the last padded row (the last block of the last row runs past it)
+static inline size_t conv_bf16_input_slack(const conv_bf16_layer_t *l) {
+    const conv_desc_t *d = &l->desc;
+    return ((size_t)CONV_BLOCK_M * d->stride + d->kernel) * d->c_in + l->k_seg_pad;
+}
+
+static inline size_t conv_bf16_padded_input_size(const conv_bf16_layer_t *l) {
+    const conv_desc_t *d = &l->desc;
+    return (size_t)(d->h + 2 * d->pad) * (d->w + 2 * d->pad) * d->c_in + conv_bf16_input_slack(l);
+}
+
+// Returns NULL when the shape isn't supported
+static inline conv_bf16_layer_t *conv_bf16_create(const conv_desc_t *desc, const float *filter) {
+    if (desc->h < 1 || desc->w < 1 || desc->c_in < 1 || desc->c_out < 1 || desc->kernel < 1 ||
+        desc->kernel > CONV_MAX_KERNEL || desc->stride < 1 || desc->pad < 0 || desc->dilation != 1 ||
+        conv_out_size(desc->h, desc->kernel, desc->stride, desc->pad, 1) < 1 ||
+        conv_out_size(desc->w, desc->kernel, desc->stride, desc->pad, 1) < 1) {
+        fprintf(stderr, "conv_bf16: unsupported shape\n");
+        return NULL;
+    }
+
+    conv_bf16_layer_t *l = (conv_bf16_layer_t *)malloc(sizeof(conv_bf16_layer_t));
+    const conv_desc_t *d = &l->desc;
+    l->desc = *desc;
+    l->out_h = conv_out_size(d->h, d->kernel, d->stride, d->pad, 1);
+    l->out_w = conv_out_size(d->w, d->kernel, d->stride, d->pad, 1);
+    l->k_seg = d->kernel * d->c_in;
+    l->k_seg_pad = CONV_ROUND_UP(l->k_seg, CONV_BF16_TILE_K);
+    l->k_pad = d->kernel * l->k_seg_pad;
+    l->n_pad = CONV_ROUND_UP(d->c_out, CONV_BLOCK_N);
+
+    const size_t size = (size_t)l->k_pad * l->n_pad * sizeof(uint16_t);
+    l->panels = (uint16_t *)aligned_alloc(64, size);
+    memset(l->panels, 0, size);
+
+    // K value kk of filter row s is row s * k_seg + kk of the filter ([kernel][kernel][c_in][c_out]);
+    // 2 rows are interleaved into one tile row
+    const size_t filter_size = (size_t)d->kernel * d->kernel * d->c_in * d->c_out;
+    uint16_t *filter16 = (uint16_t *)malloc(filter_size * sizeof(uint16_t));
+    bf16_convert(filter16, filter, (int)filter_size);
+
+    const size_t chunk_stride = conv_bf16_panel(l, 1, 0) * sizeof(uint16_t);
+    uint16_t *zeros = (uint16_t *)calloc(d->c_out, sizeof(uint16_t));
+
+    for (int q = 0; q < l->k_pad; q += 2) {
+        const uint16_t *rows[2];
+        for (int i = 0; i < 2; ++i) {
+            const int s = (q + i) / l->k_seg_pad;
+            const int kk = (q + i) % l->k_seg_pad;
+            rows[i] = (kk < l->k_seg) ? &filter16[((size_t)s * l->k_seg + kk) * d->c_out] : zeros;
+        }
+
+        uint16_t *dst =
+            &l->panels[conv_bf16_panel(l, 0, q / CONV_BF16_TILE_K) + (q % CONV_BF16_TILE_K) / 2 * (CONV_TILE_N * 2)];
+        vnni_interleave2_bf16(dst, chunk_stride, rows[0], rows[1], d->c_out);
+    }
+
+    free(zeros);
+    free(filter16);
+
+    // The border and the slack are zeroed once; a run writes only the inside
+    const size_t xp_size = CONV_ROUND_UP(conv_bf16_padded_input_size(l) * sizeof(uint16_t), 64);
+    l->xp = (uint16_t *)aligned_alloc(64, xp_size);
+    memset(l->xp, 0, xp_size);
+    return l;
+}
+
+static inline void conv_bf16_destroy(conv_bf16_layer_t *l) {
+    free(l->panels);
+    free(l->xp);
+    free(l);
+}
+
+// Naive convolution (the reference): the input and the filter are rounded to bf16 as the layer does,
+// and the products are summed in double
+static inline void conv_bf16_ref(const conv_desc_t *d, float *output, const float *input, const float *filter) {
+    const int out_h = conv_out_size(d->h, d->kernel, d->stride, d->pad, 1);
+    const int out_w = conv_out_size(d->w, d->kernel, d->stride, d->pad, 1);
+
+    for (int oy = 0; oy < out_h; ++oy) {
+        for (int ox = 0; ox < out_w; ++ox) {
+            for (int och = 0; och < d->c_out; ++och) {
+                double sum = 0;
+                for (int fr = 0; fr < d->kernel; ++fr) {
+                    for (int fc = 0; fc < d->kernel; ++fc) {
+                        const int y = oy * d->stride - d->pad + fr;
+                        const int x = ox * d->stride - d->pad + fc;
+                        if (y < 0 || y >= d->h || x < 0 || x >= d->w)
+                            continue;
+                        for (int ich = 0; ich < d->c_in; ++ich) {
+                            const float v = input[((size_t)y * d->w + x) * d->c_in + ich];
+                            const float f = filter[(((size_t)fr * d->kernel + fc) * d->c_in + ich) * d->c_out + och];
+                            sum += (double)bf16_to_fp32(bf16_from_fp32(v)) *
+                                   bf16_to_fp32(bf16_from_fp32(f));
+                        }
+                    }
+                }
+                output[((size_t)oy * out_w + ox) * d->c_out + och] = (float)sum;
+            }
+        }
+    }
+}
+
+// Copy the input (float, or bf16 with input_bf16) into the inside of conv_bf16_layer_t::xp
+static void conv_bf16_pad_input(conv_bf16_layer_t *l, const void *input, bool input_bf16) {
+    const conv_desc_t *d = &l->desc;
+    const int wp = d->w + 2 * d->pad;
+    const size_t row = (size_t)d->w * d->c_in;
+
+    for (int y = 0; y < d->h; ++y) {
+        uint16_t *dst = &l->xp[((size_t)(y + d->pad) * wp + d->pad) * d->c_in];
+        if (input_bf16) {
+            memcpy(dst, (const uint16_t *)input + y * row, row * sizeof(uint16_t));
+        } else {
+            bf16_convert(dst, (const float *)input + y * row, (int)row);
+        }
+    }
+}
+
+// Store rows x cols fp32 sums (acc_stride apart) at pixel p, channel j of the output (float or bf16)
+static inline void conv_bf16_store(const conv_bf16_layer_t *l, void *output, bool output_bf16, int p, int j,
+                                   const float *acc, int acc_stride, int rows, int cols) {
+    const int c_out = l->desc.c_out;
+    for (int r = 0; r < rows; ++r) {
+        const size_t offset = (size_t)(p + r) * c_out + j;
+        if (output_bf16) {
+            bf16_convert((uint16_t *)output + offset, &acc[r * acc_stride], cols);
+        } else {
+            memcpy((float *)output + offset, &acc[r * acc_stride], cols * sizeof(float));
+        }
+    }
+}
+
+// -----------------------------------------------
+// AMX
+
+TARGET_AMX_BF16 static void conv_bf16_init_tile_config() {
+    tile_config_t tile = {0};
+    tile.palette_id = 1;
+
+    // C tiles: 16 pixels x 16 output channels of fp32
+    for (int t = TILE_0; t <= TILE_3; ++t) {
+        tile.colsb[t] = CONV_TILE_N * sizeof(float);
+        tile.rows[t] = CONV_TILE_M;
+    }
+    // A tiles: 16 pixels x 32 K of bf16
+    for (int t = TILE_4; t <= TILE_5; ++t) {
+        tile.colsb[t] = CONV_BF16_TILE_K * sizeof(uint16_t);
+        tile.rows[t] = CONV_TILE_M;
+    }
+    // B tiles: 32 K x 16 output channels, stored as [16][32]
+    for (int t = TILE_6; t <= TILE_7; ++t) {
+        tile.colsb[t] = CONV_TILE_N * 2 * sizeof(uint16_t);
+        tile.rows[t] = CONV_BF16_TILE_K / 2;
+    }
+
+    _tile_loadconfig(&tile);
+}
+
+// Compute output pixels p .. p + 31 (of which the first `pixels` are stored) x channels j .. j + 31.
+// Pixel p + r reads filter row s from a0[s] + r * a_stride (r < 16) or a1[s] + (r - 16) * a_stride (in bytes).
+TARGET_AMX_BF16 static inline void conv_bf16_amx_block(const conv_bf16_layer_t *l, void *output, bool output_bf16,
+                                                       int p, int pixels, const uint16_t *const *a0,
+                                                       const uint16_t *const *a1, long a_stride, int j) {
+    const int c_out = l->desc.c_out;
+    const int seg_blocks = l->k_seg_pad / CONV_BF16_TILE_K;
+    const uint16_t *b0 = &l->panels[conv_bf16_panel(l, j / CONV_TILE_N, 0)];
+    const uint16_t *b1 = &l->panels[conv_bf16_panel(l, j / CONV_TILE_N + 1, 0)];
+
+    _tile_zero(TILE_0);
+    _tile_zero(TILE_1);
+    _tile_zero(TILE_2);
+    _tile_zero(TILE_3);
+
+    for (int s = 0; s < l->desc.kernel; ++s) {
+        for (int kb = 0; kb < seg_blocks; ++kb) {
+            const size_t panel = (size_t)(s * seg_blocks + kb) * (CONV_BF16_TILE_K * CONV_TILE_N);
+            _tile_loadd(TILE_4, a0[s] + kb * CONV_BF16_TILE_K, a_stride);
+            _tile_loadd(TILE_5, a1[s] + kb * CONV_BF16_TILE_K, a_stride);
+            _tile_loadd(TILE_6, &b0[panel], CONV_TILE_N * 2 * sizeof(uint16_t));
+            _tile_loadd(TILE_7, &b1[panel], CONV_TILE_N * 2 * sizeof(uint16_t));
+
+            _tile_dpbf16ps(TILE_0, TILE_4, TILE_6);
+            _tile_dpbf16ps(TILE_1, TILE_4, TILE_7);
+            _tile_dpbf16ps(TILE_2, TILE_5, TILE_6);
+            _tile_dpbf16ps(TILE_3, TILE_5, TILE_7);
+        }
+    }
+
+    if (!output_bf16 && pixels == CONV_BLOCK_M && j + CONV_BLOCK_N <= c_out) {
+        float *c0 = (float *)output + (size_t)p * c_out + j;
+        float *c1 = c0 + (size_t)CONV_TILE_M * c_out;
+        _tile_stored(TILE_0, c0, c_out * sizeof(float));
+        _tile_stored(TILE_1, c0 + CONV_TILE_N, c_out * sizeof(float));
+        _tile_stored(TILE_2, c1, c_out * sizeof(float));
+        _tile_stored(TILE_3, c1 + CONV_TILE_N, c_out * sizeof(float));
+    } else {
+        // Last pixels or channels, or bf16 output: the whole 32 x 32 block goes to c_edge, and conv_bf16_store
+        // writes only its first `pixels` rows and `cols` channels, rounded to bf16 if asked (the rest is dropped)
+        float c_edge[CONV_BLOCK_M][CONV_BLOCK_N];
+        _tile_stored(TILE_0, &c_edge[0][0], sizeof(c_edge[0]));
+        _tile_stored(TILE_1, &c_edge[0][CONV_TILE_N], sizeof(c_edge[0]));
+        _tile_stored(TILE_2, &c_edge[CONV_TILE_M][0], sizeof(c_edge[0]));
+        _tile_stored(TILE_3, &c_edge[CONV_TILE_M][CONV_TILE_N], sizeof(c_edge[0]));
+
+        const int cols = (c_out - j < CONV_BLOCK_N) ? c_out - j : CONV_BLOCK_N;
+        conv_bf16_store(l, output, output_bf16, p, j, c_edge[0], CONV_BLOCK_N, pixels, cols);
+    }
+}
+
+// Row segments on conv_bf16_layer_t::xp: pixel (oy, ox) reads filter row fr at xp[oy * stride + fr][ox * stride].
+// 32 pixels of one output row are a block; pixels past out_w are computed from whatever follows and not stored.
+TARGET_AMX_BF16 static void conv_bf16_amx(const conv_bf16_layer_t *l, void *output, bool output_bf16) {
+    const conv_desc_t *d = &l->desc;
+    const int wp = d->w + 2 * d->pad;
+    const long a_stride = (long)d->stride * d->c_in * sizeof(uint16_t);
+
+    for (int oy = 0; oy < l->out_h; ++oy) {
+        for (int ox = 0; ox < l->out_w; ox += CONV_BLOCK_M) {
+            const int pixels = (l->out_w - ox < CONV_BLOCK_M) ? l->out_w - ox : CONV_BLOCK_M;
+
+            const uint16_t *a0[CONV_MAX_KERNEL];
+            const uint16_t *a1[CONV_MAX_KERNEL];
+            for (int fr = 0; fr < d->kernel; ++fr) {
+                a0[fr] = &l->xp[((size_t)(oy * d->stride + fr) * wp + (size_t)ox * d->stride) * d->c_in];
+                a1[fr] = a0[fr] + (size_t)CONV_TILE_M * d->stride * d->c_in;
+            }
+
+            for (int j = 0; j < l->n_pad; j += CONV_BLOCK_N) {
+                conv_bf16_amx_block(l, output, output_bf16, oy * l->out_w + ox, pixels, a0, a1, a_stride, j);
+            }
+        }
+    }
+}
+
+// -----------------------------------------------
+// Without AMX: AVX-512 BF16
+
+static inline __mmask16 conv_bf16_store_mask(int cols) { return cols <= 0 ? 0 : bf16_tail_mask(cols); }
+
+// Output pixels p .. p + pixels - 1 x every output channel with vdpbf16ps, 4 pixels x 32 channels per step.
+// A panel row is 16 channels of (k, k + 1) pairs, the operand of vdpbf16ps with the matching pair of the input
+// broadcast (as gemm_avx512_bf16_packed in bf16_mul). Pixel p + r reads filter row s from a[s] + r * a_stride.
+TARGET_AVX512_BF16 static void conv_bf16_avx512_block(const conv_bf16_layer_t *l, void *output, bool output_bf16,
+                                                      int p, int pixels, const uint16_t *const *a, size_t a_stride) {
+    const int c_out = l->desc.c_out;
+    const int seg_pairs = (l->k_seg + 1) / 2; // the panels are zero from k_seg to k_seg_pad
+
+    for (int j = 0; j < c_out; j += CONV_BLOCK_N) {
+        const uint16_t *b0 = &l->panels[conv_bf16_panel(l, j / CONV_TILE_N, 0)];
+        const uint16_t *b1 = &l->panels[conv_bf16_panel(l, j / CONV_TILE_N + 1, 0)];
+        const __mmask16 mask0 = conv_bf16_store_mask(c_out - j);
+        const __mmask16 mask1 = conv_bf16_store_mask(c_out - j - CONV_TILE_N);
+
+        for (int i = 0; i < pixels; i += 4) {
+            __m512 acc[4][2];
+            for (int r = 0; r < 4; ++r) {
+                acc[r][0] = _mm512_setzero_ps();
+                acc[r][1] = _mm512_setzero_ps();
+            }
+
+            for (int s = 0; s < l->desc.kernel; ++s) {
+                // Pixels past `pixels` repeat the last one and are not stored
+                const uint16_t *ar[4];
+                for (int r = 0; r < 4; ++r) {
+                    ar[r] = a[s] + (size_t)(i + r < pixels ? i + r : pixels - 1) * a_stride;
+                }
+                const size_t row0 = (size_t)s * l->k_seg_pad * CONV_TILE_N; // panel row of pair s * k_seg_pad / 2
+
+                for (int t = 0; t < seg_pairs; ++t) {
+                    const __m512bh vb0 = (__m512bh)_mm512_load_si512(&b0[row0 + t * (CONV_TILE_N * 2)]);
+                    const __m512bh vb1 = (__m512bh)_mm512_load_si512(&b1[row0 + t * (CONV_TILE_N * 2)]);
+                    for (int r = 0; r < 4; ++r) {
+                        uint32_t pair;
+                        memcpy(&pair, &ar[r][2 * t], sizeof(pair));
+                        const __m512bh va = (__m512bh)_mm512_set1_epi32((int)pair);
+                        acc[r][0] = _mm512_dpbf16_ps(acc[r][0], va, vb0);
+                        acc[r][1] = _mm512_dpbf16_ps(acc[r][1], va, vb1);
+                    }
+                }
+            }
+
+            for (int r = 0; r < 4 && i + r < pixels; ++r) {
+                const size_t offset = (size_t)(p + i + r) * c_out + j;
+                if (output_bf16) {
+                    uint16_t *dst = (uint16_t *)output + offset;
+                    _mm256_mask_storeu_epi16(dst, mask0, (__m256i)_mm512_cvtneps_pbh(acc[r][0]));
+                    _mm256_mask_storeu_epi16(dst + CONV_TILE_N, mask1, (__m256i)_mm512_cvtneps_pbh(acc[r][1]));
+                } else {
+                    float *dst = (float *)output + offset;
+                    _mm512_mask_storeu_ps(dst, mask0, acc[r][0]);
+                    _mm512_mask_storeu_ps(dst + CONV_TILE_N, mask1, acc[r][1]);
+                }
+            }
+        }
+    }
+}
+
+// Row segments on conv_bf16_layer_t::xp as in conv_bf16_amx, 32 pixels of one output row at a time
+TARGET_AVX512_BF16 static void conv_bf16_avx512(const conv_bf16_layer_t *l, void *output, bool output_bf16) {
+    const conv_desc_t *d = &l->desc;
+    const int wp = d->w + 2 * d->pad;
+
+    for (int oy = 0; oy < l->out_h; ++oy) {
+        for (int ox = 0; ox < l->out_w; ox += CONV_BLOCK_M) {
+            const int pixels = (l->out_w - ox < CONV_BLOCK_M) ? l->out_w - ox : CONV_BLOCK_M;
+            const uint16_t *a[CONV_MAX_KERNEL];
+            for (int fr = 0; fr < d->kernel; ++fr) {
+                a[fr] = &l->xp[((size_t)(oy * d->stride + fr) * wp + (size_t)ox * d->stride) * d->c_in];
+            }
+            conv_bf16_avx512_block(l, output, output_bf16, oy * l->out_w + ox, pixels, a,
+                                   (size_t)d->stride * d->c_in);
+        }
+    }
+}
+
+// -----------------------------------------------
+// Without AVX-512 BF16
+
+static void conv_bf16_scalar(const conv_bf16_layer_t *l, void *output, bool output_bf16) {
+    const conv_desc_t *d = &l->desc;
+    const int wp = d->w + 2 * d->pad;
+    float *acc = (float *)malloc(d->c_out * sizeof(float)); // one output pixel
+
+    for (int oy = 0; oy < l->out_h; ++oy) {
+        for (int ox = 0; ox < l->out_w; ++ox) {
+            for (int och = 0; och < d->c_out; ++och) {
+                const uint16_t *col = &l->panels[conv_bf16_panel(l, och / CONV_TILE_N, 0) + (och % CONV_TILE_N) * 2];
+                float sum = 0;
+                for (int fr = 0; fr < d->kernel; ++fr) {
+                    const uint16_t *a = &l->xp[((size_t)(oy * d->stride + fr) * wp + (size_t)ox * d->stride) * d->c_in];
+                    for (int kk = 0; kk < l->k_seg; ++kk) {
+                        const int q = fr * l->k_seg_pad + kk;
+                        sum += bf16_to_fp32(a[kk]) * bf16_to_fp32(col[(q / 2) * (CONV_TILE_N * 2) + q % 2]);
+                    }
+                }
+                acc[och] = sum;
+            }
+            conv_bf16_store(l, output, output_bf16, oy * l->out_w + ox, 0, acc, d->c_out, 1, d->c_out);
+        }
+    }
+    free(acc);
+}
+
+// -----------------------------------------------
+
+// Run a layer: output[out_h][out_w][c_out] = input[h][w][c_in] (*) filter,
+// with input and output of float, or of bf16 with input_bf16 / output_bf16.
+// The input is copied into l->xp, so l is not const.
+static void conv_bf16_run_io(conv_bf16_layer_t *l, void *output, bool output_bf16, const void *input,
+                             bool input_bf16) {
+    conv_bf16_pad_input(l, input, input_bf16);
+
+    if (cpu_features.amx_bf16) {
+        conv_bf16_init_tile_config();
+        conv_bf16_amx(l, output, output_bf16);
+    } else if (cpu_features.avx512_bf16) {
+        conv_bf16_avx512(l, output, output_bf16);
+    } else {
+        conv_bf16_scalar(l, output, output_bf16);
+    }
+}
+
+// The kernel conv_bf16_run_io uses on this CPU
+static inline const char *conv_bf16_kernel_name() {
+    return cpu_features.amx_bf16 ? "AMX-BF16" : cpu_features.avx512_bf16 ? "AVX512-BF16" : "scalar";
+}
+
+static inline void conv_bf16_run(conv_bf16_layer_t *l, float *output, const float *input) {
+    conv_bf16_run_io(l, output, false, input, false);
+}
+
+// bf16 in and out, e.g. from one layer to the next
+static inline void conv_bf16_run_bf16(conv_bf16_layer_t *l, uint16_t *output, const uint16_t *input) {
+    conv_bf16_run_io(l, output, true, input, true);
+}
@@ -0,0 +1,437 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "conv.h"
+#include "requant.h"
+#include "tensor.h"
+
+// -----------------------------------------------
+// Layer graph with strip fusion
+// A chain of convolutions (each requantized into the int8 / uint8 input of the next, see common/requant.h) and
+// max pooling layers is run in strips of rows instead of layer by layer: a strip of output rows of the last layer
+// is computed through every layer before the next strip, so the activations between the layers never leave L2.
+//
+//   conv_graph_t *g = conv_graph_create(h, w, c);
+//   conv_graph_add_conv(g, layer0, &q0);       // requantized (int8 / uint8) output
+//   conv_graph_add_maxpool(g, 3, 2, 1);         // kernel, stride, pad
+//   conv_graph_add_conv(g, layer1, NULL);       // int32 output, the last layer only
+//   conv_graph_plan(g, 0);                      // strips sized to L2
+//   conv_graph_run(g, &output, &input);         // input from conv_graph_input_tensor
+//
+// Between two layers there is a line buffer of rows of the full width (with a halo of zero pixels for the padding
+// of the next layer). Rows the next layer won't read any more are dropped before a layer adds its rows for a
+// strip, so only the halo rows (those the windows of two strips share) are kept and nothing is computed twice.
+// The padding rows above and below the image are zero rows of the line buffer.
+//
+// A convolution runs on a strip through a copy of its conv_layer_t shaped as the rows of the strip without
+// padding (the left and right padding is the halo of the line buffer, the top and bottom padding its zero rows),
+// so every path of common/conv.h runs unchanged, in place on the line buffer.
+// The layers (and their requant_t arrays) belong to the caller; a graph is run by one thread at a time.
+
+#define CONV_GRAPH_MAX_NODES 16
+
+typedef enum conv_graph_op_t {
+    CONV_GRAPH_CONV,
+    CONV_GRAPH_MAXPOOL,
+} conv_graph_op_t;
+
+typedef struct conv_graph_node_t {
+    conv_graph_op_t op;
+    const conv_layer_t *conv; // CONV_GRAPH_CONV
+    requant_t q;
+    bool requant;                      // false: int32 output (the last node only)
+    int kernel, stride, pad, dilation; // the window
+    int h, w, c_in;                    // input
+    int out_h, out_w, c_out;
+} conv_graph_node_t;
+
+typedef struct conv_graph_t {
+    int h, w, c; // input
+    int num_nodes;
+    conv_graph_node_t nodes[CONV_GRAPH_MAX_NODES];
+
+    // Set by conv_graph_plan
+    int strip_rows; // output rows of the last node per strip
+    tensor_t buffers[CONV_GRAPH_MAX_NODES - 1]; // output rows of node i; data is (row 0, pixel 0), h the capacity
+    size_t buffer_bytes;                        // of all line buffers
+    uint8_t *memory;
+} conv_graph_t;
+
+// Rows of a tensor or a line buffer: row y of the image is row y - first of t
+typedef struct conv_graph_rows_t {
+    tensor_t t;
+    int first;
+    const uint8_t *end; // end of the memory, up to which the tile loads may run
+} conv_graph_rows_t;
+
+static inline uint8_t *conv_graph_pixel(const conv_graph_rows_t *r, int y, int x) {
+    return (uint8_t *)tensor_pixel(&r->t, y - r->first, x);
+}
+
+static inline conv_graph_t *conv_graph_create(int h, int w, int c) {
+    conv_graph_t *g = (conv_graph_t *)calloc(1, sizeof(conv_graph_t));
+    g->h = h;
+    g->w = w;
+    g->c = c;
+    return g;
+}
+
+static inline void conv_graph_destroy(conv_graph_t *g) {
+    free(g->memory);
+    free(g);
+}
+
+// The next node reads the output of the last one; returns NULL when the graph is full or ends in int32
+static inline conv_graph_node_t *conv_graph_next_node(conv_graph_t *g) {
+    if (g->num_nodes == CONV_GRAPH_MAX_NODES ||
+        (g->num_nodes > 0 && g->nodes[g->num_nodes - 1].op == CONV_GRAPH_CONV && !g->nodes[g->num_nodes - 1].requant)) {
+        fprintf(stderr, "conv_graph: no node can follow\n");
+        return NULL;
+    }
+    conv_graph_node_t *n = &g->nodes[g->num_nodes];
+    memset(n, 0, sizeof(*n));
+    if (g->num_nodes == 0) {
+        n->h = g->h;
+        n->w = g->w;
+        n->c_in = g->c;
+    } else {
+        n->h = n[-1].out_h;
+        n->w = n[-1].out_w;
+        n->c_in = n[-1].c_out;
+    }
+    return n;
+}
+
+// Append a convolution; q == NULL gives the int32 accumulators, which ends the graph.
+// Returns false when the layer doesn't take the output of the last node.
+static inline bool conv_graph_add_conv(conv_graph_t *g, const conv_layer_t *layer, const requant_t *q) {
+    conv_graph_node_t *n = conv_graph_next_node(g);
+    if (n == NULL)
+        return false;
+    const conv_desc_t *d = &layer->desc;
+    if (d->h != n->h || d->w != n->w || d->c_in != n->c_in) {
+        fprintf(stderr, "conv_graph: the layer doesn't match its input\n");
+        return false;
+    }
+
+    n->op = CONV_GRAPH_CONV;
+    n->conv = layer;
+    n->requant = q != NULL;
+    if (q != NULL)
+        n->q = *q;
+    n->kernel = d->kernel;
+    n->stride = d->stride;
+    n->pad = d->pad;
+    n->dilation = d->dilation;
+    n->out_h = layer->out_h;
+    n->out_w = layer->out_w;
+    n->c_out = d->c_out;
+    g->num_nodes++;
+    return true;
+}
+
+// Append a max pooling of kernel x kernel pixels; the padding never wins (it isn't -128 or 0, it is left out)
+static inline bool conv_graph_add_maxpool(conv_graph_t *g, int kernel, int stride, int pad) {
+    conv_graph_node_t *n = conv_graph_next_node(g);
+    if (n == NULL)
+        return false;
+    if (kernel < 1 || stride < 1 || pad < 0 || pad >= kernel || conv_out_size(n->h, kernel, stride, pad, 1) < 1 ||
+        conv_out_size(n->w, kernel, stride, pad, 1) < 1) {
+        fprintf(stderr, "conv_graph: unsupported pooling\n");
+        return false;
+    }
+
+    n->op = CONV_GRAPH_MAXPOOL;
+    n->requant = true; // 1-byte output, as its input
+    n->kernel = kernel;
+    n->stride = stride;
+    n->pad = pad;
+    n->dilation = 1;
+    n->out_h = conv_out_size(n->h, kernel, stride, pad, 1);
+    n->out_w = conv_out_size(n->w, kernel, stride, pad, 1);
+    n->c_out = n->c_in;
+    g->num_nodes++;
+    return true;
+}
+
+// Bytes a node may read past the last row of its window (conv_input_slack of a convolution)
+static inline size_t conv_graph_slack(const conv_graph_node_t *n) {
+    return n->op == CONV_GRAPH_CONV ? conv_input_slack(n->conv) : 0;
+}
+
+// An input tensor of the graph from the arena, which the first layer reads in place
+static inline tensor_t conv_graph_input_tensor(tensor_arena_t *a, const conv_graph_t *g, int halo) {
+    const conv_graph_node_t *n = &g->nodes[0];
+    if (halo < n->pad)
+        halo = n->pad;
+    return tensor_alloc(a, g->h, g->w, g->c, 1, halo, conv_graph_slack(n));
+}
+
+// -----------------------------------------------
+// Max pooling
+
+// Output rows oy0 .. oy1 - 1 of a max pooling of src (h image rows) into dst, both 1 byte per value
+static void maxpool_rows(const conv_graph_rows_t *dst, const conv_graph_rows_t *src, int h, int kernel, int stride,
+                         int pad, int oy0, int oy1) {
+    const int w = src->t.w;
+    const int c = src->t.c;
+    const int out_w = dst->t.w;
+    const bool is_unsigned = src->t.is_unsigned;
+
+    for (int oy = oy0; oy < oy1; ++oy) {
+        const int y0 = oy * stride - pad < 0 ? 0 : oy * stride - pad;
+        const int y1 = oy * stride - pad + kernel > h ? h : oy * stride - pad + kernel;
+        for (int ox = 0; ox < out_w; ++ox) {
+            const int x0 = ox * stride - pad < 0 ? 0 : ox * stride - pad;
+            const int x1 = ox * stride - pad + kernel > w ? w : ox * stride - pad + kernel;
+            uint8_t *out = conv_graph_pixel(dst, oy, ox);
+            memcpy(out, conv_graph_pixel(src, y0, x0), c);
+
+            for (int y = y0; y < y1; ++y) {
+                for (int x = (y == y0) ? x0 + 1 : x0; x < x1; ++x) {
+                    const uint8_t *in = conv_graph_pixel(src, y, x);
+                    if (is_unsigned) {
+                        for (int ch = 0; ch < c; ++ch) {
+                            out[ch] = in[ch] > out[ch] ? in[ch] : out[ch];
+                        }
+                    } else {
+                        for (int ch = 0; ch < c; ++ch) {
+                            out[ch] = (int8_t)in[ch] > (int8_t)out[ch] ? in[ch] : out[ch];
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Max pooling of a whole tensor (the output shape is conv_out_size of the input with dilation 1)
+static inline void maxpool_run_tensor(const tensor_t *output, const tensor_t *input, int kernel, int stride, int pad) {
+    const conv_graph_rows_t dst = {*output, 0, NULL};
+    const conv_graph_rows_t src = {*input, 0, NULL};
+    maxpool_rows(&dst, &src, input->h, kernel, stride, pad, 0, output->h);
+}
+
+// -----------------------------------------------
+// Strips
+
+// Image rows [*begin, *end) a node reads for its output rows oy0 .. oy1 - 1, padding rows included
+static inline void conv_graph_window(const conv_graph_node_t *n, int oy0, int oy1, int *begin, int *end) {
+    *begin = oy0 * n->stride - n->pad;
+    *end = (oy1 - 1) * n->stride - n->pad + n->dilation * (n->kernel - 1) + 1;
+}
+
+// Output rows oy0 .. oy1 - 1 of node n
+static void conv_graph_run_node(const conv_graph_node_t *n, const conv_graph_rows_t *dst, const conv_graph_rows_t *src,
+                                int oy0, int oy1) {
+    if (n->op == CONV_GRAPH_MAXPOOL) {
+        maxpool_rows(dst, src, n->h, n->kernel, n->stride, n->pad, oy0, oy1);
+        return;
+    }
+
+    int iy0, iy1;
+    conv_graph_window(n, oy0, oy1, &iy0, &iy1);
+
+    // The rows of the window as an unpadded input of the same layer
+    conv_layer_t view = *n->conv;
+    view.desc.h = iy1 - iy0;
+    view.desc.w = n->w + 2 * n->pad;
+    view.desc.pad = 0;
+    view.out_h = oy1 - oy0;
+
+    const uint8_t *window_end = conv_graph_pixel(src, iy1, -n->pad);
+    const size_t available = (size_t)(src->end - window_end);
+    const size_t slack = conv_input_slack(&view);
+    const tensor_t in = {.data = conv_graph_pixel(src, iy0, -n->pad),
+                         .h = view.desc.h,
+                         .w = view.desc.w,
+                         .c = n->c_in,
+                         .elem_size = 1,
+                         .halo = 0,
+                         .pitch = src->t.pitch,
+                         .slack = available >= slack ? slack : 0,
+                         .is_unsigned = src->t.is_unsigned};
+    tensor_t out = dst->t;
+    out.data = conv_graph_pixel(dst, oy0, 0);
+    out.h = oy1 - oy0;
+    conv_run_tensor(&view, &out, &in, n->requant ? &n->q : NULL);
+}
+
+// Run (or with output == NULL only simulate) the strips of strip_rows output rows, and return the bytes of the
+// line buffers they need (their capacity in rows is stored in capacity[])
+static size_t conv_graph_schedule(const conv_graph_t *g, int strip_rows, int *capacity, const tensor_t *output,
+                                  const tensor_t *input) {
+    const int num_nodes = g->num_nodes;
+    const conv_graph_node_t *last = &g->nodes[num_nodes - 1];
+    const bool execute = output != NULL;
+
+    int done[CONV_GRAPH_MAX_NODES] = {0}; // output rows computed by each node
+    conv_graph_rows_t rows[CONV_GRAPH_MAX_NODES + 1];
+    int valid[CONV_GRAPH_MAX_NODES]; // line buffer i holds rows[i + 1].first .. valid[i] - 1
+
+    if (execute) {
+        rows[0] = (conv_graph_rows_t){*input, 0, NULL};
+        rows[0].end = (const uint8_t *)tensor_pixel(input, input->h + input->halo, -input->halo) + input->slack;
+        rows[num_nodes] = (conv_graph_rows_t){*output, 0, NULL};
+    }
+    for (int i = 0; i < num_nodes - 1; ++i) {
+        const tensor_t *buffer = &g->buffers[i];
+        valid[i] = 0;
+        if (execute) {
+            rows[i + 1].t = *buffer;
+            rows[i + 1].end = (const uint8_t *)tensor_pixel(buffer, buffer->h, -buffer->halo) + buffer->slack;
+            // uint8 after a convolution with a uint8 requantization, otherwise as the input of the node
+            rows[i + 1].t.is_unsigned = g->nodes[i].op == CONV_GRAPH_CONV ? g->nodes[i].q.is_unsigned
+                                                                          : rows[i].t.is_unsigned;
+            // The halo pixels are zero since conv_graph_plan (rows are only moved as a whole), the rows above the
+            // image are zeroed again
+            memset(tensor_pixel(buffer, 0, -buffer->halo), 0, (size_t)g->nodes[i + 1].pad * tensor_row_bytes(buffer));
+        } else {
+            capacity[i] = g->nodes[i + 1].pad;
+        }
+        rows[i + 1].first = -g->nodes[i + 1].pad; // starts with the zero rows above the image
+    }
+
+    size_t bytes = 0;
+    for (int oy = 0; oy < last->out_h; oy += strip_rows) {
+        // The rows every node has to reach for the strip, from the last node back
+        int end[CONV_GRAPH_MAX_NODES];
+        end[num_nodes - 1] = (oy + strip_rows < last->out_h) ? oy + strip_rows : last->out_h;
+        for (int i = num_nodes - 1; i > 0; --i) {
+            int begin, input_end;
+            conv_graph_window(&g->nodes[i], done[i], end[i], &begin, &input_end);
+            end[i - 1] = input_end < g->nodes[i].h ? input_end : g->nodes[i].h;
+            end[i - 1] = end[i - 1] > done[i - 1] ? end[i - 1] : done[i - 1];
+        }
+
+        for (int i = 0; i < num_nodes; ++i) {
+            const conv_graph_node_t *n = &g->nodes[i];
+            if (end[i] <= done[i])
+                continue;
+
+            if (i < num_nodes - 1) {
+                // Drop the rows the next node has read for the last time, then make room for the new ones
+                conv_graph_rows_t *buf = &rows[i + 1];
+                const conv_graph_node_t *next = &g->nodes[i + 1];
+                int keep = done[i + 1] * next->stride - next->pad;
+                keep = keep < valid[i] ? keep : valid[i];
+                if (keep > buf->first) {
+                    if (execute) {
+                        const int halo = buf->t.halo;
+                        memmove(conv_graph_pixel(buf, buf->first, -halo), conv_graph_pixel(buf, keep, -halo),
+                                (size_t)(valid[i] - keep) * tensor_row_bytes(&buf->t));
+                    }
+                    buf->first = keep;
+                }
+
+                // The zero rows below the image come with its last row
+                valid[i] = end[i] == n->out_h ? n->out_h + next->pad : end[i];
+                if (execute) {
+                    memset(conv_graph_pixel(buf, end[i], -buf->t.halo), 0,
+                           (size_t)(valid[i] - end[i]) * tensor_row_bytes(&buf->t));
+                } else if (valid[i] - buf->first > capacity[i]) {
+                    capacity[i] = valid[i] - buf->first;
+                }
+            }
+
+            if (execute)
+                conv_graph_run_node(n, &rows[i + 1], &rows[i], done[i], end[i]);
+            done[i] = end[i];
+        }
+    }
+
+    for (int i = 0; i < num_nodes - 1 && !execute; ++i) {
+        const conv_graph_node_t *next = &g->nodes[i + 1];
+        bytes += tensor_bytes(capacity[i], g->nodes[i].out_w, g->nodes[i].c_out, 1, 0, 0) +
+                 (size_t)capacity[i] * 2 * next->pad * g->nodes[i].c_out + conv_graph_slack(next);
+    }
+    return bytes;
+}
+
+// L2 per core (sysconf, 1 MiB when the libc doesn't know)
+static inline size_t conv_graph_l2_bytes() {
+#if defined(_SC_LEVEL2_CACHE_SIZE)
+    const long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (l2 > 0)
+        return (size_t)l2;
+#endif
+    return 1 << 20;
+}
+
+// Pick the strips and allocate the line buffers: the most rows per strip whose line buffers take at most half of
+// cache_bytes (0: L2), leaving the rest to the filters and the rows the layers stream through.
+// Returns false when the graph is empty.
+static inline bool conv_graph_plan(conv_graph_t *g, size_t cache_bytes) {
+    if (g->num_nodes == 0) {
+        fprintf(stderr, "conv_graph: no nodes\n");
+        return false;
+    }
+    if (cache_bytes == 0)
+        cache_bytes = conv_graph_l2_bytes();
+
+    const int out_h = g->nodes[g->num_nodes - 1].out_h;
+    int capacity[CONV_GRAPH_MAX_NODES];
+    int strip_rows = out_h;
+    for (; strip_rows > 1; --strip_rows) {
+        if (conv_graph_schedule(g, strip_rows, capacity, NULL, NULL) <= cache_bytes / 2)
+            break;
+    }
+    g->strip_rows = strip_rows;
+    g->buffer_bytes = conv_graph_schedule(g, strip_rows, capacity, NULL, NULL);
+
+    // One block for all line buffers, each 64-byte aligned
+    size_t offsets[CONV_GRAPH_MAX_NODES];
+    size_t size = 0;
+    for (int i = 0; i < g->num_nodes - 1; ++i) {
+        const conv_graph_node_t *n = &g->nodes[i];
+        const conv_graph_node_t *next = &g->nodes[i + 1];
+        offsets[i] = size;
+        size += TENSOR_ROUND_UP(tensor_bytes(capacity[i] - 2 * next->pad, n->out_w, n->c_out, 1, next->pad,
+                                             conv_graph_slack(next)),
+                                TENSOR_ALIGN);
+    }
+    free(g->memory);
+    g->memory = (uint8_t *)aligned_alloc(TENSOR_ALIGN, size > 0 ? size : TENSOR_ALIGN);
+    memset(g->memory, 0, size);
+
+    for (int i = 0; i < g->num_nodes - 1; ++i) {
+        const conv_graph_node_t *n = &g->nodes[i];
+        const conv_graph_node_t *next = &g->nodes[i + 1];
+        const int pitch = n->out_w + 2 * next->pad;
+        g->buffers[i] = (tensor_t){.data = g->memory + offsets[i] + (size_t)next->pad * n->c_out,
+                                   .h = capacity[i],
+                                   .w = n->out_w,
+                                   .c = n->c_out,
+                                   .elem_size = 1,
+                                   .halo = next->pad,
+                                   .pitch = pitch,
+                                   .slack = conv_graph_slack(next),
+                                   .is_unsigned = false};
+    }
+    return true;
+}
+
+// Run the graph: input[h][w][c] (1 byte per value, a halo of at least the padding of the first layer, see
+// conv_graph_input_tensor) to output (1 byte per value, or int32 when the last convolution isn't requantized).
+// Returns false when the tensors don't match the graph.
+static inline bool conv_graph_run(const conv_graph_t *g, const tensor_t *output, const tensor_t *input) {
+    const conv_graph_node_t *first = &g->nodes[0];
+    const conv_graph_node_t *last = &g->nodes[g->num_nodes - 1];
+    if (g->strip_rows == 0 || input->h != g->h || input->w != g->w || input->c != g->c || input->elem_size != 1 ||
+        (first->op == CONV_GRAPH_CONV && input->halo < first->pad) || output->h != last->out_h ||
+        output->w != last->out_w || output->c != last->c_out ||
+        output->elem_size != (last->requant ? 1 : (int)sizeof(int32_t))) {
+        fprintf(stderr, "conv_graph: the tensors don't match the graph\n");
+        return false;
+    }
+
+    int capacity[CONV_GRAPH_MAX_NODES];
+    conv_graph_schedule(g, g->strip_rows, capacity, output, input);
+    return true;
+}
@@ -0,0 +1,250 @@
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "conv.h"
+#include "requant.h"
+#include "tensor.h"
+
+// -----------------------------------------------
+// Streaming convolution of files
+// conv_run_file runs a layer of common/conv.h on an image that doesn't have to fit in memory:
+//
+//   input file:  raw [h][w][c_in] int8 / uint8 (NHWC, no header)
+//   output file: raw [out_h][out_w][c_out] of int32, or int8 / uint8 with a requant_t
+//
+// The output rows are computed in strips. The input rows of a strip are copied into a strip buffer with the
+// padding as zero pixels and rows, from a read-only mapping of the file (CONV_STREAM_MMAP) or with read() in file
+// order (CONV_STREAM_READ, which also takes a pipe). The rows two strips share stay in the buffer, so every input
+// row is read once. The layer runs on the buffer in place, as an unpadded layer of the rows of the strip, and
+// stores into a shared mapping of the output file.
+//
+// After every strip, the pages of the input rows behind the strip and of the output rows written are given back
+// (MADV_DONTNEED; the written pages stay in the page cache and go to the file), and the input rows of the next
+// strip are requested ahead (MADV_WILLNEED). The resident memory is then about the strip buffer plus two strips of
+// input and output rows, whatever the size of the image.
+
+// Bytes of input rows per strip when strip_rows is 0
+#define CONV_STREAM_STRIP_BYTES (1 << 20)
+
+typedef enum conv_stream_mode_t {
+    CONV_STREAM_MMAP,
+    CONV_STREAM_READ,
+} conv_stream_mode_t;
+
+typedef struct conv_stream_stats_t {
+    int strips;
+    int strip_rows;      // output rows per strip
+    size_t buffer_bytes; // of the strip buffer
+} conv_stream_stats_t;
+
+typedef struct conv_stream_input_t {
+    int fd;
+    const uint8_t *map; // NULL with CONV_STREAM_READ
+    size_t size;
+    size_t row_bytes;
+    size_t released; // bytes at the start of the mapping already given back
+} conv_stream_input_t;
+
+static inline size_t conv_stream_page_down(size_t x) {
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return x / page * page;
+}
+
+// read() all of bytes, across short reads
+static inline bool conv_stream_read_all(int fd, uint8_t *dst, size_t bytes) {
+    while (bytes > 0) {
+        const ssize_t n = read(fd, dst, bytes);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        dst += n;
+        bytes -= (size_t)n;
+    }
+    return true;
+}
+
+// Image rows y .. y + rows - 1 to dst (pitch bytes apart). With read() the rows must come in file order.
+static inline bool conv_stream_read_rows(conv_stream_input_t *in, uint8_t *dst, size_t pitch, int y, int rows) {
+    for (int r = 0; r < rows; ++r) {
+        if (in->map != NULL) {
+            memcpy(dst + r * pitch, in->map + (size_t)(y + r) * in->row_bytes, in->row_bytes);
+        } else if (!conv_stream_read_all(in->fd, dst + r * pitch, in->row_bytes)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Give back the input pages before image row y (the rows are in the strip buffer), and ask for the rows up to y_end
+static inline void conv_stream_advise_input(conv_stream_input_t *in, int y, int y_end) {
+    if (in->map == NULL)
+        return;
+    const size_t begin = (size_t)y * in->row_bytes < in->size ? (size_t)y * in->row_bytes : in->size;
+    const size_t release = conv_stream_page_down(begin);
+    if (release > in->released) {
+        madvise((void *)(in->map + in->released), release - in->released, MADV_DONTNEED);
+        in->released = release;
+    }
+    const size_t end = (size_t)y_end * in->row_bytes < in->size ? (size_t)y_end * in->row_bytes : in->size;
+    if (end > release)
+        madvise((void *)(in->map + release), end - release, MADV_WILLNEED);
+}
+
+// Run l on the image in input_path into output_path (created or truncated), in strips of strip_rows output rows
+// (0: about CONV_STREAM_STRIP_BYTES of input rows). The input bytes are uint8 with input_unsigned, and q == NULL
+// gives int32 outputs. stats may be NULL. Returns false when a file can't be read or written.
+static bool conv_run_file(const conv_layer_t *l, const char *output_path, const char *input_path, bool input_unsigned,
+                          const requant_t *q, conv_stream_mode_t mode, int strip_rows, conv_stream_stats_t *stats) {
+    const conv_desc_t *d = &l->desc;
+    const size_t elem_size = q != NULL ? 1 : sizeof(int32_t);
+    const size_t out_row_bytes = (size_t)l->out_w * d->c_out * elem_size;
+    const size_t output_size = out_row_bytes * l->out_h;
+
+    conv_stream_input_t in = {-1, NULL, (size_t)d->h * d->w * d->c_in, (size_t)d->w * d->c_in, 0};
+    in.fd = open(input_path, O_RDONLY);
+    struct stat st;
+    if (in.fd < 0 || fstat(in.fd, &st) != 0 || (S_ISREG(st.st_mode) && (size_t)st.st_size < in.size)) {
+        fprintf(stderr, "conv_stream: can't read %s\n", input_path);
+        if (in.fd >= 0)
+            close(in.fd);
+        return false;
+    }
+    if (mode == CONV_STREAM_MMAP) {
+        void *map = mmap(NULL, in.size, PROT_READ, MAP_SHARED, in.fd, 0);
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "conv_stream: can't map %s: %s\n", input_path, strerror(errno));
+            close(in.fd);
+            return false;
+        }
+        in.map = (const uint8_t *)map;
+        madvise(map, in.size, MADV_SEQUENTIAL);
+    } else {
+        posix_fadvise(in.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    const int out_fd = open(output_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    uint8_t *out_map = MAP_FAILED;
+    if (out_fd >= 0 && ftruncate(out_fd, (off_t)output_size) == 0)
+        out_map = (uint8_t *)mmap(NULL, output_size, PROT_READ | PROT_WRITE, MAP_SHARED, out_fd, 0);
+    if (out_map == MAP_FAILED) {
+        fprintf(stderr, "conv_stream: can't write %s\n", output_path);
+        if (in.map != NULL)
+            munmap((void *)in.map, in.size);
+        close(in.fd);
+        if (out_fd >= 0)
+            close(out_fd);
+        return false;
+    }
+
+    // The strip buffer: the input rows of a strip with pad zero pixels left and right, and the slack of the layer
+    const int span = d->dilation * (d->kernel - 1) + 1;
+    const int pitch = d->w + 2 * d->pad;
+    const size_t row_bytes = (size_t)pitch * d->c_in;
+    if (strip_rows <= 0) {
+        strip_rows = (int)(CONV_STREAM_STRIP_BYTES / ((size_t)d->stride * row_bytes));
+        strip_rows = strip_rows < 1 ? 1 : strip_rows;
+    }
+    strip_rows = strip_rows < l->out_h ? strip_rows : l->out_h;
+    const int capacity = (strip_rows - 1) * d->stride + span;
+    const size_t buffer_bytes = TENSOR_ROUND_UP((size_t)capacity * row_bytes + conv_input_slack(l), TENSOR_ALIGN);
+    uint8_t *buffer = (uint8_t *)aligned_alloc(TENSOR_ALIGN, buffer_bytes);
+    memset(buffer, 0, buffer_bytes);
+
+    int first = -d->pad; // image row of buffer row 0; the rows above the image are zero
+    int valid = 0;       // the buffer holds image rows first .. valid - 1
+    size_t out_released = 0;
+    bool ok = true;
+    int strips = 0;
+
+    for (int oy = 0; oy < l->out_h && ok; oy += strip_rows, ++strips) {
+        const int rows = (l->out_h - oy < strip_rows) ? l->out_h - oy : strip_rows;
+        const int iy0 = oy * d->stride - d->pad;
+        const int iy1 = (oy + rows - 1) * d->stride - d->pad + span;
+
+        // Keep the rows this strip shares with the last one
+        const int keep = iy0 < valid ? iy0 : valid;
+        if (keep > first) {
+            memmove(buffer, buffer + (size_t)(keep - first) * row_bytes, (size_t)(valid - keep) * row_bytes);
+            first = keep;
+        }
+        // Rows no strip reads (stride > kernel) are skipped, with read() into the buffer
+        if (valid < iy0) {
+            for (int y = valid; y < iy0 && y < d->h && ok && in.map == NULL; ++y) {
+                ok = conv_stream_read_rows(&in, buffer + (size_t)d->pad * d->c_in, row_bytes, y, 1);
+            }
+            first = valid = iy0;
+        }
+        // The new rows, and zero rows below the image
+        const int read_end = iy1 < d->h ? iy1 : d->h;
+        if (read_end > valid) {
+            ok = ok && conv_stream_read_rows(&in, buffer + ((size_t)(valid - first) * pitch + d->pad) * d->c_in,
+                                             row_bytes, valid, read_end - valid);
+            valid = read_end;
+        }
+        if (iy1 > valid) {
+            memset(buffer + (size_t)(valid - first) * row_bytes, 0, (size_t)(iy1 - valid) * row_bytes);
+            valid = iy1;
+        }
+        if (!ok) {
+            fprintf(stderr, "conv_stream: %s ends early\n", input_path);
+            break;
+        }
+
+        // The strip as an unpadded layer
+        conv_layer_t view = *l;
+        view.desc.h = iy1 - iy0;
+        view.desc.w = pitch;
+        view.desc.pad = 0;
+        view.out_h = rows;
+        const tensor_t input = {.data = buffer + (size_t)(iy0 - first) * row_bytes,
+                                .h = view.desc.h,
+                                .w = pitch,
+                                .c = d->c_in,
+                                .elem_size = 1,
+                                .halo = 0,
+                                .pitch = pitch,
+                                .slack = buffer_bytes - (size_t)(iy1 - first) * row_bytes,
+                                .is_unsigned = input_unsigned};
+        const tensor_t output = {.data = out_map + (size_t)oy * out_row_bytes,
+                                 .h = rows,
+                                 .w = l->out_w,
+                                 .c = d->c_out,
+                                 .elem_size = (int)elem_size,
+                                 .halo = 0,
+                                 .pitch = l->out_w,
+                                 .slack = 0,
+                                 .is_unsigned = false};
+        conv_run_tensor(&view, &output, &input, q);
+
+        // Hand the written rows to the page cache, give back the input rows read, and ask for those of the next strip
+        const size_t out_end = conv_stream_page_down((size_t)(oy + rows) * out_row_bytes);
+        if (out_end > out_released) {
+            msync(out_map + out_released, out_end - out_released, MS_ASYNC);
+            madvise(out_map + out_released, out_end - out_released, MADV_DONTNEED);
+            out_released = out_end;
+        }
+        conv_stream_advise_input(&in, valid, valid + strip_rows * d->stride);
+    }
+
+    if (stats != NULL)
+        *stats = (conv_stream_stats_t){strips, strip_rows, buffer_bytes};
+
+    free(buffer);
+    munmap(out_map, output_size);
+    close(out_fd);
+    if (in.map != NULL)
+        munmap((void *)in.map, in.size);
+    close(in.fd);
+    return ok;
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cpuid.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define ARCH_GET_XCOMP_PERM 0x1022
+#define ARCH_REQ_XCOMP_PERM 0x1023
+#define XFEATURE_XTILECFG 17
+#define XFEATURE_XTILEDATA 18
+#endif
+
+// -----------------------------------------------
+// Runtime CPU feature detection
+// The programs are built without -march, and every kernel that needs more than SSE2
+// is compiled for its instruction set with one of the TARGET_* attributes below.
+// detect_cpu_features() decides at startup which of them may be called.
+
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx512vl,avx512dq")))
+#define TARGET_AVX512_VNNI __attribute__((target("avx512f,avx512bw,avx512vl,avx512dq,avx512vnni")))
+#define TARGET_AVX512_BF16 __attribute__((target("avx512f,avx512bw,avx512vl,avx512dq,avx512bf16")))
+
+#if defined(AMX_EMULATE)
+// The AMX kernels are plain C on top of common/amx_emu.h
+#define TARGET_AMX_INT8
+#define TARGET_AMX_BF16
+#else
+#define TARGET_AMX_INT8 __attribute__((target("amx-tile,amx-int8")))
+#define TARGET_AMX_BF16 __attribute__((target("amx-tile,amx-bf16")))
+#endif
+
+typedef struct cpu_features_t {
+    bool avx2;        // AVX2 and FMA
+    bool avx512;      // AVX-512 F, BW, VL and DQ
+    bool avx512_vnni; // vpdpbusd
+    bool avx512_bf16; // vcvtne2ps2bf16, vdpbf16ps
+    bool amx_tile;
+    bool amx_int8;
+    bool amx_bf16;
+} cpu_features_t;
+
+static cpu_features_t cpu_features;
+
+static inline uint64_t read_xcr0() {
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+}
+
+// Fill cpu_features.
+// A feature is reported only when the CPU has it (CPUID) and the OS saves its registers (XCR0).
+// AMX additionally needs the permission for XTILEDATA on Linux, which is requested here.
+//
+// The environment variable AMX_EXAMPLE_ISA (scalar, avx2, avx512, amx) caps the result,
+// so the fallback kernels can be run on a machine with AMX.
+// With -DAMX_EMULATE, AMX is always reported (see common/amx_emu.h).
+static void detect_cpu_features() {
+    memset(&cpu_features, 0, sizeof(cpu_features));
+
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE))
+        return;
+    const bool fma = ecx & bit_FMA;
+
+    const uint64_t xcr0 = read_xcr0();
+    const bool ymm_enabled = (xcr0 & 0x06) == 0x06;                                  // SSE, AVX
+    const bool zmm_enabled = (xcr0 & 0xe6) == 0xe6;                                  // + opmask, ZMM
+    const bool tile_enabled = ((xcr0 >> XFEATURE_XTILECFG) & 3) == 3 && ymm_enabled; // XTILECFG, XTILEDATA
+
+    if (__get_cpuid_max(0, NULL) < 7)
+        return;
+
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    const unsigned int max_subleaf = eax;
+
+    cpu_features.avx2 = ymm_enabled && fma && (ebx & bit_AVX2);
+    cpu_features.avx512 = zmm_enabled && (ebx & bit_AVX512F) && (ebx & bit_AVX512BW) && (ebx & bit_AVX512VL) &&
+                          (ebx & bit_AVX512DQ);
+    cpu_features.avx512_vnni = cpu_features.avx512 && (ecx & (1u << 11));
+#if defined(AMX_EMULATE)
+    // Always there (common/amx_emu.h)
+    (void)tile_enabled;
+    cpu_features.amx_tile = cpu_features.amx_int8 = cpu_features.amx_bf16 = true;
+#else
+    cpu_features.amx_tile = tile_enabled && (edx & (1u << 24));
+    cpu_features.amx_int8 = cpu_features.amx_tile && (edx & (1u << 25));
+    cpu_features.amx_bf16 = cpu_features.amx_tile && (edx & (1u << 22));
+#endif
+
+    if (max_subleaf >= 1) {
+        __cpuid_count(7, 1, eax, ebx, ecx, edx);
+        cpu_features.avx512_bf16 = cpu_features.avx512 && (eax & (1u << 5));
+    }
+
+    const char *isa = getenv("AMX_EXAMPLE_ISA");
+    if (isa != NULL && strcmp(isa, "amx") != 0) {
+        cpu_features.amx_tile = cpu_features.amx_int8 = cpu_features.amx_bf16 = false;
+        if (strcmp(isa, "avx512") != 0) {
+            cpu_features.avx512 = cpu_features.avx512_vnni = cpu_features.avx512_bf16 = false;
+            if (strcmp(isa, "avx2") != 0)
+                cpu_features.avx2 = false;
+        }
+    }
+
+#if defined(__linux__) && !defined(AMX_EMULATE)
+    if (cpu_features.amx_tile && syscall(SYS_arch_prctl, ARCH_REQ_XCOMP_PERM, XFEATURE_XTILEDATA)) {
+        printf("\n Fail to do XFEATURE_XTILEDATA, AMX is disabled \n\n");
+        cpu_features.amx_tile = cpu_features.amx_int8 = cpu_features.amx_bf16 = false;
+    }
+#endif
+}
+
+static void print_cpu_features() {
+    printf("CPU features:%s%s%s%s%s%s%s\n", cpu_features.avx2 ? " AVX2" : "", cpu_features.avx512 ? " AVX-512" : "",
+           cpu_features.avx512_vnni ? " AVX512-VNNI" : "", cpu_features.avx512_bf16 ? " AVX512-BF16" : "",
+           cpu_features.amx_tile ? " AMX-TILE" : "", cpu_features.amx_int8 ? " AMX-INT8" : "",
+           cpu_features.amx_bf16 ? " AMX-BF16" : "");
+#if defined(AMX_EMULATE)
+    printf("AMX is emulated in software\n");
+#endif
+}
@@ -0,0 +1,333 @@
+#pragma once
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#endif
+
+#include "thread_pool.h"
+
+// -----------------------------------------------
+// Page allocation
+// page_alloc maps the large buffers (packed B panels, activations) with 2 MB pages, so that the rows of a tile
+// load, K bytes apart, don't each need a TLB entry of their own:
+//
+//   PAGES_SMALL    4 KB pages
+//   PAGES_THP      transparent huge pages: a 2 MB aligned mapping with MADV_HUGEPAGE (THP "madvise" or "always")
+//   PAGES_HUGETLB  pages of the hugetlbfs pool (MAP_HUGETLB, reserved with vm.nr_hugepages)
+//
+// A kind that isn't available falls back to the next one (HUGETLB -> THP -> SMALL) with a note to stderr, and
+// page_kind says what a buffer got. A buffer under one huge page comes from aligned_alloc (no system call).
+//
+// page_alloc doesn't touch the mappings (the blocks are kept in a table on the side), and the thread that writes
+// a page first places it on its NUMA node, so page_first_touch zeroes a buffer on the threads of a pool, each the
+// part it works on with SCHEDULE_STATIC. page_alloc_node places a buffer on one node instead (mbind before the
+// first touch), e.g. a copy of read-only weights per node.
+// AMX_EXAMPLE_PAGES=small|thp|hugetlb sets page_default_kind (thp when it isn't set).
+
+#define PAGE_HUGE_SIZE ((size_t)2 << 20)
+#define PAGE_MAX_NODES 64
+
+typedef enum page_kind_t {
+    PAGES_SMALL,
+    PAGES_THP,
+    PAGES_HUGETLB,
+} page_kind_t;
+
+static const char *const page_kind_names[] = {"small", "thp", "hugetlb"};
+
+// A mapping of page_alloc
+typedef struct page_block_t {
+    void *base;
+    size_t size;
+    page_kind_t kind;
+} page_block_t;
+
+// The mappings of page_alloc, found by their address
+static struct {
+    pthread_mutex_t mutex;
+    page_block_t *blocks;
+    int count, capacity;
+} page_table = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0};
+
+static inline size_t page_round_up(size_t x, size_t page) { return (x + page - 1) / page * page; }
+
+static inline void page_table_add(const page_block_t *block) {
+    pthread_mutex_lock(&page_table.mutex);
+    if (page_table.count == page_table.capacity) {
+        page_table.capacity = page_table.capacity > 0 ? page_table.capacity * 2 : 16;
+        page_table.blocks =
+            (page_block_t *)realloc(page_table.blocks, (size_t)page_table.capacity * sizeof(page_block_t));
+    }
+    page_table.blocks[page_table.count++] = *block;
+    pthread_mutex_unlock(&page_table.mutex);
+}
+
+// The block of p (and remove it with remove), false when p isn't a mapping of page_alloc
+static inline bool page_table_find(const void *p, page_block_t *block, bool remove) {
+    bool found = false;
+    pthread_mutex_lock(&page_table.mutex);
+    for (int i = 0; i < page_table.count && !found; ++i) {
+        if (page_table.blocks[i].base == p) {
+            *block = page_table.blocks[i];
+            if (remove)
+                page_table.blocks[i] = page_table.blocks[--page_table.count];
+            found = true;
+        }
+    }
+    pthread_mutex_unlock(&page_table.mutex);
+    return found;
+}
+
+// THP is on for MADV_HUGEPAGE mappings ("always" or "madvise"); sysfs is read once
+static inline bool page_thp_enabled() {
+    static atomic_int enabled = -1;
+    int value = atomic_load(&enabled);
+    if (value < 0) {
+        FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+        char line[128] = "";
+        if (f != NULL) {
+            if (fgets(line, sizeof(line), f) == NULL)
+                line[0] = '\0';
+            fclose(f);
+        }
+        value = line[0] != '\0' && strstr(line, "[never]") == NULL;
+        atomic_store(&enabled, value);
+    }
+    return value != 0;
+}
+
+static inline page_kind_t page_default_kind() {
+    const char *pages = getenv("AMX_EXAMPLE_PAGES");
+    if (pages != NULL && strcmp(pages, "small") == 0)
+        return PAGES_SMALL;
+    if (pages != NULL && strcmp(pages, "hugetlb") == 0)
+        return PAGES_HUGETLB;
+    return PAGES_THP;
+}
+
+// Note a fallback once per kind
+static inline void page_fallback(page_kind_t kind, const char *reason) {
+    static atomic_bool noted[3];
+    if (!atomic_exchange(&noted[kind], true))
+        fprintf(stderr, "page_alloc: no %s pages (%s), falling back\n", page_kind_names[kind], reason);
+}
+
+// bytes of kind (or the one it falls back to), 64-byte aligned; a mapping is untouched (zero).
+// Returns NULL when even the small pages can't be mapped.
+static inline void *page_alloc(size_t bytes, page_kind_t kind) {
+    if (bytes < PAGE_HUGE_SIZE)
+        return aligned_alloc(64, page_round_up(bytes > 0 ? bytes : 1, 64));
+
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    void *base = MAP_FAILED;
+    size_t size = page_round_up(bytes, PAGE_HUGE_SIZE);
+
+#if defined(MAP_HUGETLB)
+    if (kind == PAGES_HUGETLB) {
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (base == MAP_FAILED) {
+            page_fallback(kind, strerror(errno));
+            kind = PAGES_THP;
+        }
+    }
+#else
+    if (kind == PAGES_HUGETLB) {
+        page_fallback(kind, "no MAP_HUGETLB");
+        kind = PAGES_THP;
+    }
+#endif
+
+#if defined(MADV_HUGEPAGE)
+    if (kind == PAGES_THP && !page_thp_enabled()) {
+        page_fallback(kind, "transparent_hugepage is never");
+        kind = PAGES_SMALL;
+    }
+    if (kind == PAGES_THP) {
+        // Map 2 MB more and trim both ends, so the buffer starts at a 2 MB boundary. The size is in small pages:
+        // the part of the last 2 MB past the end of the buffer isn't mapped, and that part gets small pages.
+        size = page_round_up(bytes, page);
+        uint8_t *map = (uint8_t *)mmap(NULL, size + PAGE_HUGE_SIZE, PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map != MAP_FAILED) {
+            uint8_t *aligned = (uint8_t *)page_round_up((uintptr_t)map, PAGE_HUGE_SIZE);
+            if (aligned > map)
+                munmap(map, aligned - map);
+            if (aligned + size < map + size + PAGE_HUGE_SIZE)
+                munmap(aligned + size, map + size + PAGE_HUGE_SIZE - (aligned + size));
+            base = aligned;
+            if (madvise(base, size, MADV_HUGEPAGE) != 0) {
+                page_fallback(kind, strerror(errno));
+                kind = PAGES_SMALL;
+            }
+        }
+    }
+#else
+    if (kind == PAGES_THP) {
+        page_fallback(kind, "no MADV_HUGEPAGE");
+        kind = PAGES_SMALL;
+    }
+#endif
+
+    if (base == MAP_FAILED) {
+        kind = PAGES_SMALL;
+        size = page_round_up(bytes, page);
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+            return NULL;
+    }
+
+    const page_block_t block = {base, size, kind};
+    page_table_add(&block);
+    return base;
+}
+
+// Free a buffer of page_alloc (or page_alloc_node)
+static inline void page_free(void *p) {
+    page_block_t block;
+    if (page_table_find(p, &block, true))
+        munmap(block.base, block.size);
+    else
+        free(p);
+}
+
+// What a buffer of page_alloc got (PAGES_SMALL from aligned_alloc)
+static inline page_kind_t page_kind(const void *p) {
+    page_block_t block;
+    return page_table_find(p, &block, false) ? block.kind : PAGES_SMALL;
+}
+
+// Bytes of a buffer of page_alloc that are on huge pages now (/proc/self/smaps), 0 when it isn't known.
+// The kernel merges neighbouring mappings of the same kind, so the huge pages of a mapping are counted by the
+// share of it the buffer covers.
+static inline size_t page_huge_bytes(const void *p) {
+    page_block_t block;
+    if (!page_table_find(p, &block, false))
+        return 0;
+    const uintptr_t begin = (uintptr_t)block.base;
+    const uintptr_t end = begin + block.size;
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (f == NULL)
+        return 0;
+    char line[256];
+    double share = 0; // of the current mapping inside the buffer
+    double bytes = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        unsigned long start, stop;
+        size_t kb;
+        if (sscanf(line, "%lx-%lx ", &start, &stop) == 2) { // the line of a mapping, the others are "Field: value"
+            const uintptr_t lo = begin > start ? begin : start;
+            const uintptr_t hi = end < stop ? end : stop;
+            share = hi > lo ? (double)(hi - lo) / (stop - start) : 0;
+        } else if (share > 0 && (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1 ||
+                                 sscanf(line, "Private_Hugetlb: %zu kB", &kb) == 1 ||
+                                 sscanf(line, "Shared_Hugetlb: %zu kB", &kb) == 1)) {
+            bytes += kb * 1024.0 * share;
+        }
+    }
+    fclose(f);
+    return (size_t)bytes;
+}
+
+// -----------------------------------------------
+// NUMA nodes (without libnuma)
+
+// Nodes are numbered 0 .. numa_num_nodes() - 1 (some may be offline); 1 without the sysfs topology
+static inline int numa_read_nodes() {
+    FILE *f = fopen("/sys/devices/system/node/online", "r");
+    if (f == NULL)
+        return 1;
+    char line[256] = "";
+    const bool read = fgets(line, sizeof(line), f) != NULL;
+    fclose(f);
+
+    // "0", "0-1" or "0-3,6": the last number is the highest node
+    int nodes = 1;
+    for (const char *s = line; read && *s != '\0';) {
+        char *end;
+        const long node = strtol(s, &end, 10);
+        if (end == s) {
+            ++s;
+            continue;
+        }
+        nodes = node + 1 > nodes ? (int)node + 1 : nodes;
+        s = end;
+    }
+    return nodes < PAGE_MAX_NODES ? nodes : PAGE_MAX_NODES;
+}
+
+// numa_read_nodes, read once
+static inline int numa_num_nodes() {
+    static atomic_int nodes = 0;
+    int value = atomic_load(&nodes);
+    if (value == 0) {
+        value = numa_read_nodes();
+        atomic_store(&nodes, value);
+    }
+    return value;
+}
+
+// Node of the CPU the calling thread runs on. A system call: a thread of a pool (pinned) asks once per job,
+// in parallel_job_t::begin, not per task.
+static inline int numa_current_node() {
+#if defined(__linux__)
+    unsigned int cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0 && node < PAGE_MAX_NODES)
+        return (int)node;
+#endif
+    return 0;
+}
+
+// Like page_alloc, with the pages placed on node (preferred, so a full node still gives memory). The mapping
+// isn't touched yet, so every page follows the policy. A buffer under one huge page (aligned_alloc) stays where
+// the allocator put it.
+static inline void *page_alloc_node(size_t bytes, page_kind_t kind, int node) {
+    void *p = page_alloc(bytes, kind);
+#if defined(__linux__)
+    page_block_t block;
+    if (p != NULL && numa_num_nodes() > 1 && page_table_find(p, &block, false)) {
+        unsigned long mask[PAGE_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+        mask[node / (8 * sizeof(unsigned long))] = 1ul << (node % (8 * sizeof(unsigned long)));
+        if (syscall(SYS_mbind, block.base, block.size, MPOL_PREFERRED, mask, PAGE_MAX_NODES + 1, 0) != 0)
+            fprintf(stderr, "page_alloc_node: mbind to node %d: %s\n", node, strerror(errno));
+    }
+#else
+    (void)node;
+#endif
+    return p;
+}
+
+typedef struct page_touch_args_t {
+    uint8_t *data;
+    size_t bytes;
+    int parts;
+} page_touch_args_t;
+
+static inline void page_touch_task(void *arg, int task) {
+    const page_touch_args_t *args = (const page_touch_args_t *)arg;
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t begin = task == 0 ? 0 : args->bytes * task / args->parts / page * page;
+    const size_t end = task + 1 == args->parts ? args->bytes : args->bytes * (task + 1) / args->parts / page * page;
+    if (end > begin)
+        memset(args->data + begin, 0, end - begin);
+}
+
+// Zero p with thread t of the pool writing the t-th of num_threads equal parts (at page boundaries), so the pages
+// of each part are on the node of the thread that works on it
+static inline void page_first_touch(thread_pool_t *pool, void *p, size_t bytes) {
+    page_touch_args_t args = {(uint8_t *)p, bytes, pool->num_threads};
+    const parallel_job_t job = {NULL, page_touch_task, &args, pool->num_threads, SCHEDULE_STATIC};
+    thread_pool_run(pool, &job);
+}
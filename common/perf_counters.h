@@ -0,0 +1,162 @@
+#pragma once
+
+#include <cpuid.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <x86intrin.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "cpu_features.h"
+
+// -----------------------------------------------
+// Hardware performance counters
+// Counts the events of the calling thread (and of threads it creates afterwards) between perf_counters_start and
+// perf_counters_stop with perf_event_open, in user mode only, so perf_event_paranoid <= 2 is enough:
+//
+//   cycles, instructions   core cycles and retired instructions
+//   l1d_misses             L1D read misses
+//   l2_misses              L2_RQSTS.MISS (Intel only)
+//   llc_misses             last level cache misses
+//   amx_busy               EXE.AMX_BUSY, cycles the AMX unit is busy (Intel with AMX, not with the emulator)
+//
+// An event the CPU or the kernel doesn't expose is reported as not available. When even the cycles can't be
+// counted (no permission, a container or a VM without a virtual PMU), cycles fall back to rdtsc, i.e. reference
+// cycles at the nominal frequency, and the other events are not available.
+
+typedef enum perf_counter_id_t {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_L2_MISSES,
+    PERF_LLC_MISSES,
+    PERF_AMX_BUSY,
+    PERF_NUM_COUNTERS,
+} perf_counter_id_t;
+
+static const char *const perf_counter_names[PERF_NUM_COUNTERS] = {
+    "cycles", "instructions", "l1d_misses", "l2_misses", "llc_misses", "amx_busy",
+};
+
+typedef struct perf_counters_t {
+    int fds[PERF_NUM_COUNTERS]; // -1: not available
+    bool perf;                  // the cycles come from perf_event_open, not from rdtsc
+    uint64_t tsc_start;
+} perf_counters_t;
+
+// Counts of one run of a kernel
+typedef struct perf_sample_t {
+    bool valid;                       // counters were collected
+    bool perf;                        // see perf_counters_t
+    double values[PERF_NUM_COUNTERS]; // < 0: not available
+} perf_sample_t;
+
+static inline bool perf_is_intel() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx))
+        return false;
+    return ebx == 0x756e6547 && edx == 0x49656e69 && ecx == 0x6c65746e; // "GenuineIntel"
+}
+
+#if defined(__linux__)
+static inline int perf_open_event(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1; // count the worker threads of a thread pool created later
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+// Open the counters. Prints a note to stderr when they fall back to rdtsc.
+static inline void perf_counters_open(perf_counters_t *pc) {
+    for (int i = 0; i < PERF_NUM_COUNTERS; ++i) {
+        pc->fds[i] = -1;
+    }
+    pc->perf = false;
+    errno = ENOSYS;
+
+#if defined(__linux__)
+    const bool intel = perf_is_intel();
+    pc->fds[PERF_CYCLES] = perf_open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    if (pc->fds[PERF_CYCLES] >= 0) {
+        pc->perf = true;
+        pc->fds[PERF_INSTRUCTIONS] = perf_open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        const uint64_t l1d_read_miss =
+            PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        pc->fds[PERF_L1D_MISSES] = perf_open_event(PERF_TYPE_HW_CACHE, l1d_read_miss);
+        pc->fds[PERF_LLC_MISSES] = perf_open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        if (intel)
+            pc->fds[PERF_L2_MISSES] = perf_open_event(PERF_TYPE_RAW, 0x3f24); // umask 0x3f, event 0x24
+#if !defined(AMX_EMULATE)
+        if (intel && cpu_features.amx_tile)
+            pc->fds[PERF_AMX_BUSY] = perf_open_event(PERF_TYPE_RAW, 0x02b7); // umask 0x02, event 0xb7
+#endif
+    }
+#endif
+
+    if (!pc->perf)
+        fprintf(stderr, "perf_event_open: %s, only the cycles are counted (with rdtsc)\n", strerror(errno));
+}
+
+static inline void perf_counters_close(perf_counters_t *pc) {
+#if defined(__linux__)
+    for (int i = 0; i < PERF_NUM_COUNTERS; ++i) {
+        if (pc->fds[i] >= 0)
+            close(pc->fds[i]);
+        pc->fds[i] = -1;
+    }
+#endif
+}
+
+static inline void perf_counters_start(perf_counters_t *pc) {
+#if defined(__linux__)
+    for (int i = 0; i < PERF_NUM_COUNTERS; ++i) {
+        if (pc->fds[i] >= 0) {
+            ioctl(pc->fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(pc->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+    pc->tsc_start = __rdtsc();
+}
+
+// Stop counting and return the counts divided by runs. A counter that was multiplexed with others is scaled
+// by the fraction of the time it ran.
+static inline perf_sample_t perf_counters_stop(perf_counters_t *pc, uint64_t runs) {
+    const uint64_t tsc = __rdtsc() - pc->tsc_start;
+    perf_sample_t s;
+    s.valid = true;
+    s.perf = pc->perf;
+    for (int i = 0; i < PERF_NUM_COUNTERS; ++i) {
+        s.values[i] = -1;
+    }
+
+#if defined(__linux__)
+    for (int i = 0; i < PERF_NUM_COUNTERS; ++i) {
+        if (pc->fds[i] < 0)
+            continue;
+        ioctl(pc->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t data[3]; // value, time enabled, time running
+        if (read(pc->fds[i], data, sizeof(data)) == (ssize_t)sizeof(data) && data[2] > 0)
+            s.values[i] = (double)data[0] * ((double)data[1] / data[2]) / runs;
+    }
+#endif
+    if (!pc->perf)
+        s.values[PERF_CYCLES] = (double)tsc / runs;
+    return s;
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <immintrin.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cpu_features.h"
+
+// -----------------------------------------------
+// Dynamic quantization
+// FP32 values become int8 with a scale computed from the values themselves at run time:
+//
+//   scale = max |x| / 127,   q = clamp(round(x / scale), -127, 127),   x ~ q * scale
+//
+// The range is symmetric (no zero point), so the product of two quantized values is dequantized by
+// multiplying the int32 dot product with both scales. round is to nearest even (cvtps2dq, as requant_value).
+
+#define QUANT_MAX 127
+
+static inline float quant_abs(float x) { return x < 0 ? -x : x; }
+
+static inline float quant_absmax_scalar(const float *x, size_t n) {
+    float m = 0;
+    for (size_t i = 0; i < n; ++i) {
+        m = quant_abs(x[i]) > m ? quant_abs(x[i]) : m;
+    }
+    return m;
+}
+
+TARGET_AVX2 static float quant_absmax_avx2(const float *x, size_t n) {
+    const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 m0 = _mm256_setzero_ps();
+    __m256 m1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        m0 = _mm256_max_ps(m0, _mm256_and_ps(_mm256_loadu_ps(&x[i]), abs_mask));
+        m1 = _mm256_max_ps(m1, _mm256_and_ps(_mm256_loadu_ps(&x[i + 8]), abs_mask));
+    }
+    m0 = _mm256_max_ps(m0, m1);
+    __m128 m = _mm_max_ps(_mm256_castps256_ps128(m0), _mm256_extractf128_ps(m0, 1));
+    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+
+    const float tail = quant_absmax_scalar(&x[i], n - i);
+    return _mm_cvtss_f32(m) > tail ? _mm_cvtss_f32(m) : tail;
+}
+
+TARGET_AVX512 static float quant_absmax_avx512(const float *x, size_t n) {
+    __m512 m0 = _mm512_setzero_ps();
+    __m512 m1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        m0 = _mm512_max_ps(m0, _mm512_abs_ps(_mm512_loadu_ps(&x[i])));
+        m1 = _mm512_max_ps(m1, _mm512_abs_ps(_mm512_loadu_ps(&x[i + 16])));
+    }
+    for (; i < n; i += 16) {
+        const __mmask16 mask = (n - i >= 16) ? 0xffff : (__mmask16)((1u << (n - i)) - 1);
+        m0 = _mm512_max_ps(m0, _mm512_abs_ps(_mm512_maskz_loadu_ps(mask, &x[i])));
+    }
+    return _mm512_reduce_max_ps(_mm512_max_ps(m0, m1));
+}
+
+// max |x[i]| of n values
+static float quant_absmax(const float *x, size_t n) {
+    if (cpu_features.avx512)
+        return quant_absmax_avx512(x, n);
+    if (cpu_features.avx2)
+        return quant_absmax_avx2(x, n);
+    return quant_absmax_scalar(x, n);
+}
+
+// The scale of values whose max |x| is absmax (0 when they are all 0)
+static inline float quant_scale(float absmax) { return absmax / QUANT_MAX; }
+
+static inline int8_t quant_value(float x, float inv_scale) {
+    const int32_t q = _mm_cvtss_si32(_mm_set_ss(x * inv_scale)); // to nearest even, no libm
+    return (int8_t)(q < -QUANT_MAX ? -QUANT_MAX : (q > QUANT_MAX ? QUANT_MAX : q));
+}
+
+TARGET_AVX2 static void quant_values_avx2(int8_t *dst, const float *x, size_t n, float inv_scale) {
+    const __m256 inv = _mm256_set1_ps(inv_scale);
+    const __m256i lo = _mm256_set1_epi32(-QUANT_MAX);
+    const __m256i hi = _mm256_set1_epi32(QUANT_MAX);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i q = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(&x[i]), inv));
+        q = _mm256_min_epi32(_mm256_max_epi32(q, lo), hi);
+        const __m128i q16 = _mm_packs_epi32(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1));
+        _mm_storel_epi64((__m128i *)&dst[i], _mm_packs_epi16(q16, q16));
+    }
+    for (; i < n; ++i) {
+        dst[i] = quant_value(x[i], inv_scale);
+    }
+}
+
+TARGET_AVX512 static void quant_values_avx512(int8_t *dst, const float *x, size_t n, float inv_scale) {
+    const __m512 inv = _mm512_set1_ps(inv_scale);
+    const __m512i lo = _mm512_set1_epi32(-QUANT_MAX);
+    const __m512i hi = _mm512_set1_epi32(QUANT_MAX);
+    for (size_t i = 0; i < n; i += 16) {
+        const __mmask16 mask = (n - i >= 16) ? 0xffff : (__mmask16)((1u << (n - i)) - 1);
+        __m512i q = _mm512_cvtps_epi32(_mm512_mul_ps(_mm512_maskz_loadu_ps(mask, &x[i]), inv));
+        q = _mm512_min_epi32(_mm512_max_epi32(q, lo), hi);
+        _mm512_mask_cvtepi32_storeu_epi8(&dst[i], mask, q);
+    }
+}
+
+// Quantize n values with scale (from quant_scale)
+static void quant_values(int8_t *dst, const float *x, size_t n, float scale) {
+    const float inv_scale = scale > 0 ? 1.0f / scale : 0.0f;
+    if (cpu_features.avx512) {
+        quant_values_avx512(dst, x, n, inv_scale);
+    } else if (cpu_features.avx2) {
+        quant_values_avx2(dst, x, n, inv_scale);
+    } else {
+        for (size_t i = 0; i < n; ++i) {
+            dst[i] = quant_value(x[i], inv_scale);
+        }
+    }
+}
+
+// Quantize rows x n values (src_stride apart) with a scale per row, which goes to scales[r]
+static void quant_rows(int8_t *dst, size_t dst_stride, const float *src, size_t src_stride, int rows, size_t n,
+                       float *scales) {
+    for (int r = 0; r < rows; ++r) {
+        scales[r] = quant_scale(quant_absmax(&src[r * src_stride], n));
+        quant_values(&dst[r * dst_stride], &src[r * src_stride], n, scales[r]);
+    }
+}
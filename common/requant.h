@@ -0,0 +1,159 @@
+#pragma once
+
+#include <immintrin.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cpu_features.h"
+
+// -----------------------------------------------
+// Requantization epilogue
+// The int32 accumulators of a GEMM or convolution become the int8 / uint8 activations of the next layer:
+//
+//   y = clamp(round((acc + bias[ch]) * scale[ch]) + zero_point[ch], lo, hi)
+//
+// round is to nearest even, [lo, hi] is the range of int8 or uint8, and with relu lo is at least zero_point[ch]
+// (the quantized 0). ch is the output channel (the column of C).
+// The kernels run it on a block of accumulators that was just stored from the tiles into an L1 scratch,
+// so the int32 output is never written to memory and read back.
+
+typedef struct requant_t {
+    const int32_t *bias;       // [channels], or NULL
+    const float *scale;        // [channels]
+    const int32_t *zero_point; // [channels], or NULL (0)
+    bool relu;
+    bool is_unsigned; // uint8 output, otherwise int8
+} requant_t;
+
+// |x| of the scaled value is clamped to this before the rounding, so it always fits int32
+#define REQUANT_MAX_ABS 1073741824.0f // 2^30
+
+static inline int32_t requant_value(int32_t acc, int ch, const requant_t *q) {
+    const int32_t biased = (int32_t)((uint32_t)acc + (uint32_t)(q->bias != NULL ? q->bias[ch] : 0));
+    float f = (float)biased * q->scale[ch];
+    f = f < -REQUANT_MAX_ABS ? -REQUANT_MAX_ABS : (f > REQUANT_MAX_ABS ? REQUANT_MAX_ABS : f);
+
+    const int32_t zp = q->zero_point != NULL ? q->zero_point[ch] : 0;
+    int32_t lo = q->is_unsigned ? 0 : -128;
+    const int32_t hi = q->is_unsigned ? 255 : 127;
+    if (q->relu && zp > lo)
+        lo = zp;
+
+    const int32_t y = _mm_cvtss_si32(_mm_set_ss(f)) + zp; // cvtss2si: to nearest even, no libm
+    return y < lo ? lo : (y > hi ? hi : y);
+}
+
+// rows x n accumulators (acc_stride apart, in elements) of channels ch0 .. ch0 + n - 1
+// to dst (dst_stride apart, in bytes)
+static inline void requant_rows_scalar(uint8_t *dst, size_t dst_stride, const int32_t *acc, size_t acc_stride,
+                                       int rows, int ch0, int n, const requant_t *q) {
+    for (int r = 0; r < rows; ++r) {
+        for (int x = 0; x < n; ++x) {
+            dst[r * dst_stride + x] = (uint8_t)requant_value(acc[r * acc_stride + x], ch0 + x, q);
+        }
+    }
+}
+
+// 16 channels per vector, whose parameters are loaded once for all rows.
+// vcvtps2dq rounds to nearest even (MXCSR default), as cvtss2si of requant_value.
+TARGET_AVX512 static inline void requant_rows_avx512(uint8_t *dst, size_t dst_stride, const int32_t *acc,
+                                                     size_t acc_stride, int rows, int ch0, int n, const requant_t *q) {
+    const __m512 max_abs = _mm512_set1_ps(REQUANT_MAX_ABS);
+    const __m512 min_abs = _mm512_set1_ps(-REQUANT_MAX_ABS);
+    const __m512i type_hi = _mm512_set1_epi32(q->is_unsigned ? 255 : 127);
+
+    for (int x = 0; x < n; x += 16) {
+        const __mmask16 mask = (n - x >= 16) ? 0xffff : (__mmask16)((1u << (n - x)) - 1);
+
+        const __m512i bias = q->bias != NULL ? _mm512_maskz_loadu_epi32(mask, &q->bias[ch0 + x]) : _mm512_setzero_si512();
+        const __m512 scale = _mm512_maskz_loadu_ps(mask, &q->scale[ch0 + x]);
+        const __m512i zp =
+            q->zero_point != NULL ? _mm512_maskz_loadu_epi32(mask, &q->zero_point[ch0 + x]) : _mm512_setzero_si512();
+        __m512i lo = _mm512_set1_epi32(q->is_unsigned ? 0 : -128);
+        if (q->relu)
+            lo = _mm512_max_epi32(lo, zp);
+
+        for (int r = 0; r < rows; ++r) {
+            const __m512i v = _mm512_add_epi32(_mm512_maskz_loadu_epi32(mask, &acc[r * acc_stride + x]), bias);
+            __m512 f = _mm512_mul_ps(_mm512_cvtepi32_ps(v), scale);
+            f = _mm512_min_ps(_mm512_max_ps(f, min_abs), max_abs);
+
+            __m512i y = _mm512_add_epi32(_mm512_cvtps_epi32(f), zp);
+            y = _mm512_min_epi32(_mm512_max_epi32(y, lo), type_hi);
+            _mm512_mask_cvtepi32_storeu_epi8(&dst[r * dst_stride + x], mask, y);
+        }
+    }
+}
+
+static inline void requant_rows(void *dst, size_t dst_stride, const int32_t *acc, size_t acc_stride, int rows, int ch0,
+                                int n, const requant_t *q) {
+    if (cpu_features.avx512) {
+        requant_rows_avx512((uint8_t *)dst, dst_stride, acc, acc_stride, rows, ch0, n, q);
+    } else {
+        requant_rows_scalar((uint8_t *)dst, dst_stride, acc, acc_stride, rows, ch0, n, q);
+    }
+}
+
+// -----------------------------------------------
+// Dequantization to FP32 of the dot products of dynamically quantized int8 operands (see common/quant.h):
+//
+//   y = acc * row_scale[row] * scale
+//
+// row_scale is per row of A (per row of C), scale is of all of B.
+
+typedef struct dequant_t {
+    const float *row_scale; // [rows]
+    float scale;
+} dequant_t;
+
+static inline void dequant_row(float *dst, const int32_t *acc, int n, float scale) {
+    for (int x = 0; x < n; ++x) {
+        dst[x] = (float)acc[x] * scale;
+    }
+}
+
+// -----------------------------------------------
+// Output of a kernel: int32 accumulators, int8 / uint8 through the requantization epilogue, or FP32 through
+// the dequantization
+
+typedef struct acc_output_t {
+    void *data;               // [rows][ld] of int32_t, of int8_t / uint8_t with requant, or of float with dequant
+    size_t ld;                // elements per row
+    const requant_t *requant; // NULL: the int32 accumulators are stored as they are
+    int row_pixels;           // 0, or the rows of C are pixels of an image with this many pixels per image row,
+    size_t row_stride;        // whose image rows are row_stride elements apart (a tensor with a halo)
+    const dequant_t *dequant; // NULL, or the output is FP32 (requant must be NULL)
+} acc_output_t;
+
+// Whether the int32 accumulators are stored as they are (so the tiles may be stored to the output directly)
+static inline bool acc_output_is_int32(const acc_output_t *out) { return out->requant == NULL && out->dequant == NULL; }
+
+// Offset (in elements) of row `row` of out
+static inline size_t acc_output_offset(const acc_output_t *out, size_t row) {
+    if (out->row_pixels == 0)
+        return row * out->ld;
+    return row / out->row_pixels * out->row_stride + row % out->row_pixels * out->ld;
+}
+
+// Whether rows row .. row + rows - 1 are ld elements apart, so one tile store covers them
+static inline bool acc_output_contiguous(const acc_output_t *out, size_t row, int rows) {
+    return out->row_pixels == 0 || row / out->row_pixels == (row + rows - 1) / out->row_pixels;
+}
+
+// Store rows x cols accumulators (acc_stride apart) at (row, col) of out; col is the first channel
+static inline void acc_output_store(const acc_output_t *out, size_t row, int col, const int32_t *acc,
+                                    size_t acc_stride, int rows, int cols) {
+    for (int r = 0; r < rows; ++r) {
+        const size_t offset = acc_output_offset(out, row + r) + col;
+        if (out->dequant != NULL) {
+            const float scale = out->dequant->row_scale[row + r] * out->dequant->scale;
+            dequant_row((float *)out->data + offset, &acc[r * acc_stride], cols, scale);
+        } else if (out->requant == NULL) {
+            memcpy((int32_t *)out->data + offset, &acc[r * acc_stride], cols * sizeof(int32_t));
+        } else {
+            requant_rows((uint8_t *)out->data + offset, 0, &acc[r * acc_stride], 0, 1, col, cols, out->requant);
+        }
+    }
+}
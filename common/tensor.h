@@ -0,0 +1,131 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// -----------------------------------------------
+// Tensor arena
+// One 64-byte aligned block is allocated up front, and the tensors of a network are carved out of it
+// (bump allocation), so running a layer allocates nothing. tensor_arena_mark / tensor_arena_release
+// give the space of the tensors of a layer back for the next one.
+//
+// A tensor is NHWC (batch 1) with a zeroed halo of `halo` pixels on every side, and `slack` zero bytes after
+// the last padded row. "Same"-padded convolution then reads its borders from the halo with no edge code,
+// and tile loads that run past the last pixel stay in owned (zero) memory.
+
+#define TENSOR_ALIGN 64
+
+typedef struct tensor_arena_t {
+    uint8_t *base; // TENSOR_ALIGN aligned
+    size_t size;
+    size_t used;
+} tensor_arena_t;
+
+typedef struct tensor_t {
+    void *data;       // pixel (0, 0), inside the halo
+    int h, w, c;
+    int elem_size;    // bytes per value: 1 (int8 / uint8) or 4 (int32)
+    int halo;         // zero pixels on every side
+    int pitch;        // pixels per row, w + 2 * halo
+    size_t slack;     // zero bytes after the last padded row
+    bool is_unsigned; // 1-byte values are uint8 (e.g. activations after ReLU)
+} tensor_t;
+
+#define TENSOR_ROUND_UP(x, y) (((x) + (y) - 1) / (y) * (y))
+
+static inline tensor_arena_t *tensor_arena_create(size_t size) {
+    tensor_arena_t *a = (tensor_arena_t *)malloc(sizeof(tensor_arena_t));
+    a->size = TENSOR_ROUND_UP(size, TENSOR_ALIGN);
+    a->base = (uint8_t *)aligned_alloc(TENSOR_ALIGN, a->size);
+    a->used = 0;
+    return a;
+}
+
+static inline void tensor_arena_destroy(tensor_arena_t *a) {
+    free(a->base);
+    free(a);
+}
+
+// Returns NULL when the arena is full
+static void *tensor_arena_alloc(tensor_arena_t *a, size_t bytes) {
+    const size_t size = TENSOR_ROUND_UP(bytes, TENSOR_ALIGN);
+    if (size > a->size - a->used) {
+        fprintf(stderr, "tensor arena: out of space (%zu of %zu bytes used, %zu requested)\n", a->used, a->size,
+                bytes);
+        return NULL;
+    }
+    void *p = a->base + a->used;
+    a->used += size;
+    return p;
+}
+
+static inline size_t tensor_arena_mark(const tensor_arena_t *a) { return a->used; }
+
+// Free everything allocated after the mark
+static inline void tensor_arena_release(tensor_arena_t *a, size_t mark) { a->used = mark; }
+
+// Bytes of a tensor: the padded rows and the slack
+static inline size_t tensor_bytes(int h, int w, int c, int elem_size, int halo, size_t slack) {
+    return (size_t)(h + 2 * halo) * (w + 2 * halo) * c * elem_size + slack;
+}
+
+static inline size_t tensor_row_bytes(const tensor_t *t) { return (size_t)t->pitch * t->c * t->elem_size; }
+
+// Pixel (y, x); y and x may be in the halo (-halo .. h + halo - 1)
+static inline void *tensor_pixel(const tensor_t *t, int y, int x) {
+    return (uint8_t *)t->data + ((ptrdiff_t)y * t->pitch + x) * t->c * t->elem_size;
+}
+
+// Zero the halo and the slack (the inside is left to whoever writes the tensor)
+static void tensor_zero_halo(const tensor_t *t) {
+    const size_t pixel_bytes = (size_t)t->c * t->elem_size;
+    const size_t row_bytes = tensor_row_bytes(t);
+    uint8_t *first = (uint8_t *)tensor_pixel(t, -t->halo, -t->halo);
+
+    memset(first, 0, row_bytes * t->halo);
+    for (int y = 0; y < t->h; ++y) {
+        uint8_t *row = first + (size_t)(y + t->halo) * row_bytes;
+        memset(row, 0, t->halo * pixel_bytes);
+        memset(row + (t->halo + t->w) * pixel_bytes, 0, t->halo * pixel_bytes);
+    }
+    memset(first + (size_t)(t->h + t->halo) * row_bytes, 0, row_bytes * t->halo + t->slack);
+}
+
+// A tensor from the arena with a zeroed halo; data is NULL when the arena is full
+static tensor_t tensor_alloc(tensor_arena_t *a, int h, int w, int c, int elem_size, int halo, size_t slack) {
+    tensor_t t = {.data = NULL,
+                  .h = h,
+                  .w = w,
+                  .c = c,
+                  .elem_size = elem_size,
+                  .halo = halo,
+                  .pitch = w + 2 * halo,
+                  .slack = slack,
+                  .is_unsigned = false};
+    uint8_t *base = (uint8_t *)tensor_arena_alloc(a, tensor_bytes(h, w, c, elem_size, halo, slack));
+    if (base == NULL)
+        return t;
+
+    t.data = base + ((size_t)halo * t.pitch + halo) * c * elem_size;
+    tensor_zero_halo(&t);
+    return t;
+}
+
+// Copy a dense [h][w][c] array into the inside of t, and back
+static inline void tensor_load(const tensor_t *t, const void *src) {
+    const size_t bytes = (size_t)t->w * t->c * t->elem_size;
+    for (int y = 0; y < t->h; ++y) {
+        memcpy(tensor_pixel(t, y, 0), (const uint8_t *)src + y * bytes, bytes);
+    }
+}
+
+static inline void tensor_store(const tensor_t *t, void *dst) {
+    const size_t bytes = (size_t)t->w * t->c * t->elem_size;
+    for (int y = 0; y < t->h; ++y) {
+        memcpy((uint8_t *)dst + y * bytes, tensor_pixel(t, y, 0), bytes);
+    }
+}
@@ -0,0 +1,248 @@
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// CPU affinity (pthread_setaffinity_np, CPU_SET) needs _GNU_SOURCE before the first #include
+#if !defined(CPU_SET)
+#error "Define _GNU_SOURCE at the top of the file that includes thread_pool.h"
+#endif
+
+// -----------------------------------------------
+// Thread pool
+// The calling thread is thread 0 and takes part in every job; num_threads - 1 workers wait for jobs.
+// Thread t is pinned to the t-th core of the socket (see socket_core_cpus).
+//
+// Tile state (the tile config and the tile data) is per thread, so a job that uses AMX loads
+// the tile config on every thread in parallel_job_t::begin, and the workers call thread_exit
+// (amx_release) before they end. The XTILEDATA permission is per process (detect_cpu_features).
+
+typedef enum schedule_t {
+    SCHEDULE_STATIC,  // thread t runs the t-th contiguous range of tasks
+    SCHEDULE_DYNAMIC, // threads take the next task from a shared counter (ragged shapes, tasks of uneven cost)
+} schedule_t;
+
+typedef struct parallel_job_t {
+    void (*begin)(void *arg); // called once by each thread before its first task (may be NULL)
+    void (*task)(void *arg, int task);
+    void *arg;
+    int num_tasks;
+    schedule_t schedule;
+} parallel_job_t;
+
+typedef struct thread_pool_t thread_pool_t;
+
+typedef struct thread_pool_worker_t {
+    thread_pool_t *pool;
+    int index;
+    pthread_t thread;
+} thread_pool_worker_t;
+
+struct thread_pool_t {
+    int num_threads;
+    thread_pool_worker_t *workers; // [num_threads], workers[0] is the calling thread
+    void (*thread_exit)();
+    int cpus[CPU_SETSIZE];
+    cpu_set_t caller_affinity; // restored by thread_pool_destroy
+
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    const parallel_job_t *job;
+    uint64_t generation; // incremented for every job
+    int running;         // workers that haven't finished the current job
+    bool stop;
+
+    atomic_int next_task; // SCHEDULE_DYNAMIC
+};
+
+// CPUs of the cores of one socket (the socket of the first CPU this process may run on),
+// one hardware thread per core. Returns the number of cores.
+// Without the sysfs topology, every CPU of the affinity mask counts as a core.
+static int socket_core_cpus(int *cpus, int max_cpus) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        cpus[0] = 0;
+        return 1;
+    }
+
+    int count = 0;
+    int socket = -1;
+    int core_ids[CPU_SETSIZE];
+
+    for (int cpu = 0; cpu < CPU_SETSIZE && count < max_cpus; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+
+        int package = 0;
+        int core = cpu;
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        FILE *f = fopen(path, "r");
+        if (f != NULL) {
+            if (fscanf(f, "%d", &package) != 1)
+                package = 0;
+            fclose(f);
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+        f = fopen(path, "r");
+        if (f != NULL) {
+            if (fscanf(f, "%d", &core) != 1)
+                core = cpu;
+            fclose(f);
+        }
+
+        if (socket < 0)
+            socket = package;
+        if (package != socket)
+            continue;
+
+        // Skip the other hardware threads of a core
+        bool seen = false;
+        for (int i = 0; i < count; ++i) {
+            seen |= core_ids[i] == core;
+        }
+        if (seen)
+            continue;
+
+        core_ids[count] = core;
+        cpus[count++] = cpu;
+    }
+
+    if (count == 0) {
+        cpus[0] = 0;
+        count = 1;
+    }
+    return count;
+}
+
+static void thread_pool_pin(pthread_t thread, int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+// Run the tasks of the current job that belong to thread t
+static void thread_pool_work(thread_pool_t *pool, const parallel_job_t *job, int t) {
+    bool begun = false;
+
+    if (job->schedule == SCHEDULE_STATIC) {
+        const int first = (int)((int64_t)job->num_tasks * t / pool->num_threads);
+        const int last = (int)((int64_t)job->num_tasks * (t + 1) / pool->num_threads);
+        for (int i = first; i < last; ++i) {
+            if (!begun && job->begin != NULL)
+                job->begin(job->arg);
+            begun = true;
+            job->task(job->arg, i);
+        }
+    } else {
+        for (int i; (i = atomic_fetch_add(&pool->next_task, 1)) < job->num_tasks;) {
+            if (!begun && job->begin != NULL)
+                job->begin(job->arg);
+            begun = true;
+            job->task(job->arg, i);
+        }
+    }
+}
+
+static void *thread_pool_main(void *arg) {
+    thread_pool_worker_t *worker = (thread_pool_worker_t *)arg;
+    thread_pool_t *pool = worker->pool;
+    uint64_t generation = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->mutex);
+        while (!pool->stop && pool->generation == generation) {
+            pthread_cond_wait(&pool->start, &pool->mutex);
+        }
+        if (pool->stop) {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+        generation = pool->generation;
+        const parallel_job_t *job = pool->job;
+        pthread_mutex_unlock(&pool->mutex);
+
+        thread_pool_work(pool, job, worker->index);
+
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->running == 0)
+            pthread_cond_signal(&pool->done);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    if (pool->thread_exit != NULL)
+        pool->thread_exit();
+    return NULL;
+}
+
+// thread_exit is called by every worker before it ends (may be NULL)
+static thread_pool_t *thread_pool_create(int num_threads, void (*thread_exit)()) {
+    thread_pool_t *pool = (thread_pool_t *)calloc(1, sizeof(thread_pool_t));
+    const int num_cores = socket_core_cpus(pool->cpus, CPU_SETSIZE);
+
+    pool->num_threads = num_threads < 1 ? 1 : num_threads;
+    pool->thread_exit = thread_exit;
+    pool->workers = (thread_pool_worker_t *)calloc(pool->num_threads, sizeof(thread_pool_worker_t));
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    pthread_getaffinity_np(pthread_self(), sizeof(pool->caller_affinity), &pool->caller_affinity);
+    pool->workers[0] = (thread_pool_worker_t){pool, 0, pthread_self()};
+    thread_pool_pin(pthread_self(), pool->cpus[0]);
+
+    for (int t = 1; t < pool->num_threads; ++t) {
+        pool->workers[t].pool = pool;
+        pool->workers[t].index = t;
+        pthread_create(&pool->workers[t].thread, NULL, thread_pool_main, &pool->workers[t]);
+        thread_pool_pin(pool->workers[t].thread, pool->cpus[t % num_cores]);
+    }
+
+    return pool;
+}
+
+static void thread_pool_destroy(thread_pool_t *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int t = 1; t < pool->num_threads; ++t) {
+        pthread_join(pool->workers[t].thread, NULL);
+    }
+
+    pthread_setaffinity_np(pthread_self(), sizeof(pool->caller_affinity), &pool->caller_affinity);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    free(pool->workers);
+    free(pool);
+}
+
+// Run a job on all threads of the pool and wait until every task is done
+static void thread_pool_run(thread_pool_t *pool, const parallel_job_t *job) {
+    atomic_store(&pool->next_task, 0);
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->job = job;
+    pool->running = pool->num_threads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->mutex);
+
+    thread_pool_work(pool, job, 0);
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->running > 0) {
+        pthread_cond_wait(&pool->done, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
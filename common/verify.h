@@ -0,0 +1,329 @@
+#pragma once
+
+#include <immintrin.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu_features.h"
+
+// -----------------------------------------------
+// Verification
+// Compare the output of a kernel with its reference and print one line instead of the values:
+//
+//   conv_amx_v4: OK (153600 values, exact)
+//   conv_amx_v4: 12 of 153600 values differ, first at [3][17][2] (got 41, expected 40), max |error| 3
+//
+// int32 outputs must be exact. FP32 outputs pass within max_ulps units in the last place, or within rel_tol of
+// the largest |reference| (for sums whose order differs from the reference, where a small value may be off by
+// many ulps). With AVX-512 a passing fp32 check is two vector passes at memory speed (max |reference|, then the
+// comparison with the error statistics); only the lanes the vector test rejects, and the report of a failing
+// check, go through the scalar code.
+//
+// With the environment variable AMX_EXAMPLE_DUMP set to a directory, the output and the reference are also
+// written there as raw little-endian arrays (<name>.bin and <name>.ref.bin, the name with [A-Za-z0-9_-] only)
+// for offline diffing, e.g. with cmp or numpy.fromfile.
+
+#define VERIFY_MAX_RANK 4
+
+// Shape of the compared arrays (row-major), for the coordinates of the first mismatch
+typedef struct verify_dims_t {
+    int rank;
+    int n[VERIFY_MAX_RANK];
+} verify_dims_t;
+
+static inline verify_dims_t verify_dims2(int rows, int cols) { return (verify_dims_t){2, {rows, cols}}; }
+
+static inline verify_dims_t verify_dims3(int rows, int cols, int ch) { return (verify_dims_t){3, {rows, cols, ch}}; }
+
+static inline size_t verify_count(const verify_dims_t *dims) {
+    size_t count = 1;
+    for (int d = 0; d < dims->rank; ++d) {
+        count *= dims->n[d];
+    }
+    return count;
+}
+
+// "[r][c][ch]" of flat index i
+static inline void verify_format_index(char *buf, size_t size, const verify_dims_t *dims, size_t i) {
+    size_t coords[VERIFY_MAX_RANK];
+    for (int d = dims->rank - 1; d >= 0; --d) {
+        coords[d] = i % dims->n[d];
+        i /= dims->n[d];
+    }
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int d = 0; d < dims->rank && len < size; ++d) {
+        len += snprintf(buf + len, size - len, "[%zu]", coords[d]);
+    }
+}
+
+static inline void verify_dump_file(const char *dir, const char *name, const char *suffix, const void *data,
+                                    size_t bytes) {
+    char path[512];
+    size_t len = snprintf(path, sizeof(path), "%s/", dir);
+    for (const char *p = name; *p && len + 1 < sizeof(path); ++p) {
+        const bool ok = (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') ||
+                        *p == '_' || *p == '-';
+        path[len++] = ok ? *p : '_';
+    }
+    snprintf(path + len, sizeof(path) - len, "%s", suffix);
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL || fwrite(data, 1, bytes, f) != bytes) {
+        fprintf(stderr, "verify: can't write %s\n", path);
+    }
+    if (f != NULL)
+        fclose(f);
+}
+
+// Write got and ref into AMX_EXAMPLE_DUMP, when it is set
+static inline void verify_dump(const char *name, const void *got, const void *ref, size_t bytes) {
+    const char *dir = getenv("AMX_EXAMPLE_DUMP");
+    if (dir == NULL || *dir == '\0')
+        return;
+    verify_dump_file(dir, name, ".bin", got, bytes);
+    verify_dump_file(dir, name, ".ref.bin", ref, bytes);
+}
+
+// -----------------------------------------------
+// int32, exact
+
+static inline size_t verify_first_diff_i32_scalar(const int32_t *got, const int32_t *ref, size_t begin, size_t n) {
+    for (size_t i = begin; i < n; ++i) {
+        if (got[i] != ref[i])
+            return i;
+    }
+    return n;
+}
+
+TARGET_AVX2 static inline size_t verify_first_diff_i32_avx2(const int32_t *got, const int32_t *ref, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256i eq = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *)&got[i]),
+                                              _mm256_loadu_si256((const __m256i *)&ref[i]));
+        const unsigned int mask = (unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(eq));
+        if (mask != 0xff)
+            return i + __builtin_ctz(~mask);
+    }
+    return verify_first_diff_i32_scalar(got, ref, i, n);
+}
+
+TARGET_AVX512 static inline size_t verify_first_diff_i32_avx512(const int32_t *got, const int32_t *ref, size_t n) {
+    for (size_t i = 0; i < n; i += 16) {
+        const __mmask16 mask = (n - i >= 16) ? 0xffff : (__mmask16)((1u << (n - i)) - 1);
+        const __mmask16 ne = _mm512_mask_cmpneq_epi32_mask(mask, _mm512_maskz_loadu_epi32(mask, &got[i]),
+                                                           _mm512_maskz_loadu_epi32(mask, &ref[i]));
+        if (ne)
+            return i + __builtin_ctz(ne);
+    }
+    return n;
+}
+
+// Index of the first got[i] != ref[i], or n
+static inline size_t verify_first_diff_i32(const int32_t *got, const int32_t *ref, size_t n) {
+    if (cpu_features.avx512)
+        return verify_first_diff_i32_avx512(got, ref, n);
+    if (cpu_features.avx2)
+        return verify_first_diff_i32_avx2(got, ref, n);
+    return verify_first_diff_i32_scalar(got, ref, 0, n);
+}
+
+// Compare got with ref (both of dims) exactly and print the result. Returns true when they are equal.
+static inline bool verify_i32(const char *name, const int32_t *got, const int32_t *ref, verify_dims_t dims) {
+    const size_t n = verify_count(&dims);
+    verify_dump(name, got, ref, n * sizeof(int32_t));
+
+    const size_t first = verify_first_diff_i32(got, ref, n);
+    if (first == n) {
+        printf("%s: OK (%zu values, exact)\n", name, n);
+        return true;
+    }
+
+    // Only a failing output is scanned to the end
+    size_t mismatches = 0;
+    int64_t max_err = 0;
+    for (size_t i = first; i < n; ++i) {
+        const int64_t err = llabs((int64_t)got[i] - ref[i]);
+        mismatches += err != 0;
+        max_err = err > max_err ? err : max_err;
+    }
+
+    char where[64];
+    verify_format_index(where, sizeof(where), &dims, first);
+    printf("%s: %zu of %zu values differ, first at %s (got %d, expected %d), max |error| %lld\n", name, mismatches, n,
+           where, got[first], ref[first], (long long)max_err);
+    return false;
+}
+
+// Requantized int8 / uint8 outputs: widened to int32 and compared with verify_i32 (and dumped as int32)
+static inline bool verify_bytes(const char *name, const void *got, const void *ref, verify_dims_t dims,
+                                bool is_unsigned) {
+    const size_t n = verify_count(&dims);
+    int32_t *got32 = (int32_t *)malloc(n * sizeof(int32_t));
+    int32_t *ref32 = (int32_t *)malloc(n * sizeof(int32_t));
+    for (size_t i = 0; i < n; ++i) {
+        got32[i] = is_unsigned ? ((const uint8_t *)got)[i] : ((const int8_t *)got)[i];
+        ref32[i] = is_unsigned ? ((const uint8_t *)ref)[i] : ((const int8_t *)ref)[i];
+    }
+    const bool ok = verify_i32(name, got32, ref32, dims);
+    free(got32);
+    free(ref32);
+    return ok;
+}
+
+static inline bool verify_i8(const char *name, const int8_t *got, const int8_t *ref, verify_dims_t dims) {
+    return verify_bytes(name, got, ref, dims, false);
+}
+
+static inline bool verify_u8(const char *name, const uint8_t *got, const uint8_t *ref, verify_dims_t dims) {
+    return verify_bytes(name, got, ref, dims, true);
+}
+
+// -----------------------------------------------
+// FP32, within a tolerance
+
+// Distance of a and b in units in the last place (the bit patterns mapped to a monotonic integer line)
+static inline int64_t verify_ulps(float a, float b) {
+    int32_t ia, ib;
+    memcpy(&ia, &a, sizeof(ia));
+    memcpy(&ib, &b, sizeof(ib));
+    const int64_t la = ia < 0 ? (int64_t)INT32_MIN - ia : ia;
+    const int64_t lb = ib < 0 ? (int64_t)INT32_MIN - ib : ib;
+    return la > lb ? la - lb : lb - la;
+}
+
+static inline float verify_absmax_f32_scalar(const float *x, size_t n) {
+    float m = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const float v = x[i] < 0 ? -x[i] : x[i];
+        m = v > m ? v : m;
+    }
+    return m;
+}
+
+// (_mm512_max_ps returns its second operand for NaN, so NaN is skipped as in the scalar loop)
+TARGET_AVX512 static inline float verify_absmax_f32_avx512(const float *x, size_t n) {
+    __m512 m = _mm512_setzero_ps();
+    for (size_t i = 0; i < n; i += 16) {
+        const __mmask16 mask = (n - i >= 16) ? 0xffff : (__mmask16)((1u << (n - i)) - 1);
+        m = _mm512_max_ps(_mm512_abs_ps(_mm512_maskz_loadu_ps(mask, &x[i])), m);
+    }
+    return _mm512_reduce_max_ps(m);
+}
+
+static inline float verify_absmax_f32(const float *x, size_t n) {
+    return cpu_features.avx512 ? verify_absmax_f32_avx512(x, n) : verify_absmax_f32_scalar(x, n);
+}
+
+static inline bool verify_f32_ok(float got, float ref, int max_ulps, float abs_tol) {
+    const float err = got > ref ? got - ref : ref - got;
+    return err <= abs_tol || verify_ulps(got, ref) <= max_ulps;
+}
+
+static inline size_t verify_first_fail_f32_scalar(const float *got, const float *ref, size_t begin, size_t n,
+                                                  int max_ulps, float abs_tol) {
+    for (size_t i = begin; i < n; ++i) {
+        if (!verify_f32_ok(got[i], ref[i], max_ulps, abs_tol))
+            return i;
+    }
+    return n;
+}
+
+// Largest |got - ref| and ulps (NaN errors are skipped), and the number of failures
+static inline size_t verify_stats_f32_scalar(const float *got, const float *ref, size_t n, int max_ulps,
+                                             float abs_tol, float *max_err, int64_t *max_ulp_err) {
+    size_t failures = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const float err = got[i] > ref[i] ? got[i] - ref[i] : ref[i] - got[i];
+        const int64_t ulps = verify_ulps(got[i], ref[i]);
+        *max_err = err > *max_err ? err : *max_err;
+        *max_ulp_err = ulps > *max_ulp_err ? ulps : *max_ulp_err;
+        failures += !verify_f32_ok(got[i], ref[i], max_ulps, abs_tol);
+    }
+    return failures;
+}
+
+// 16 fp32 as the monotonic integers of verify_ulps, widened to int64 (low and high 8 lanes)
+TARGET_AVX512 static inline void verify_ordered_avx512(__m512 x, __m512i *lo, __m512i *hi) {
+    const __m512i bits = _mm512_castps_si512(x);
+    const __m512i mag = _mm512_and_si512(bits, _mm512_set1_epi32(0x7fffffff));
+    const __m512i ordered = _mm512_mask_sub_epi32(mag, _mm512_movepi32_mask(bits), _mm512_setzero_si512(), mag);
+    *lo = _mm512_cvtepi32_epi64(_mm512_castsi512_si256(ordered));
+    *hi = _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(ordered, 1));
+}
+
+// The absolute test in AVX-512; the lanes it rejects (and NaN) get the exact scalar test.
+// Returns the first failure, or n with *max_err and *max_ulp_err of every value.
+TARGET_AVX512 static inline size_t verify_first_fail_f32_avx512(const float *got, const float *ref, size_t n,
+                                                                int max_ulps, float abs_tol, float *max_err,
+                                                                int64_t *max_ulp_err) {
+    const __m512 tol = _mm512_set1_ps(abs_tol);
+    __m512 err_max = _mm512_setzero_ps();
+    __m512i ulps_max = _mm512_setzero_si512();
+
+    for (size_t i = 0; i < n; i += 16) {
+        const __mmask16 mask = (n - i >= 16) ? 0xffff : (__mmask16)((1u << (n - i)) - 1);
+        const __m512 g = _mm512_maskz_loadu_ps(mask, &got[i]);
+        const __m512 r = _mm512_maskz_loadu_ps(mask, &ref[i]);
+        const __m512 err = _mm512_abs_ps(_mm512_sub_ps(g, r));
+        const __mmask16 suspect = _mm512_mask_cmp_ps_mask(mask, err, tol, _CMP_NLE_UQ);
+        if (suspect) {
+            const size_t end = (n - i >= 16) ? i + 16 : n;
+            const size_t fail = verify_first_fail_f32_scalar(got, ref, i, end, max_ulps, abs_tol);
+            if (fail < end)
+                return fail;
+        }
+
+        __m512i g_lo, g_hi, r_lo, r_hi;
+        verify_ordered_avx512(g, &g_lo, &g_hi);
+        verify_ordered_avx512(r, &r_lo, &r_hi);
+        ulps_max = _mm512_max_epi64(ulps_max, _mm512_abs_epi64(_mm512_sub_epi64(g_lo, r_lo)));
+        ulps_max = _mm512_max_epi64(ulps_max, _mm512_abs_epi64(_mm512_sub_epi64(g_hi, r_hi)));
+        err_max = _mm512_max_ps(err, err_max);
+    }
+
+    *max_err = _mm512_reduce_max_ps(err_max);
+    *max_ulp_err = _mm512_reduce_max_epi64(ulps_max);
+    return n;
+}
+
+// Compare got with ref (both of dims): a value passes within max_ulps, or within rel_tol * max |ref|.
+// Prints the largest errors either way. Returns true when every value passes.
+static inline bool verify_f32(const char *name, const float *got, const float *ref, verify_dims_t dims, int max_ulps,
+                              float rel_tol) {
+    const size_t n = verify_count(&dims);
+    verify_dump(name, got, ref, n * sizeof(float));
+
+    const float max_ref = verify_absmax_f32(ref, n);
+    const float abs_tol = rel_tol * max_ref;
+
+    // The statistics come with the AVX-512 search when everything passes, and from a scalar pass otherwise
+    size_t failures = 0;
+    int64_t max_ulp_err = 0;
+    float max_err = 0;
+    size_t first = n;
+    if (cpu_features.avx512)
+        first = verify_first_fail_f32_avx512(got, ref, n, max_ulps, abs_tol, &max_err, &max_ulp_err);
+    if (!cpu_features.avx512 || first < n) {
+        max_err = 0;
+        max_ulp_err = 0;
+        failures = verify_stats_f32_scalar(got, ref, n, max_ulps, abs_tol, &max_err, &max_ulp_err);
+        first = failures > 0 ? verify_first_fail_f32_scalar(got, ref, 0, n, max_ulps, abs_tol) : n;
+    }
+    const float rel_err = max_ref > 0 ? max_err / max_ref : max_err;
+
+    if (first == n) {
+        printf("%s: OK (%zu values, max error %lld ulps, %g relative)\n", name, n, (long long)max_ulp_err, rel_err);
+        return true;
+    }
+
+    char where[64];
+    verify_format_index(where, sizeof(where), &dims, first);
+    printf("%s: %zu of %zu values out of tolerance, first at %s (got %g, expected %g), max error %lld ulps, "
+           "%g relative\n",
+           name, failures, n, where, got[first], ref[first], (long long)max_ulp_err, rel_err);
+    return false;
+}
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <immintrin.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cpu_features.h"
+
+// -----------------------------------------------
+// Interleave (VNNI re-layout) kernels for the B operand of the AMX dot products
+//
+// int8: 4 rows of B become one row of the tile, dst[c * 4 + i] = rows[i][c]
+// bf16: 2 rows of B become one row of the tile, dst[c * 2 + i] = rows[i][c]
+//
+// 16 columns make one 64-byte tile row (a "chunk").
+// Chunk x of the output is written at dst + x * chunk_stride (in bytes),
+// so the columns can go straight into separate 16-column panels.
+// Pass chunk_stride = 64 for a contiguous output.
+//
+// Rows past the end of B are passed as a pointer to zeros.
+
+static inline void vnni_interleave4_s8_scalar(int8_t *dst, size_t chunk_stride, const int8_t *r0, const int8_t *r1,
+                                              const int8_t *r2, const int8_t *r3, int n) {
+    for (int c = 0; c < n; ++c) {
+        int8_t *d = dst + (c / 16) * chunk_stride + (c % 16) * 4;
+        d[0] = r0[c];
+        d[1] = r1[c];
+        d[2] = r2[c];
+        d[3] = r3[c];
+    }
+}
+
+static inline void vnni_interleave2_bf16_scalar(uint16_t *dst, size_t chunk_stride, const uint16_t *r0,
+                                                const uint16_t *r1, int n) {
+    for (int c = 0; c < n; ++c) {
+        uint16_t *d = (uint16_t *)((int8_t *)dst + (c / 16) * chunk_stride) + (c % 16) * 2;
+        d[0] = r0[c];
+        d[1] = r1[c];
+    }
+}
+
+// -----------------------------------------------
+// AVX2: 32 columns (int8) / 16 columns (bf16) per iteration
+
+TARGET_AVX2 static inline void vnni_interleave4_s8_avx2(int8_t *dst, size_t chunk_stride, const int8_t *r0,
+                                                        const int8_t *r1, const int8_t *r2, const int8_t *r3, int n) {
+    int c = 0;
+    for (; c + 32 <= n; c += 32) {
+        const __m256i v0 = _mm256_loadu_si256((const __m256i *)&r0[c]);
+        const __m256i v1 = _mm256_loadu_si256((const __m256i *)&r1[c]);
+        const __m256i v2 = _mm256_loadu_si256((const __m256i *)&r2[c]);
+        const __m256i v3 = _mm256_loadu_si256((const __m256i *)&r3[c]);
+
+        // Byte pairs (r0, r1) and (r2, r3); lane 0 holds columns 0-15, lane 1 holds 16-31
+        const __m256i p01_lo = _mm256_unpacklo_epi8(v0, v1);
+        const __m256i p01_hi = _mm256_unpackhi_epi8(v0, v1);
+        const __m256i p23_lo = _mm256_unpacklo_epi8(v2, v3);
+        const __m256i p23_hi = _mm256_unpackhi_epi8(v2, v3);
+
+        // 4-byte groups: q0 = columns 0-3 (+16), q1 = 4-7, q2 = 8-11, q3 = 12-15
+        const __m256i q0 = _mm256_unpacklo_epi16(p01_lo, p23_lo);
+        const __m256i q1 = _mm256_unpackhi_epi16(p01_lo, p23_lo);
+        const __m256i q2 = _mm256_unpacklo_epi16(p01_hi, p23_hi);
+        const __m256i q3 = _mm256_unpackhi_epi16(p01_hi, p23_hi);
+
+        int8_t *d0 = dst + (c / 16) * chunk_stride;
+        int8_t *d1 = d0 + chunk_stride;
+        _mm256_storeu_si256((__m256i *)&d0[0], _mm256_permute2x128_si256(q0, q1, 0x20));
+        _mm256_storeu_si256((__m256i *)&d0[32], _mm256_permute2x128_si256(q2, q3, 0x20));
+        _mm256_storeu_si256((__m256i *)&d1[0], _mm256_permute2x128_si256(q0, q1, 0x31));
+        _mm256_storeu_si256((__m256i *)&d1[32], _mm256_permute2x128_si256(q2, q3, 0x31));
+    }
+
+    // Remainder columns (c is a multiple of 16, so the chunk layout continues)
+    vnni_interleave4_s8_scalar(dst + (c / 16) * chunk_stride, chunk_stride, r0 + c, r1 + c, r2 + c, r3 + c, n - c);
+}
+
+TARGET_AVX2 static inline void vnni_interleave2_bf16_avx2(uint16_t *dst, size_t chunk_stride, const uint16_t *r0,
+                                                          const uint16_t *r1, int n) {
+    int c = 0;
+    for (; c + 16 <= n; c += 16) {
+        const __m256i v0 = _mm256_loadu_si256((const __m256i *)&r0[c]);
+        const __m256i v1 = _mm256_loadu_si256((const __m256i *)&r1[c]);
+
+        // lo = columns 0-3 and 8-11, hi = columns 4-7 and 12-15
+        const __m256i lo = _mm256_unpacklo_epi16(v0, v1);
+        const __m256i hi = _mm256_unpackhi_epi16(v0, v1);
+
+        int8_t *d = (int8_t *)dst + (c / 16) * chunk_stride;
+        _mm256_storeu_si256((__m256i *)&d[0], _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)&d[32], _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+
+    vnni_interleave2_bf16_scalar((uint16_t *)((int8_t *)dst + (c / 16) * chunk_stride), chunk_stride, r0 + c, r1 + c,
+                                 n - c);
+}
+
+// -----------------------------------------------
+// AVX-512: 64 columns (int8) / 32 columns (bf16) per iteration
+
+TARGET_AVX512 static inline void vnni_interleave4_s8_avx512(int8_t *dst, size_t chunk_stride, const int8_t *r0,
+                                                            const int8_t *r1, const int8_t *r2, const int8_t *r3,
+                                                            int n) {
+    int c = 0;
+    for (; c + 64 <= n; c += 64) {
+        const __m512i v0 = _mm512_loadu_si512(&r0[c]);
+        const __m512i v1 = _mm512_loadu_si512(&r1[c]);
+        const __m512i v2 = _mm512_loadu_si512(&r2[c]);
+        const __m512i v3 = _mm512_loadu_si512(&r3[c]);
+
+        // Same as AVX2, but lane L holds columns 16 * L .. 16 * L + 15
+        const __m512i p01_lo = _mm512_unpacklo_epi8(v0, v1);
+        const __m512i p01_hi = _mm512_unpackhi_epi8(v0, v1);
+        const __m512i p23_lo = _mm512_unpacklo_epi8(v2, v3);
+        const __m512i p23_hi = _mm512_unpackhi_epi8(v2, v3);
+
+        const __m512i q0 = _mm512_unpacklo_epi16(p01_lo, p23_lo);
+        const __m512i q1 = _mm512_unpackhi_epi16(p01_lo, p23_lo);
+        const __m512i q2 = _mm512_unpacklo_epi16(p01_hi, p23_hi);
+        const __m512i q3 = _mm512_unpackhi_epi16(p01_hi, p23_hi);
+
+        // Transpose the 4x4 matrix of 128-bit lanes: chunk L = (q0.L, q1.L, q2.L, q3.L)
+        const __m512i t0 = _mm512_shuffle_i64x2(q0, q1, _MM_SHUFFLE(1, 0, 1, 0));
+        const __m512i t1 = _mm512_shuffle_i64x2(q2, q3, _MM_SHUFFLE(1, 0, 1, 0));
+        const __m512i t2 = _mm512_shuffle_i64x2(q0, q1, _MM_SHUFFLE(3, 2, 3, 2));
+        const __m512i t3 = _mm512_shuffle_i64x2(q2, q3, _MM_SHUFFLE(3, 2, 3, 2));
+
+        int8_t *d = dst + (c / 16) * chunk_stride;
+        _mm512_storeu_si512(d, _mm512_shuffle_i64x2(t0, t1, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm512_storeu_si512(d + chunk_stride, _mm512_shuffle_i64x2(t0, t1, _MM_SHUFFLE(3, 1, 3, 1)));
+        _mm512_storeu_si512(d + chunk_stride * 2, _mm512_shuffle_i64x2(t2, t3, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm512_storeu_si512(d + chunk_stride * 3, _mm512_shuffle_i64x2(t2, t3, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+
+    vnni_interleave4_s8_scalar(dst + (c / 16) * chunk_stride, chunk_stride, r0 + c, r1 + c, r2 + c, r3 + c, n - c);
+}
+
+TARGET_AVX512 static inline void vnni_interleave2_bf16_avx512(uint16_t *dst, size_t chunk_stride, const uint16_t *r0,
+                                                              const uint16_t *r1, int n) {
+    // chunk 0 = (lo.0, hi.0, lo.1, hi.1), chunk 1 = (lo.2, hi.2, lo.3, hi.3) in 128-bit lanes
+    const __m512i idx0 = _mm512_setr_epi64(0, 1, 8, 9, 2, 3, 10, 11);
+    const __m512i idx1 = _mm512_setr_epi64(4, 5, 12, 13, 6, 7, 14, 15);
+
+    int c = 0;
+    for (; c + 32 <= n; c += 32) {
+        const __m512i v0 = _mm512_loadu_si512(&r0[c]);
+        const __m512i v1 = _mm512_loadu_si512(&r1[c]);
+
+        const __m512i lo = _mm512_unpacklo_epi16(v0, v1);
+        const __m512i hi = _mm512_unpackhi_epi16(v0, v1);
+
+        int8_t *d = (int8_t *)dst + (c / 16) * chunk_stride;
+        _mm512_storeu_si512(d, _mm512_permutex2var_epi64(lo, idx0, hi));
+        _mm512_storeu_si512(d + chunk_stride, _mm512_permutex2var_epi64(lo, idx1, hi));
+    }
+
+    vnni_interleave2_bf16_scalar((uint16_t *)((int8_t *)dst + (c / 16) * chunk_stride), chunk_stride, r0 + c, r1 + c,
+                                 n - c);
+}
+
+// -----------------------------------------------
+// Use the widest kernel the CPU supports (see detect_cpu_features)
+
+static inline void vnni_interleave4_s8(int8_t *dst, size_t chunk_stride, const int8_t *r0, const int8_t *r1,
+                                       const int8_t *r2, const int8_t *r3, int n) {
+    if (cpu_features.avx512) {
+        vnni_interleave4_s8_avx512(dst, chunk_stride, r0, r1, r2, r3, n);
+    } else if (cpu_features.avx2) {
+        vnni_interleave4_s8_avx2(dst, chunk_stride, r0, r1, r2, r3, n);
+    } else {
+        vnni_interleave4_s8_scalar(dst, chunk_stride, r0, r1, r2, r3, n);
+    }
+}
+
+static inline void vnni_interleave2_bf16(uint16_t *dst, size_t chunk_stride, const uint16_t *r0, const uint16_t *r1,
+                                         int n) {
+    if (cpu_features.avx512) {
+        vnni_interleave2_bf16_avx512(dst, chunk_stride, r0, r1, n);
+    } else if (cpu_features.avx2) {
+        vnni_interleave2_bf16_avx2(dst, chunk_stride, r0, r1, n);
+    } else {
+        vnni_interleave2_bf16_scalar(dst, chunk_stride, r0, r1, n);
+    }
+}
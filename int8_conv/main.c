@@ -1,3 +1,5 @@
+#define _GNU_SOURCE // CPU affinity of the thread pool
+
 #include <immintrin.h>
 #include <memory.h>
 #include <stdbool.h>
@@ -5,15 +7,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-#if defined(__linux__)
-#include <sys/syscall.h>
-#include <unistd.h>
-
-#define ARCH_GET_XCOMP_PERM 0x1022
-#define ARCH_REQ_XCOMP_PERM 0x1023
-#define XFEATURE_XTILECFG 17
-#define XFEATURE_XTILEDATA 18
-#endif
+#include "../common/amx.h"
+#include "../common/bench.h"
+#include "../common/conv.h"
+#include "../common/conv_graph.h"
+#include "../common/conv_stream.h"
+#include "../common/cpu_features.h"
+#include "../common/requant.h"
+#include "../common/tensor.h"
+#include "../common/thread_pool.h"
+#include "../common/verify.h"
+#include "../common/vnni_pack.h"
 
 #define INPUT_ROWS 160
 #define INPUT_COLS 160
@@ -29,6 +33,10 @@ typedef struct input_data_t {
             int8_t ch[INPUT_CH];
         } cols[INPUT_COLS];
     } rows[INPUT_ROWS];
+
+    // A tile row is up to 64 bytes from a pixel, so the loads of the last pixels read past the last row
+    // (the extra K values meet zero weights)
+    int8_t tail[64];
 } input_data_t;
 
 typedef struct output_data_t {
@@ -55,6 +63,7 @@ void init_input_data(input_data_t *input) {
             }
         }
     }
+    memset(input->tail, 0, sizeof(input->tail));
 }
 
 void init_filter_data(filter_t filter[INPUT_CH]) {
@@ -69,18 +78,10 @@ void init_filter_data(filter_t filter[INPUT_CH]) {
     }
 }
 
-void print_output_data(const output_data_t *output) {
-    for (int r = 0; r < INPUT_ROWS; ++r) {
-        for (int c = 0; c < INPUT_COLS; ++c) {
-            for (int och = 0; och < OUTPUT_CH; ++och) {
-                printf("%d", output->rows[r].cols[c].ch[och]);
-                if (och < OUTPUT_CH - 1)
-                    printf(", ");
-            }
-            printf("; ");
-        }
-        printf("\n");
-    }
+// Compare an output with the one of conv_naive (see common/verify.h)
+bool verify_output_data(const char *name, const output_data_t *output, const output_data_t *expected) {
+    return verify_i32(name, &output->rows[0].cols[0].ch[0], &expected->rows[0].cols[0].ch[0],
+                      verify_dims3(INPUT_ROWS, INPUT_COLS, OUTPUT_CH));
 }
 
 // -----------------------------------------------
@@ -105,33 +106,34 @@ void conv_naive(output_data_t *output, const input_data_t *input, const filter_t
 
 // -----------------------------------------------
 // See: https://www.intel.com/content/www/us/en/docs/intrinsics-guide/index.html#!=undefined&techs=AMX
+// The tile config (tile_config_t) and the tile numbers (TILE_0 - TILE_7) are in common/amx.h.
+
+// The filter matrix of one filter row is K = FILTER_SIZE * INPUT_CH (fc * INPUT_CH + ich) x OUTPUT_CH.
+// When it fits one tile (K <= 60 and OUTPUT_CH <= 16), a tile row of the input is the whole filter row.
+// Otherwise it is blocked by tiles: K in tile rows of 64 values (dot products accumulate over them)
+// and the output channels in C tiles of 16, both padded with zeros so every tile row is full.
 
-typedef struct tile_config_t {
-    uint8_t palette_id;         // 0
-    uint8_t start_row;          // 1
-    uint8_t reserved_2_15[14];  // 2-15: must be zero
-    uint16_t colsb[8];          // 16-31
-    uint8_t reserved_32_47[16]; // 32-47: must be zero
-    uint8_t rows[8];            // 48-55
-    uint8_t reserved_56_63[16]; // 56-63: must be zero
-} tile_config_t;
-
-// AMX has 8 tiles
-#define TILE_0 0
-#define TILE_1 1
-#define TILE_2 2
-#define TILE_3 3
-#define TILE_4 4
-#define TILE_5 5
-#define TILE_6 6
-#define TILE_7 7
-
-#define TFILTER_ELEMS ((FILTER_SIZE * INPUT_CH) + (4 - (FILTER_SIZE * INPUT_CH) % 4))
+#define FILTER_ROW_ELEMS (FILTER_SIZE * INPUT_CH)
+
+#if FILTER_ROW_ELEMS + 4 - FILTER_ROW_ELEMS % 4 <= 64
+#define TFILTER_ELEMS (FILTER_ROW_ELEMS + (4 - FILTER_ROW_ELEMS % 4))
+#else
+#define TFILTER_ELEMS ((FILTER_ROW_ELEMS + 63) / 64 * 64)
+#endif
 
 #define TFILETER_ROWS (TFILTER_ELEMS / 4)
-#define TFILETER_COLS (OUTPUT_CH * 4)
+#define TFILETER_COLS (((OUTPUT_CH <= 16) ? OUTPUT_CH : (OUTPUT_CH + 15) / 16 * 16) * 4)
+
+#define CONV_K_TILES ((TFILTER_ELEMS + 63) / 64)
+#define CONV_N_TILES ((OUTPUT_CH + 15) / 16)
+#define TILE_K_ELEMS (TFILTER_ELEMS / CONV_K_TILES)        // K of a tile row of the input
+#define TILE_OUTPUT_CH (TFILETER_COLS / 4 / CONV_N_TILES) // output channels of a C tile
+
+// V1 - V3 keep the whole filter row in one tile; V4 and the kernels for CPUs without AMX are blocked
+#define CONV_SINGLE_TILE (CONV_K_TILES == 1 && CONV_N_TILES == 1)
 
-typedef struct tfilter_t {
+// Each transformed filter row starts on its own 64-byte boundary
+typedef struct __attribute__((aligned(64))) tfilter_t {
     struct {
         int8_t cols[TFILETER_COLS];
     } rows[TFILETER_ROWS];
@@ -140,23 +142,44 @@ typedef struct tfilter_t {
 void transform_filter(tfilter_t tfilter[FILTER_SIZE], const filter_t filter[INPUT_CH]) {
     memset(tfilter, 0, sizeof(tfilter_t) * FILTER_SIZE);
 
-    for (int r = 0; r < FILTER_SIZE; ++r) {
-        for (int c = 0; c < FILTER_SIZE; ++c) {
-            for (int och = 0; och < OUTPUT_CH; ++och) {
-                for (int ich = 0; ich < INPUT_CH; ++ich) {
-                    const int c2 = och;
-                    const int r2 = c * INPUT_CH + ich;
+    static const int8_t zeros[OUTPUT_CH] = {0};
 
-                    tfilter[r].rows[r2 / 4].cols[c2 * 4 + r2 % 4] = (filter[ich].rows[r].cols[c].ch[och]);
-                }
+    for (int r = 0; r < FILTER_SIZE; ++r) {
+        // Row r2 = c * INPUT_CH + ich of the filter matrix is filter[ich].rows[r].cols[c].ch[0 .. OUTPUT_CH]
+        for (int r2 = 0; r2 < FILTER_SIZE * INPUT_CH; r2 += 4) {
+            const int8_t *rows[4];
+            for (int i = 0; i < 4; ++i) {
+                const int k = r2 + i;
+                rows[i] = (k < FILTER_SIZE * INPUT_CH) ? filter[k % INPUT_CH].rows[r].cols[k / INPUT_CH].ch : zeros;
             }
+
+            vnni_interleave4_s8(tfilter[r].rows[r2 / 4].cols, 64, rows[0], rows[1], rows[2], rows[3], OUTPUT_CH);
         }
     }
 }
 
+// -----------------------------------------------
+// Pre-packed filter
+// Filters (weights) usually don't change between convolutions,
+// so transform_filter is done once and the result is kept in a handle.
+
+typedef struct packed_filter_t {
+    tfilter_t tfilter[FILTER_SIZE];
+} packed_filter_t;
+
+packed_filter_t *pack_filter(const filter_t filter[INPUT_CH]) {
+    packed_filter_t *pf = (packed_filter_t *)aligned_alloc(64, sizeof(packed_filter_t));
+    transform_filter(pf->tfilter, filter);
+    return pf;
+}
+
+void free_packed_filter(packed_filter_t *pf) { free(pf); }
+
+#if CONV_SINGLE_TILE
+
 // -----------------------------------------------
 // Normal convolution operation with AMX
-void conv_amx(output_data_t *output, const input_data_t *input, const filter_t filter[INPUT_CH]) {
+TARGET_AMX_INT8 void conv_amx_packed(output_data_t *output, const input_data_t *input, const packed_filter_t *pf) {
     // Load configuraion for convolution
     tile_config_t tile = {0};
 
@@ -179,8 +202,7 @@ void conv_amx(output_data_t *output, const input_data_t *input, const filter_t f
 
     // -----------------------------------------------
 
-    tfilter_t tfilter[FILTER_SIZE];
-    transform_filter(tfilter, filter);
+    const tfilter_t *tfilter = pf->tfilter;
 
     for (int r = 0; r <= INPUT_ROWS - FILTER_SIZE; ++r) {
         for (int c = 0; c <= INPUT_COLS - FILTER_SIZE; ++c) {
@@ -201,7 +223,7 @@ void conv_amx(output_data_t *output, const input_data_t *input, const filter_t f
 // -----------------------------------------------
 // V2: Use 7 rows, not just 3 tiles
 // This is abount 2-3 times faster than the normal
-void conv_amx_v2(output_data_t *output, const input_data_t *input, const filter_t filter[INPUT_CH]) {
+TARGET_AMX_INT8 void conv_amx_v2_packed(output_data_t *output, const input_data_t *input, const packed_filter_t *pf) {
     // Load configuraion for convolution
     tile_config_t tile = {0};
 
@@ -234,11 +256,13 @@ void conv_amx_v2(output_data_t *output, const input_data_t *input, const filter_
 
     // -----------------------------------------------
 
-    tfilter_t tfilter[FILTER_SIZE];
-    transform_filter(tfilter, filter);
+    const tfilter_t *tfilter = pf->tfilter;
+
+    const int output_cols = INPUT_COLS - FILTER_SIZE + 1;
 
     for (int r = 0; r <= INPUT_ROWS - FILTER_SIZE; ++r) {
-        for (int c = 0; c <= INPUT_COLS - FILTER_SIZE - 3; c += 3) {
+        int c = 0;
+        for (; c + 3 <= output_cols; c += 3) {
             _tile_zero(TILE_1);
             _tile_zero(TILE_3);
             _tile_zero(TILE_5);
@@ -261,30 +285,17 @@ void conv_amx_v2(output_data_t *output, const input_data_t *input, const filter_
             _tile_stored(TILE_5, &output->rows[r].cols[c + 2].ch[0], 0);
         }
 
-        // Remainder Block
-        {
-            const int c = INPUT_COLS - FILTER_SIZE - 3;
-
+        // Remainder Block: the last 1 or 2 pixels, one tile each
+        for (; c < output_cols; ++c) {
             _tile_zero(TILE_1);
-            _tile_zero(TILE_3);
-            _tile_zero(TILE_5);
 
             for (int acc = 0; acc < FILTER_SIZE; ++acc) {
                 _tile_loadd(TILE_0, &tfilter[acc].rows[0].cols[0], TFILETER_COLS * sizeof(int8_t));
-
                 _tile_loadd(TILE_2, &input->rows[r + acc].cols[c].ch[0], 0);
                 _tile_dpbssd(TILE_1, TILE_2, TILE_0);
-
-                _tile_loadd(TILE_4, &input->rows[r + acc].cols[c + 1].ch[0], 0);
-                _tile_dpbssd(TILE_3, TILE_4, TILE_0);
-
-                _tile_loadd(TILE_6, &input->rows[r + acc].cols[c + 2].ch[0], 0);
-                _tile_dpbssd(TILE_5, TILE_6, TILE_0);
             }
 
             _tile_stored(TILE_1, &output->rows[r].cols[c].ch[0], 0);
-            _tile_stored(TILE_3, &output->rows[r].cols[c + 1].ch[0], 0);
-            _tile_stored(TILE_5, &output->rows[r].cols[c + 2].ch[0], 0);
         }
     }
 }
@@ -292,7 +303,12 @@ void conv_amx_v2(output_data_t *output, const input_data_t *input, const filter_
 // -----------------------------------------------
 // V3: Use all 16 rows, not just one
 // This is abount 7 times faster than the normal
-void conv_amx_v3(output_data_t *output, const input_data_t *input, const filter_t filter[INPUT_CH]) {
+
+// Pixels of the Remainder Block of a row (the output columns past the last full tile)
+#define CONV_V3_TAIL ((INPUT_COLS - FILTER_SIZE + 1) % 16)
+
+// The tiles of 16 pixels have `pixels` rows (fewer for the Remainder Block)
+TARGET_AMX_INT8 void init_conv_v3_tile_config(int pixels) {
     // Load configuraion for convolution
     tile_config_t tile = {0};
 
@@ -305,54 +321,64 @@ void conv_amx_v3(output_data_t *output, const input_data_t *input, const filter_
 
     // config for output data
     tile.colsb[TILE_1] = OUTPUT_CH * sizeof(int32_t);
-    tile.rows[TILE_1] = 16;
+    tile.rows[TILE_1] = pixels;
 
     // config for input data
     tile.colsb[TILE_2] = TFILTER_ELEMS * sizeof(int8_t);
-    tile.rows[TILE_2] = 16;
+    tile.rows[TILE_2] = pixels;
 
     _tile_loadconfig(&tile);
+}
 
-    // -----------------------------------------------
+// Output pixels c .. c + (rows of TILE_1) - 1 of output row r
+TARGET_AMX_INT8 static inline void conv_amx_v3_block(output_data_t *output, const input_data_t *input,
+                                                     const tfilter_t *tfilter, int r, int c) {
+    _tile_zero(TILE_1);
 
-    tfilter_t tfilter[FILTER_SIZE];
-    transform_filter(tfilter, filter);
+    for (int acc = 0; acc < FILTER_SIZE; ++acc) {
+        _tile_loadd(TILE_0, &tfilter[acc].rows[0].cols[0], TFILETER_COLS * sizeof(int8_t));
+        _tile_loadd(TILE_2, &input->rows[r + acc].cols[c].ch[0], INPUT_CH * sizeof(int8_t));
 
-    for (int r = 0; r <= INPUT_ROWS - FILTER_SIZE; ++r) {
-        for (int c = 0; c <= INPUT_COLS - FILTER_SIZE - 16; c += 16) {
-            _tile_zero(TILE_1);
+        _tile_dpbssd(TILE_1, TILE_2, TILE_0);
+    }
 
-            for (int acc = 0; acc < FILTER_SIZE; ++acc) {
-                _tile_loadd(TILE_0, &tfilter[acc].rows[0].cols[0], TFILETER_COLS * sizeof(int8_t));
-                _tile_loadd(TILE_2, &input->rows[r + acc].cols[c].ch[0], INPUT_CH * sizeof(int8_t));
+    _tile_stored(TILE_1, &output->rows[r].cols[c].ch[0], OUTPUT_CH * sizeof(int32_t));
+}
 
-                _tile_dpbssd(TILE_1, TILE_2, TILE_0);
-            }
+TARGET_AMX_INT8 void conv_amx_v3_packed(output_data_t *output, const input_data_t *input, const packed_filter_t *pf) {
+    const tfilter_t *tfilter = pf->tfilter;
+    const int output_cols = INPUT_COLS - FILTER_SIZE + 1;
 
-            _tile_stored(TILE_1, &output->rows[r].cols[c].ch[0], OUTPUT_CH * sizeof(int32_t));
+    init_conv_v3_tile_config(16);
+    for (int r = 0; r <= INPUT_ROWS - FILTER_SIZE; ++r) {
+        for (int c = 0; c + 16 <= output_cols; c += 16) {
+            conv_amx_v3_block(output, input, tfilter, r, c);
         }
+    }
 
-        // Remainder Block
-        {
-            const int c = INPUT_COLS - FILTER_SIZE - 16;
-            _tile_zero(TILE_1);
-
-            for (int acc = 0; acc < FILTER_SIZE; ++acc) {
-                _tile_loadd(TILE_0, &tfilter[acc].rows[0].cols[0], TFILETER_COLS * sizeof(int8_t));
-                _tile_loadd(TILE_2, &input->rows[r + acc].cols[c].ch[0], INPUT_CH * sizeof(int8_t));
-
-                _tile_dpbssd(TILE_1, TILE_2, TILE_0);
-            }
-
-            _tile_stored(TILE_1, &output->rows[r].cols[c].ch[0], OUTPUT_CH * sizeof(int32_t));
+    // Remainder Block: a tile config with fewer rows for the last pixels of every row,
+    // so every output pixel is computed once
+    if (CONV_V3_TAIL > 0) {
+        init_conv_v3_tile_config(CONV_V3_TAIL);
+        for (int r = 0; r <= INPUT_ROWS - FILTER_SIZE; ++r) {
+            conv_amx_v3_block(output, input, tfilter, r, output_cols - CONV_V3_TAIL);
         }
     }
 }
 
+#endif // CONV_SINGLE_TILE
+
 // -----------------------------------------------
 // V4: Combine V2 and V3
 // This is abount 7-8 times faster than the normal
-void conv_amx_v4(output_data_t *output, const input_data_t *input, const filter_t filter[INPUT_CH]) {
+// With many channels, every block of 16 * 3 pixels runs once per C tile of output channels,
+// and the dot products of a filter row accumulate over its K tiles.
+
+// Pixels of the Remainder Block of a row (the output columns past the last full block of 16 * 3)
+#define CONV_V4_TAIL ((INPUT_COLS - FILTER_SIZE + 1) % (16 * 3))
+
+// The last tile of a block (TILE_5 and TILE_6) has `last_rows` rows, 16 except for the Remainder Block
+TARGET_AMX_INT8 void init_conv_v4_tile_config_last(int last_rows) {
     // Load configuraion for convolution
     tile_config_t tile = {0};
 
@@ -360,145 +386,1504 @@ void conv_amx_v4(output_data_t *output, const input_data_t *input, const filter_
     tile.start_row = 0;
 
     // config for filter
-    tile.colsb[TILE_0] = TFILETER_COLS * sizeof(int8_t);
-    tile.rows[TILE_0] = TFILETER_ROWS;
+    tile.colsb[TILE_0] = TILE_OUTPUT_CH * 4 * sizeof(int8_t);
+    tile.rows[TILE_0] = TILE_K_ELEMS / 4;
 
-    tile.colsb[TILE_1] = OUTPUT_CH * sizeof(int32_t);
+    tile.colsb[TILE_1] = TILE_OUTPUT_CH * sizeof(int32_t);
     tile.rows[TILE_1] = 16;
 
-    tile.colsb[TILE_2] = TFILTER_ELEMS * sizeof(int8_t);
+    tile.colsb[TILE_2] = TILE_K_ELEMS * sizeof(int8_t);
     tile.rows[TILE_2] = 16;
 
-    tile.colsb[TILE_3] = OUTPUT_CH * sizeof(int32_t);
+    tile.colsb[TILE_3] = TILE_OUTPUT_CH * sizeof(int32_t);
     tile.rows[TILE_3] = 16;
 
-    tile.colsb[TILE_4] = TFILTER_ELEMS * sizeof(int8_t);
+    tile.colsb[TILE_4] = TILE_K_ELEMS * sizeof(int8_t);
     tile.rows[TILE_4] = 16;
 
-    tile.colsb[TILE_5] = OUTPUT_CH * sizeof(int32_t);
-    tile.rows[TILE_5] = 16;
+    tile.colsb[TILE_5] = TILE_OUTPUT_CH * sizeof(int32_t);
+    tile.rows[TILE_5] = last_rows;
 
-    tile.colsb[TILE_6] = TFILTER_ELEMS * sizeof(int8_t);
-    tile.rows[TILE_6] = 16;
+    tile.colsb[TILE_6] = TILE_K_ELEMS * sizeof(int8_t);
+    tile.rows[TILE_6] = last_rows;
 
     _tile_loadconfig(&tile);
+}
 
-    // -----------------------------------------------
+TARGET_AMX_INT8 void init_conv_v4_tile_config() { init_conv_v4_tile_config_last(16); }
 
-    tfilter_t tfilter[FILTER_SIZE];
-    transform_filter(tfilter, filter);
+// Output pixels c .. c + pixels - 1 of output row r (pixels is 16 * 3, or CONV_V4_TAIL for the Remainder Block).
+// The last up to 16 pixels are in TILE_5 (with as many rows), the full tiles before them in TILE_1 and TILE_3.
+__attribute__((always_inline)) TARGET_AMX_INT8 static inline void
+conv_amx_v4_block(output_data_t *output, const input_data_t *input, const tfilter_t *tfilter, int r, int c,
+                  const int pixels) {
+    const int full = (pixels - 1) / 16; // full tiles before TILE_5
+    const int c_last = c + 16 * full;
 
-    for (int r = 0; r <= INPUT_ROWS - FILTER_SIZE; ++r) {
-        for (int c = 0; c <= INPUT_COLS - FILTER_SIZE - 16 * 3; c += 16 * 3) {
+    for (int jt = 0; jt < CONV_N_TILES; ++jt) {
+        if (full >= 1)
             _tile_zero(TILE_1);
+        if (full >= 2)
             _tile_zero(TILE_3);
-            _tile_zero(TILE_5);
+        _tile_zero(TILE_5);
 
-            for (int acc = 0; acc < FILTER_SIZE; ++acc) {
-                _tile_loadd(TILE_0, &tfilter[acc].rows[0].cols[0], TFILETER_COLS * sizeof(int8_t));
+        for (int acc = 0; acc < FILTER_SIZE; ++acc) {
+            for (int kt = 0; kt < CONV_K_TILES; ++kt) {
+                const int8_t *in = &input->rows[r + acc].cols[c].ch[0] + kt * TILE_K_ELEMS;
 
-                _tile_loadd(TILE_2, &input->rows[r + acc].cols[c].ch[0], INPUT_CH * sizeof(int8_t));
-                _tile_dpbssd(TILE_1, TILE_2, TILE_0);
+                _tile_loadd(TILE_0, &tfilter[acc].rows[kt * TILE_K_ELEMS / 4].cols[jt * TILE_OUTPUT_CH * 4],
+                            TFILETER_COLS * sizeof(int8_t));
 
-                _tile_loadd(TILE_4, &input->rows[r + acc].cols[c + 16].ch[0], INPUT_CH * sizeof(int8_t));
-                _tile_dpbssd(TILE_3, TILE_4, TILE_0);
+                if (full >= 1) {
+                    _tile_loadd(TILE_2, in, INPUT_CH * sizeof(int8_t));
+                    _tile_dpbssd(TILE_1, TILE_2, TILE_0);
+                }
 
-                _tile_loadd(TILE_6, &input->rows[r + acc].cols[c + 16 * 2].ch[0], INPUT_CH * sizeof(int8_t));
+                if (full >= 2) {
+                    _tile_loadd(TILE_4, in + 16 * INPUT_CH, INPUT_CH * sizeof(int8_t));
+                    _tile_dpbssd(TILE_3, TILE_4, TILE_0);
+                }
+
+                _tile_loadd(TILE_6, in + 16 * full * INPUT_CH, INPUT_CH * sizeof(int8_t));
                 _tile_dpbssd(TILE_5, TILE_6, TILE_0);
             }
+        }
+
+        // The last C tile may be partly padding; its rows would run into the next pixel
+        const int och = jt * TILE_OUTPUT_CH;
+        if (och + TILE_OUTPUT_CH <= OUTPUT_CH) {
+            if (full >= 1)
+                _tile_stored(TILE_1, &output->rows[r].cols[c].ch[och], OUTPUT_CH * sizeof(int32_t));
+            if (full >= 2)
+                _tile_stored(TILE_3, &output->rows[r].cols[c + 16].ch[och], OUTPUT_CH * sizeof(int32_t));
+            _tile_stored(TILE_5, &output->rows[r].cols[c_last].ch[och], OUTPUT_CH * sizeof(int32_t));
+        } else {
+            int32_t c_edge[16 * 3][TILE_OUTPUT_CH];
+            if (full >= 1)
+                _tile_stored(TILE_1, c_edge[0], sizeof(c_edge[0]));
+            if (full >= 2)
+                _tile_stored(TILE_3, c_edge[16], sizeof(c_edge[0]));
+            _tile_stored(TILE_5, c_edge[16 * full], sizeof(c_edge[0]));
+            for (int i = 0; i < pixels; ++i) {
+                memcpy(&output->rows[r].cols[c + i].ch[och], c_edge[i], (OUTPUT_CH - och) * sizeof(int32_t));
+            }
+        }
+    }
+}
+
+// Output rows r_begin .. r_end - 1 of V4 (the tile config of init_conv_v4_tile_config must be loaded, and is
+// loaded again at the end)
+TARGET_AMX_INT8 void conv_amx_v4_rows(output_data_t *output, const input_data_t *input, const packed_filter_t *pf,
+                                      int r_begin, int r_end) {
+    const tfilter_t *tfilter = pf->tfilter;
+    const int output_cols = INPUT_COLS - FILTER_SIZE + 1;
 
-            _tile_stored(TILE_1, &output->rows[r].cols[c].ch[0], OUTPUT_CH * sizeof(int32_t));
-            _tile_stored(TILE_3, &output->rows[r].cols[c + 16].ch[0], OUTPUT_CH * sizeof(int32_t));
-            _tile_stored(TILE_5, &output->rows[r].cols[c + 16 * 2].ch[0], OUTPUT_CH * sizeof(int32_t));
+    for (int r = r_begin; r < r_end; ++r) {
+        for (int c = 0; c + 16 * 3 <= output_cols; c += 16 * 3) {
+            conv_amx_v4_block(output, input, tfilter, r, c, 16 * 3);
         }
+    }
 
-        // Remainder Block
-        {
-            const int c = INPUT_COLS - FILTER_SIZE - 16 * 3;
+    // Remainder Block: the last tile has as many rows as the pixels left, so every output pixel is computed once
+    if (CONV_V4_TAIL > 0) {
+        init_conv_v4_tile_config_last(CONV_V4_TAIL - (CONV_V4_TAIL - 1) / 16 * 16);
+        for (int r = r_begin; r < r_end; ++r) {
+            conv_amx_v4_block(output, input, tfilter, r, output_cols - CONV_V4_TAIL, CONV_V4_TAIL);
+        }
+        init_conv_v4_tile_config();
+    }
+}
 
-            _tile_zero(TILE_1);
-            _tile_zero(TILE_3);
-            _tile_zero(TILE_5);
+TARGET_AMX_INT8 void conv_amx_v4_packed(output_data_t *output, const input_data_t *input, const packed_filter_t *pf) {
+    init_conv_v4_tile_config();
+    conv_amx_v4_rows(output, input, pf, 0, INPUT_ROWS - FILTER_SIZE + 1);
+}
 
-            for (int acc = 0; acc < FILTER_SIZE; ++acc) {
-                _tile_loadd(TILE_0, &tfilter[acc].rows[0].cols[0], TFILETER_COLS * sizeof(int8_t));
+// -----------------------------------------------
+// V5: Keep the filter in tiles and compute 4 output rows at a time
+// V4 loads the filter tile of a filter row for every block, and an input row once for each of the
+// FILTER_SIZE output rows that use it. V5 loads the filter taps of a C tile of output channels once into
+// TILE_0 - TILE_2, and every input row of a block of 16 pixels once into TILE_3, where it feeds the dot
+// products of all output rows it belongs to (C tiles TILE_4 - TILE_7).
+// Per 4 output rows x 16 pixels: (4 + FILTER_SIZE - 1) * CONV_K_TILES loads for 4 * FILTER_SIZE * CONV_K_TILES
+// dot products, instead of 2 loads per dot product.
+
+#define CONV_V5_ROWS 4                                // output rows per block (C tiles)
+#define CONV_V5_TAPS (FILTER_SIZE * CONV_K_TILES)     // filter tiles of a C tile of output channels
+#define CONV_V5_IN_ROWS (CONV_V5_ROWS + FILTER_SIZE - 1) // input rows of a block
+#define CONV_V5 (CONV_V5_TAPS <= 3)                   // every tap fits TILE_0 - TILE_2
+
+#if CONV_V5
+
+// Pixels of the Remainder Block of a row (the output columns past the last full tile)
+#define CONV_V5_TAIL ((INPUT_COLS - FILTER_SIZE + 1) % 16)
+
+// The input and C tiles have `pixels` rows, 16 except for the Remainder Block
+TARGET_AMX_INT8 void init_conv_v5_tile_config(int pixels) {
+    tile_config_t tile = {0};
 
-                _tile_loadd(TILE_2, &input->rows[r + acc].cols[c].ch[0], INPUT_CH * sizeof(int8_t));
-                _tile_dpbssd(TILE_1, TILE_2, TILE_0);
+    tile.palette_id = 1;
+    tile.start_row = 0;
 
-                _tile_loadd(TILE_4, &input->rows[r + acc].cols[c + 16].ch[0], INPUT_CH * sizeof(int8_t));
-                _tile_dpbssd(TILE_3, TILE_4, TILE_0);
+    // config for filter (one tile per filter row and K tile)
+    for (int t = TILE_0; t <= TILE_2; ++t) {
+        tile.colsb[t] = TILE_OUTPUT_CH * 4 * sizeof(int8_t);
+        tile.rows[t] = TILE_K_ELEMS / 4;
+    }
 
-                _tile_loadd(TILE_6, &input->rows[r + acc].cols[c + 16 * 2].ch[0], INPUT_CH * sizeof(int8_t));
-                _tile_dpbssd(TILE_5, TILE_6, TILE_0);
+    // config for input data
+    tile.colsb[TILE_3] = TILE_K_ELEMS * sizeof(int8_t);
+    tile.rows[TILE_3] = pixels;
+
+    // config for output data (one tile per output row)
+    for (int t = TILE_4; t <= TILE_7; ++t) {
+        tile.colsb[t] = TILE_OUTPUT_CH * sizeof(int32_t);
+        tile.rows[t] = pixels;
+    }
+
+    _tile_loadconfig(&tile);
+}
+
+// The tile numbers of the instructions are immediates. Both helpers are called from fully unrolled loops,
+// so the switches are resolved at compile time.
+__attribute__((always_inline)) TARGET_AMX_INT8 static inline void conv_amx_v5_load_tap(int tap, const int8_t *src) {
+    switch (tap) {
+    case 0:
+        _tile_loadd(TILE_0, src, TFILETER_COLS * sizeof(int8_t));
+        break;
+    case 1:
+        _tile_loadd(TILE_1, src, TFILETER_COLS * sizeof(int8_t));
+        break;
+    default:
+        _tile_loadd(TILE_2, src, TFILETER_COLS * sizeof(int8_t));
+        break;
+    }
+}
+
+#define CONV_V5_DP(ct, tap)                                                                                            \
+    case (ct) * 3 + (tap):                                                                                             \
+        _tile_dpbssd(TILE_##ct, TILE_3, TILE_##tap);                                                                  \
+        break;
+
+// Output row o of the block (C tile TILE_4 + o) += input (TILE_3) * filter tap
+__attribute__((always_inline)) TARGET_AMX_INT8 static inline void conv_amx_v5_dp(int o, int tap) {
+    switch ((TILE_4 + o) * 3 + tap) {
+        CONV_V5_DP(4, 0)
+        CONV_V5_DP(4, 1)
+        CONV_V5_DP(4, 2)
+        CONV_V5_DP(5, 0)
+        CONV_V5_DP(5, 1)
+        CONV_V5_DP(5, 2)
+        CONV_V5_DP(6, 0)
+        CONV_V5_DP(6, 1)
+        CONV_V5_DP(6, 2)
+        CONV_V5_DP(7, 0)
+        CONV_V5_DP(7, 1)
+        CONV_V5_DP(7, 2)
+    }
+}
+
+#undef CONV_V5_DP
+
+// Output rows r .. r + rows - 1 (rows <= 4), pixels c .. c + pixels - 1 (the rows of the tile config),
+// output channels of C tile jt (its taps must be in TILE_0 - TILE_2)
+TARGET_AMX_INT8 static inline void conv_amx_v5_block(output_data_t *output, const input_data_t *input, int r, int c,
+                                                     int jt, int rows, int pixels) {
+    _tile_zero(TILE_4);
+    _tile_zero(TILE_5);
+    _tile_zero(TILE_6);
+    _tile_zero(TILE_7);
+
+    // Input row r + i is output row r + o for filter row fr = i - o
+#pragma GCC unroll 16
+    for (int i = 0; i < CONV_V5_IN_ROWS; ++i) {
+        if (i >= rows + FILTER_SIZE - 1)
+            break;
+#pragma GCC unroll 4
+        for (int kt = 0; kt < CONV_K_TILES; ++kt) {
+            _tile_loadd(TILE_3, &input->rows[r + i].cols[c].ch[0] + kt * TILE_K_ELEMS, INPUT_CH * sizeof(int8_t));
+#pragma GCC unroll 16
+            for (int fr = 0; fr < FILTER_SIZE; ++fr) {
+                if (i - fr >= 0 && i - fr < CONV_V5_ROWS && i - fr < rows)
+                    conv_amx_v5_dp(i - fr, fr * CONV_K_TILES + kt);
             }
+        }
+    }
+
+    const int och = jt * TILE_OUTPUT_CH;
+    if (och + TILE_OUTPUT_CH <= OUTPUT_CH) {
+        _tile_stored(TILE_4, &output->rows[r].cols[c].ch[och], OUTPUT_CH * sizeof(int32_t));
+        if (rows > 1)
+            _tile_stored(TILE_5, &output->rows[r + 1].cols[c].ch[och], OUTPUT_CH * sizeof(int32_t));
+        if (rows > 2)
+            _tile_stored(TILE_6, &output->rows[r + 2].cols[c].ch[och], OUTPUT_CH * sizeof(int32_t));
+        if (rows > 3)
+            _tile_stored(TILE_7, &output->rows[r + 3].cols[c].ch[och], OUTPUT_CH * sizeof(int32_t));
+    } else {
+        // The last C tile may be partly padding, as in V4
+        int32_t c_edge[CONV_V5_ROWS][16][TILE_OUTPUT_CH];
+        _tile_stored(TILE_4, c_edge[0], sizeof(c_edge[0][0]));
+        _tile_stored(TILE_5, c_edge[1], sizeof(c_edge[0][0]));
+        _tile_stored(TILE_6, c_edge[2], sizeof(c_edge[0][0]));
+        _tile_stored(TILE_7, c_edge[3], sizeof(c_edge[0][0]));
+        for (int o = 0; o < rows; ++o) {
+            for (int i = 0; i < pixels; ++i) {
+                memcpy(&output->rows[r + o].cols[c + i].ch[och], c_edge[o][i], (OUTPUT_CH - och) * sizeof(int32_t));
+            }
+        }
+    }
+}
+
+// Load the taps of C tile jt into TILE_0 - TILE_2
+TARGET_AMX_INT8 static inline void conv_amx_v5_load_taps(const tfilter_t *tfilter, int jt) {
+#pragma GCC unroll 16
+    for (int fr = 0; fr < FILTER_SIZE; ++fr) {
+#pragma GCC unroll 4
+        for (int kt = 0; kt < CONV_K_TILES; ++kt) {
+            conv_amx_v5_load_tap(fr * CONV_K_TILES + kt,
+                                 &tfilter[fr].rows[kt * TILE_K_ELEMS / 4].cols[jt * TILE_OUTPUT_CH * 4]);
+        }
+    }
+}
 
-            _tile_stored(TILE_1, &output->rows[r].cols[c].ch[0], OUTPUT_CH * sizeof(int32_t));
-            _tile_stored(TILE_3, &output->rows[r].cols[c + 16].ch[0], OUTPUT_CH * sizeof(int32_t));
-            _tile_stored(TILE_5, &output->rows[r].cols[c + 16 * 2].ch[0], OUTPUT_CH * sizeof(int32_t));
+// Every block of 16 pixels (or the CONV_V5_TAIL pixels at c) of every 4 output rows (fewer for the last rows)
+TARGET_AMX_INT8 static void conv_amx_v5_cols(output_data_t *output, const input_data_t *input, const tfilter_t *tfilter,
+                                             int c_begin, int c_end, int pixels) {
+    const int output_rows = INPUT_ROWS - FILTER_SIZE + 1;
+
+    // With one C tile the taps stay in the tiles for all blocks. With more, they are reloaded for every
+    // C tile of a block (CONV_V5_TAPS loads per block), so the channels of an output pixel are written together.
+    if (CONV_N_TILES == 1)
+        conv_amx_v5_load_taps(tfilter, 0);
+
+    for (int r = 0; r < output_rows; r += CONV_V5_ROWS) {
+        const int rows = (output_rows - r < CONV_V5_ROWS) ? output_rows - r : CONV_V5_ROWS;
+        for (int c = c_begin; c < c_end; c += pixels) {
+            for (int jt = 0; jt < CONV_N_TILES; ++jt) {
+                if (CONV_N_TILES > 1)
+                    conv_amx_v5_load_taps(tfilter, jt);
+                conv_amx_v5_block(output, input, r, c, jt, rows, pixels);
+            }
         }
     }
 }
 
+TARGET_AMX_INT8 void conv_amx_v5_packed(output_data_t *output, const input_data_t *input, const packed_filter_t *pf) {
+    const int output_cols = INPUT_COLS - FILTER_SIZE + 1;
+    const int full_cols = output_cols - CONV_V5_TAIL;
+
+    init_conv_v5_tile_config(16);
+    conv_amx_v5_cols(output, input, pf->tfilter, 0, full_cols, 16);
+
+    // Remainder Block: a tile config with fewer rows for the last pixels (the taps are loaded again,
+    // ldtilecfg zeroes the tiles)
+    if (CONV_V5_TAIL > 0) {
+        init_conv_v5_tile_config(CONV_V5_TAIL);
+        conv_amx_v5_cols(output, input, pf->tfilter, full_cols, output_cols, CONV_V5_TAIL);
+    }
+}
+
+#endif // CONV_V5
+
+// -----------------------------------------------
+// The filter is transformed on every call; use pack_filter and conv_amx*_packed when the filter is reused.
+
+#if CONV_SINGLE_TILE
+void conv_amx(output_data_t *output, const input_data_t *input, const filter_t filter[INPUT_CH]) {
+    packed_filter_t pf;
+    transform_filter(pf.tfilter, filter);
+    conv_amx_packed(output, input, &pf);
+}
+
+void conv_amx_v2(output_data_t *output, const input_data_t *input, const filter_t filter[INPUT_CH]) {
+    packed_filter_t pf;
+    transform_filter(pf.tfilter, filter);
+    conv_amx_v2_packed(output, input, &pf);
+}
+
+void conv_amx_v3(output_data_t *output, const input_data_t *input, const filter_t filter[INPUT_CH]) {
+    packed_filter_t pf;
+    transform_filter(pf.tfilter, filter);
+    conv_amx_v3_packed(output, input, &pf);
+}
+#endif
+
+void conv_amx_v4(output_data_t *output, const input_data_t *input, const filter_t filter[INPUT_CH]) {
+    packed_filter_t pf;
+    transform_filter(pf.tfilter, filter);
+    conv_amx_v4_packed(output, input, &pf);
+}
+
+#if CONV_V5
+void conv_amx_v5(output_data_t *output, const input_data_t *input, const filter_t filter[INPUT_CH]) {
+    packed_filter_t pf;
+    transform_filter(pf.tfilter, filter);
+    conv_amx_v5_packed(output, input, &pf);
+}
+#endif
+
 // -----------------------------------------------
+// Kernels for CPUs without AMX
+// They read the same packed filter: for filter row fr, K index kk = fc * INPUT_CH + ich
+// is at tfilter[fr].rows[kk / 4].cols[och * 4 + kk % 4], and the matching input values are the
+// FILTER_SIZE * INPUT_CH bytes starting at input->rows[r + fr].cols[c] (the same trick as the AMX kernels).
+
+// Dwords of K of a filter row (the padding of TFILTER_ELEMS is skipped)
+#define FILTER_ROW_QUADS ((FILTER_ROW_ELEMS + 3) / 4)
+
+// Load in[4 * g .. 4 * g + 4] as one dword; past the end of the filter row the bytes are zero (no overread)
+static inline int32_t load_input_quad(const int8_t *in, int g) {
+    int32_t v = 0;
+    const int avail = FILTER_ROW_ELEMS - 4 * g;
+    if (avail >= 4) {
+        memcpy(&v, &in[4 * g], 4);
+    } else {
+        memcpy(&v, &in[4 * g], avail);
+    }
+    return v;
+}
+
+// Convolution on the packed filter without SIMD
+void conv_scalar_packed(output_data_t *output, const input_data_t *input, const packed_filter_t *pf) {
+    for (int r = 0; r <= INPUT_ROWS - FILTER_SIZE; ++r) {
+        for (int c = 0; c <= INPUT_COLS - FILTER_SIZE; ++c) {
+            for (int och = 0; och < OUTPUT_CH; ++och) {
+                int32_t sum = 0;
+                for (int fr = 0; fr < FILTER_SIZE; ++fr) {
+                    const int8_t *in = &input->rows[r + fr].cols[c].ch[0];
+                    for (int kk = 0; kk < FILTER_ROW_ELEMS; ++kk) {
+                        sum += in[kk] * pf->tfilter[fr].rows[kk / 4].cols[och * 4 + kk % 4];
+                    }
+                }
+                output->rows[r].cols[c].ch[och] = sum;
+            }
+        }
+    }
+}
+
+// Convolution on the packed filter using AVX-512 VNNI
+// A tfilter row is dwords of 4 K values per output channel, the B operand of vpdpbusd with the output channels
+// as lanes, 16 channels (one C tile of V4) per vector.
+// vpdpbusd multiplies unsigned by signed bytes, so the input is biased to x + 128 (x ^ 0x80)
+// and 128 * (sum of the weights) of each output channel is subtracted.
+TARGET_AVX512_VNNI void conv_avx512_vnni_packed(output_data_t *output, const input_data_t *input,
+                                                const packed_filter_t *pf) {
+    const __m512i flip = _mm512_set1_epi8((char)0x80);
+
+    for (int jt = 0; jt < CONV_N_TILES; ++jt) {
+        const int och = jt * TILE_OUTPUT_CH;
+        const int n = (OUTPUT_CH - och < TILE_OUTPUT_CH) ? OUTPUT_CH - och : TILE_OUTPUT_CH;
+        const __mmask64 wmask = (n >= 16) ? ~0ull : ((1ull << (n * 4)) - 1);
+        const __mmask16 omask = (__mmask16)((1u << n) - 1);
+
+        // The filter of these channels stays in registers
+        __m512i w[FILTER_SIZE][FILTER_ROW_QUADS];
+        __m512i bias = _mm512_setzero_si512();
+        for (int fr = 0; fr < FILTER_SIZE; ++fr) {
+            for (int g = 0; g < FILTER_ROW_QUADS; ++g) {
+                w[fr][g] = _mm512_maskz_loadu_epi8(wmask, &pf->tfilter[fr].rows[g].cols[och * 4]);
+                bias = _mm512_dpbusd_epi32(bias, flip, w[fr][g]);
+            }
+        }
+        const __m512i neg_bias = _mm512_sub_epi32(_mm512_setzero_si512(), bias);
+
+        for (int r = 0; r <= INPUT_ROWS - FILTER_SIZE; ++r) {
+            for (int c = 0; c <= INPUT_COLS - FILTER_SIZE; ++c) {
+                __m512i acc = neg_bias;
+
+                for (int fr = 0; fr < FILTER_SIZE; ++fr) {
+                    const int8_t *in = &input->rows[r + fr].cols[c].ch[0];
+                    for (int g = 0; g < FILTER_ROW_QUADS; ++g) {
+                        const __m512i va = _mm512_xor_si512(_mm512_set1_epi32(load_input_quad(in, g)), flip);
+                        acc = _mm512_dpbusd_epi32(acc, va, w[fr][g]);
+                    }
+                }
 
-int main() {
-#if defined(__linux__)
-    if (syscall(SYS_arch_prctl, ARCH_REQ_XCOMP_PERM, XFEATURE_XTILEDATA)) {
-        printf("\n Fail to do XFEATURE_XTILEDATA \n\n");
-        fflush(stdout);
-        return 1;
+                _mm512_mask_storeu_epi32(&output->rows[r].cols[c].ch[och], omask, acc);
+            }
+        }
     }
+}
+
+// 4 output channels (16 bytes of a tfilter row) per AVX2 vector
+#define OCH_GROUPS ((TILE_OUTPUT_CH + 3) / 4)
+#define OCH_GROUPS_EVEN ((OCH_GROUPS + 1) / 2 * 2)
+
+// Convolution on the packed filter using AVX2
+// Same as gemm_avx2_packed: the weights are widened to int16 and _mm256_madd_epi16 leaves
+// 2 partial sums per output channel, which are added by hadd at the end.
+// The output channels are done TILE_OUTPUT_CH at a time, as the C tiles of V4.
+TARGET_AVX2 void conv_avx2_packed(output_data_t *output, const input_data_t *input, const packed_filter_t *pf) {
+    for (int jt = 0; jt < CONV_N_TILES; ++jt) {
+        const int och = jt * TILE_OUTPUT_CH;
+        const int n = (OUTPUT_CH - och < TILE_OUTPUT_CH) ? OUTPUT_CH - och : TILE_OUTPUT_CH;
+
+        __m256i w[FILTER_SIZE][FILTER_ROW_QUADS][OCH_GROUPS_EVEN];
+        for (int fr = 0; fr < FILTER_SIZE; ++fr) {
+            for (int g = 0; g < FILTER_ROW_QUADS; ++g) {
+                int8_t row[OCH_GROUPS_EVEN * 16] = {0};
+                memcpy(row, &pf->tfilter[fr].rows[g].cols[och * 4], n * 4);
+                for (int x = 0; x < OCH_GROUPS_EVEN; ++x) {
+                    w[fr][g][x] = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)&row[x * 16]));
+                }
+            }
+        }
+
+        for (int r = 0; r <= INPUT_ROWS - FILTER_SIZE; ++r) {
+            for (int c = 0; c <= INPUT_COLS - FILTER_SIZE; ++c) {
+                __m256i acc[OCH_GROUPS_EVEN];
+                for (int x = 0; x < OCH_GROUPS_EVEN; ++x) {
+                    acc[x] = _mm256_setzero_si256();
+                }
+
+                for (int fr = 0; fr < FILTER_SIZE; ++fr) {
+                    const int8_t *in = &input->rows[r + fr].cols[c].ch[0];
+                    for (int g = 0; g < FILTER_ROW_QUADS; ++g) {
+                        const __m256i va =
+                            _mm256_broadcastq_epi64(_mm_cvtepi8_epi16(_mm_cvtsi32_si128(load_input_quad(in, g))));
+                        for (int x = 0; x < OCH_GROUPS_EVEN; ++x) {
+                            acc[x] = _mm256_add_epi32(acc[x], _mm256_madd_epi16(va, w[fr][g][x]));
+                        }
+                    }
+                }
+
+                int32_t sums[OCH_GROUPS_EVEN * 4];
+                for (int x = 0; x < OCH_GROUPS_EVEN; x += 2) {
+                    _mm256_storeu_si256((__m256i *)&sums[x * 4],
+                                        _mm256_permute4x64_epi64(_mm256_hadd_epi32(acc[x], acc[x + 1]), 0xd8));
+                }
+                memcpy(&output->rows[r].cols[c].ch[och], sums, n * sizeof(int32_t));
+            }
+        }
+    }
+}
+
+// -----------------------------------------------
+// Runtime dispatch
+// conv_packed and conv use the fastest kernel the CPU supports (see detect_cpu_features).
+
+typedef void (*conv_packed_fn_t)(output_data_t *output, const input_data_t *input, const packed_filter_t *pf);
+
+typedef struct conv_kernel_t {
+    const char *name;
+    conv_packed_fn_t fn;
+} conv_kernel_t;
+
+// Supported kernels, the fastest first
+static conv_kernel_t conv_kernels[4];
+static int num_conv_kernels;
+
+void init_dispatch() {
+    num_conv_kernels = 0;
+    if (cpu_features.amx_int8)
+        conv_kernels[num_conv_kernels++] = (conv_kernel_t){"AMX-INT8 (V4)", conv_amx_v4_packed};
+    if (cpu_features.avx512_vnni)
+        conv_kernels[num_conv_kernels++] = (conv_kernel_t){"AVX512-VNNI", conv_avx512_vnni_packed};
+    if (cpu_features.avx2)
+        conv_kernels[num_conv_kernels++] = (conv_kernel_t){"AVX2", conv_avx2_packed};
+    conv_kernels[num_conv_kernels++] = (conv_kernel_t){"scalar", conv_scalar_packed};
+}
+
+void conv_packed(output_data_t *output, const input_data_t *input, const packed_filter_t *pf) {
+    conv_kernels[0].fn(output, input, pf);
+}
+
+void conv(output_data_t *output, const input_data_t *input, const filter_t filter[INPUT_CH]) {
+    packed_filter_t pf;
+    transform_filter(pf.tfilter, filter);
+    conv_packed(output, input, &pf);
+}
+
+// -----------------------------------------------
+// Multi-threaded convolution
+// With AMX, every CONV_STRIP_ROWS output rows of V4 are a task. The tile config is per thread, so every thread
+// loads it before its first strip (parallel_job_t::begin), and the pool releases the tiles when a worker ends.
+// The other kernels run on the calling thread only.
+
+#define CONV_STRIP_ROWS 8
+
+typedef struct conv_job_args_t {
+    output_data_t *output;
+    const input_data_t *input;
+    const packed_filter_t *pf;
+} conv_job_args_t;
+
+static void conv_amx_v4_begin(void *arg) {
+    (void)arg;
+    init_conv_v4_tile_config();
+}
+
+static void conv_amx_v4_task(void *arg, int task) {
+    const conv_job_args_t *args = (const conv_job_args_t *)arg;
+    const int output_rows = INPUT_ROWS - FILTER_SIZE + 1;
+    const int r = task * CONV_STRIP_ROWS;
+    conv_amx_v4_rows(args->output, args->input, args->pf, r,
+                     (r + CONV_STRIP_ROWS < output_rows) ? r + CONV_STRIP_ROWS : output_rows);
+}
+
+// Same as conv_packed on all threads of the pool
+// The strips are split statically when every thread gets the same number of full strips,
+// otherwise the threads take them one by one from a shared counter.
+void conv_packed_mt(thread_pool_t *pool, output_data_t *output, const input_data_t *input,
+                    const packed_filter_t *pf) {
+    if (!cpu_features.amx_int8) {
+        conv_packed(output, input, pf);
+        return;
+    }
+
+    const int output_rows = INPUT_ROWS - FILTER_SIZE + 1;
+    const int num_strips = (output_rows + CONV_STRIP_ROWS - 1) / CONV_STRIP_ROWS;
+    const bool ragged = output_rows % CONV_STRIP_ROWS != 0 || num_strips % pool->num_threads != 0;
+
+    conv_job_args_t args = {output, input, pf};
+    const parallel_job_t job = {conv_amx_v4_begin, conv_amx_v4_task, &args, num_strips,
+                                ragged ? SCHEDULE_DYNAMIC : SCHEDULE_STATIC};
+    thread_pool_run(pool, &job);
+}
+
+// Run conv_packed_mt from 1 thread to all cores of a socket and print the speedup
+// expected is the result of conv_packed (on a zeroed output)
+void run_conv_scaling(const input_data_t *input, const filter_t filter[INPUT_CH], const output_data_t *expected) {
+    output_data_t *output = (output_data_t *)malloc(sizeof(output_data_t));
+    packed_filter_t *pf = pack_filter(filter);
+
+    int cpus[CPU_SETSIZE];
+    const int num_cores = socket_core_cpus(cpus, CPU_SETSIZE);
+    double time_1 = 0;
+
+    printf("%s, %d cores in the socket\n", conv_kernels[0].name, num_cores);
+
+    for (int threads = 1;; threads = (threads * 2 < num_cores) ? threads * 2 : num_cores) {
+        thread_pool_t *pool = thread_pool_create(threads, cpu_features.amx_tile ? amx_release : NULL);
+
+        // The first run warms up the threads and the caches, then the fastest of 20 runs is kept
+        memset(output, 0, sizeof(output_data_t));
+        conv_packed_mt(pool, output, input, pf);
+        double best = 1e30;
+        for (int x = 0; x < 20; ++x) {
+            const double t0 = now_sec();
+            conv_packed_mt(pool, output, input, pf);
+            const double t1 = now_sec();
+            best = (t1 - t0 < best) ? t1 - t0 : best;
+        }
+        thread_pool_destroy(pool);
+
+        if (threads == 1)
+            time_1 = best;
+        printf("    threads %3d %9.3f us, speedup %5.2fx\n", threads, best * 1e6, time_1 / best);
+        char name[64];
+        snprintf(name, sizeof(name), "conv_packed_mt %d threads", threads);
+        verify_output_data(name, output, expected);
+
+        if (threads == num_cores)
+            break;
+    }
+
+    free_packed_filter(pf);
+    free(output);
+}
+
+// -----------------------------------------------
+// V5 against V4: the time, and with the AMX emulator the tile loads per dot product
+// expected is the result of conv_naive
+
+#if CONV_V5
+void run_conv_v5(const input_data_t *input, const filter_t filter[INPUT_CH], const output_data_t *expected) {
+    output_data_t *output = (output_data_t *)malloc(sizeof(output_data_t));
+    packed_filter_t *pf = pack_filter(filter);
+
+    const char *names[2] = {"V4", "V5"};
+    conv_packed_fn_t versions[2] = {conv_amx_v4_packed, conv_amx_v5_packed};
+    for (int v = 0; v < 2; ++v) {
+        memset(output, 0, sizeof(output_data_t));
+#if defined(AMX_EMULATE)
+        amx_emu_reset_counters();
+        versions[v](output, input, pf);
+        const amx_emu_counters_t counters = amx_emu_counters;
+#else
+        versions[v](output, input, pf);
 #endif
+        verify_output_data(names[v], output, expected);
+
+        // The fastest of 20 runs
+        double best = 1e30;
+        for (int x = 0; x < 20; ++x) {
+            const double t0 = now_sec();
+            versions[v](output, input, pf);
+            const double t1 = now_sec();
+            best = (t1 - t0 < best) ? t1 - t0 : best;
+        }
+
+        printf("%s %9.3f us", names[v], best * 1e6);
+#if defined(AMX_EMULATE)
+        printf(", loads per TMUL %.3f (%llu loads, %llu TMUL)", (double)counters.loads / counters.tmuls,
+               (unsigned long long)counters.loads, (unsigned long long)counters.tmuls);
+#endif
+        printf("\n");
+    }
+
+    free_packed_filter(pf);
+    free(output);
+}
+#endif
+
+// -----------------------------------------------
+// Runtime-shaped convolution (common/conv.h)
+// The layers of a small CNN run in one process; the first one is the layer above.
+
+static const conv_desc_t cnn_layers[] = {
+    // h, w, c_in, c_out, kernel, stride, pad, dilation
+    {INPUT_ROWS, INPUT_COLS, INPUT_CH, OUTPUT_CH, FILTER_SIZE, 1, 0, 1},
+    {112, 112, 3, 32, 3, 2, 1, 1},
+    {56, 56, 32, 32, 3, 1, 1, 1},
+    {56, 56, 32, 64, 1, 1, 0, 1},
+    {56, 56, 64, 64, 5, 1, 2, 1},
+    {28, 28, 64, 128, 3, 2, 1, 1},
+    {28, 28, 128, 128, 3, 1, 2, 2}, // dilated
+    {14, 14, 128, 256, 1, 1, 0, 1},
+    {14, 14, 256, 10, 7, 1, 0, 1},
+};
+static const int num_cnn_layers = sizeof(cnn_layers) / sizeof(cnn_layers[0]);
+
+// Filter of the layer above as [FILTER_SIZE][FILTER_SIZE][INPUT_CH][OUTPUT_CH]
+void filter_to_hwio(int8_t *hwio, const filter_t filter[INPUT_CH]) {
+    for (int fr = 0; fr < FILTER_SIZE; ++fr) {
+        for (int fc = 0; fc < FILTER_SIZE; ++fc) {
+            for (int ich = 0; ich < INPUT_CH; ++ich) {
+                for (int och = 0; och < OUTPUT_CH; ++och) {
+                    hwio[((fr * FILTER_SIZE + fc) * INPUT_CH + ich) * OUTPUT_CH + och] =
+                        filter[ich].rows[fr].cols[fc].ch[och];
+                }
+            }
+        }
+    }
+}
+
+// Input and filter of layer x (the layer above for x = 0)
+void init_cnn_layer(int x, int8_t *input, int8_t *filter, const input_data_t *input0, const filter_t filter0[INPUT_CH]) {
+    const conv_desc_t *d = &cnn_layers[x];
+    const size_t input_size = (size_t)d->h * d->w * d->c_in;
+    const size_t filter_size = (size_t)d->kernel * d->kernel * d->c_in * d->c_out;
+
+    if (x == 0) {
+        memcpy(input, input0, input_size);
+        filter_to_hwio(filter, filter0);
+        return;
+    }
+    for (size_t i = 0; i < input_size; ++i) {
+        input[i] = (int8_t)(i * 13 + x); // The value you like
+    }
+    for (size_t i = 0; i < filter_size; ++i) {
+        filter[i] = (int8_t)(i * 7 - x); // The value you like
+    }
+}
+
+// Per-channel bias, scale and zero point of a layer with ReLU (the values you like), for K products of int8
+typedef struct cnn_requant_params_t {
+    int32_t *bias;
+    float *scale;
+    int32_t *zero_point;
+    requant_t q;
+} cnn_requant_params_t;
+
+static void init_cnn_requant(cnn_requant_params_t *p, const conv_desc_t *d) {
+    const int k = d->kernel * d->kernel * d->c_in;
+    p->bias = (int32_t *)malloc(d->c_out * sizeof(int32_t));
+    p->scale = (float *)malloc(d->c_out * sizeof(float));
+    p->zero_point = (int32_t *)malloc(d->c_out * sizeof(int32_t));
+    for (int och = 0; och < d->c_out; ++och) {
+        p->bias[och] = och * 50 - 300;
+        p->scale[och] = (1.0f + (och % 5) * 0.25f) / (32.0f * k);
+        p->zero_point[och] = och % 3 - 1;
+    }
+    p->q = (requant_t){p->bias, p->scale, p->zero_point, true, false};
+}
+
+static void free_cnn_requant(cnn_requant_params_t *p) {
+    free(p->bias);
+    free(p->scale);
+    free(p->zero_point);
+}
+
+// Bytes of the tensors and the buffers of layer x in run_cnn
+static size_t cnn_layer_bytes(const conv_layer_t *layer, int halo) {
+    const conv_desc_t *d = &layer->desc;
+    const size_t output_size = (size_t)layer->out_h * layer->out_w * d->c_out;
+    return tensor_bytes(d->h, d->w, d->c_in, 1, d->pad > halo ? d->pad : halo, conv_input_slack(layer)) +
+           tensor_bytes(layer->out_h, layer->out_w, d->c_out, sizeof(int32_t), 0, 0) +
+           2 * tensor_bytes(layer->out_h, layer->out_w, d->c_out, 1, halo, 0) +
+           (size_t)d->h * d->w * d->c_in + (size_t)d->kernel * d->kernel * d->c_in * d->c_out +
+           3 * output_size * sizeof(int32_t) + 9 * TENSOR_ALIGN;
+}
+
+// Run every layer with conv_run_tensor and compare it with conv_ref,
+// requantized (int8 output with ReLU, into a tensor with a halo as the next layer would read) against
+// conv_ref + requant_value, and with the input bytes read as uint8 against conv_ref_u8.
+// The buffers of every layer come from one arena, given back after the layer.
+void run_cnn(const input_data_t *input0, const filter_t filter0[INPUT_CH]) {
+    const int halo = 1; // of the requantized output
+
+    conv_layer_t *layers[sizeof(cnn_layers) / sizeof(cnn_layers[0])];
+    size_t arena_size = 0;
+    for (int x = 0; x < num_cnn_layers; ++x) {
+        const conv_desc_t *d = &cnn_layers[x];
+        int8_t *filter = (int8_t *)malloc((size_t)d->kernel * d->kernel * d->c_in * d->c_out);
+        int8_t *input = (int8_t *)malloc((size_t)d->h * d->w * d->c_in);
+        init_cnn_layer(x, input, filter, input0, filter0);
+        layers[x] = conv_create(d, filter);
+        free(input);
+        free(filter);
+
+        const size_t bytes = cnn_layer_bytes(layers[x], halo);
+        arena_size = bytes > arena_size ? bytes : arena_size;
+    }
+    tensor_arena_t *arena = tensor_arena_create(arena_size);
+
+    for (int x = 0; x < num_cnn_layers; ++x) {
+        const conv_desc_t *d = &cnn_layers[x];
+        const conv_layer_t *layer = layers[x];
+        const size_t mark = tensor_arena_mark(arena);
+
+        const size_t output_size = (size_t)layer->out_h * layer->out_w * d->c_out;
+        int8_t *input = (int8_t *)tensor_arena_alloc(arena, (size_t)d->h * d->w * d->c_in);
+        int8_t *filter = (int8_t *)tensor_arena_alloc(arena, (size_t)d->kernel * d->kernel * d->c_in * d->c_out);
+        int32_t *output_ref = (int32_t *)tensor_arena_alloc(arena, output_size * sizeof(int32_t));
+        int32_t *output_ref_u8 = (int32_t *)tensor_arena_alloc(arena, output_size * sizeof(int32_t));
+        init_cnn_layer(x, input, filter, input0, filter0);
+
+        const tensor_t in = conv_input_tensor(arena, layer, 0);
+        const tensor_t out = tensor_alloc(arena, layer->out_h, layer->out_w, d->c_out, sizeof(int32_t), 0, 0);
+        const tensor_t out8 = tensor_alloc(arena, layer->out_h, layer->out_w, d->c_out, 1, halo, 0);
+        tensor_load(&in, input);
+
+        cnn_requant_params_t params;
+        init_cnn_requant(&params, d);
+
+        conv_ref(d, output_ref, input, filter);
+        conv_ref_u8(d, output_ref_u8, (const uint8_t *)input, filter);
+        const double t0 = now_sec();
+        conv_run_tensor(layer, &out, &in, NULL);
+        const double t1 = now_sec();
+        conv_run_tensor(layer, &out8, &in, &params.q);
+        const double t2 = now_sec();
+
+        // The same input as uint8 (tdpbusd)
+        tensor_t in_u8 = in;
+        in_u8.is_unsigned = true;
+        int32_t *output_u8 = (int32_t *)tensor_arena_alloc(arena, output_size * sizeof(int32_t));
+        const tensor_t out_u8 = {.data = output_u8,
+                                 .h = layer->out_h,
+                                 .w = layer->out_w,
+                                 .c = d->c_out,
+                                 .elem_size = sizeof(int32_t),
+                                 .halo = 0,
+                                 .pitch = layer->out_w,
+                                 .slack = 0,
+                                 .is_unsigned = false};
+        const double t3 = now_sec();
+        conv_run_tensor(layer, &out_u8, &in_u8, NULL);
+        const double t4 = now_sec();
+
+        // conv_ref + requant_value in a tensor with the same halo, so that the halo of out8 is compared too
+        const tensor_t ref8 = tensor_alloc(arena, layer->out_h, layer->out_w, d->c_out, 1, halo, 0);
+        for (int oy = 0; oy < layer->out_h; ++oy) {
+            for (int ox = 0; ox < layer->out_w; ++ox) {
+                const int32_t *ref = &output_ref[((size_t)oy * layer->out_w + ox) * d->c_out];
+                int8_t *q8 = (int8_t *)tensor_pixel(&ref8, oy, ox);
+                for (int och = 0; och < d->c_out; ++och) {
+                    q8[och] = (int8_t)requant_value(ref[och], och, &params.q);
+                }
+            }
+        }
+
+        printf("%3dx%-3d %3d -> %3d, %dx%d s%d p%d d%d: %-12s %9.3f ms, requantized %9.3f ms, uint8 input %9.3f ms\n",
+               d->h, d->w, d->c_in, d->c_out, d->kernel, d->kernel, d->stride, d->pad, d->dilation,
+               conv_path_name(layer->path), (t1 - t0) * 1e3, (t2 - t1) * 1e3, (t4 - t3) * 1e3);
+
+        const verify_dims_t dims = verify_dims3(layer->out_h, layer->out_w, d->c_out);
+        char name[64];
+        snprintf(name, sizeof(name), "cnn layer %d", x);
+        verify_i32(name, (const int32_t *)out.data, output_ref, dims);
+        snprintf(name, sizeof(name), "cnn layer %d requantized (rows and columns from -%d)", x, halo);
+        verify_i8(name, (const int8_t *)tensor_pixel(&out8, -halo, -halo),
+                  (const int8_t *)tensor_pixel(&ref8, -halo, -halo),
+                  verify_dims3(layer->out_h + 2 * halo, out8.pitch, d->c_out));
+        snprintf(name, sizeof(name), "cnn layer %d uint8 input", x);
+        verify_i32(name, output_u8, output_ref_u8, dims);
+
+        free_cnn_requant(&params);
+        tensor_arena_release(arena, mark);
+    }
+
+    for (int x = 0; x < num_cnn_layers; ++x) {
+        conv_destroy(layers[x]);
+    }
+    tensor_arena_destroy(arena);
+}
+
+// Create every layer with conv_create_tuned, and compare the tuned path with the guess of conv_select_path
+void run_cnn_autotune(const input_data_t *input0, const filter_t filter0[INPUT_CH]) {
+    // The first run tunes and writes the cache file, the next ones read it
+    autotune_cache_t *cache = autotune_cache_load(NULL);
+    printf("%s, %s\n", cache->cpu, cache->path);
+
+    for (int x = 0; x < num_cnn_layers; ++x) {
+        const conv_desc_t *d = &cnn_layers[x];
+        int8_t *filter = (int8_t *)malloc((size_t)d->kernel * d->kernel * d->c_in * d->c_out);
+        int8_t *input = (int8_t *)malloc((size_t)d->h * d->w * d->c_in);
+        init_cnn_layer(x, input, filter, input0, filter0);
+
+        bool cached;
+        const double t0 = now_sec();
+        conv_layer_t *tuned = conv_create_tuned(d, filter, cache, &cached);
+        const double t1 = now_sec();
+        conv_layer_t *guessed = conv_create(d, filter);
+
+        const size_t output_size = (size_t)tuned->out_h * tuned->out_w * d->c_out;
+        int32_t *output_ref = (int32_t *)malloc(output_size * sizeof(int32_t));
+        int32_t *output = (int32_t *)malloc(output_size * sizeof(int32_t));
+        conv_ref(d, output_ref, input, filter);
+
+        conv_tune_args_t args = {guessed, output, input};
+        const double ms_guessed = autotune_measure(conv_tune_run, &args);
+        args.l = tuned;
+        const double ms_tuned = autotune_measure(conv_tune_run, &args);
+
+        printf("%3dx%-3d %3d -> %3d, %dx%d s%d p%d d%d: %-12s %8.3f ms, %s %-12s %8.3f ms (%.3f s)\n", d->h, d->w,
+               d->c_in, d->c_out, d->kernel, d->kernel, d->stride, d->pad, d->dilation, conv_path_name(guessed->path),
+               ms_guessed, cached ? "cached" : "tuned ", conv_path_name(tuned->path), ms_tuned, t1 - t0);
+        char name[64];
+        snprintf(name, sizeof(name), "cnn layer %d tuned", x);
+        verify_i32(name, output, output_ref, verify_dims3(tuned->out_h, tuned->out_w, d->c_out));
+
+        conv_destroy(tuned);
+        conv_destroy(guessed);
+        free(input);
+        free(filter);
+        free(output_ref);
+        free(output);
+    }
+
+    autotune_cache_save(cache);
+    autotune_cache_destroy(cache);
+}
+
+// -----------------------------------------------
+// Strip-fused layer graph (common/conv_graph.h)
+// A ResNet-like stem run layer by layer (every activation is a whole tensor) and as one conv_graph_t
+// (strips of rows through every layer, the activations stay in L2).
+
+typedef struct stem_layer_t {
+    bool pool;        // max pooling of kernel, stride and pad of desc
+    conv_desc_t desc; // h, w, c_in, c_out, kernel, stride, pad, dilation
+} stem_layer_t;
+
+static const stem_layer_t stem_layers[] = {
+    {false, {224, 224, 3, 32, 3, 2, 1, 1}},
+    {false, {112, 112, 32, 64, 3, 1, 1, 1}},
+    {true, {112, 112, 64, 64, 3, 2, 1, 1}},
+    {false, {56, 56, 64, 128, 1, 1, 0, 1}},
+    {false, {56, 56, 128, 128, 3, 1, 1, 1}},
+    {false, {56, 56, 128, 64, 1, 1, 0, 1}}, // int32 output
+};
+#define NUM_STEM_LAYERS ((int)(sizeof(stem_layers) / sizeof(stem_layers[0])))
+
+typedef struct stem_t {
+    conv_layer_t *layers[NUM_STEM_LAYERS];
+    cnn_requant_params_t params[NUM_STEM_LAYERS];
+    conv_graph_t *graph;
+    tensor_arena_t *arena;
+    tensor_t tensors[NUM_STEM_LAYERS + 1]; // the input and the output of every layer, layer by layer
+    tensor_t input;                        // of the graph
+    tensor_t output;                       // of the graph
+} stem_t;
+
+// Create the layers (uint8 activations after ReLU), the graph and the tensors of both ways
+static stem_t *stem_create() {
+    stem_t *s = (stem_t *)calloc(1, sizeof(stem_t));
+    const stem_layer_t *last = &stem_layers[NUM_STEM_LAYERS - 1];
+    s->graph = conv_graph_create(stem_layers[0].desc.h, stem_layers[0].desc.w, stem_layers[0].desc.c_in);
+
+    size_t arena_size = 0;
+    int h = 0, w = 0;
+    for (int x = 0; x < NUM_STEM_LAYERS; ++x) {
+        const conv_desc_t *d = &stem_layers[x].desc;
+        if (stem_layers[x].pool) {
+            conv_graph_add_maxpool(s->graph, d->kernel, d->stride, d->pad);
+        } else {
+            const size_t filter_size = (size_t)d->kernel * d->kernel * d->c_in * d->c_out;
+            int8_t *filter = (int8_t *)malloc(filter_size);
+            for (size_t i = 0; i < filter_size; ++i) {
+                filter[i] = (int8_t)(i * 7 + x * 3); // The value you like
+            }
+            s->layers[x] = conv_create(d, filter);
+            free(filter);
+
+            init_cnn_requant(&s->params[x], d);
+            s->params[x].q.is_unsigned = true;
+            conv_graph_add_conv(s->graph, s->layers[x], x + 1 < NUM_STEM_LAYERS ? &s->params[x].q : NULL);
+        }
+        h = conv_out_size(d->h, d->kernel, d->stride, d->pad, d->dilation);
+        w = conv_out_size(d->w, d->kernel, d->stride, d->pad, d->dilation);
+        const size_t slack = s->layers[x] != NULL ? conv_input_slack(s->layers[x]) : 0;
+        arena_size += tensor_bytes(d->h, d->w, d->c_in, 1, d->pad, slack) + TENSOR_ALIGN;
+    }
+    conv_graph_plan(s->graph, 0);
+    arena_size += 2 * tensor_bytes(h, w, last->desc.c_out, sizeof(int32_t), 0, 0) +
+                  tensor_bytes(stem_layers[0].desc.h, stem_layers[0].desc.w, stem_layers[0].desc.c_in, 1,
+                               stem_layers[0].desc.pad, conv_graph_slack(&s->graph->nodes[0])) +
+                  3 * TENSOR_ALIGN;
+    s->arena = tensor_arena_create(arena_size);
+
+    // Layer by layer: the output of a layer has a halo of the padding of the next one, which reads it in place
+    for (int x = 0; x < NUM_STEM_LAYERS; ++x) {
+        const conv_desc_t *d = &stem_layers[x].desc;
+        const size_t slack = s->layers[x] != NULL ? conv_input_slack(s->layers[x]) : 0;
+        s->tensors[x] = tensor_alloc(s->arena, d->h, d->w, d->c_in, 1, d->pad, slack);
+        s->tensors[x].is_unsigned = true;
+    }
+    s->tensors[NUM_STEM_LAYERS] = tensor_alloc(s->arena, h, w, last->desc.c_out, sizeof(int32_t), 0, 0);
+
+    s->input = conv_graph_input_tensor(s->arena, s->graph, 0);
+    s->input.is_unsigned = true;
+    s->output = tensor_alloc(s->arena, h, w, last->desc.c_out, sizeof(int32_t), 0, 0);
+
+    // An image of uint8 pixels
+    uint8_t *image = (uint8_t *)malloc((size_t)s->input.h * s->input.w * s->input.c);
+    for (size_t i = 0; i < (size_t)s->input.h * s->input.w * s->input.c; ++i) {
+        image[i] = (uint8_t)(i * 13 + i / 7); // The value you like
+    }
+    tensor_load(&s->tensors[0], image);
+    tensor_load(&s->input, image);
+    free(image);
+    return s;
+}
+
+static void stem_destroy(stem_t *s) {
+    for (int x = 0; x < NUM_STEM_LAYERS; ++x) {
+        if (s->layers[x] != NULL) {
+            conv_destroy(s->layers[x]);
+            free_cnn_requant(&s->params[x]);
+        }
+    }
+    conv_graph_destroy(s->graph);
+    tensor_arena_destroy(s->arena);
+    free(s);
+}
+
+static void stem_run_layers(void *arg) {
+    stem_t *s = (stem_t *)arg;
+    for (int x = 0; x < NUM_STEM_LAYERS; ++x) {
+        const conv_desc_t *d = &stem_layers[x].desc;
+        if (stem_layers[x].pool) {
+            maxpool_run_tensor(&s->tensors[x + 1], &s->tensors[x], d->kernel, d->stride, d->pad);
+        } else {
+            conv_run_tensor(s->layers[x], &s->tensors[x + 1], &s->tensors[x],
+                            x + 1 < NUM_STEM_LAYERS ? &s->params[x].q : NULL);
+        }
+    }
+}
+
+static void stem_run_fused(void *arg) {
+    stem_t *s = (stem_t *)arg;
+    conv_graph_run(s->graph, &s->output, &s->input);
+}
+
+// Multiply-adds of the convolutions of the stem
+static double stem_ops() {
+    double ops = 0;
+    for (int x = 0; x < NUM_STEM_LAYERS; ++x) {
+        const conv_desc_t *d = &stem_layers[x].desc;
+        if (!stem_layers[x].pool) {
+            ops += 2.0 * conv_out_size(d->h, d->kernel, d->stride, d->pad, d->dilation) *
+                   conv_out_size(d->w, d->kernel, d->stride, d->pad, d->dilation) * d->c_out * d->kernel * d->kernel *
+                   d->c_in;
+        }
+    }
+    return ops;
+}
+
+// Run the stem both ways, compare the outputs and time them (--bench times them properly)
+void run_cnn_fused() {
+    stem_t *s = stem_create();
+    const conv_desc_t *d0 = &stem_layers[0].desc;
+    printf("%dx%dx%d -> %dx%dx%d, %d layers: strips of %d output rows, %zu KB of line buffers\n", d0->h, d0->w,
+           d0->c_in, s->output.h, s->output.w, s->output.c, NUM_STEM_LAYERS, s->graph->strip_rows,
+           s->graph->buffer_bytes / 1024);
+
+    stem_run_layers(s);
+    stem_run_fused(s);
+    verify_i32("conv_graph_run", (const int32_t *)s->output.data, (const int32_t *)s->tensors[NUM_STEM_LAYERS].data,
+               verify_dims3(s->output.h, s->output.w, s->output.c));
+
+    // Warmed up and timed as in the benchmark mode (the median of up to bench_config.repeat runs)
+    const bench_stats_t layers = bench_measure(stem_run_layers, s);
+    const bench_stats_t fused = bench_measure(stem_run_fused, s);
+    printf("layer by layer %9.3f ms, fused %9.3f ms (median of %d / %d runs)\n", layers.median_sec * 1e3,
+           fused.median_sec * 1e3, layers.runs, fused.runs);
+
+    stem_destroy(s);
+}
+
+// -----------------------------------------------
+// Streaming input (common/conv_stream.h)
+// A layer on an image file, through mappings or read() in strips, against loading the whole image into memory
+
+// h, w, c_in, c_out, kernel, stride, pad, dilation
+static const conv_desc_t stream_layer = {2048, 2048, 3, 8, 3, 1, 1, 1};
+
+typedef struct stream_files_t {
+    char input[512], output[512], output_ref[512];
+    conv_layer_t *layer;
+    cnn_requant_params_t params;
+    conv_stream_stats_t stats; // of the last streamed run
+    bool ok;                   // of the last streamed run
+} stream_files_t;
+
+// A field of /proc/self/status in KB (VmRSS, VmHWM), -1 when it isn't there
+static long proc_status_kb(const char *field) {
+    FILE *f = fopen("/proc/self/status", "r");
+    if (f == NULL)
+        return -1;
+    char line[256];
+    long kb = -1;
+    const size_t n = strlen(field);
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, field, n) == 0 && line[n] == ':')
+            kb = atol(line + n + 1);
+    }
+    fclose(f);
+    return kb;
+}
+
+// Start VmHWM again from VmRSS (Linux 4.0 and later)
+static void reset_peak_rss() {
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    if (f != NULL) {
+        fputs("5", f);
+        fclose(f);
+    }
+}
+
+// The layer (uint8 input and output, with ReLU) and an image file of uint8 pixels in TMPDIR
+static stream_files_t *stream_files_create() {
+    stream_files_t *s = (stream_files_t *)calloc(1, sizeof(stream_files_t));
+    const conv_desc_t *d = &stream_layer;
+    const char *dir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    snprintf(s->input, sizeof(s->input), "%s/amx_stream_input.raw", dir);
+    snprintf(s->output, sizeof(s->output), "%s/amx_stream_output.raw", dir);
+    snprintf(s->output_ref, sizeof(s->output_ref), "%s/amx_stream_output_ref.raw", dir);
+
+    const size_t filter_size = (size_t)d->kernel * d->kernel * d->c_in * d->c_out;
+    int8_t *filter = (int8_t *)malloc(filter_size);
+    for (size_t i = 0; i < filter_size; ++i) {
+        filter[i] = (int8_t)(i * 11 - 40); // The value you like
+    }
+    s->layer = conv_create(d, filter);
+    free(filter);
+    init_cnn_requant(&s->params, d);
+    s->params.q.is_unsigned = true;
+
+    // Written a row at a time, as the image itself is never in memory
+    FILE *f = fopen(s->input, "wb");
+    uint8_t *row = (uint8_t *)malloc((size_t)d->w * d->c_in);
+    for (int y = 0; y < d->h && f != NULL; ++y) {
+        for (int i = 0; i < d->w * d->c_in; ++i) {
+            row[i] = (uint8_t)(y * 3 + i * 7 + (i >> 5)); // The value you like
+        }
+        fwrite(row, 1, (size_t)d->w * d->c_in, f);
+    }
+    free(row);
+    if (f == NULL || fclose(f) != 0)
+        fprintf(stderr, "can't write %s\n", s->input);
+    return s;
+}
+
+static void stream_files_destroy(stream_files_t *s) {
+    unlink(s->input);
+    unlink(s->output);
+    unlink(s->output_ref);
+    conv_destroy(s->layer);
+    free_cnn_requant(&s->params);
+    free(s);
+}
+
+// The in-memory way: read the whole image into a tensor, run the layer, write the whole output
+static void stream_run_in_memory(void *arg) {
+    const stream_files_t *s = (const stream_files_t *)arg;
+    const conv_layer_t *l = s->layer;
+    const conv_desc_t *d = &l->desc;
+    tensor_arena_t *arena = tensor_arena_create(tensor_bytes(d->h, d->w, d->c_in, 1, d->pad, conv_input_slack(l)) +
+                                                tensor_bytes(l->out_h, l->out_w, d->c_out, 1, 0, 0) + 2 * TENSOR_ALIGN);
+    tensor_t in = conv_input_tensor(arena, l, 0);
+    in.is_unsigned = true;
+    const tensor_t out = tensor_alloc(arena, l->out_h, l->out_w, d->c_out, 1, 0, 0);
+
+    FILE *f = fopen(s->input, "rb");
+    for (int y = 0; y < d->h && f != NULL; ++y) {
+        if (fread(tensor_pixel(&in, y, 0), 1, (size_t)d->w * d->c_in, f) != (size_t)d->w * d->c_in)
+            break;
+    }
+    if (f != NULL)
+        fclose(f);
+
+    conv_run_tensor(l, &out, &in, &s->params.q);
+
+    f = fopen(s->output_ref, "wb");
+    if (f != NULL) {
+        fwrite(out.data, 1, (size_t)l->out_h * l->out_w * d->c_out, f);
+        fclose(f);
+    }
+    tensor_arena_destroy(arena);
+}
+
+static void stream_run_mmap(void *arg) {
+    stream_files_t *s = (stream_files_t *)arg;
+    s->ok = conv_run_file(s->layer, s->output, s->input, true, &s->params.q, CONV_STREAM_MMAP, 0, &s->stats);
+}
+
+static void stream_run_read(void *arg) {
+    stream_files_t *s = (stream_files_t *)arg;
+    s->ok = conv_run_file(s->layer, s->output, s->input, true, &s->params.q, CONV_STREAM_READ, 0, &s->stats);
+}
+
+// size bytes of a file in a malloc'ed buffer (zeros after a short read)
+static uint8_t *read_file(const char *path, size_t size) {
+    uint8_t *data = (uint8_t *)calloc(size, 1);
+    FILE *f = fopen(path, "rb");
+    if (f == NULL || fread(data, 1, size, f) != size)
+        fprintf(stderr, "can't read %s\n", path);
+    if (f != NULL)
+        fclose(f);
+    return data;
+}
+
+// Run the layer in memory, then streamed both ways, and compare the output files, the time and the growth of the
+// resident memory (the page cache of the files isn't counted, the pages mapped in are)
+void run_conv_stream() {
+    stream_files_t *s = stream_files_create();
+    const conv_desc_t *d = &stream_layer;
+    const double mb = ((double)d->h * d->w * d->c_in + (double)s->layer->out_h * s->layer->out_w * d->c_out) / 1e6;
+    printf("%dx%dx%d -> %dx%dx%d (%s), %.1f MB of input and output in %s\n", d->h, d->w, d->c_in, s->layer->out_h,
+           s->layer->out_w, d->c_out, conv_path_name(s->layer->path), mb, s->input);
+
+    const char *names[3] = {"in memory", "mmap strips", "read() strips"};
+    void (*const runs[3])(void *) = {stream_run_in_memory, stream_run_mmap, stream_run_read};
+    for (int x = 0; x < 3; ++x) {
+        const long rss = proc_status_kb("VmRSS");
+        reset_peak_rss();
+        const double t0 = now_sec();
+        runs[x](s);
+        const double t1 = now_sec();
+        const long peak = proc_status_kb("VmHWM");
+
+        printf("%-14s %9.3f ms (%7.1f MB/s), peak RSS +%6ld KB", names[x], (t1 - t0) * 1e3, mb / (t1 - t0),
+               peak - rss);
+        if (x > 0) {
+            printf(", %d strips of %d rows, %zu KB strip buffer%s", s->stats.strips, s->stats.strip_rows,
+                   s->stats.buffer_bytes / 1024, s->ok ? "" : ", FAILED");
+        }
+        printf("\n");
+
+        // The output file against the one written in memory
+        if (x > 0) {
+            const size_t size = (size_t)s->layer->out_h * s->layer->out_w * d->c_out;
+            uint8_t *output = read_file(s->output, size);
+            uint8_t *output_ref = read_file(s->output_ref, size);
+            verify_u8(names[x], output, output_ref, verify_dims3(s->layer->out_h, s->layer->out_w, d->c_out));
+            free(output);
+            free(output_ref);
+        }
+    }
+
+    stream_files_destroy(s);
+}
+
+// -----------------------------------------------
+// Benchmark mode (--bench, see common/bench.h)
+// The shape is fixed at compile time (INPUT_ROWS, INPUT_COLS, INPUT_CH, OUTPUT_CH, FILTER_SIZE).
+
+typedef struct conv_bench_args_t {
+    void (*fn)(output_data_t *output, const input_data_t *input, const filter_t filter[INPUT_CH]);
+    conv_packed_fn_t packed_fn;
+    output_data_t *output;
+    const input_data_t *input;
+    const filter_t *filter;
+    const packed_filter_t *pf;
+} conv_bench_args_t;
+
+static void bench_conv(void *arg) {
+    conv_bench_args_t *args = (conv_bench_args_t *)arg;
+    args->fn(args->output, args->input, args->filter);
+}
+
+static void bench_conv_packed(void *arg) {
+    conv_bench_args_t *args = (conv_bench_args_t *)arg;
+    args->packed_fn(args->output, args->input, args->pf);
+}
+
+typedef struct conv_run_bench_args_t {
+    const conv_layer_t *layer;
+    const tensor_t *output;
+    const tensor_t *input;
+} conv_run_bench_args_t;
+
+static void bench_conv_run(void *arg) {
+    conv_run_bench_args_t *args = (conv_run_bench_args_t *)arg;
+    conv_run_tensor(args->layer, args->output, args->input, NULL);
+}
+
+// conv_naive, conv_amx - conv_amx_v5 (the filter is transformed on every call, as in the normal run),
+// the kernels for CPUs without AMX on the packed filter, conv_run_tensor on every layer of cnn_layers, the stem
+// of stem_layers layer by layer and strip-fused, and stream_layer on an image file in memory and streamed
+void run_benchmarks(const input_data_t *input, const filter_t filter[INPUT_CH]) {
+    const int output_rows = INPUT_ROWS - FILTER_SIZE + 1;
+    const int output_cols = INPUT_COLS - FILTER_SIZE + 1;
+    const double ops = 2.0 * output_rows * output_cols * OUTPUT_CH * FILTER_SIZE * FILTER_SIZE * INPUT_CH;
+    const double bytes = (double)INPUT_ROWS * INPUT_COLS * INPUT_CH + INPUT_CH * sizeof(filter_t) +
+                         (double)output_rows * output_cols * OUTPUT_CH * sizeof(int32_t);
+
+    char shape[64];
+    snprintf(shape, sizeof(shape), "%dx%dx%d-%dx%dx%d", INPUT_ROWS, INPUT_COLS, INPUT_CH, FILTER_SIZE, FILTER_SIZE,
+             OUTPUT_CH);
+
+    output_data_t *output = (output_data_t *)malloc(sizeof(output_data_t));
+    memset(output, 0, sizeof(output_data_t));
+    packed_filter_t *pf = pack_filter(filter);
+    conv_bench_args_t args = {conv_naive, NULL, output, input, filter, pf};
+
+    bench_begin();
+    bench_report("int8_conv", "conv_naive", shape, ops, bytes, bench_measure(bench_conv, &args));
+
+#if CONV_SINGLE_TILE
+    if (cpu_features.amx_int8) {
+        const char *names[4] = {"conv_amx", "conv_amx_v2", "conv_amx_v3", "conv_amx_v4"};
+        void (*const versions[4])(output_data_t *, const input_data_t *, const filter_t[INPUT_CH]) = {
+            conv_amx, conv_amx_v2, conv_amx_v3, conv_amx_v4};
+        for (int v = 0; v < 4; ++v) {
+            args.fn = versions[v];
+            bench_report("int8_conv", names[v], shape, ops, bytes, bench_measure(bench_conv, &args));
+        }
+    }
+#endif
+
+#if CONV_V5
+    if (cpu_features.amx_int8) {
+        args.fn = conv_amx_v5;
+        bench_report("int8_conv", "conv_amx_v5", shape, ops, bytes, bench_measure(bench_conv, &args));
+    }
+#endif
+
+    for (int x = 0; x < num_conv_kernels; ++x) {
+        if (CONV_SINGLE_TILE && conv_kernels[x].fn == conv_amx_v4_packed)
+            continue;
+        args.packed_fn = conv_kernels[x].fn;
+        bench_report("int8_conv", conv_kernels[x].name, shape, ops, bytes, bench_measure(bench_conv_packed, &args));
+    }
+
+    free_packed_filter(pf);
+    free(output);
+
+    // The layers of cnn_layers with conv_run_tensor
+    for (int x = 0; x < num_cnn_layers; ++x) {
+        const conv_desc_t *d = &cnn_layers[x];
+        int8_t *layer_input = (int8_t *)malloc((size_t)d->h * d->w * d->c_in);
+        int8_t *layer_filter = (int8_t *)malloc((size_t)d->kernel * d->kernel * d->c_in * d->c_out);
+        init_cnn_layer(x, layer_input, layer_filter, input, filter);
+
+        conv_layer_t *layer = conv_create(d, layer_filter);
+        const size_t output_size = (size_t)layer->out_h * layer->out_w * d->c_out;
+        tensor_arena_t *arena = tensor_arena_create(cnn_layer_bytes(layer, 0));
+        const tensor_t layer_in = conv_input_tensor(arena, layer, 0);
+        const tensor_t layer_out = tensor_alloc(arena, layer->out_h, layer->out_w, d->c_out, sizeof(int32_t), 0, 0);
+        tensor_load(&layer_in, layer_input);
+
+        const double layer_ops = 2.0 * output_size * d->kernel * d->kernel * d->c_in;
+        const double layer_bytes = (double)d->h * d->w * d->c_in + (double)d->kernel * d->kernel * d->c_in * d->c_out +
+                                   (double)output_size * sizeof(int32_t);
+        snprintf(shape, sizeof(shape), "%dx%dx%d-%dx%dx%d-s%dp%dd%d", d->h, d->w, d->c_in, d->kernel, d->kernel,
+                 d->c_out, d->stride, d->pad, d->dilation);
+
+        conv_run_bench_args_t run_args = {layer, &layer_out, &layer_in};
+        bench_report("int8_conv", cpu_features.amx_int8 ? conv_path_name(layer->path) : "conv_run (scalar)", shape,
+                     layer_ops, layer_bytes, bench_measure(bench_conv_run, &run_args));
+
+        conv_destroy(layer);
+        tensor_arena_destroy(arena);
+        free(layer_input);
+        free(layer_filter);
+    }
+
+    // The stem layer by layer and strip-fused; the traffic counts the image and the output once
+    stem_t *stem = stem_create();
+    const conv_desc_t *d0 = &stem_layers[0].desc;
+    const double stem_bytes =
+        (double)d0->h * d0->w * d0->c_in + (double)stem->output.h * stem->output.w * stem->output.c * sizeof(int32_t);
+    bench_report("int8_conv", "stem layer by layer", "stem-224", stem_ops(), stem_bytes,
+                 bench_measure(stem_run_layers, stem));
+    bench_report("int8_conv", "stem conv_graph", "stem-224", stem_ops(), stem_bytes,
+                 bench_measure(stem_run_fused, stem));
+    stem_destroy(stem);
+
+    // The image file in memory and streamed; the traffic counts the files once
+    stream_files_t *stream = stream_files_create();
+    const conv_desc_t *ds = &stream_layer;
+    const double stream_ops = 2.0 * stream->layer->out_h * stream->layer->out_w * ds->c_out * ds->kernel * ds->kernel *
+                              ds->c_in;
+    const double stream_bytes =
+        (double)ds->h * ds->w * ds->c_in + (double)stream->layer->out_h * stream->layer->out_w * ds->c_out;
+    char stream_shape[64];
+    snprintf(stream_shape, sizeof(stream_shape), "%dx%dx%d-%dx%dx%d", ds->h, ds->w, ds->c_in, ds->kernel, ds->kernel,
+             ds->c_out);
+    bench_report("int8_conv", "file in memory", stream_shape, stream_ops, stream_bytes,
+                 bench_measure(stream_run_in_memory, stream));
+    bench_report("int8_conv", "conv_run_file mmap", stream_shape, stream_ops, stream_bytes,
+                 bench_measure(stream_run_mmap, stream));
+    bench_report("int8_conv", "conv_run_file read", stream_shape, stream_ops, stream_bytes,
+                 bench_measure(stream_run_read, stream));
+    stream_files_destroy(stream);
+    bench_end();
+}
+
+// -----------------------------------------------
+
+int main(int argc, char **argv) {
+    detect_cpu_features();
+    init_dispatch();
+
+    // The input and the outputs below, 64-byte aligned
+    tensor_arena_t *arena = tensor_arena_create(sizeof(input_data_t) + 7 * (sizeof(output_data_t) + TENSOR_ALIGN));
 
     input_data_t *input;
-    input = (input_data_t *)malloc(sizeof(input_data_t));
+    input = (input_data_t *)tensor_arena_alloc(arena, sizeof(input_data_t));
     init_input_data(input);
 
     filter_t filter[INPUT_CH];
     init_filter_data(filter);
 
+    if (bench_parse_args(argc, argv)) {
+        run_benchmarks(input, filter);
+        if (cpu_features.amx_tile)
+            amx_release();
+        tensor_arena_destroy(arena);
+        return 0;
+    }
+
+    print_cpu_features();
+
     output_data_t *output_naive;
-    output_naive = (output_data_t *)malloc(sizeof(output_data_t));
+    output_naive = (output_data_t *)tensor_arena_alloc(arena, sizeof(output_data_t));
     memset(output_naive, 0, sizeof(output_data_t));
 
-    output_data_t *output_amx;
-    output_amx = (output_data_t *)malloc(sizeof(output_data_t));
-    memset(output_amx, 0, sizeof(output_data_t));
+    output_data_t *output_conv;
+    output_conv = (output_data_t *)tensor_arena_alloc(arena, sizeof(output_data_t));
+    memset(output_conv, 0, sizeof(output_data_t));
 
-    output_data_t *output_amx_v2;
-    output_amx_v2 = (output_data_t *)malloc(sizeof(output_data_t));
-    memset(output_amx_v2, 0, sizeof(output_data_t));
+    // -----------------------------------------------
 
-    output_data_t *output_amx_v3;
-    output_amx_v3 = (output_data_t *)malloc(sizeof(output_data_t));
-    memset(output_amx_v3, 0, sizeof(output_data_t));
+    conv_naive(output_naive, input, filter);
+    conv(output_conv, input, filter);
 
-    output_data_t *output_amx_v4;
-    output_amx_v4 = (output_data_t *)malloc(sizeof(output_data_t));
-    memset(output_amx_v4, 0, sizeof(output_data_t));
+    printf("----------------------------------------------- Verification against conv_naive\n");
+    char name[64];
+    snprintf(name, sizeof(name), "conv (%s)", conv_kernels[0].name);
+    verify_output_data(name, output_conv, output_naive);
 
     // -----------------------------------------------
+    // The steps V1 - V4; V1 - V3 need a filter row that fits one tile (CONV_SINGLE_TILE),
+    // otherwise V4 is the dispatched result above
+
+#if CONV_SINGLE_TILE
+    if (cpu_features.amx_int8) {
+        output_data_t *output_amx;
+        output_amx = (output_data_t *)tensor_arena_alloc(arena, sizeof(output_data_t));
+        memset(output_amx, 0, sizeof(output_data_t));
+
+        output_data_t *output_amx_v2;
+        output_amx_v2 = (output_data_t *)tensor_arena_alloc(arena, sizeof(output_data_t));
+        memset(output_amx_v2, 0, sizeof(output_data_t));
+
+        output_data_t *output_amx_v3;
+        output_amx_v3 = (output_data_t *)tensor_arena_alloc(arena, sizeof(output_data_t));
+        memset(output_amx_v3, 0, sizeof(output_data_t));
+
+        output_data_t *output_amx_v4;
+        output_amx_v4 = (output_data_t *)tensor_arena_alloc(arena, sizeof(output_data_t));
+        memset(output_amx_v4, 0, sizeof(output_data_t));
+
+        output_data_t *output_amx_v4_packed;
+        output_amx_v4_packed = (output_data_t *)tensor_arena_alloc(arena, sizeof(output_data_t));
+        memset(output_amx_v4_packed, 0, sizeof(output_data_t));
+
+#if defined(AMX_EMULATE)
+        // Tile instructions of each version (the filter is transformed outside of the counters)
+        packed_filter_t *pf_emu = pack_filter(filter);
+        amx_emu_counters_t counters[4];
+        void (*const versions[4])(output_data_t *, const input_data_t *, const packed_filter_t *) = {
+            conv_amx_packed, conv_amx_v2_packed, conv_amx_v3_packed, conv_amx_v4_packed};
+        output_data_t *outputs[4] = {output_amx, output_amx_v2, output_amx_v3, output_amx_v4};
+        for (int v = 0; v < 4; ++v) {
+            amx_emu_reset_counters();
+            versions[v](outputs[v], input, pf_emu);
+            counters[v] = amx_emu_counters;
+        }
+        free_packed_filter(pf_emu);
+#else
+        conv_amx(output_amx, input, filter);
+        conv_amx_v2(output_amx_v2, input, filter);
+        conv_amx_v3(output_amx_v3, input, filter);
+        conv_amx_v4(output_amx_v4, input, filter);
+#endif
 
-    conv_naive(output_naive, input, filter);
-    conv_amx(output_amx, input, filter);
-    conv_amx_v2(output_amx_v2, input, filter);
-    conv_amx_v3(output_amx_v3, input, filter);
-    conv_amx_v4(output_amx_v4, input, filter);
+        // The filter is packed once, e.g. inference weights
+        packed_filter_t *pf = pack_filter(filter);
+        conv_amx_v4_packed(output_amx_v4_packed, input, pf);
+        free_packed_filter(pf);
+
+        verify_output_data("conv_amx", output_amx, output_naive);
+        verify_output_data("conv_amx_v2", output_amx_v2, output_naive);
+        verify_output_data("conv_amx_v3", output_amx_v3, output_naive);
+        verify_output_data("conv_amx_v4", output_amx_v4, output_naive);
+        verify_output_data("conv_amx_v4_packed", output_amx_v4_packed, output_naive);
+
+#if defined(AMX_EMULATE)
+        printf("----------------------------------------------- AMX emulator counters\n");
+        const char *names[4] = {"V1", "V2", "V3", "V4"};
+        for (int v = 0; v < 4; ++v) {
+            amx_emu_counters = counters[v];
+            amx_emu_print_counters(names[v]);
+        }
+#endif
 
-    // -----------------------------------------------
+        amx_release(); // Release the AMX state
+    }
+#endif
+
+#if CONV_V5
+    if (cpu_features.amx_int8) {
+        printf("----------------------------------------------- AMX V5 (filter-resident, 4 output rows)\n");
+        run_conv_v5(input, filter, output_naive);
+        amx_release();
+    }
+#endif
+
+    printf("----------------------------------------------- Multi-threaded convolution\n");
+    run_conv_scaling(input, filter, output_conv);
+
+    printf("----------------------------------------------- Runtime-shaped convolution\n");
+    run_cnn(input, filter);
+
+    if (cpu_features.avx2) {
+        printf("----------------------------------------------- Autotuned paths (conv_create_tuned)\n");
+        run_cnn_autotune(input, filter);
+    }
 
-    printf("----------------------------------------------- Naive result\n");
-    print_output_data(output_naive);
-    printf("----------------------------------------------- AMX result\n");
-    print_output_data(output_amx);
-    printf("----------------------------------------------- AMX result (V2)\n");
-    print_output_data(output_amx_v2);
-    printf("----------------------------------------------- AMX result (V3)\n");
-    print_output_data(output_amx_v3);
-    printf("----------------------------------------------- AMX result (V4)\n");
+    printf("----------------------------------------------- Strip-fused layer graph (conv_graph_t)\n");
+    run_cnn_fused();
 
-    _tile_release(); // Release the AMX state
+    printf("----------------------------------------------- Streaming input (conv_run_file)\n");
+    run_conv_stream();
 
+    tensor_arena_destroy(arena);
     return 0;
 }
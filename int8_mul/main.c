@@ -1,23 +1,27 @@
+#define _GNU_SOURCE // CPU affinity of the thread pool
+
 #include <immintrin.h>
 #include <memory.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
-#if defined(__linux__)
-#include <sys/syscall.h>
-#include <unistd.h>
-
-#define ARCH_GET_XCOMP_PERM 0x1022
-#define ARCH_REQ_XCOMP_PERM 0x1023
-#define XFEATURE_XTILECFG 17
-#define XFEATURE_XTILEDATA 18
-#endif
+#include "../common/amx.h"
+#include "../common/autotune.h"
+#include "../common/bench.h"
+#include "../common/cpu_features.h"
+#include "../common/page_alloc.h"
+#include "../common/quant.h"
+#include "../common/requant.h"
+#include "../common/thread_pool.h"
+#include "../common/verify.h"
+#include "../common/vnni_pack.h"
 
 void init_mat_a(int8_t a[16][32]) {
-    for (int r = 0; r < 32; ++r) {
-        for (int c = 0; c < 16; ++c) {
+    for (int r = 0; r < 16; ++r) {
+        for (int c = 0; c < 32; ++c) {
             a[r][c] = r + c; // The value you like
         }
     }
@@ -31,15 +35,6 @@ void init_mat_b(int8_t b[32][16]) {
     }
 }
 
-void print_dword16x16(int32_t m[16][16]) {
-    for (int r = 0; r < 8; ++r) {
-        for (int c = 0; c < 8; ++c) {
-            printf("%d ", m[r][c]);
-        }
-        printf("\n");
-    }
-}
-
 // -----------------------------------------------
 
 // Multiply A and B using naive method
@@ -56,28 +51,9 @@ void mul_naive(int32_t c[16][16], int8_t a[16][32], int8_t b[32][16]) {
 
 // -----------------------------------------------
 // See: https://www.intel.com/content/www/us/en/docs/intrinsics-guide/index.html#!=undefined&techs=AMX
+// The tile config (tile_config_t) and the tile numbers (TILE_0 - TILE_7) are in common/amx.h.
 
-typedef struct tile_config_t {
-    uint8_t palette_id;         // 0
-    uint8_t start_row;          // 1
-    uint8_t reserved_2_15[14];  // 2-15: must be zero
-    uint16_t colsb[8];          // 16-31
-    uint8_t reserved_32_47[16]; // 32-47: must be zero
-    uint8_t rows[8];            // 48-55
-    uint8_t reserved_56_63[16]; // 56-63: must be zero
-} tile_config_t;
-
-// AMX has 8 tiles
-#define TILE_0 0
-#define TILE_1 1
-#define TILE_2 2
-#define TILE_3 3
-#define TILE_4 4
-#define TILE_5 5
-#define TILE_6 6
-#define TILE_7 7
-
-void init_tile_config() {
+TARGET_AMX_INT8 void init_tile_config() {
     tile_config_t tile = {0};
 
     tile.palette_id = 1; // This value is always 0 when using AMX
@@ -104,7 +80,7 @@ void init_tile_config() {
 }
 
 // Multiply A and B using AMX
-void mul_amx(int32_t c[16][16], int8_t a[16][32], int8_t b[32][16]) {
+TARGET_AMX_INT8 void mul_amx(int32_t c[16][16], int8_t a[16][32], int8_t b[32][16]) {
     int8_t b_transformed[8][64];
     for (int r = 0; r < 32; ++r) {
         for (int c = 0; c < 16; ++c) {
@@ -127,16 +103,1759 @@ void mul_amx(int32_t c[16][16], int8_t a[16][32], int8_t b[32][16]) {
     _tile_stored(TILE_0, c, 16 * sizeof(int32_t));
 }
 
+// -----------------------------------------------
+// General int8 GEMM: C[M][N] = A[M][K] * B[K][N] (all row-major)
+
+// Multiply A and B using naive method (any shape); the bytes of A and B are int8 or uint8 (see int8_signs_t)
+void gemm_naive_signs(int32_t *c, const int8_t *a, const int8_t *b, int m, int n, int k, int8_signs_t signs) {
+    const bool a_unsigned = int8_signs_a_unsigned(signs);
+    const bool b_unsigned = int8_signs_b_unsigned(signs);
+
+    for (int i = 0; i < m; ++i) {
+        for (int j = 0; j < n; ++j) {
+            int32_t sum = 0;
+            for (int p = 0; p < k; ++p) {
+                const int32_t x = a_unsigned ? (uint8_t)a[i * k + p] : a[i * k + p];
+                const int32_t y = b_unsigned ? (uint8_t)b[p * n + j] : b[p * n + j];
+                sum += x * y;
+            }
+            c[i * n + j] = sum;
+        }
+    }
+}
+
+void gemm_naive(int32_t *c, const int8_t *a, const int8_t *b, int m, int n, int k) {
+    gemm_naive_signs(c, a, b, m, n, k, INT8_SS);
+}
+
+// One tile holds 16 rows of 64 bytes.
+// For int8 that is A[16][64] and B[64][16] (B is stored as [64 / 4][16 * 4]).
+#define GEMM_TILE_M 16
+#define GEMM_TILE_N 16
+#define GEMM_TILE_K 64
+
+// 2x2 register blocking: one block computes C[32][32] with 4 C tiles, 2 A tiles and 2 B tiles
+#define GEMM_BLOCK_M (GEMM_TILE_M * 2)
+#define GEMM_BLOCK_N (GEMM_TILE_N * 2)
+
+#define ROUND_UP(x, y) (((x) + (y) - 1) / (y) * (y))
+
+// Tile config for blocks of rows x cols of C (up to 32 x 32).
+// Blocks at the bottom and right edges of C use a reduced config, so their tile loads and stores touch only
+// the rows and columns that exist. Tiles of a half the block doesn't have (rows or cols <= 16) stay unconfigured.
+TARGET_AMX_INT8 void init_gemm_tile_config_block(int rows, int cols) {
+    tile_config_t tile = {0};
+
+    tile.palette_id = 1;
+    tile.start_row = 0;
+
+    const int rows0 = (rows < GEMM_TILE_M) ? rows : GEMM_TILE_M;
+    const int cols0 = (cols < GEMM_TILE_N) ? cols : GEMM_TILE_N;
+    const int rows1 = rows - rows0;
+    const int cols1 = cols - cols0;
+
+    // config for C tiles: c[16][16] of int32 (TILE_0 | TILE_1 over TILE_2 | TILE_3)
+    tile.rows[TILE_0] = rows0;
+    tile.colsb[TILE_0] = cols0 * sizeof(int32_t);
+    tile.rows[TILE_1] = cols1 > 0 ? rows0 : 0;
+    tile.colsb[TILE_1] = cols1 > 0 ? cols1 * sizeof(int32_t) : 0;
+    tile.rows[TILE_2] = rows1;
+    tile.colsb[TILE_2] = rows1 > 0 ? cols0 * sizeof(int32_t) : 0;
+    tile.rows[TILE_3] = cols1 > 0 ? rows1 : 0;
+    tile.colsb[TILE_3] = (rows1 > 0 && cols1 > 0) ? cols1 * sizeof(int32_t) : 0;
+
+    // config for A tiles: a[16][64] of int8
+    tile.rows[TILE_4] = rows0;
+    tile.colsb[TILE_4] = GEMM_TILE_K * sizeof(int8_t); // 64
+    tile.rows[TILE_5] = rows1;
+    tile.colsb[TILE_5] = rows1 > 0 ? GEMM_TILE_K * sizeof(int8_t) : 0;
+
+    // config for B tiles: b[64][16] of int8, stored as [16][64]
+    tile.rows[TILE_6] = GEMM_TILE_K / 4; // 16
+    tile.colsb[TILE_6] = (cols0 * 4) * sizeof(int8_t);
+    tile.rows[TILE_7] = cols1 > 0 ? GEMM_TILE_K / 4 : 0;
+    tile.colsb[TILE_7] = (cols1 * 4) * sizeof(int8_t);
+
+    _tile_loadconfig(&tile);
+}
+
+TARGET_AMX_INT8 void init_gemm_tile_config() { init_gemm_tile_config_block(GEMM_BLOCK_M, GEMM_BLOCK_N); }
+
+// -----------------------------------------------
+// Pre-packed B
+// B (e.g. weights) usually doesn't change between multiplications,
+// so the 4-byte interleave is done once and the result is kept in a handle.
+
+typedef struct packed_b_t {
+    int n, k;         // shape of the original B[K][N]
+    int n_pad, k_pad; // padded to GEMM_BLOCK_N and GEMM_TILE_K
+    bool b_unsigned;  // the bytes of B are uint8 (pack_b_u8)
+    int8_t *panels;   // 64-byte aligned
+    int32_t *col_sums; // sum_k B[k][j] for each (padded) column, used by gemm_avx512_vnni_packed
+} packed_b_t;
+
+// Offset of panel (j, kb) in packed_b_t::panels.
+// Panel (j, kb) holds B[kb * 64 .. +64][j * 16 .. +16] as a [16][64] tile,
+// and the panels of a column j are contiguous so that the K loop streams them.
+static inline size_t packed_b_panel(const packed_b_t *pb, int j, int kb) {
+    return ((size_t)j * (pb->k_pad / GEMM_TILE_K) + kb) * (GEMM_TILE_K * GEMM_TILE_N);
+}
+
+// Pack B[K][N] (int8, or uint8 with b_unsigned) into tile panels on pages of kind (common/page_alloc.h).
+// Out-of-range elements are zero, so ragged K and N contribute nothing to C.
+packed_b_t *pack_b_pages(const int8_t *b, int n, int k, bool b_unsigned, page_kind_t kind) {
+    packed_b_t *pb = (packed_b_t *)malloc(sizeof(packed_b_t));
+    pb->n = n;
+    pb->k = k;
+    pb->b_unsigned = b_unsigned;
+    pb->n_pad = ROUND_UP(n, GEMM_BLOCK_N);
+    pb->k_pad = ROUND_UP(k, GEMM_TILE_K);
+    pb->panels = (int8_t *)page_alloc((size_t)pb->n_pad * pb->k_pad, kind);
+    memset(pb->panels, 0, (size_t)pb->n_pad * pb->k_pad);
+
+    // The rows of B must be divided by 4 byte elements.
+    // Every 16 columns of an interleaved row go to the next panel column (j + 1).
+    const size_t chunk_stride = packed_b_panel(pb, 1, 0);
+    int8_t *zeros = (int8_t *)calloc(n, sizeof(int8_t)); // rows past K
+
+    for (int r = 0; r < k; r += 4) {
+        const int8_t *rows[4];
+        for (int i = 0; i < 4; ++i) {
+            rows[i] = (r + i < k) ? &b[(size_t)(r + i) * n] : zeros;
+        }
+
+        int8_t *dst = &pb->panels[packed_b_panel(pb, 0, r / GEMM_TILE_K) + (r % GEMM_TILE_K) / 4 * (GEMM_TILE_N * 4)];
+        vnni_interleave4_s8(dst, chunk_stride, rows[0], rows[1], rows[2], rows[3], n);
+    }
+
+    free(zeros);
+
+    pb->col_sums = (int32_t *)aligned_alloc(64, pb->n_pad * sizeof(int32_t));
+    memset(pb->col_sums, 0, pb->n_pad * sizeof(int32_t));
+    for (int r = 0; r < k; ++r) {
+        for (int c = 0; c < n; ++c) {
+            pb->col_sums[c] += b_unsigned ? (uint8_t)b[(size_t)r * n + c] : b[(size_t)r * n + c];
+        }
+    }
+
+    return pb;
+}
+
+packed_b_t *pack_b_sign(const int8_t *b, int n, int k, bool b_unsigned) {
+    return pack_b_pages(b, n, k, b_unsigned, page_default_kind());
+}
+
+packed_b_t *pack_b(const int8_t *b, int n, int k) { return pack_b_sign(b, n, k, false); }
+
+// B of uint8, e.g. to multiply two matrices of activations
+packed_b_t *pack_b_u8(const uint8_t *b, int n, int k) { return pack_b_sign((const int8_t *)b, n, k, true); }
+
+void free_packed_b(packed_b_t *pb) {
+    page_free(pb->panels);
+    free(pb->col_sums);
+    free(pb);
+}
+
+// A copy of a packed B on every NUMA node, so the threads of every node read the weights from local memory
+typedef struct packed_b_nodes_t {
+    int num_nodes;
+    packed_b_t *pb[PAGE_MAX_NODES]; // [node]
+} packed_b_nodes_t;
+
+packed_b_nodes_t *pack_b_nodes(const packed_b_t *pb) {
+    packed_b_nodes_t *nodes = (packed_b_nodes_t *)calloc(1, sizeof(packed_b_nodes_t));
+    nodes->num_nodes = numa_num_nodes();
+    const size_t panels_size = (size_t)pb->n_pad * pb->k_pad;
+    for (int node = 0; node < nodes->num_nodes; ++node) {
+        packed_b_t *copy = (packed_b_t *)malloc(sizeof(packed_b_t));
+        *copy = *pb;
+        copy->panels = (int8_t *)page_alloc_node(panels_size, page_kind(pb->panels), node);
+        memcpy(copy->panels, pb->panels, panels_size);
+        copy->col_sums = (int32_t *)aligned_alloc(64, pb->n_pad * sizeof(int32_t));
+        memcpy(copy->col_sums, pb->col_sums, pb->n_pad * sizeof(int32_t));
+        nodes->pb[node] = copy;
+    }
+    return nodes;
+}
+
+void free_packed_b_nodes(packed_b_nodes_t *nodes) {
+    for (int node = 0; node < nodes->num_nodes; ++node) {
+        free_packed_b(nodes->pb[node]);
+    }
+    free(nodes);
+}
+
+// Ragged K: the last K block of A (K % 64 values of each row) is copied into a zero-padded [M][64] buffer,
+// the only part of A whose 64-byte tile rows would run past the rows of A. The other K blocks are loaded from A.
+// Returns NULL when K is a multiple of 64.
+static int8_t *gemm_a_k_tail(const int8_t *a, int m, int k) {
+    const int k_full = k / GEMM_TILE_K * GEMM_TILE_K;
+    if (k == k_full)
+        return NULL;
+
+    int8_t *a_tail = (int8_t *)aligned_alloc(64, (size_t)m * GEMM_TILE_K);
+    memset(a_tail, 0, (size_t)m * GEMM_TILE_K);
+    for (int i = 0; i < m; ++i) {
+        memcpy(&a_tail[(size_t)i * GEMM_TILE_K], &a[(size_t)i * k + k_full], k - k_full);
+    }
+    return a_tail;
+}
+
+// Compute the block of C at (i, j) with AMX: min(M - i, 32) x min(N - j, 32), every element exactly once
+// (the tile config of init_gemm_tile_config_block for this shape must be loaded).
+// The block stays in 4 tiles during the whole K loop, and every loaded A or B tile is used by two dot products
+// (tdpbssd, or tdpbusd / tdpbsud / tdpbuud for uint8 operands, see amx_tile_dpb).
+// a_tail is the last K block of A from gemm_a_k_tail (NULL when K is a multiple of 64).
+// With requantization or dequantization (c->requant, c->dequant) the block is stored into c_edge (in L1)
+// and only the int8 / FP32 result goes to C.
+TARGET_AMX_INT8 void gemm_amx_block(const acc_output_t *c, const int8_t *a, const int8_t *a_tail, const packed_b_t *pb,
+                                    int m, int i, int j, int8_signs_t signs) {
+    const int n = pb->n;
+    const int k = pb->k;
+    const int k_full_blocks = k / GEMM_TILE_K;
+    const bool has_m1 = m - i > GEMM_TILE_M; // TILE_2, TILE_3 and TILE_5 are configured
+    const bool has_n1 = n - j > GEMM_TILE_N; // TILE_1, TILE_3 and TILE_7 are configured
+
+    const int8_t *a0 = &a[(size_t)i * k];
+    const int8_t *a1 = &a[(size_t)(i + GEMM_TILE_M) * k];
+    const int8_t *b0 = &pb->panels[packed_b_panel(pb, j / GEMM_TILE_N, 0)];
+    const int8_t *b1 = &pb->panels[packed_b_panel(pb, j / GEMM_TILE_N + 1, 0)];
+
+    _tile_zero(TILE_0);
+    if (has_n1)
+        _tile_zero(TILE_1);
+    if (has_m1)
+        _tile_zero(TILE_2);
+    if (has_m1 && has_n1)
+        _tile_zero(TILE_3);
+
+    if (has_m1 && has_n1) {
+        for (int kb = 0; kb < k_full_blocks; ++kb) {
+            _tile_loadd(TILE_4, &a0[kb * GEMM_TILE_K], k);
+            _tile_loadd(TILE_5, &a1[kb * GEMM_TILE_K], k);
+            _tile_loadd(TILE_6, &b0[kb * GEMM_TILE_K * GEMM_TILE_N], GEMM_TILE_N * 4);
+            _tile_loadd(TILE_7, &b1[kb * GEMM_TILE_K * GEMM_TILE_N], GEMM_TILE_N * 4);
+
+            amx_tile_dpb(signs, TILE_0, TILE_4, TILE_6);
+            amx_tile_dpb(signs, TILE_1, TILE_4, TILE_7);
+            amx_tile_dpb(signs, TILE_2, TILE_5, TILE_6);
+            amx_tile_dpb(signs, TILE_3, TILE_5, TILE_7);
+        }
+    }
+
+    // Edge blocks, and the last K block of a ragged K (from a_tail)
+    for (int kb = (has_m1 && has_n1) ? k_full_blocks : 0; kb < pb->k_pad / GEMM_TILE_K; ++kb) {
+        const bool tail = kb == k_full_blocks;
+        const int a_stride = tail ? GEMM_TILE_K : k;
+        const int8_t *a0_kb = tail ? &a_tail[(size_t)i * GEMM_TILE_K] : &a0[kb * GEMM_TILE_K];
+
+        _tile_loadd(TILE_4, a0_kb, a_stride);
+        _tile_loadd(TILE_6, &b0[kb * GEMM_TILE_K * GEMM_TILE_N], GEMM_TILE_N * 4);
+        amx_tile_dpb(signs, TILE_0, TILE_4, TILE_6);
+        if (has_n1) {
+            _tile_loadd(TILE_7, &b1[kb * GEMM_TILE_K * GEMM_TILE_N], GEMM_TILE_N * 4);
+            amx_tile_dpb(signs, TILE_1, TILE_4, TILE_7);
+        }
+        if (has_m1) {
+            _tile_loadd(TILE_5, a0_kb + GEMM_TILE_M * a_stride, a_stride);
+            amx_tile_dpb(signs, TILE_2, TILE_5, TILE_6);
+            if (has_n1)
+                amx_tile_dpb(signs, TILE_3, TILE_5, TILE_7);
+        }
+    }
+
+    if (acc_output_is_int32(c)) {
+        // The tile config covers only the valid part of the block, so the tiles go to C as they are
+        int32_t *c0 = (int32_t *)c->data + (size_t)i * n + j;
+        int32_t *c1 = c0 + (size_t)GEMM_TILE_M * n;
+        _tile_stored(TILE_0, c0, n * sizeof(int32_t));
+        if (has_n1)
+            _tile_stored(TILE_1, c0 + GEMM_TILE_N, n * sizeof(int32_t));
+        if (has_m1)
+            _tile_stored(TILE_2, c1, n * sizeof(int32_t));
+        if (has_m1 && has_n1)
+            _tile_stored(TILE_3, c1 + GEMM_TILE_N, n * sizeof(int32_t));
+    } else {
+        // Stored here first, then requantized or dequantized into C
+        int32_t c_edge[GEMM_BLOCK_M][GEMM_BLOCK_N];
+        _tile_stored(TILE_0, &c_edge[0][0], sizeof(c_edge[0]));
+        if (has_n1)
+            _tile_stored(TILE_1, &c_edge[0][GEMM_TILE_N], sizeof(c_edge[0]));
+        if (has_m1)
+            _tile_stored(TILE_2, &c_edge[GEMM_TILE_M][0], sizeof(c_edge[0]));
+        if (has_m1 && has_n1)
+            _tile_stored(TILE_3, &c_edge[GEMM_TILE_M][GEMM_TILE_N], sizeof(c_edge[0]));
+
+        const int rows = (m - i < GEMM_BLOCK_M) ? m - i : GEMM_BLOCK_M;
+        const int cols = (n - j < GEMM_BLOCK_N) ? n - j : GEMM_BLOCK_N;
+        acc_output_store(c, i, j, c_edge[0], GEMM_BLOCK_N, rows, cols);
+    }
+}
+
+// Blocks [i_begin, i_end) x [j_begin, j_end) of C, which all have the shape of the loaded tile config
+TARGET_AMX_INT8 static void gemm_amx_blocks(const acc_output_t *c, const int8_t *a, const int8_t *a_tail,
+                                            const packed_b_t *pb, int m, int i_begin, int i_end, int j_begin,
+                                            int j_end, int8_signs_t signs) {
+    for (int i = i_begin; i < i_end; i += GEMM_BLOCK_M) {
+        for (int j = j_begin; j < j_end; j += GEMM_BLOCK_N) {
+            gemm_amx_block(c, a, a_tail, pb, m, i, j, signs);
+        }
+    }
+}
+
+// The right edge, the bottom edge and the corner of C (past the full 32x32 blocks), each with its own tile config
+TARGET_AMX_INT8 static void gemm_amx_edges(const acc_output_t *c, const int8_t *a, const int8_t *a_tail,
+                                           const packed_b_t *pb, int m, int8_signs_t signs) {
+    const int n = pb->n;
+    const int m_full = m / GEMM_BLOCK_M * GEMM_BLOCK_M;
+    const int n_full = n / GEMM_BLOCK_N * GEMM_BLOCK_N;
+
+    if (n_full < n) {
+        init_gemm_tile_config_block(GEMM_BLOCK_M, n - n_full);
+        gemm_amx_blocks(c, a, a_tail, pb, m, 0, m_full, n_full, n, signs);
+    }
+    if (m_full < m) {
+        init_gemm_tile_config_block(m - m_full, GEMM_BLOCK_N);
+        gemm_amx_blocks(c, a, a_tail, pb, m, m_full, m, 0, n_full, signs);
+    }
+    if (m_full < m && n_full < n) {
+        init_gemm_tile_config_block(m - m_full, n - n_full);
+        gemm_amx_blocks(c, a, a_tail, pb, m, m_full, m, n_full, n, signs);
+    }
+}
+
+// The full 32x32 blocks, then the right edge, the bottom edge and the corner, each with its own tile config
+// (at most 4 tile configs per call)
+TARGET_AMX_INT8 static void gemm_amx_packed_output(const acc_output_t *c, const int8_t *a, const packed_b_t *pb,
+                                                   int m, bool a_unsigned) {
+    const int8_signs_t signs = int8_signs(a_unsigned, pb->b_unsigned);
+    const int n = pb->n;
+    const int m_full = m / GEMM_BLOCK_M * GEMM_BLOCK_M;
+    const int n_full = n / GEMM_BLOCK_N * GEMM_BLOCK_N;
+
+    int8_t *a_tail = gemm_a_k_tail(a, m, pb->k);
+
+    init_gemm_tile_config();
+    gemm_amx_blocks(c, a, a_tail, pb, m, 0, m_full, 0, n_full, signs);
+    gemm_amx_edges(c, a, a_tail, pb, m, signs);
+
+    free(a_tail);
+}
+
+// Multiply A (int8, or uint8 with a_unsigned) and pre-packed B using AMX (any shape)
+void gemm_amx_packed(int32_t *c, const int8_t *a, const packed_b_t *pb, int m, bool a_unsigned) {
+    const acc_output_t out = {.data = c, .ld = (size_t)pb->n};
+    gemm_amx_packed_output(&out, a, pb, m, a_unsigned);
+}
+
+// Same as gemm_amx_packed, but C is int8 / uint8 [M][N], requantized per column (see requant_t)
+void gemm_amx_packed_requant(void *c, const int8_t *a, const packed_b_t *pb, int m, bool a_unsigned,
+                             const requant_t *q) {
+    const acc_output_t out = {.data = c, .ld = (size_t)pb->n, .requant = q};
+    gemm_amx_packed_output(&out, a, pb, m, a_unsigned);
+}
+
+// Multiply A and B using AMX (any shape)
+// B is packed on every call; use pack_b and gemm_amx_packed when B is reused.
+void gemm_amx(int32_t *c, const int8_t *a, const int8_t *b, int m, int n, int k) {
+    packed_b_t *pb = pack_b(b, n, k);
+    gemm_amx_packed(c, a, pb, m, false);
+    free_packed_b(pb);
+}
+
+// Multiply A[16][32] and pre-packed B[32][16] using AMX (same as mul_amx without the re-layout)
+// The first 8 rows of panel (0, 0) are exactly b_transformed of mul_amx.
+TARGET_AMX_INT8 void mul_amx_packed(int32_t c[16][16], int8_t a[16][32], const packed_b_t *pb) {
+    _tile_loadd(TILE_1, a, 32 * sizeof(int8_t));
+    _tile_loadd(TILE_2, pb->panels, (16 * 4) * sizeof(int8_t));
+
+    _tile_zero(TILE_0);
+    _tile_dpbssd(TILE_0, TILE_1, TILE_2);
+    _tile_stored(TILE_0, c, 16 * sizeof(int32_t));
+}
+
+// -----------------------------------------------
+// Kernels for CPUs without AMX
+// They read the same packed B. The panels of a column j are contiguous,
+// so row q (4 values of K) of the 16 columns starting at j is at packed_b_panel(pb, j / 16, 0) + q * 64.
+
+// Multiply A and pre-packed B without SIMD
+void gemm_scalar_packed(int32_t *c, const int8_t *a, const packed_b_t *pb, int m, bool a_unsigned) {
+    const int n = pb->n;
+    const int k = pb->k;
+
+    for (int i = 0; i < m; ++i) {
+        for (int j = 0; j < n; ++j) {
+            const int8_t *col = &pb->panels[packed_b_panel(pb, j / GEMM_TILE_N, 0) + (j % GEMM_TILE_N) * 4];
+            int32_t sum = 0;
+            for (int p = 0; p < k; ++p) {
+                const int8_t y = col[(p / 4) * (GEMM_TILE_N * 4) + p % 4];
+                sum += (a_unsigned ? (uint8_t)a[i * k + p] : a[i * k + p]) * (pb->b_unsigned ? (uint8_t)y : y);
+            }
+            c[i * n + j] = sum;
+        }
+    }
+}
+
+// Load A[p .. p + 4] as one dword; at the end of a row only the valid bytes are read, the rest are zero
+static inline int32_t load_a_quad(const int8_t *p, int avail) {
+    int32_t v = 0;
+    if (avail >= 4) {
+        memcpy(&v, p, 4);
+    } else {
+        memcpy(&v, p, avail);
+    }
+    return v;
+}
+
+static inline __mmask16 store_mask16(int cols) {
+    return cols >= 16 ? 0xffff : cols <= 0 ? 0 : (__mmask16)((1u << cols) - 1);
+}
+
+// Sum of each row of A (int8 or uint8), for gemm_avx512_vnni_packed with uint8 B
+static int32_t *gemm_a_row_sums(const int8_t *a, int m, int k, bool a_unsigned) {
+    int32_t *sums = (int32_t *)malloc(m * sizeof(int32_t));
+    for (int i = 0; i < m; ++i) {
+        int32_t sum = 0;
+        for (int p = 0; p < k; ++p) {
+            sum += a_unsigned ? (uint8_t)a[(size_t)i * k + p] : a[(size_t)i * k + p];
+        }
+        sums[i] = sum;
+    }
+    return sums;
+}
+
+// Multiply A and pre-packed B using AVX-512 VNNI
+// vpdpbusd multiplies unsigned A by signed B, which is the uint8 x int8 case as it is. Otherwise
+// int8 A is biased to a + 128 (a ^ 0x80) and 128 * sum_k B[k][j] (from packed_b_t::col_sums) is subtracted from C;
+// uint8 B is biased to b - 128 (b ^ 0x80) and 128 * sum_k A[i][k] is added to C.
+// With both, the K' = 4 * ceil(K / 4) products of the two biases (zeros of A and B included) add 128 * 128 * K'.
+// One step computes C[4][32] with 8 accumulators; each B row is used 4 times, each A dword twice.
+TARGET_AVX512_VNNI void gemm_avx512_vnni_packed(int32_t *c, const int8_t *a, const packed_b_t *pb, int m,
+                                                bool a_unsigned) {
+    const int n = pb->n;
+    const int k = pb->k;
+    const int k_quads = (k + 3) / 4;
+    const bool a_biased = !a_unsigned;
+    const bool b_biased = pb->b_unsigned;
+    const __m512i a_flip = _mm512_set1_epi8(a_biased ? (char)0x80 : 0);
+    const __m512i b_flip = _mm512_set1_epi8(b_biased ? (char)0x80 : 0);
+    const __m512i both = _mm512_set1_epi32((a_biased && b_biased) ? 128 * 128 * 4 * k_quads : 0);
+    int32_t *row_sums = b_biased ? gemm_a_row_sums(a, m, k, a_unsigned) : NULL;
+
+    for (int j = 0; j < pb->n_pad; j += GEMM_BLOCK_N) {
+        const int8_t *b0 = &pb->panels[packed_b_panel(pb, j / GEMM_TILE_N, 0)];
+        const int8_t *b1 = &pb->panels[packed_b_panel(pb, j / GEMM_TILE_N + 1, 0)];
+        __m512i bias0 = both;
+        __m512i bias1 = both;
+        if (a_biased) {
+            bias0 = _mm512_sub_epi32(bias0, _mm512_slli_epi32(_mm512_load_si512(&pb->col_sums[j]), 7));
+            bias1 = _mm512_sub_epi32(bias1, _mm512_slli_epi32(_mm512_load_si512(&pb->col_sums[j + GEMM_TILE_N]), 7));
+        }
+
+        for (int i = 0; i < m; i += 4) {
+            // Rows past M repeat the last row and are not stored
+            const int8_t *ar[4];
+            for (int r = 0; r < 4; ++r) {
+                ar[r] = &a[(size_t)(i + r < m ? i + r : m - 1) * k];
+            }
+
+            __m512i acc[4][2];
+            for (int r = 0; r < 4; ++r) {
+                const __m512i row_bias = _mm512_set1_epi32(b_biased ? row_sums[i + r < m ? i + r : m - 1] * 128 : 0);
+                acc[r][0] = _mm512_add_epi32(bias0, row_bias);
+                acc[r][1] = _mm512_add_epi32(bias1, row_bias);
+            }
+
+            for (int q = 0; q < k_quads; ++q) {
+                const __m512i vb0 = _mm512_xor_si512(_mm512_load_si512(&b0[q * 64]), b_flip);
+                const __m512i vb1 = _mm512_xor_si512(_mm512_load_si512(&b1[q * 64]), b_flip);
+
+                for (int r = 0; r < 4; ++r) {
+                    const __m512i va =
+                        _mm512_xor_si512(_mm512_set1_epi32(load_a_quad(&ar[r][q * 4], k - q * 4)), a_flip);
+                    acc[r][0] = _mm512_dpbusd_epi32(acc[r][0], va, vb0);
+                    acc[r][1] = _mm512_dpbusd_epi32(acc[r][1], va, vb1);
+                }
+            }
+
+            for (int r = 0; r < 4 && i + r < m; ++r) {
+                int32_t *cr = &c[(size_t)(i + r) * n + j];
+                _mm512_mask_storeu_epi32(cr, store_mask16(n - j), acc[r][0]);
+                _mm512_mask_storeu_epi32(cr + GEMM_TILE_N, store_mask16(n - j - GEMM_TILE_N), acc[r][1]);
+            }
+        }
+    }
+    free(row_sums);
+}
+
+// Multiply A and pre-packed B using AVX2
+// AVX2 has no byte dot product without saturation, so B is widened to int16 and _mm256_madd_epi16 is used
+// (uint8 A and B are zero-extended; a pair of their products is at most 2 * 255 * 255).
+// A panel row (4 values of K for 16 columns) becomes 4 vectors for columns 0-3, 4-7, 8-11 and 12-15,
+// and madd leaves 2 partial sums per column (K pairs 0-1 and 2-3) that are added by hadd at the end.
+TARGET_AVX2 void gemm_avx2_packed(int32_t *c, const int8_t *a, const packed_b_t *pb, int m, bool a_unsigned) {
+    const int n = pb->n;
+    const int k = pb->k;
+    const int k_quads = (k + 3) / 4;
+
+    for (int j = 0; j < n; j += GEMM_TILE_N) {
+        const int8_t *bj = &pb->panels[packed_b_panel(pb, j / GEMM_TILE_N, 0)];
+
+        for (int i = 0; i < m; i += 2) {
+            const int8_t *ar[2];
+            for (int r = 0; r < 2; ++r) {
+                ar[r] = &a[(size_t)(i + r < m ? i + r : m - 1) * k];
+            }
+
+            __m256i acc[2][4];
+            for (int r = 0; r < 2; ++r) {
+                for (int x = 0; x < 4; ++x) {
+                    acc[r][x] = _mm256_setzero_si256();
+                }
+            }
+
+            for (int q = 0; q < k_quads; ++q) {
+                __m256i vb[4];
+                for (int x = 0; x < 4; ++x) {
+                    const __m128i b16 = _mm_load_si128((const __m128i *)&bj[q * 64 + x * 16]);
+                    vb[x] = pb->b_unsigned ? _mm256_cvtepu8_epi16(b16) : _mm256_cvtepi8_epi16(b16);
+                }
+
+                for (int r = 0; r < 2; ++r) {
+                    // 4 values of A as int16, repeated for every column
+                    const __m128i a_quad = _mm_cvtsi32_si128(load_a_quad(&ar[r][q * 4], k - q * 4));
+                    const __m128i a4 = a_unsigned ? _mm_cvtepu8_epi16(a_quad) : _mm_cvtepi8_epi16(a_quad);
+                    const __m256i va = _mm256_broadcastq_epi64(a4);
+                    for (int x = 0; x < 4; ++x) {
+                        acc[r][x] = _mm256_add_epi32(acc[r][x], _mm256_madd_epi16(va, vb[x]));
+                    }
+                }
+            }
+
+            for (int r = 0; r < 2 && i + r < m; ++r) {
+                int32_t row[GEMM_TILE_N];
+                _mm256_storeu_si256((__m256i *)&row[0],
+                                    _mm256_permute4x64_epi64(_mm256_hadd_epi32(acc[r][0], acc[r][1]), 0xd8));
+                _mm256_storeu_si256((__m256i *)&row[8],
+                                    _mm256_permute4x64_epi64(_mm256_hadd_epi32(acc[r][2], acc[r][3]), 0xd8));
+
+                const int cols = (n - j < GEMM_TILE_N) ? n - j : GEMM_TILE_N;
+                memcpy(&c[(size_t)(i + r) * n + j], row, cols * sizeof(int32_t));
+            }
+        }
+    }
+}
+
+// -----------------------------------------------
+// Runtime dispatch
+// gemm_packed, gemm and mul use the fastest kernel the CPU supports (see detect_cpu_features).
+// Every kernel takes A of int8, or of uint8 with a_unsigned; B says its own signedness (packed_b_t::b_unsigned).
+
+typedef void (*gemm_packed_fn_t)(int32_t *c, const int8_t *a, const packed_b_t *pb, int m, bool a_unsigned);
+
+typedef struct gemm_kernel_t {
+    const char *name;
+    gemm_packed_fn_t fn;
+} gemm_kernel_t;
+
+// Supported kernels, the fastest first
+static gemm_kernel_t gemm_kernels[4];
+static int num_gemm_kernels;
+
+void init_dispatch() {
+    num_gemm_kernels = 0;
+    if (cpu_features.amx_int8)
+        gemm_kernels[num_gemm_kernels++] = (gemm_kernel_t){"AMX-INT8", gemm_amx_packed};
+    if (cpu_features.avx512_vnni)
+        gemm_kernels[num_gemm_kernels++] = (gemm_kernel_t){"AVX512-VNNI", gemm_avx512_vnni_packed};
+    if (cpu_features.avx2)
+        gemm_kernels[num_gemm_kernels++] = (gemm_kernel_t){"AVX2", gemm_avx2_packed};
+    gemm_kernels[num_gemm_kernels++] = (gemm_kernel_t){"scalar", gemm_scalar_packed};
+}
+
+void gemm_packed(int32_t *c, const int8_t *a, const packed_b_t *pb, int m) { gemm_kernels[0].fn(c, a, pb, m, false); }
+
+// A of uint8, e.g. activations after ReLU or image pixels (uint8 x int8 is tdpbusd, uint8 x uint8 tdpbuud)
+void gemm_packed_u8(int32_t *c, const uint8_t *a, const packed_b_t *pb, int m) {
+    gemm_kernels[0].fn(c, (const int8_t *)a, pb, m, true);
+}
+
+void gemm(int32_t *c, const int8_t *a, const int8_t *b, int m, int n, int k) {
+    packed_b_t *pb = pack_b(b, n, k);
+    gemm_packed(c, a, pb, m);
+    free_packed_b(pb);
+}
+
+// C as int8 / uint8 [M][N] (see requant_t, the channels are the columns of C)
+// With AMX every 32x32 block is requantized as it leaves the tiles; the other kernels write the int32 C
+// and requantize it in a second pass.
+static void gemm_packed_requant_sign(void *c, const int8_t *a, const packed_b_t *pb, int m, bool a_unsigned,
+                                     const requant_t *q) {
+    if (cpu_features.amx_int8) {
+        gemm_amx_packed_requant(c, a, pb, m, a_unsigned, q);
+        return;
+    }
+
+    int32_t *c32 = (int32_t *)malloc((size_t)m * pb->n * sizeof(int32_t));
+    gemm_kernels[0].fn(c32, a, pb, m, a_unsigned);
+    requant_rows(c, pb->n, c32, pb->n, m, 0, pb->n, q);
+    free(c32);
+}
+
+void gemm_packed_requant(void *c, const int8_t *a, const packed_b_t *pb, int m, const requant_t *q) {
+    gemm_packed_requant_sign(c, a, pb, m, false, q);
+}
+
+void gemm_packed_requant_u8(void *c, const uint8_t *a, const packed_b_t *pb, int m, const requant_t *q) {
+    gemm_packed_requant_sign(c, (const int8_t *)a, pb, m, true, q);
+}
+
+// -----------------------------------------------
+// Dynamic-quantized GEMM: C[M][N] = A[M][K] * B[K][N] of FP32, computed in int8 (see common/quant.h)
+// B has one scale and is quantized and packed once (pack_b_dq). A has a scale per row and is quantized as the
+// GEMM runs, GEMM_BLOCK_M rows at a time into a small buffer, and the int32 accumulators are dequantized to FP32
+// as they leave the tiles. The int8 TMULs do twice the MACs of the BF16 ones, at the precision of int8:
+// every value is off by up to half its scale (1/254 of the largest |value| of its row of A, or of B).
+
+typedef struct packed_b_dq_t {
+    packed_b_t *pb; // B quantized to int8
+    float scale;
+} packed_b_dq_t;
+
+packed_b_dq_t *pack_b_dq(const float *b, int n, int k) {
+    packed_b_dq_t *qb = (packed_b_dq_t *)malloc(sizeof(packed_b_dq_t));
+    const size_t size = (size_t)k * n;
+    int8_t *b8 = (int8_t *)malloc(size);
+
+    qb->scale = quant_scale(quant_absmax(b, size));
+    quant_values(b8, b, size, qb->scale);
+    qb->pb = pack_b(b8, n, k);
+
+    free(b8);
+    return qb;
+}
+
+void free_packed_b_dq(packed_b_dq_t *qb) {
+    free_packed_b(qb->pb);
+    free(qb);
+}
+
+void gemm_dq_packed(float *c, const float *a, const packed_b_dq_t *qb, int m) {
+    const packed_b_t *pb = qb->pb;
+    const int n = pb->n;
+    const int k = pb->k;
+
+    int8_t *a8 = (int8_t *)aligned_alloc(64, ROUND_UP((size_t)GEMM_BLOCK_M * k, 64)); // rows i .. i + 31
+    int32_t *c32 = NULL; // Without AMX, the accumulators of the rows
+    if (!cpu_features.amx_int8)
+        c32 = (int32_t *)malloc((size_t)GEMM_BLOCK_M * n * sizeof(int32_t));
+
+    float row_scale[GEMM_BLOCK_M];
+    const dequant_t dq = {row_scale, qb->scale};
+
+    for (int i = 0; i < m; i += GEMM_BLOCK_M) {
+        const int rows = (m - i < GEMM_BLOCK_M) ? m - i : GEMM_BLOCK_M;
+        quant_rows(a8, k, &a[(size_t)i * k], k, rows, k, row_scale);
+
+        const acc_output_t out = {.data = &c[(size_t)i * n], .ld = (size_t)n, .dequant = &dq};
+        if (cpu_features.amx_int8) {
+            gemm_amx_packed_output(&out, a8, pb, rows, false);
+        } else {
+            gemm_kernels[0].fn(c32, a8, pb, rows, false);
+            acc_output_store(&out, 0, 0, c32, n, rows, n);
+        }
+    }
+
+    free(a8);
+    free(c32);
+}
+
+// B is quantized and packed on every call; use pack_b_dq and gemm_dq_packed when B is reused.
+void gemm_dq(float *c, const float *a, const float *b, int m, int n, int k) {
+    packed_b_dq_t *qb = pack_b_dq(b, n, k);
+    gemm_dq_packed(c, a, qb, m);
+    free_packed_b_dq(qb);
+}
+
+void mul(int32_t c[16][16], int8_t a[16][32], int8_t b[32][16]) {
+    if (cpu_features.amx_int8) {
+        init_tile_config();
+        mul_amx(c, a, b);
+    } else {
+        gemm(&c[0][0], &a[0][0], &b[0][0], 16, 16, 32);
+    }
+}
+
+// -----------------------------------------------
+// Autotuned AMX GEMM
+// gemm_amx_packed computes every 32x32 block of C in one pass over K with 4 C tiles, going along the rows of C.
+// Which blocking is fastest depends on the shape and the caches, so gemm_amx_packed_tuned takes the blocking as
+// a gemm_tuning_t, and gemm_autotune times the candidates for a shape and keeps the fastest in the tuning cache
+// (common/autotune.h). The edges of C are computed as in gemm_amx_packed.
+
+typedef struct gemm_tuning_t {
+    int tiles_m, tiles_n; // C tiles of a sub-block (2x2 is gemm_amx_block; 1x2 and 2x1 load fewer tiles at once)
+    int n_outer;          // 1: go down the columns of C (a column of B panels stays in cache, A streams)
+    int k_blocks;         // K is done in panels of k_blocks * 64 for every block, C is reloaded between them
+                          // (0: all of K at once, C stays in the tiles)
+    int prefetch;         // prefetch A and B this many K blocks ahead (0: none)
+} gemm_tuning_t;
+
+#define GEMM_TUNING_PARAMS 5
+
+static const gemm_tuning_t gemm_tuning_default = {2, 2, 0, 0, 0}; // gemm_amx_packed
+
+// Prefetch the K block kb of rows i .. i + rows - 1 of A, and of B panel columns j / 16 .. + cols / 16
+static inline void gemm_prefetch(const int8_t *a, const packed_b_t *pb, int i, int rows, int j, int cols, int kb) {
+    for (int r = 0; r < rows; ++r) {
+        _mm_prefetch((const char *)&a[(size_t)(i + r) * pb->k + kb * GEMM_TILE_K], _MM_HINT_T0);
+    }
+    for (int jj = j; jj < j + cols; jj += GEMM_TILE_N) {
+        const int8_t *panel = &pb->panels[packed_b_panel(pb, jj / GEMM_TILE_N, kb)];
+        for (int line = 0; line < GEMM_TILE_K * GEMM_TILE_N; line += 64) {
+            _mm_prefetch((const char *)&panel[line], _MM_HINT_T0);
+        }
+    }
+}
+
+// Sub-block (i, j) of t->tiles_m x t->tiles_n tiles of an int32 C, K blocks kb_begin .. kb_end - 1.
+// The C tiles start from zero at kb_begin == 0 and are loaded from C otherwise; the tile config is the full one
+// of init_gemm_tile_config (TILE_0 | TILE_1 over TILE_2 | TILE_3, A in TILE_4 / TILE_5, B in TILE_6 / TILE_7).
+TARGET_AMX_INT8 static inline void gemm_amx_tuned_sub(int32_t *c, const int8_t *a, const int8_t *a_tail,
+                                                      const packed_b_t *pb, int i, int j, int kb_begin, int kb_end,
+                                                      const gemm_tuning_t *t, int8_signs_t signs) {
+    const int n = pb->n;
+    const int k = pb->k;
+    const int k_full_blocks = k / GEMM_TILE_K;
+    const bool m2 = t->tiles_m == 2;
+    const bool n2 = t->tiles_n == 2;
+    const long c_stride = n * sizeof(int32_t);
+
+    int32_t *c0 = &c[(size_t)i * n + j];
+    int32_t *c1 = c0 + (size_t)GEMM_TILE_M * n;
+    const int8_t *b0 = &pb->panels[packed_b_panel(pb, j / GEMM_TILE_N, 0)];
+    const int8_t *b1 = &pb->panels[packed_b_panel(pb, j / GEMM_TILE_N + 1, 0)];
+
+    if (kb_begin == 0) {
+        _tile_zero(TILE_0);
+        if (n2)
+            _tile_zero(TILE_1);
+        if (m2)
+            _tile_zero(TILE_2);
+        if (m2 && n2)
+            _tile_zero(TILE_3);
+    } else {
+        _tile_loadd(TILE_0, c0, c_stride);
+        if (n2)
+            _tile_loadd(TILE_1, c0 + GEMM_TILE_N, c_stride);
+        if (m2)
+            _tile_loadd(TILE_2, c1, c_stride);
+        if (m2 && n2)
+            _tile_loadd(TILE_3, c1 + GEMM_TILE_N, c_stride);
+    }
+
+    for (int kb = kb_begin; kb < kb_end; ++kb) {
+        const bool tail = kb == k_full_blocks;
+        const long a_stride = tail ? GEMM_TILE_K : k;
+        const int8_t *a0 = tail ? &a_tail[(size_t)i * GEMM_TILE_K] : &a[(size_t)i * k + kb * GEMM_TILE_K];
+        const size_t b_offset = (size_t)kb * GEMM_TILE_K * GEMM_TILE_N;
+
+        if (t->prefetch > 0 && kb + t->prefetch < k_full_blocks)
+            gemm_prefetch(a, pb, i, t->tiles_m * GEMM_TILE_M, j, t->tiles_n * GEMM_TILE_N, kb + t->prefetch);
+
+        if (m2 && n2) {
+            _tile_loadd(TILE_4, a0, a_stride);
+            _tile_loadd(TILE_5, a0 + GEMM_TILE_M * a_stride, a_stride);
+            _tile_loadd(TILE_6, &b0[b_offset], GEMM_TILE_N * 4);
+            _tile_loadd(TILE_7, &b1[b_offset], GEMM_TILE_N * 4);
+
+            amx_tile_dpb(signs, TILE_0, TILE_4, TILE_6);
+            amx_tile_dpb(signs, TILE_1, TILE_4, TILE_7);
+            amx_tile_dpb(signs, TILE_2, TILE_5, TILE_6);
+            amx_tile_dpb(signs, TILE_3, TILE_5, TILE_7);
+        } else if (n2) {
+            _tile_loadd(TILE_4, a0, a_stride);
+            _tile_loadd(TILE_6, &b0[b_offset], GEMM_TILE_N * 4);
+            _tile_loadd(TILE_7, &b1[b_offset], GEMM_TILE_N * 4);
+
+            amx_tile_dpb(signs, TILE_0, TILE_4, TILE_6);
+            amx_tile_dpb(signs, TILE_1, TILE_4, TILE_7);
+        } else if (m2) {
+            _tile_loadd(TILE_4, a0, a_stride);
+            _tile_loadd(TILE_5, a0 + GEMM_TILE_M * a_stride, a_stride);
+            _tile_loadd(TILE_6, &b0[b_offset], GEMM_TILE_N * 4);
+
+            amx_tile_dpb(signs, TILE_0, TILE_4, TILE_6);
+            amx_tile_dpb(signs, TILE_2, TILE_5, TILE_6);
+        } else {
+            _tile_loadd(TILE_4, a0, a_stride);
+            _tile_loadd(TILE_6, &b0[b_offset], GEMM_TILE_N * 4);
+
+            amx_tile_dpb(signs, TILE_0, TILE_4, TILE_6);
+        }
+    }
+
+    _tile_stored(TILE_0, c0, c_stride);
+    if (n2)
+        _tile_stored(TILE_1, c0 + GEMM_TILE_N, c_stride);
+    if (m2)
+        _tile_stored(TILE_2, c1, c_stride);
+    if (m2 && n2)
+        _tile_stored(TILE_3, c1 + GEMM_TILE_N, c_stride);
+}
+
+// Same as gemm_amx_packed (int32 C) with the blocking of t for the full 32x32 blocks
+TARGET_AMX_INT8 void gemm_amx_packed_tuned(int32_t *c, const int8_t *a, const packed_b_t *pb, int m, bool a_unsigned,
+                                           const gemm_tuning_t *t) {
+    const int8_signs_t signs = int8_signs(a_unsigned, pb->b_unsigned);
+    const int m_full = m / GEMM_BLOCK_M * GEMM_BLOCK_M;
+    const int n_full = pb->n / GEMM_BLOCK_N * GEMM_BLOCK_N;
+    const int k_blocks = pb->k_pad / GEMM_TILE_K;
+    const int k_step = (t->k_blocks > 0 && t->k_blocks < k_blocks) ? t->k_blocks : k_blocks;
+    const int sub_m = t->tiles_m * GEMM_TILE_M;
+    const int sub_n = t->tiles_n * GEMM_TILE_N;
+
+    int8_t *a_tail = gemm_a_k_tail(a, m, pb->k);
+
+    init_gemm_tile_config();
+    for (int kb = 0; kb < k_blocks; kb += k_step) {
+        const int kb_end = (kb + k_step < k_blocks) ? kb + k_step : k_blocks;
+        if (t->n_outer) {
+            for (int j = 0; j < n_full; j += sub_n) {
+                for (int i = 0; i < m_full; i += sub_m) {
+                    gemm_amx_tuned_sub(c, a, a_tail, pb, i, j, kb, kb_end, t, signs);
+                }
+            }
+        } else {
+            for (int i = 0; i < m_full; i += sub_m) {
+                for (int j = 0; j < n_full; j += sub_n) {
+                    gemm_amx_tuned_sub(c, a, a_tail, pb, i, j, kb, kb_end, t, signs);
+                }
+            }
+        }
+    }
+
+    const acc_output_t out = {.data = c, .ld = (size_t)pb->n};
+    gemm_amx_edges(&out, a, a_tail, pb, m, signs);
+    free(a_tail);
+}
+
+typedef struct gemm_tune_args_t {
+    int32_t *c;
+    const int8_t *a;
+    const packed_b_t *pb;
+    int m;
+    gemm_tuning_t tuning;
+} gemm_tune_args_t;
+
+static void gemm_tune_run(void *arg) {
+    gemm_tune_args_t *args = (gemm_tune_args_t *)arg;
+    gemm_amx_packed_tuned(args->c, args->a, args->pb, args->m, false, &args->tuning);
+}
+
+// The blocking for C[m][pb->n] = A * B (int8 A) on this CPU: from the cache, or tuned on a (with c as the output)
+// and added to it. *cached tells which. Without AMX it is gemm_tuning_default (the other kernels have no blocking
+// choices).
+gemm_tuning_t gemm_autotune(autotune_cache_t *cache, int32_t *c, const int8_t *a, const packed_b_t *pb, int m,
+                            bool *cached) {
+    char key[AUTOTUNE_MAX_KEY];
+    snprintf(key, sizeof(key), "int8_gemm m%d n%d k%d", m, pb->n, pb->k);
+
+    gemm_tuning_t best = gemm_tuning_default;
+    *cached = false;
+    if (!cpu_features.amx_int8)
+        return best;
+    int v[GEMM_TUNING_PARAMS];
+    if (autotune_cache_lookup(cache, key, v, GEMM_TUNING_PARAMS)) {
+        *cached = true;
+        return (gemm_tuning_t){.tiles_m = v[0], .tiles_n = v[1], .n_outer = v[2], .k_blocks = v[3], .prefetch = v[4]};
+    }
+
+    static const int shapes[][2] = {{2, 2}, {1, 2}, {2, 1}};
+    static const int k_blocks[] = {0, 4, 16};
+    static const int prefetch[] = {0, 2};
+
+    double best_ms = 1e30;
+    gemm_tune_args_t args = {c, a, pb, m, gemm_tuning_default};
+    for (int x = 0; x < 3; ++x) {
+        for (int n_outer = 0; n_outer < 2; ++n_outer) {
+            for (int y = 0; y < 3; ++y) {
+                // A panel as deep as K is the same as no panels
+                if (k_blocks[y] > 0 && k_blocks[y] >= pb->k_pad / GEMM_TILE_K)
+                    continue;
+                for (int z = 0; z < 2; ++z) {
+                    args.tuning = (gemm_tuning_t){shapes[x][0], shapes[x][1], n_outer, k_blocks[y], prefetch[z]};
+                    const double ms = autotune_measure(gemm_tune_run, &args);
+                    if (ms < best_ms) {
+                        best_ms = ms;
+                        best = args.tuning;
+                    }
+                }
+            }
+        }
+    }
+
+    const int values[GEMM_TUNING_PARAMS] = {best.tiles_m, best.tiles_n, best.n_outer, best.k_blocks, best.prefetch};
+    autotune_cache_store(cache, key, values, GEMM_TUNING_PARAMS, best_ms);
+    return best;
+}
+
+// -----------------------------------------------
+// Batched mul
+// Many independent 16x32 * 32x16 problems (e.g. per-head attention blocks, small MLPs) in one call.
+// The tile config is loaded once for the batch, and two sets of tiles alternate:
+// problem x uses (TILE_0, TILE_1, TILE_2) or (TILE_3, TILE_4, TILE_5) by its parity, so the B re-layout
+// and the tile loads of problem x + 1 are issued before the _tile_dpbssd of problem x and overlap it.
+
+// Problem x is c[x], a[x] and b[x] (arrays of pointers), or, when they are NULL,
+// c_base + x * c_stride, a_base + x * a_stride and b_base + x * b_stride (strides in elements)
+typedef struct mul_batch_t {
+    int32_t *const *c;
+    const int8_t *const *a;
+    const int8_t *const *b;
+    int32_t *c_base;
+    const int8_t *a_base;
+    const int8_t *b_base;
+    size_t c_stride, a_stride, b_stride;
+    int count;
+} mul_batch_t;
+
+static inline int32_t *mul_batch_c(const mul_batch_t *batch, int x) {
+    return batch->c != NULL ? batch->c[x] : batch->c_base + x * batch->c_stride;
+}
+
+static inline const int8_t *mul_batch_a(const mul_batch_t *batch, int x) {
+    return batch->a != NULL ? batch->a[x] : batch->a_base + x * batch->a_stride;
+}
+
+static inline const int8_t *mul_batch_b(const mul_batch_t *batch, int x) {
+    return batch->b != NULL ? batch->b[x] : batch->b_base + x * batch->b_stride;
+}
+
+// b_transformed of mul_amx with SSE2 (16 columns are below the chunks of the wider kernels of common/vnni_pack.h):
+// 4 rows of 16 bytes become 64 bytes of (r0, r1, r2, r3) per column
+static inline void transform_b(int8_t b_transformed[8][64], const int8_t *b) {
+    for (int q = 0; q < 8; ++q) {
+        const __m128i r0 = _mm_loadu_si128((const __m128i *)&b[(q * 4 + 0) * 16]);
+        const __m128i r1 = _mm_loadu_si128((const __m128i *)&b[(q * 4 + 1) * 16]);
+        const __m128i r2 = _mm_loadu_si128((const __m128i *)&b[(q * 4 + 2) * 16]);
+        const __m128i r3 = _mm_loadu_si128((const __m128i *)&b[(q * 4 + 3) * 16]);
+        const __m128i r01_lo = _mm_unpacklo_epi8(r0, r1);
+        const __m128i r01_hi = _mm_unpackhi_epi8(r0, r1);
+        const __m128i r23_lo = _mm_unpacklo_epi8(r2, r3);
+        const __m128i r23_hi = _mm_unpackhi_epi8(r2, r3);
+
+        _mm_storeu_si128((__m128i *)&b_transformed[q][0], _mm_unpacklo_epi16(r01_lo, r23_lo));
+        _mm_storeu_si128((__m128i *)&b_transformed[q][16], _mm_unpackhi_epi16(r01_lo, r23_lo));
+        _mm_storeu_si128((__m128i *)&b_transformed[q][32], _mm_unpacklo_epi16(r01_hi, r23_hi));
+        _mm_storeu_si128((__m128i *)&b_transformed[q][48], _mm_unpackhi_epi16(r01_hi, r23_hi));
+    }
+}
+
+// Tile config of the batch: mul_amx's C, A and B tiles twice
+TARGET_AMX_INT8 void init_batch_tile_config() {
+    tile_config_t tile = {0};
+    tile.palette_id = 1;
+
+    for (int set = 0; set < 2; ++set) {
+        tile.colsb[TILE_0 + set * 3] = 16 * sizeof(int32_t); // c[16][16]
+        tile.rows[TILE_0 + set * 3] = 16;
+        tile.colsb[TILE_1 + set * 3] = 32 * sizeof(int8_t); // a[16][32]
+        tile.rows[TILE_1 + set * 3] = 16;
+        tile.colsb[TILE_2 + set * 3] = (16 * 4) * sizeof(int8_t); // b[32][16] as [8][64]
+        tile.rows[TILE_2 + set * 3] = 32 / 4;
+    }
+
+    _tile_loadconfig(&tile);
+}
+
+TARGET_AMX_INT8 void mul_amx_batch_run(const mul_batch_t *batch) {
+    const int count = batch->count;
+    int8_t b_transformed[2][8][64] __attribute__((aligned(64)));
+    if (count <= 0)
+        return;
+
+    init_batch_tile_config();
+
+    transform_b(b_transformed[0], mul_batch_b(batch, 0));
+    _tile_loadd(TILE_1, mul_batch_a(batch, 0), 32 * sizeof(int8_t));
+    _tile_loadd(TILE_2, b_transformed[0], (16 * 4) * sizeof(int8_t));
+    _tile_zero(TILE_0);
+
+    for (int x = 0; x < count; x += 2) {
+        // Problem x is in the first set; load x + 1 into the second one
+        if (x + 1 < count) {
+            transform_b(b_transformed[1], mul_batch_b(batch, x + 1));
+            _tile_loadd(TILE_4, mul_batch_a(batch, x + 1), 32 * sizeof(int8_t));
+            _tile_loadd(TILE_5, b_transformed[1], (16 * 4) * sizeof(int8_t));
+            _tile_zero(TILE_3);
+        }
+        _tile_dpbssd(TILE_0, TILE_1, TILE_2);
+        _tile_stored(TILE_0, mul_batch_c(batch, x), 16 * sizeof(int32_t));
+
+        if (x + 1 >= count)
+            break;
+
+        // Problem x + 1 is in the second set; load x + 2 into the first one
+        if (x + 2 < count) {
+            transform_b(b_transformed[0], mul_batch_b(batch, x + 2));
+            _tile_loadd(TILE_1, mul_batch_a(batch, x + 2), 32 * sizeof(int8_t));
+            _tile_loadd(TILE_2, b_transformed[0], (16 * 4) * sizeof(int8_t));
+            _tile_zero(TILE_0);
+        }
+        _tile_dpbssd(TILE_3, TILE_4, TILE_5);
+        _tile_stored(TILE_3, mul_batch_c(batch, x + 1), 16 * sizeof(int32_t));
+    }
+}
+
+// Without AMX, mul one by one
+static void mul_batch_run(const mul_batch_t *batch) {
+    if (cpu_features.amx_int8) {
+        mul_amx_batch_run(batch);
+        return;
+    }
+    for (int x = 0; x < batch->count; ++x) {
+        gemm(mul_batch_c(batch, x), mul_batch_a(batch, x), mul_batch_b(batch, x), 16, 16, 32);
+    }
+}
+
+// count problems c[x][16][16] = a[x][16][32] * b[x][32][16], given as arrays of pointers
+void mul_batch(int32_t *const c[], const int8_t *const a[], const int8_t *const b[], int count) {
+    const mul_batch_t batch = {c, a, b, NULL, NULL, NULL, 0, 0, 0, count};
+    mul_batch_run(&batch);
+}
+
+// Same, problem x at c + x * c_stride, a + x * a_stride and b + x * b_stride (in elements)
+void mul_batch_strided(int32_t *c, size_t c_stride, const int8_t *a, size_t a_stride, const int8_t *b,
+                       size_t b_stride, int count) {
+    const mul_batch_t batch = {NULL, NULL, NULL, c, a, b, c_stride, a_stride, b_stride, count};
+    mul_batch_run(&batch);
+}
+
+// -----------------------------------------------
+// Multi-threaded GEMM
+// AMX: every 32x32 block of C is a task. The tile config is per thread, so every thread loads it
+// before its first block (parallel_job_t::begin), and the pool releases the tiles when a worker ends.
+// A block at the edge of C loads its reduced tile config and restores the full one afterwards.
+// Other kernels: every GEMM_BLOCK_M rows of C are a task for the single-threaded kernel.
+// gemm_packed_mt_nodes takes a copy of B per NUMA node (pack_b_nodes), and every task reads the one of its node.
+
+typedef struct gemm_job_args_t {
+    int32_t *c;
+    const int8_t *a;
+    const int8_t *a_tail; // gemm_a_k_tail (AMX)
+    const packed_b_t *pb;
+    const packed_b_nodes_t *nodes; // a copy of pb per NUMA node, or NULL
+    int m;
+    int n_blocks; // blocks of C in a row (AMX)
+} gemm_job_args_t;
+
+// Node of the thread, set in gemm_nodes_begin (once per job, not per task)
+static __thread int gemm_thread_node;
+
+// pb, or its copy on the node of the calling thread
+static inline const packed_b_t *gemm_job_pb(const gemm_job_args_t *args) {
+    if (args->nodes == NULL)
+        return args->pb;
+    return args->nodes->pb[gemm_thread_node < args->nodes->num_nodes ? gemm_thread_node : 0];
+}
+
+static void gemm_nodes_begin(void *arg) {
+    (void)arg;
+    gemm_thread_node = numa_current_node();
+}
+
+static void gemm_amx_begin(void *arg) {
+    const gemm_job_args_t *args = (const gemm_job_args_t *)arg;
+    if (args->nodes != NULL)
+        gemm_nodes_begin(arg);
+    init_gemm_tile_config();
+}
+
+static void gemm_amx_task(void *arg, int task) {
+    const gemm_job_args_t *args = (const gemm_job_args_t *)arg;
+    const packed_b_t *pb = gemm_job_pb(args);
+    const int i = task / args->n_blocks * GEMM_BLOCK_M;
+    const int j = task % args->n_blocks * GEMM_BLOCK_N;
+    const int rows = (args->m - i < GEMM_BLOCK_M) ? args->m - i : GEMM_BLOCK_M;
+    const int cols = (pb->n - j < GEMM_BLOCK_N) ? pb->n - j : GEMM_BLOCK_N;
+    const bool edge = rows < GEMM_BLOCK_M || cols < GEMM_BLOCK_N;
+    const acc_output_t out = {.data = args->c, .ld = (size_t)pb->n};
+
+    if (edge)
+        init_gemm_tile_config_block(rows, cols);
+    gemm_amx_block(&out, args->a, args->a_tail, pb, args->m, i, j, int8_signs(false, pb->b_unsigned));
+    if (edge)
+        init_gemm_tile_config();
+}
+
+static void gemm_strip_task(void *arg, int task) {
+    const gemm_job_args_t *args = (const gemm_job_args_t *)arg;
+    const packed_b_t *pb = gemm_job_pb(args);
+    const int i = task * GEMM_BLOCK_M;
+    const int rows = (args->m - i < GEMM_BLOCK_M) ? args->m - i : GEMM_BLOCK_M;
+    gemm_kernels[0].fn(&args->c[(size_t)i * pb->n], &args->a[(size_t)i * pb->k], pb, rows, false);
+}
+
+static void gemm_packed_mt_run(thread_pool_t *pool, int32_t *c, const int8_t *a, const packed_b_t *pb,
+                               const packed_b_nodes_t *nodes, int m) {
+    const int m_pad = ROUND_UP(m, GEMM_BLOCK_M);
+    const bool ragged = m != m_pad || pb->n != pb->n_pad;
+
+    gemm_job_args_t args = {c, a, NULL, pb, nodes, m, pb->n_pad / GEMM_BLOCK_N};
+    parallel_job_t job = {nodes != NULL ? gemm_nodes_begin : NULL, gemm_strip_task, &args, m_pad / GEMM_BLOCK_M,
+                          SCHEDULE_STATIC};
+
+    int8_t *a_tail = NULL;
+    if (cpu_features.amx_int8) {
+        a_tail = gemm_a_k_tail(a, m, pb->k);
+        args.a_tail = a_tail;
+        job.begin = gemm_amx_begin;
+        job.task = gemm_amx_task;
+        job.num_tasks = (m_pad / GEMM_BLOCK_M) * args.n_blocks;
+    }
+
+    if (ragged || job.num_tasks % pool->num_threads != 0)
+        job.schedule = SCHEDULE_DYNAMIC;
+
+    thread_pool_run(pool, &job);
+    free(a_tail);
+}
+
+// Same as gemm_packed on all threads of the pool
+// The tasks are split statically when every thread gets the same number of full blocks;
+// ragged shapes take the tasks one by one from a shared counter.
+void gemm_packed_mt(thread_pool_t *pool, int32_t *c, const int8_t *a, const packed_b_t *pb, int m) {
+    gemm_packed_mt_run(pool, c, a, pb, NULL, m);
+}
+
+// Same as gemm_packed_mt with B from pack_b_nodes: every thread reads the copy on its own node
+void gemm_packed_mt_nodes(thread_pool_t *pool, int32_t *c, const int8_t *a, const packed_b_nodes_t *nodes, int m) {
+    gemm_packed_mt_run(pool, c, a, nodes->pb[0], nodes, m);
+}
+
 // -----------------------------------------------
 
-int main() {
-#if defined(__linux__)
-    if (syscall(SYS_arch_prctl, ARCH_REQ_XCOMP_PERM, XFEATURE_XTILEDATA)) {
-        printf("\n Fail to do XFEATURE_XTILEDATA \n\n");
-        fflush(stdout);
-        return 1;
+static const char *const int8_signs_names[] = {"int8 x int8", "int8 x uint8", "uint8 x int8", "uint8 x uint8"};
+
+// Compare every supported kernel with gemm_naive on a shape and print the speed
+// (the same bytes of A and B are read as int8 or uint8 by signs)
+void run_gemm(int m, int n, int k, int8_signs_t signs) {
+    int8_t *a = (int8_t *)malloc((size_t)m * k);
+    int8_t *b = (int8_t *)malloc((size_t)k * n);
+    int32_t *c_naive = (int32_t *)malloc((size_t)m * n * sizeof(int32_t));
+    int32_t *c_kernel = (int32_t *)malloc((size_t)m * n * sizeof(int32_t));
+
+    for (int i = 0; i < m * k; ++i) {
+        a[i] = (int8_t)(i * 7 + 3); // The value you like
     }
+    for (int i = 0; i < k * n; ++i) {
+        b[i] = (int8_t)(i * 5 - 1); // The value you like
+    }
+
+    const double ops = 2.0 * m * n * k;
+
+    double t0 = now_sec();
+    gemm_naive_signs(c_naive, a, b, m, n, k, signs);
+    double t1 = now_sec();
+
+    // B packed once, e.g. inference weights
+    packed_b_t *pb = pack_b_sign(b, n, k, int8_signs_b_unsigned(signs));
+    double t2 = now_sec();
+
+    printf("M=%d N=%d K=%d (%s): naive %.3f ms (%.2f GOPS), pack_b %.3f ms\n", m, n, k, int8_signs_names[signs],
+           (t1 - t0) * 1e3, ops / (t1 - t0) * 1e-9, (t2 - t1) * 1e3);
+
+    for (int x = 0; x < num_gemm_kernels; ++x) {
+        memset(c_kernel, 0, (size_t)m * n * sizeof(int32_t));
+#if defined(AMX_EMULATE)
+        amx_emu_reset_counters();
 #endif
+        double t3 = now_sec();
+        gemm_kernels[x].fn(c_kernel, a, pb, m, int8_signs_a_unsigned(signs));
+        double t4 = now_sec();
+
+        printf("    %-12s %9.3f ms (%7.2f GOPS)\n", gemm_kernels[x].name, (t4 - t3) * 1e3, ops / (t4 - t3) * 1e-9);
+        char name[96];
+        snprintf(name, sizeof(name), "%s %dx%dx%d %s", gemm_kernels[x].name, m, n, k, int8_signs_names[signs]);
+        verify_i32(name, c_kernel, c_naive, verify_dims2(m, n));
+#if defined(AMX_EMULATE)
+        if (amx_emu_counters.tmuls > 0)
+            amx_emu_print_counters("(tile instructions)");
+#endif
+    }
+
+    free_packed_b(pb);
+    free(a);
+    free(b);
+    free(c_naive);
+    free(c_kernel);
+}
+
+// Run gemm_packed_mt from 1 thread to all cores of a socket and print the speedup
+void run_gemm_scaling(int m, int n, int k) {
+    int8_t *a = (int8_t *)malloc((size_t)m * k);
+    int8_t *b = (int8_t *)malloc((size_t)k * n);
+    int32_t *c_ref = (int32_t *)malloc((size_t)m * n * sizeof(int32_t));
+    int32_t *c_mt = (int32_t *)malloc((size_t)m * n * sizeof(int32_t));
+
+    for (int i = 0; i < m * k; ++i) {
+        a[i] = (int8_t)(i * 7 + 3); // The value you like
+    }
+    for (int i = 0; i < k * n; ++i) {
+        b[i] = (int8_t)(i * 5 - 1); // The value you like
+    }
+
+    packed_b_t *pb = pack_b(b, n, k);
+    gemm_packed(c_ref, a, pb, m);
+
+    int cpus[CPU_SETSIZE];
+    const int num_cores = socket_core_cpus(cpus, CPU_SETSIZE);
+    const double ops = 2.0 * m * n * k;
+    double time_1 = 0;
+
+    printf("M=%d N=%d K=%d (%s, %d cores in the socket)\n", m, n, k, gemm_kernels[0].name, num_cores);
+
+    for (int threads = 1;; threads = (threads * 2 < num_cores) ? threads * 2 : num_cores) {
+        thread_pool_t *pool = thread_pool_create(threads, cpu_features.amx_tile ? amx_release : NULL);
+
+        // The first run warms up the threads and the caches, then the fastest of 3 runs is kept
+        memset(c_mt, 0, (size_t)m * n * sizeof(int32_t));
+        gemm_packed_mt(pool, c_mt, a, pb, m);
+        double best = 1e30;
+        for (int x = 0; x < 3; ++x) {
+            const double t0 = now_sec();
+            gemm_packed_mt(pool, c_mt, a, pb, m);
+            const double t1 = now_sec();
+            best = (t1 - t0 < best) ? t1 - t0 : best;
+        }
+        thread_pool_destroy(pool);
+
+        if (threads == 1)
+            time_1 = best;
+        printf("    threads %3d %9.3f ms (%7.2f GOPS), speedup %5.2fx\n", threads, best * 1e3, ops / best * 1e-9,
+               time_1 / best);
+        char name[64];
+        snprintf(name, sizeof(name), "gemm_packed_mt %d threads", threads);
+        verify_i32(name, c_mt, c_ref, verify_dims2(m, n));
+
+        if (threads == num_cores)
+            break;
+    }
+
+    free_packed_b(pb);
+    free(a);
+    free(b);
+    free(c_ref);
+    free(c_mt);
+}
+
+// Run gemm_packed_mt on all cores of a socket with A, B and C on each kind of pages (A and C first touched by the
+// threads that work on them), then with a copy of B per NUMA node, and print the time and the bytes on huge pages
+void run_gemm_pages(int m, int n, int k) {
+    int8_t *b = (int8_t *)malloc((size_t)k * n);
+    int32_t *c_ref = (int32_t *)malloc((size_t)m * n * sizeof(int32_t));
+    for (int i = 0; i < k * n; ++i) {
+        b[i] = (int8_t)(i * 5 - 1); // The value you like
+    }
+
+    int cpus[CPU_SETSIZE];
+    const int num_cores = socket_core_cpus(cpus, CPU_SETSIZE);
+    thread_pool_t *pool = thread_pool_create(num_cores, cpu_features.amx_tile ? amx_release : NULL);
+    const double ops = 2.0 * m * n * k;
+    const size_t a_size = (size_t)m * k;
+    const size_t c_size = (size_t)m * n * sizeof(int32_t);
+
+    printf("M=%d N=%d K=%d (%s, %d threads, %d NUMA nodes)\n", m, n, k, gemm_kernels[0].name, num_cores,
+           numa_num_nodes());
+
+    for (int kind = PAGES_SMALL; kind <= PAGES_HUGETLB + 1; ++kind) {
+        // The last round is B per node on the default pages
+        const bool per_node = kind > PAGES_HUGETLB;
+        const page_kind_t pages = per_node ? page_default_kind() : (page_kind_t)kind;
+
+        int8_t *a = (int8_t *)page_alloc(a_size, pages);
+        int32_t *c = (int32_t *)page_alloc(c_size, pages);
+        page_first_touch(pool, a, a_size);
+        page_first_touch(pool, c, c_size);
+        for (size_t i = 0; i < a_size; ++i) {
+            a[i] = (int8_t)(i * 7 + 3); // The value you like
+        }
+        packed_b_t *pb = pack_b_pages(b, n, k, false, pages);
+        packed_b_nodes_t *nodes = per_node ? pack_b_nodes(pb) : NULL;
+        if (kind == PAGES_SMALL)
+            gemm_packed(c_ref, a, pb, m);
+
+        // The first run warms up the threads and the caches, then the fastest of 3 runs is kept
+        double best = 1e30;
+        for (int x = 0; x < 4; ++x) {
+            const double t0 = now_sec();
+            if (per_node)
+                gemm_packed_mt_nodes(pool, c, a, nodes, m);
+            else
+                gemm_packed_mt(pool, c, a, pb, m);
+            const double t1 = now_sec();
+            best = (x > 0 && t1 - t0 < best) ? t1 - t0 : best;
+        }
+
+        // e.g. "hugetlb -> thp" when there are no hugetlbfs pages
+        const bool fallback = page_kind(pb->panels) != pages;
+        char name[64];
+        snprintf(name, sizeof(name), "%s%s%s%s", per_node ? "B per node, " : "", page_kind_names[pages],
+                 fallback ? " -> " : "", fallback ? page_kind_names[page_kind(pb->panels)] : "");
+        const int8_t *panels = per_node ? nodes->pb[0]->panels : pb->panels;
+        const size_t total = a_size + c_size + (size_t)pb->n_pad * pb->k_pad;
+        const size_t huge = page_huge_bytes(a) + page_huge_bytes(c) + page_huge_bytes(panels);
+        printf("    %-26s %9.3f ms (%7.2f GOPS), %6zu of %6zu KB on huge pages\n", name, best * 1e3, ops / best * 1e-9,
+               huge / 1024, total / 1024);
+        char check[96];
+        snprintf(check, sizeof(check), "gemm_packed_mt %s", name);
+        verify_i32(check, c, c_ref, verify_dims2(m, n));
+
+        if (nodes != NULL)
+            free_packed_b_nodes(nodes);
+        free_packed_b(pb);
+        page_free(a);
+        page_free(c);
+    }
+
+    thread_pool_destroy(pool);
+    free(b);
+    free(c_ref);
+}
+
+// Tune the AMX GEMM for m x n x k (or take the blocking from the cache), then compare it with gemm_amx_packed
+void run_gemm_autotune(autotune_cache_t *cache, int m, int n, int k) {
+    int8_t *a = (int8_t *)malloc((size_t)m * k);
+    int8_t *b = (int8_t *)malloc((size_t)k * n);
+    int32_t *c_ref = (int32_t *)malloc((size_t)m * n * sizeof(int32_t));
+    int32_t *c = (int32_t *)malloc((size_t)m * n * sizeof(int32_t));
+
+    for (int i = 0; i < m * k; ++i) {
+        a[i] = (int8_t)(i * 7 + 3); // The value you like
+    }
+    for (int i = 0; i < k * n; ++i) {
+        b[i] = (int8_t)(i * 5 - 1); // The value you like
+    }
+
+    packed_b_t *pb = pack_b(b, n, k);
+    gemm_packed(c_ref, a, pb, m);
+
+    bool cached;
+    const double t0 = now_sec();
+    const gemm_tuning_t t = gemm_autotune(cache, c, a, pb, m, &cached);
+    const double t1 = now_sec();
+
+    gemm_tune_args_t args = {c, a, pb, m, gemm_tuning_default};
+    const double ms_default = autotune_measure(gemm_tune_run, &args);
+    memset(c, 0, (size_t)m * n * sizeof(int32_t));
+    args.tuning = t;
+    const double ms_tuned = autotune_measure(gemm_tune_run, &args);
+
+    const double ops = 2.0 * m * n * k;
+    printf("M=%d N=%d K=%d: %s in %.3f s: %dx%d C tiles, %s, K panel %d, prefetch %d\n", m, n, k,
+           cached ? "from the cache" : "tuned", t1 - t0, t.tiles_m, t.tiles_n, t.n_outer ? "columns" : "rows",
+           t.k_blocks * GEMM_TILE_K, t.prefetch);
+    printf("    default %9.3f ms (%7.2f GOPS), tuned %9.3f ms (%7.2f GOPS)\n", ms_default, ops / ms_default * 1e-6,
+           ms_tuned, ops / ms_tuned * 1e-6);
+    verify_i32("gemm_amx tuned", c, c_ref, verify_dims2(m, n));
+
+    free_packed_b(pb);
+    free(a);
+    free(b);
+    free(c_ref);
+    free(c);
+}
+
+// Per-column bias, scale and zero point of C with ReLU (the values you like), for K products of int8
+typedef struct gemm_requant_params_t {
+    int32_t *bias;
+    float *scale;
+    int32_t *zero_point;
+    requant_t q;
+} gemm_requant_params_t;
+
+static void init_gemm_requant(gemm_requant_params_t *p, int n, int k) {
+    p->bias = (int32_t *)malloc(n * sizeof(int32_t));
+    p->scale = (float *)malloc(n * sizeof(float));
+    p->zero_point = (int32_t *)malloc(n * sizeof(int32_t));
+    for (int j = 0; j < n; ++j) {
+        p->bias[j] = j * 100 - 5000;
+        p->scale[j] = (1.0f + (j % 7) * 0.1f) / (64.0f * k);
+        p->zero_point[j] = j % 5 - 2;
+    }
+    p->q = (requant_t){p->bias, p->scale, p->zero_point, true, false};
+}
+
+static void free_gemm_requant(gemm_requant_params_t *p) {
+    free(p->bias);
+    free(p->scale);
+    free(p->zero_point);
+}
+
+// Compare gemm_packed_requant (int8 C with ReLU) with gemm_naive + requant_value,
+// and its speed with gemm_packed + a separate requantization pass over the int32 C
+void run_gemm_requant(int m, int n, int k) {
+    int8_t *a = (int8_t *)malloc((size_t)m * k);
+    int8_t *b = (int8_t *)malloc((size_t)k * n);
+    int32_t *c32 = (int32_t *)malloc((size_t)m * n * sizeof(int32_t));
+    int8_t *c_ref = (int8_t *)malloc((size_t)m * n);
+    int8_t *c8 = (int8_t *)malloc((size_t)m * n);
+    int8_t *c8_two_pass = (int8_t *)malloc((size_t)m * n);
+
+    for (int i = 0; i < m * k; ++i) {
+        a[i] = (int8_t)(i * 7 + 3); // The value you like
+    }
+    for (int i = 0; i < k * n; ++i) {
+        b[i] = (int8_t)(i * 5 - 1); // The value you like
+    }
+
+    gemm_requant_params_t params;
+    init_gemm_requant(&params, n, k);
+
+    gemm_naive(c32, a, b, m, n, k);
+    for (int i = 0; i < m; ++i) {
+        for (int j = 0; j < n; ++j) {
+            c_ref[(size_t)i * n + j] = (int8_t)requant_value(c32[(size_t)i * n + j], j, &params.q);
+        }
+    }
+
+    packed_b_t *pb = pack_b(b, n, k);
+
+    // The fastest of 3 runs each
+    double fused = 1e30;
+    double two_pass = 1e30;
+    for (int x = 0; x < 3; ++x) {
+        double t0 = now_sec();
+        gemm_packed_requant(c8, a, pb, m, &params.q);
+        double t1 = now_sec();
+        gemm_packed(c32, a, pb, m);
+        requant_rows(c8_two_pass, n, c32, n, m, 0, n, &params.q);
+        double t2 = now_sec();
+        fused = (t1 - t0 < fused) ? t1 - t0 : fused;
+        two_pass = (t2 - t1 < two_pass) ? t2 - t1 : two_pass;
+    }
+
+    printf("M=%d N=%d K=%d (%s): fused %.3f ms, int32 C + requantization pass %.3f ms\n", m, n, k,
+           gemm_kernels[0].name, fused * 1e3, two_pass * 1e3);
+    verify_i8("gemm_packed_requant", c8, c_ref, verify_dims2(m, n));
+    verify_i8("gemm_packed + requant_rows", c8_two_pass, c_ref, verify_dims2(m, n));
+
+    free_packed_b(pb);
+    free_gemm_requant(&params);
+    free(a);
+    free(b);
+    free(c32);
+    free(c_ref);
+    free(c8);
+    free(c8_two_pass);
+}
+
+// Compare mul_batch_strided and mul_batch with mul_naive on count problems,
+// and their throughput with mul one by one (a tile config and a B re-layout per problem)
+void run_mul_batch(int count) {
+    int8_t(*a)[16][32] = malloc(count * sizeof(*a));
+    int8_t(*b)[32][16] = malloc(count * sizeof(*b));
+    int32_t(*c_ref)[16][16] = malloc(count * sizeof(*c_ref));
+    int32_t(*c)[16][16] = malloc(count * sizeof(*c));
+    const int8_t **a_ptrs = (const int8_t **)malloc(count * sizeof(int8_t *));
+    const int8_t **b_ptrs = (const int8_t **)malloc(count * sizeof(int8_t *));
+    int32_t **c_ptrs = (int32_t **)malloc(count * sizeof(int32_t *));
+
+    for (int x = 0; x < count; ++x) {
+        for (int r = 0; r < 16; ++r) {
+            for (int k = 0; k < 32; ++k) {
+                a[x][r][k] = (int8_t)(x * 3 + r * 7 - k); // The value you like
+                b[x][k][r] = (int8_t)(x - r * 5 + k * 3); // The value you like
+            }
+        }
+        mul_naive(c_ref[x], a[x], b[x]);
+
+        // In reverse order, as the problems of a batch need not be contiguous
+        a_ptrs[x] = &a[count - 1 - x][0][0];
+        b_ptrs[x] = &b[count - 1 - x][0][0];
+        c_ptrs[x] = &c[count - 1 - x][0][0];
+    }
+
+    // The fastest of 3 runs each
+    double one_by_one = 1e30;
+    double strided = 1e30;
+    double pointers = 1e30;
+    for (int run = 0; run < 3; ++run) {
+        double t0 = now_sec();
+        for (int x = 0; x < count; ++x) {
+            mul(c[x], a[x], b[x]);
+        }
+        double t1 = now_sec();
+        if (run == 0)
+            verify_i32("mul", &c[0][0][0], &c_ref[0][0][0], verify_dims3(count, 16, 16));
+        memset(c, 0, count * sizeof(*c));
+        double t2 = now_sec();
+        mul_batch_strided(&c[0][0][0], 16 * 16, &a[0][0][0], 16 * 32, &b[0][0][0], 32 * 16, count);
+        double t3 = now_sec();
+        if (run == 0)
+            verify_i32("mul_batch_strided", &c[0][0][0], &c_ref[0][0][0], verify_dims3(count, 16, 16));
+        memset(c, 0, count * sizeof(*c));
+        double t4 = now_sec();
+        mul_batch(c_ptrs, a_ptrs, b_ptrs, count);
+        double t5 = now_sec();
+        if (run == 0)
+            verify_i32("mul_batch", &c[0][0][0], &c_ref[0][0][0], verify_dims3(count, 16, 16));
+
+        one_by_one = (t1 - t0 < one_by_one) ? t1 - t0 : one_by_one;
+        strided = (t3 - t2 < strided) ? t3 - t2 : strided;
+        pointers = (t5 - t4 < pointers) ? t5 - t4 : pointers;
+    }
+
+    printf("%d problems of 16x16x32 (%s): mul %.2f M problems/s, mul_batch_strided %.2f M problems/s, "
+           "mul_batch %.2f M problems/s\n",
+           count, cpu_features.amx_int8 ? "AMX-INT8" : gemm_kernels[0].name, count / one_by_one * 1e-6,
+           count / strided * 1e-6, count / pointers * 1e-6);
+
+    free(a);
+    free(b);
+    free(c_ref);
+    free(c);
+    free(a_ptrs);
+    free(b_ptrs);
+    free(c_ptrs);
+}
+
+// FP32 GEMM with the sums in double, the reference of gemm_dq
+void gemm_naive_f32(float *c, const float *a, const float *b, int m, int n, int k) {
+    for (int i = 0; i < m; ++i) {
+        for (int j = 0; j < n; ++j) {
+            double sum = 0;
+            for (int p = 0; p < k; ++p) {
+                sum += (double)a[(size_t)i * k + p] * b[(size_t)p * n + j];
+            }
+            c[(size_t)i * n + j] = (float)sum;
+        }
+    }
+}
+
+// Compare gemm_dq_packed with gemm_naive_f32 on FP32 A and B. A and B in int8 keep about 7 bits each,
+// so C passes within GEMM_DQ_REL_TOL of the largest |C|.
+#define GEMM_DQ_REL_TOL (1.0f / 32)
+
+void run_gemm_dq(int m, int n, int k) {
+    float *a = (float *)malloc((size_t)m * k * sizeof(float));
+    float *b = (float *)malloc((size_t)k * n * sizeof(float));
+    float *c_ref = (float *)malloc((size_t)m * n * sizeof(float));
+    float *c = (float *)malloc((size_t)m * n * sizeof(float));
+
+    for (int i = 0; i < m; ++i) {
+        for (int p = 0; p < k; ++p) {
+            a[(size_t)i * k + p] = ((i * k + p) % 23 - 11) * 0.013f * (1 + i % 7); // The value you like
+        }
+    }
+    for (int i = 0; i < k * n; ++i) {
+        b[i] = (i * 5 % 19 - 9) * 0.071f; // The value you like
+    }
+
+    const double ops = 2.0 * m * n * k;
+    double t0 = now_sec();
+    gemm_naive_f32(c_ref, a, b, m, n, k);
+    double t1 = now_sec();
+
+    packed_b_dq_t *qb = pack_b_dq(b, n, k);
+
+    // The fastest of 3 runs
+    double best = 1e30;
+    for (int x = 0; x < 3; ++x) {
+        double t2 = now_sec();
+        gemm_dq_packed(c, a, qb, m);
+        double t3 = now_sec();
+        best = (t3 - t2 < best) ? t3 - t2 : best;
+    }
+
+    printf("M=%d N=%d K=%d (%s): naive FP32 %.3f ms, dynamic int8 %.3f ms (%.2f GFLOPS)\n", m, n, k,
+           gemm_kernels[0].name, (t1 - t0) * 1e3, best * 1e3, ops / best * 1e-9);
+    char name[64];
+    snprintf(name, sizeof(name), "gemm_dq_packed %dx%dx%d", m, n, k);
+    verify_f32(name, c, c_ref, verify_dims2(m, n), 4, GEMM_DQ_REL_TOL);
+
+    free_packed_b_dq(qb);
+    free(a);
+    free(b);
+    free(c_ref);
+    free(c);
+}
+
+// -----------------------------------------------
+// Benchmark mode (--bench, see common/bench.h)
+
+typedef struct mul_bench_args_t {
+    int32_t c[16][16];
+    int8_t a[16][32];
+    int8_t b[32][16];
+} mul_bench_args_t;
+
+static void bench_mul_naive(void *arg) {
+    mul_bench_args_t *args = (mul_bench_args_t *)arg;
+    mul_naive(args->c, args->a, args->b);
+}
+
+static void bench_mul_amx(void *arg) {
+    mul_bench_args_t *args = (mul_bench_args_t *)arg;
+    mul_amx(args->c, args->a, args->b);
+}
+
+typedef struct gemm_bench_args_t {
+    gemm_packed_fn_t fn;
+    int32_t *c;
+    const int8_t *a;
+    const int8_t *b;
+    const packed_b_t *pb;
+    int m, n, k;
+} gemm_bench_args_t;
+
+static void bench_gemm_naive(void *arg) {
+    gemm_bench_args_t *args = (gemm_bench_args_t *)arg;
+    gemm_naive(args->c, args->a, args->b, args->m, args->n, args->k);
+}
+
+static void bench_gemm_packed(void *arg) {
+    gemm_bench_args_t *args = (gemm_bench_args_t *)arg;
+    args->fn(args->c, args->a, args->pb, args->m, false);
+}
+
+typedef struct gemm_mt_bench_args_t {
+    thread_pool_t *pool;
+    int32_t *c;
+    const int8_t *a;
+    const packed_b_t *pb;
+    const packed_b_nodes_t *nodes; // or NULL
+    int m;
+} gemm_mt_bench_args_t;
+
+static void bench_gemm_packed_mt(void *arg) {
+    gemm_mt_bench_args_t *args = (gemm_mt_bench_args_t *)arg;
+    if (args->nodes != NULL)
+        gemm_packed_mt_nodes(args->pool, args->c, args->a, args->nodes, args->m);
+    else
+        gemm_packed_mt(args->pool, args->c, args->a, args->pb, args->m);
+}
+
+// mul_naive and mul_amx on their 16x32x16 shape, gemm_naive and every supported kernel
+// (with B packed once) over a sweep of shapes, then gemm_packed_mt with A, B and C on each kind of pages
+void run_benchmarks() {
+    bench_begin();
+
+    mul_bench_args_t *mul_args = (mul_bench_args_t *)malloc(sizeof(mul_bench_args_t));
+    init_mat_a(mul_args->a);
+    init_mat_b(mul_args->b);
+    const double mul_ops = 2.0 * 16 * 16 * 32;
+    const double mul_bytes = sizeof(mul_args->a) + sizeof(mul_args->b) + sizeof(mul_args->c);
+
+    bench_report("int8_mul", "mul_naive", "16x16x32", mul_ops, mul_bytes, bench_measure(bench_mul_naive, mul_args));
+    if (cpu_features.amx_int8) {
+        init_tile_config();
+        bench_report("int8_mul", "mul_amx", "16x16x32", mul_ops, mul_bytes, bench_measure(bench_mul_amx, mul_args));
+    }
+    free(mul_args);
+
+    // {M, N, K}; the last one is ragged
+    const int shapes[][3] = {{64, 64, 64}, {256, 256, 256}, {512, 512, 512}, {1024, 1024, 1024}, {1000, 777, 333}};
+    const int num_shapes = sizeof(shapes) / sizeof(shapes[0]);
+
+    for (int x = 0; x < num_shapes; ++x) {
+        const int m = shapes[x][0];
+        const int n = shapes[x][1];
+        const int k = shapes[x][2];
+
+        int8_t *a = (int8_t *)malloc((size_t)m * k);
+        int8_t *b = (int8_t *)malloc((size_t)k * n);
+        int32_t *c = (int32_t *)malloc((size_t)m * n * sizeof(int32_t));
+        for (int i = 0; i < m * k; ++i) {
+            a[i] = (int8_t)(i * 7 + 3); // The value you like
+        }
+        for (int i = 0; i < k * n; ++i) {
+            b[i] = (int8_t)(i * 5 - 1); // The value you like
+        }
+        packed_b_t *pb = pack_b(b, n, k);
+
+        char shape[64];
+        snprintf(shape, sizeof(shape), "%dx%dx%d", m, n, k);
+        const double ops = 2.0 * m * n * k;
+        const double bytes = (double)m * k + (double)k * n + (double)m * n * sizeof(int32_t);
+
+        gemm_bench_args_t args = {NULL, c, a, b, pb, m, n, k};
+        bench_report("int8_mul", "gemm_naive", shape, ops, bytes, bench_measure(bench_gemm_naive, &args));
+        for (int i = 0; i < num_gemm_kernels; ++i) {
+            args.fn = gemm_kernels[i].fn;
+            bench_report("int8_mul", gemm_kernels[i].name, shape, ops, bytes, bench_measure(bench_gemm_packed, &args));
+        }
+
+        free_packed_b(pb);
+        free(a);
+        free(b);
+        free(c);
+    }
+
+    // On all cores of the socket, A and C first touched by the threads that work on them; the last round has
+    // a copy of B per NUMA node
+    const int m = 1024, n = 1024, k = 4096; // a row of A per 4 KB page
+    int8_t *b = (int8_t *)malloc((size_t)k * n);
+    for (int i = 0; i < k * n; ++i) {
+        b[i] = (int8_t)(i * 5 - 1); // The value you like
+    }
+    int cpus[CPU_SETSIZE];
+    const int num_cores = socket_core_cpus(cpus, CPU_SETSIZE);
+    thread_pool_t *pool = thread_pool_create(num_cores, cpu_features.amx_tile ? amx_release : NULL);
+    char shape[64];
+    snprintf(shape, sizeof(shape), "%dx%dx%d", m, n, k);
+    const double ops = 2.0 * m * n * k;
+    const double bytes = (double)m * k + (double)k * n + (double)m * n * sizeof(int32_t);
+
+    for (int kind = PAGES_SMALL; kind <= PAGES_HUGETLB + 1; ++kind) {
+        const bool per_node = kind > PAGES_HUGETLB;
+        const page_kind_t pages = per_node ? page_default_kind() : (page_kind_t)kind;
+        int8_t *a = (int8_t *)page_alloc((size_t)m * k, pages);
+        int32_t *c = (int32_t *)page_alloc((size_t)m * n * sizeof(int32_t), pages);
+        page_first_touch(pool, a, (size_t)m * k);
+        page_first_touch(pool, c, (size_t)m * n * sizeof(int32_t));
+        for (size_t i = 0; i < (size_t)m * k; ++i) {
+            a[i] = (int8_t)(i * 7 + 3); // The value you like
+        }
+        packed_b_t *pb = pack_b_pages(b, n, k, false, pages);
+        packed_b_nodes_t *nodes = per_node ? pack_b_nodes(pb) : NULL;
+
+        // e.g. "hugetlb -> thp" when there are no hugetlbfs pages
+        const bool fallback = page_kind(pb->panels) != pages;
+        char name[64];
+        snprintf(name, sizeof(name), "gemm_packed_mt %s%s%s pages%s", page_kind_names[pages], fallback ? " -> " : "",
+                 fallback ? page_kind_names[page_kind(pb->panels)] : "", per_node ? " (B per node)" : "");
+        gemm_mt_bench_args_t args = {pool, c, a, pb, nodes, m};
+        bench_report("int8_mul", name, shape, ops, bytes, bench_measure(bench_gemm_packed_mt, &args));
+
+        if (nodes != NULL)
+            free_packed_b_nodes(nodes);
+        free_packed_b(pb);
+        page_free(a);
+        page_free(c);
+    }
+
+    thread_pool_destroy(pool);
+    free(b);
+    bench_end();
+}
+
+// -----------------------------------------------
+
+int main(int argc, char **argv) {
+    detect_cpu_features();
+    init_dispatch();
+
+    if (bench_parse_args(argc, argv)) {
+        run_benchmarks();
+        if (cpu_features.amx_tile)
+            amx_release();
+        return 0;
+    }
+
+    print_cpu_features();
 
     int8_t a[16][32];
     int8_t b[32][16];
@@ -145,19 +1864,84 @@ int main() {
     init_mat_b(b);
 
     int32_t c_naive[16][16];
-    int32_t c_amx[16][16];
+    int32_t c_mul[16][16];
 
     mul_naive(c_naive, a, b);
+    mul(c_mul, a, b);
+
+    printf("----------------------------------------------- Verification against mul_naive\n");
+    char name[64];
+    snprintf(name, sizeof(name), "mul (%s)", gemm_kernels[0].name);
+    verify_i32(name, &c_mul[0][0], &c_naive[0][0], verify_dims2(16, 16));
+
+    if (cpu_features.amx_int8) {
+        int32_t c_amx[16][16];
+        init_tile_config();
+        mul_amx(c_amx, a, b);
+
+        int32_t c_amx_packed[16][16];
+        packed_b_t *pb = pack_b(&b[0][0], 16, 32);
+        mul_amx_packed(c_amx_packed, a, pb);
+        free_packed_b(pb);
+
+        verify_i32("mul_amx", &c_amx[0][0], &c_naive[0][0], verify_dims2(16, 16));
+        verify_i32("mul_amx_packed", &c_amx_packed[0][0], &c_naive[0][0], verify_dims2(16, 16));
+    }
+
+    printf("----------------------------------------------- GEMM\n");
+    run_gemm(512, 512, 512, INT8_SS);
+    run_gemm(1000, 777, 333, INT8_SS); // ragged edges
+    run_gemm(47, 13, 70, INT8_SS);     // edges of under one tile
+    run_gemm(5, 40, 3, INT8_SS);
+
+    printf("----------------------------------------------- GEMM with uint8 operands\n");
+    run_gemm(512, 512, 512, INT8_US); // uint8 activations, int8 weights
+    run_gemm(1000, 777, 333, INT8_US);
+    run_gemm(47, 13, 70, INT8_UU);
+    run_gemm(5, 40, 3, INT8_SU);
+
+    printf("----------------------------------------------- Multi-threaded GEMM\n");
+    run_gemm_scaling(1024, 1024, 1024);
+    run_gemm_scaling(1000, 777, 333);
+
+    printf("----------------------------------------------- Huge pages and NUMA placement\n");
+#if defined(AMX_EMULATE)
+    run_gemm_pages(512, 512, 4096);
+#else
+    run_gemm_pages(cpu_features.avx2 ? 1024 : 64, 1024, 4096); // a row of A per 4 KB page
+#endif
+
+    if (cpu_features.amx_int8) {
+        // The first run tunes and writes the cache file, the next ones read it
+        autotune_cache_t *cache = autotune_cache_load(NULL);
+        printf("----------------------------------------------- Autotuned GEMM (%s, %s)\n", cache->cpu, cache->path);
+#if defined(AMX_EMULATE)
+        run_gemm_autotune(cache, 128, 128, 256);
+#else
+        run_gemm_autotune(cache, 1024, 1024, 1024);
+        run_gemm_autotune(cache, 256, 4096, 1024);
+        run_gemm_autotune(cache, 1000, 777, 333);
+#endif
+        autotune_cache_save(cache);
+        autotune_cache_destroy(cache);
+    }
+
+    printf("----------------------------------------------- Requantized GEMM (int8 C, ReLU)\n");
+    run_gemm_requant(1024, 1024, 1024);
+    run_gemm_requant(1000, 777, 333);
 
-    init_tile_config();
-    mul_amx(c_amx, a, b);
+    printf("----------------------------------------------- Batched mul\n");
+    run_mul_batch(1);
+    run_mul_batch(4096);
 
-    printf("----------------------------------------------- Naive result\n");
-    print_dword16x16(c_naive);
-    printf("----------------------------------------------- AMX result\n");
-    print_dword16x16(c_amx);
+    printf("----------------------------------------------- Dynamic-quantized GEMM (FP32 A and B)\n");
+    run_gemm_dq(16, 16, 32); // the shape of mul_naive
+    run_gemm_dq(512, 512, 512);
+    run_gemm_dq(1000, 777, 333);
+    run_gemm_dq(47, 13, 70);
 
-    _tile_release(); // Release the AMX state
+    if (cpu_features.amx_tile)
+        amx_release(); // Release the AMX state
 
     return 0;
 }
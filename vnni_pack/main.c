@@ -0,0 +1,159 @@
+#include <immintrin.h>
+#include <memory.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../common/vnni_pack.h"
+
+// Microbenchmark of the VNNI interleave kernels in common/vnni_pack.h
+// Each run re-lays out a whole B[K][N] (as the B operand of _tile_dpbssd / _tile_dpbf16ps)
+// and reports the achieved bandwidth (bytes read + bytes written per second).
+
+#define ROUND_UP(x, y) (((x) + (y) - 1) / (y) * (y))
+
+typedef void (*interleave4_s8_fn)(int8_t *, size_t, const int8_t *, const int8_t *, const int8_t *, const int8_t *,
+                                  int);
+typedef void (*interleave2_bf16_fn)(uint16_t *, size_t, const uint16_t *, const uint16_t *, int);
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// -----------------------------------------------
+
+// Interleave int8 B[K][N]: row group g (4 rows) becomes output row g of ROUND_UP(N, 16) * 4 bytes
+static void pack_s8(interleave4_s8_fn fn, int8_t *dst, const int8_t *b, const int8_t *zeros, int n, int k) {
+    const size_t dst_row = (size_t)ROUND_UP(n, 16) * 4;
+    for (int r = 0; r < k; r += 4) {
+        const int8_t *rows[4];
+        for (int i = 0; i < 4; ++i) {
+            rows[i] = (r + i < k) ? &b[(size_t)(r + i) * n] : zeros;
+        }
+        fn(&dst[(r / 4) * dst_row], 64, rows[0], rows[1], rows[2], rows[3], n);
+    }
+}
+
+// Interleave bf16 B[K][N]: row group g (2 rows) becomes output row g of ROUND_UP(N, 16) * 2 elements
+static void pack_bf16(interleave2_bf16_fn fn, uint16_t *dst, const uint16_t *b, const uint16_t *zeros, int n, int k) {
+    const size_t dst_row = (size_t)ROUND_UP(n, 16) * 2;
+    for (int r = 0; r < k; r += 2) {
+        const uint16_t *r1 = (r + 1 < k) ? &b[(size_t)(r + 1) * n] : zeros;
+        fn(&dst[(r / 2) * dst_row], 64, &b[(size_t)r * n], r1, n);
+    }
+}
+
+// -----------------------------------------------
+
+void bench_s8(const char *name, interleave4_s8_fn fn, int n, int k) {
+    const size_t dst_size = (size_t)ROUND_UP(k, 4) / 4 * ROUND_UP(n, 16) * 4;
+
+    int8_t *b = (int8_t *)malloc((size_t)k * n);
+    int8_t *zeros = (int8_t *)calloc(n, 1);
+    int8_t *ref = (int8_t *)aligned_alloc(64, dst_size);
+    int8_t *dst = (int8_t *)aligned_alloc(64, dst_size);
+
+    for (size_t i = 0; i < (size_t)k * n; ++i) {
+        b[i] = (int8_t)(i * 31 + 7); // The value you like
+    }
+    memset(ref, 0, dst_size);
+    memset(dst, 0, dst_size);
+
+    pack_s8(vnni_interleave4_s8_scalar, ref, b, zeros, n, k);
+    pack_s8(fn, dst, b, zeros, n, k);
+    const bool ok = memcmp(ref, dst, dst_size) == 0;
+
+    // Repeat for at least 50 ms and keep the fastest run
+    double best = 1e30;
+    const double start = now_sec();
+    do {
+        const double t0 = now_sec();
+        pack_s8(fn, dst, b, zeros, n, k);
+        const double t1 = now_sec();
+        best = (t1 - t0 < best) ? t1 - t0 : best;
+    } while (now_sec() - start < 0.05);
+
+    const double bytes = (double)k * n + dst_size;
+    printf("int8 %-7s K=%-5d N=%-5d %9.3f us %8.2f GB/s %s\n", name, k, n, best * 1e6, bytes / best * 1e-9,
+           ok ? "OK" : "MISMATCH");
+
+    free(b);
+    free(zeros);
+    free(ref);
+    free(dst);
+}
+
+void bench_bf16(const char *name, interleave2_bf16_fn fn, int n, int k) {
+    const size_t dst_size = (size_t)ROUND_UP(k, 2) / 2 * ROUND_UP(n, 16) * 2 * sizeof(uint16_t);
+
+    uint16_t *b = (uint16_t *)malloc((size_t)k * n * sizeof(uint16_t));
+    uint16_t *zeros = (uint16_t *)calloc(n, sizeof(uint16_t));
+    uint16_t *ref = (uint16_t *)aligned_alloc(64, dst_size);
+    uint16_t *dst = (uint16_t *)aligned_alloc(64, dst_size);
+
+    for (size_t i = 0; i < (size_t)k * n; ++i) {
+        b[i] = (uint16_t)(i * 31 + 7); // The value you like
+    }
+    memset(ref, 0, dst_size);
+    memset(dst, 0, dst_size);
+
+    pack_bf16(vnni_interleave2_bf16_scalar, ref, b, zeros, n, k);
+    pack_bf16(fn, dst, b, zeros, n, k);
+    const bool ok = memcmp(ref, dst, dst_size) == 0;
+
+    double best = 1e30;
+    const double start = now_sec();
+    do {
+        const double t0 = now_sec();
+        pack_bf16(fn, dst, b, zeros, n, k);
+        const double t1 = now_sec();
+        best = (t1 - t0 < best) ? t1 - t0 : best;
+    } while (now_sec() - start < 0.05);
+
+    const double bytes = (double)k * n * sizeof(uint16_t) + dst_size;
+    printf("bf16 %-7s K=%-5d N=%-5d %9.3f us %8.2f GB/s %s\n", name, k, n, best * 1e6, bytes / best * 1e-9,
+           ok ? "OK" : "MISMATCH");
+
+    free(b);
+    free(zeros);
+    free(ref);
+    free(dst);
+}
+
+// -----------------------------------------------
+
+int main() {
+    const int shapes[][2] = {
+        {64, 64}, {256, 256}, {1024, 1024}, {4096, 4096}, {333, 777}, // {K, N}; the last one is ragged
+    };
+    const int num_shapes = sizeof(shapes) / sizeof(shapes[0]);
+
+    detect_cpu_features();
+    print_cpu_features();
+
+    const bool has_avx2 = cpu_features.avx2;
+    const bool has_avx512 = cpu_features.avx512;
+
+    for (int i = 0; i < num_shapes; ++i) {
+        const int k = shapes[i][0];
+        const int n = shapes[i][1];
+
+        bench_s8("scalar", vnni_interleave4_s8_scalar, n, k);
+        if (has_avx2)
+            bench_s8("AVX2", vnni_interleave4_s8_avx2, n, k);
+        if (has_avx512)
+            bench_s8("AVX-512", vnni_interleave4_s8_avx512, n, k);
+
+        bench_bf16("scalar", vnni_interleave2_bf16_scalar, n, k);
+        if (has_avx2)
+            bench_bf16("AVX2", vnni_interleave2_bf16_avx2, n, k);
+        if (has_avx512)
+            bench_bf16("AVX-512", vnni_interleave2_bf16_avx512, n, k);
+    }
+
+    return 0;
+}